@@ -38,6 +38,8 @@ extern "C" {
 
 #define HAP_SUCCESS     0
 #define HAP_FAIL        -1
+/** Returned by service read/write callbacks which will complete later using hap_async_complete() */
+#define HAP_PENDING     1
 
 typedef enum  {
     HAP_MFI_AUTH_NONE = 0,
@@ -88,7 +90,8 @@ typedef enum {
 /** Data value */
 typedef struct {
     /** Pointer to an allocated buffer holding the data. This should remain valid
-     * throughout the lifetime of the characteristic.
+     * throughout the lifetime of the characteristic, unless a different ownership
+     * mode is set using hap_char_data_set_ownership().
      */
     uint8_t *buf;
     /** Length of the data */
@@ -98,6 +101,27 @@ typedef struct {
 /** TLV8 value (Same as \ref hap_data_val_t) */
 typedef hap_data_val_t hap_tlv8_val_t;
 
+/** Ownership of the buffer passed to hap_char_update_val() for Data and TLV8 characteristics */
+typedef enum {
+    /** The characteristic only keeps a reference to the buffer. It should remain valid
+     * throughout the lifetime of the characteristic, or till the next update. This is the default.
+     */
+    HAP_DATA_OWN_REF = 0,
+    /** The value is copied into a buffer owned by the characteristic. The buffer is reused
+     * across updates and reallocated only if a larger value is received.
+     */
+    HAP_DATA_OWN_COPY,
+    /** The characteristic takes ownership of the buffer. It should have been allocated using
+     * hap_platform_memory_malloc()/hap_platform_memory_calloc() and will be freed by the
+     * HAP Core when replaced or when the characteristic is deleted.
+     */
+    HAP_DATA_OWN_ADOPT,
+    /** The buffer is shared by reference counting. It should have been allocated using
+     * hap_data_buf_alloc(). The characteristic holds a reference till the value is replaced.
+     */
+    HAP_DATA_OWN_SHARED,
+} hap_data_own_t;
+
 /** HAP Value */
 typedef union {
     /** Boolean */
@@ -318,9 +342,10 @@ typedef struct {
     uint32_t task_stack_size;
     /** Internal HomeKit Task's priority */
     uint8_t task_priority;
-    /** Maximum characteristics to which event notifications can be sent simultaneously.
-     * Default value is enough for standalone accessories. Change may be required only
-     * for bridges.
+    /** Maximum characteristics included in a single event notification message.
+     * Notifications for more characteristics are sent in multiple messages, so that
+     * nothing is dropped. Repeated updates to a characteristic before the notification
+     * gets sent are coalesced into one.
      */
     uint8_t max_event_notif_chars;
     /** Indicates what paramaters will be made unique by the HAP Core */
@@ -339,8 +364,9 @@ typedef struct {
      * tokens never really need more than that.
      */
     size_t sw_token_max_len;
-    /** By default, config number (c#) incremenents on addition/removal of every bridged accessory after
-     * hap_start(). Setting this flag to true will disable this. Use hap_update_config_number()
+    /** By default, config number (c#) incremenents on addition/removal of bridged accessories after
+     * hap_start(), once the changes settle (Refer hap_db_update_begin()).
+     * Setting this flag to true will disable this. Use hap_update_config_number()
      * to increment c#. Note thar c# will still increment on a firmware upgrade though.
      */
     bool disable_config_num_update;
@@ -382,7 +408,8 @@ int hap_set_config(const hap_cfg_t *cfg);
 
 /* Update config number (c#)
  *
- * This increments the config number (c#) by 1
+ * This increments the config number (c#) by 1, irrespective of whether the
+ * accessory database has changed.
  *
  * @return HAP_SUCCESS on success
  * @return HAP_FAIL on error
@@ -395,6 +422,11 @@ int hap_update_config_number();
  * This internally initializes the MFi auth chip, TCP-IP stack, HomeKit Key Store,
  * HomeKit database, Wi-Fi and mDNS.
  *
+ * @note This starts a keystore write batch (see hap_keystore_begin_batch()), which
+ * hap_start() ends. Keystore writes made in between, including the application's own
+ * hap_keystore_set() calls, are only held in RAM until hap_start() commits them.
+ * Call hap_keystore_flush() if a value must be persistent before that.
+ *
  * @return HAP_SUCCESS on success
  * @return others on error
  */
@@ -416,6 +448,10 @@ int hap_deinit();
  * This starts the webserver and also initializes WAC or HomeKit services
  * as per the state of the accessory.
  *
+ * @note This commits the keystore writes deferred since hap_init(). It also restores the
+ * values of characteristics marked with hap_char_set_persist(), which the application can
+ * read once this returns.
+ *
  * @return HAP_SUCCESS on success
  * @return others on error
  */
@@ -523,6 +559,37 @@ void hap_add_bridged_accessory(hap_acc_t *ha, int aid);
  */
 void hap_remove_bridged_accessory(hap_acc_t *ha);
 
+/**
+ * @brief Begin a batch of bridged accessory additions/removals
+ *
+ * Once HAP has started, adding or removing bridged accessories increments the
+ * config number (c#), but only after no further change has been made for
+ * CONFIG_HAP_CONFIG_NUM_DEBOUNCE_MS. If the changes are known to come together,
+ * they can instead be wrapped between hap_db_update_begin() and hap_db_update_commit().
+ * The config number then gets incremented, and announced, just once, right
+ * when the batch gets committed.
+ *
+ * Calls can be nested. Only the outermost commit takes effect.
+ *
+ * @note This, and hap_db_update_commit() should be called from the same task
+ * which adds/removes the accessories.
+ */
+void hap_db_update_begin(void);
+
+/**
+ * @brief Commit a batch of bridged accessory additions/removals
+ *
+ * Ends a batch started with hap_db_update_begin(). If any accessory was added or
+ * removed within the batch, the config number gets incremented once, provided the
+ * resulting database actually differs from the one the current config number was
+ * announced for. Eg. re-adding the same set of accessories does not change it.
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL if there was no matching hap_db_update_begin() or the
+ * config number update could not be triggered
+ */
+int hap_db_update_commit(void);
+
 /**
  * @brief Delete HAP Accessory Object
  *
@@ -557,6 +624,23 @@ void hap_delete_all_accessories(void);
  */
 int hap_get_unique_aid(const char *id);
 
+/**
+ * Get unique AIDs for multiple identifiers
+ *
+ * Same as hap_get_unique_aid(), but for many accessories at once. All the newly
+ * assigned AIDs get stored with a single keystore commit, which makes this the
+ * preferred way to bring up a large number of bridged accessories.
+ *
+ * @param[in] ids Array of unique identifiers for the accessories
+ * @param[in] count Number of entries in ids
+ * @param[out] aids Array of at least count entries, which will be populated with the
+ * unique AIDs, in the same order as ids. The entry for a NULL id will be -1.
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL if an AID could not be assigned for any of the ids, or could not be stored
+ */
+int hap_get_unique_aids(const char *ids[], int count, int aids[]);
+
 /**
  * @brief Get Accessory using AID
  *
@@ -972,6 +1056,64 @@ void hap_char_add_valid_vals(hap_char_t *hc, const uint8_t *valid_vals, size_t v
  * @param[in] end_val End value of the range
  */
 void hap_char_add_valid_vals_range(hap_char_t *hc, uint8_t start_val, uint8_t end_val);
+
+/**
+ * @brief Set the ownership mode for the values of a Data or TLV8 characteristic
+ *
+ * This decides what the HAP Core does with the buffer passed to hap_char_update_val().
+ * Default is \ref HAP_DATA_OWN_REF.
+ *
+ * @param[in] hc HAP characteristic object handle
+ * @param[in] mode Ownership mode
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL on failure
+ */
+int hap_char_data_set_ownership(hap_char_t *hc, hap_data_own_t mode);
+
+/**
+ * @brief Reserve value storage for a String or Data/TLV8 characteristic
+ *
+ * Pre-allocates the buffer in which the characteristic value is stored, so that subsequent
+ * hap_char_update_val() calls with values up to this size do not allocate or free memory.
+ * For Data/TLV8 characteristics, this is applicable only in \ref HAP_DATA_OWN_COPY mode.
+ *
+ * @param[in] hc HAP characteristic object handle
+ * @param[in] size Capacity in bytes (excluding the NULL termination for strings)
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL on failure
+ */
+int hap_char_reserve_val(hap_char_t *hc, size_t size);
+
+/**
+ * @brief Allocate a reference counted data buffer
+ *
+ * Buffers allocated using this can be used with \ref HAP_DATA_OWN_SHARED characteristics and
+ * shared across multiple characteristics without copying. The caller owns one reference.
+ *
+ * @param[in] size Size of the buffer
+ *
+ * @return Pointer to the buffer on success
+ * @return NULL on failure
+ */
+uint8_t *hap_data_buf_alloc(size_t size);
+
+/**
+ * @brief Take a reference on a buffer allocated using hap_data_buf_alloc()
+ *
+ * @param[in] buf Pointer to the buffer
+ */
+void hap_data_buf_ref(uint8_t *buf);
+
+/**
+ * @brief Release a reference on a buffer allocated using hap_data_buf_alloc()
+ *
+ * The buffer is freed when the last reference is released.
+ *
+ * @param[in] buf Pointer to the buffer
+ */
+void hap_data_buf_unref(uint8_t *buf);
 /**
  * @brief Set IID for a given characteristic
  *
@@ -1019,6 +1161,15 @@ int hap_acc_add_serv(hap_acc_t *ha, hap_serv_t *hs);
  * from some other thread, for accessories like sensors that periodically
  * monitor some paramters.
  *
+ * String values are copied into a buffer owned by the characteristic, which is reused
+ * across updates. For Data/TLV8 values, refer hap_char_data_set_ownership().
+ *
+ * If called from an ISR, this is the same as hap_char_update_val_from_isr().
+ *
+ * @note From an ISR, only the Bool, Int, UInt8, UInt16, UInt32 and Float formats can be
+ * updated, since String and Data/TLV8 values may need memory to be allocated. For these
+ * formats, this fails if called from an ISR. Defer such updates to a task instead.
+ *
  * @param[in] hc HAP characteristic object handle
  * @param[in] val Pointer to new value
  *
@@ -1027,6 +1178,263 @@ int hap_acc_add_serv(hap_acc_t *ha, hap_serv_t *hs);
  */
 int hap_char_update_val(hap_char_t *hc, hap_val_t *val);
 
+/** Characteristic value update, for hap_char_update_vals() */
+typedef struct {
+    /** HAP characteristic object handle */
+    hap_char_t *hc;
+    /** New value */
+    hap_val_t val;
+} hap_char_update_t;
+
+/**
+ * @brief Update values of multiple characteristics
+ *
+ * All the values are validated first. If any of them is invalid, none of the values
+ * is updated. Else, all values are updated and a single notification pass is triggered
+ * for the complete set. This is preferred over multiple hap_char_update_val() calls,
+ * when many characteristics (Eg. across a bridge) get updated together.
+ *
+ * String and copied Data/TLV8 values get their storage reserved during the validation, so
+ * applying them needs no allocation.
+ *
+ * @note If another task updates one of these characteristics concurrently, it may release
+ * the reserved storage before the value gets applied. The remaining values still get
+ * applied, and HAP_FAIL is returned.
+ *
+ * @param[in] updates Array of characteristic value updates
+ * @param[in] count Number of elements in the array
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL on failure
+ */
+int hap_char_update_vals(hap_char_update_t *updates, int count);
+
+/**
+ * @brief Update the value of a characteristic from an ISR
+ *
+ * The characteristic, value and a timestamp are just pushed into a ring buffer, which is
+ * drained from task context, where the value is checked against the constraints, applied
+ * and notified. The time spent in the ISR is thus small and bounded. The ring size is set
+ * using CONFIG_HAP_ISR_UPDATE_RING_SIZE. If the ring is full, the update is dropped.
+ *
+ * hap_char_update_val(), if called from an ISR, ends up here.
+ *
+ * @note Only the Bool, Int, UInt8, UInt16, UInt32 and Float formats are supported.
+ * @note This is not placed in IRAM, so it cannot be used from an ISR registered with
+ * ESP_INTR_FLAG_IRAM.
+ *
+ * @param[in] hc HAP characteristic object handle
+ * @param[in] val Pointer to new value
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL if the format is not supported or the ring is full
+ */
+int hap_char_update_val_from_isr(hap_char_t *hc, const hap_val_t *val);
+
+/** Statistics of the ISR update ring, as reported by hap_get_isr_update_stats() */
+typedef struct {
+    /** Updates pushed into the ring */
+    uint32_t pushed;
+    /** Updates dropped since the ring was full */
+    uint32_t dropped;
+    /** Updates drained from the ring and applied */
+    uint32_t applied;
+    /** Maximum number of updates waiting in the ring at a time */
+    uint32_t high_water;
+    /** Maximum time (in usec) spent in hap_char_update_val_from_isr() */
+    uint32_t max_isr_us;
+} hap_isr_update_stats_t;
+
+/**
+ * @brief Get the statistics of the ISR update ring
+ *
+ * @param[out] stats Pointer to a structure to be populated with the statistics
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL on failure
+ */
+int hap_get_isr_update_stats(hap_isr_update_stats_t *stats);
+
+/** Window value to use the service's (or the default) notification window */
+#define HAP_NOTIF_WINDOW_INHERIT    0xFFFF
+
+/**
+ * @brief Set the notification coalescing window for a characteristic
+ *
+ * Value changes within the window (starting at the first change) get merged into a single
+ * event notification per controller, carrying the latest value. This is useful for
+ * characteristics that change in small steps, like a brightness ramp or sensor readings.
+ * Characteristics with the \ref HAP_CHAR_PERM_SPECIAL_READ permission (Eg. Programmable
+ * Switch Event) are never delayed.
+ *
+ * @param[in] hc HAP characteristic object handle
+ * @param[in] window_ms Window in milliseconds. 0 to send notifications immediately.
+ * HAP_NOTIF_WINDOW_INHERIT to use the window of the parent service.
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL on failure
+ */
+int hap_char_set_notif_window(hap_char_t *hc, uint16_t window_ms);
+
+/**
+ * @brief Save the value of a characteristic across reboots
+ *
+ * The values of all such characteristics are saved together in a single blob, at most once
+ * per CONFIG_HAP_CHAR_PERSIST_INTERVAL_MS, and before a reset or reboot triggered through
+ * the HAP APIs. They are restored by hap_start(), so this should be called before that.
+ * Values of accessories added after hap_start() (Eg. hot plugged bridged accessories)
+ * are not restored. String, Data and TLV8 values longer than \ref HAP_CHAR_STRING_MAX_LEN
+ * are not saved.
+ *
+ * @note The restored values are applied directly, without any write callbacks or events.
+ * The application should read them back using hap_char_get_val() after hap_start()
+ * returns, and bring the hardware in sync with them.
+ *
+ * @param[in] hc HAP characteristic object handle
+ * @param[in] persist true to save the value, false otherwise
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL on failure (Eg. for characteristics with the
+ * \ref HAP_CHAR_PERM_SPECIAL_READ permission, which have no state)
+ */
+int hap_char_set_persist(hap_char_t *hc, bool persist);
+
+/**
+ * @brief Save the values of persistent characteristics right away
+ *
+ * This can be used before rebooting the accessory using esp_restart(), so that
+ * changes made within the last CONFIG_HAP_CHAR_PERSIST_INTERVAL_MS are not lost.
+ * Nothing is written if no value has changed since the last save.
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL on failure
+ */
+int hap_char_persist_flush(void);
+
+/** Notification statistics, as reported by hap_get_notif_stats() */
+typedef struct {
+    /** Characteristic updates requiring a notification */
+    uint32_t updates;
+    /** Updates merged into a notification which was already pending */
+    uint32_t coalesced;
+    /** Updates sent without waiting for a coalescing window */
+    uint32_t immediate;
+    /** Notification passes */
+    uint32_t passes;
+    /** EVENT messages sent to controllers */
+    uint32_t messages;
+    /** EVENT payloads encoded. A payload is shared by all controllers getting the same notifications */
+    uint32_t payloads;
+} hap_notif_stats_t;
+
+/**
+ * @brief Get the event notification statistics
+ *
+ * @param[out] stats Pointer to a structure to be populated with the statistics
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL on failure
+ */
+int hap_get_notif_stats(hap_notif_stats_t *stats);
+
+/**
+ * @brief Reset the event notification statistics
+ */
+void hap_reset_notif_stats();
+
+/** Stages of event notification delivery, as tracked by hap_get_notif_latency() */
+typedef enum {
+    /** From a characteristic value change, till the notification pass gets triggered.
+     * This includes the coalescing window, if any.
+     */
+    HAP_NOTIF_STAGE_QUEUE = 0,
+    /** From the trigger, till the notification pass starts. This is the scheduling delay
+     * of the HomeKit main loop and the notification task.
+     */
+    HAP_NOTIF_STAGE_DISPATCH,
+    /** Building the JSON payload of an EVENT message */
+    HAP_NOTIF_STAGE_ENCODE,
+    /** Encrypting and writing an EVENT message to a controller's socket */
+    HAP_NOTIF_STAGE_SEND,
+    /** End to end, from a characteristic value change till the EVENT message carrying it
+     * has been written to the socket. Tracked per controller.
+     */
+    HAP_NOTIF_STAGE_TOTAL,
+    /** Number of stages */
+    HAP_NOTIF_STAGE_MAX,
+} hap_notif_stage_t;
+
+/** Number of buckets in a notification latency histogram.
+ *
+ * Buckets are logarithmic with 4 linear sub-buckets per power of 2, giving a resolution of
+ * 1 usec below 8 usec and better than 25% above that. Values of 2^26 usec (~67 sec) and
+ * more go to the last bucket. Use hap_notif_latency_bucket_floor() for the bucket bounds.
+ */
+#define HAP_NOTIF_LATENCY_BUCKETS   100
+
+/** Latency histogram for a notification stage. All times are in microseconds */
+typedef struct {
+    /** Number of samples */
+    uint32_t count;
+    /** Sum of all samples, for the average */
+    uint64_t sum_us;
+    /** Smallest sample */
+    uint32_t min_us;
+    /** Largest sample */
+    uint32_t max_us;
+    /** Sample count per bucket */
+    uint32_t buckets[HAP_NOTIF_LATENCY_BUCKETS];
+} hap_notif_latency_t;
+
+/**
+ * @brief Get the latency histogram of an event notification stage
+ *
+ * Requires CONFIG_HAP_NOTIF_LATENCY_STATS.
+ *
+ * @param[in] stage Notification stage
+ * @param[out] hist Pointer to a structure to be populated with the histogram
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL on failure or if latency tracking is not enabled
+ */
+int hap_get_notif_latency(hap_notif_stage_t stage, hap_notif_latency_t *hist);
+
+/**
+ * @brief Get the lowest value (in usec) accounted in a latency histogram bucket
+ *
+ * @param[in] index Bucket index, from 0 to HAP_NOTIF_LATENCY_BUCKETS - 1
+ *
+ * @return Lower bound of the bucket
+ */
+uint32_t hap_notif_latency_bucket_floor(int index);
+
+/**
+ * @brief Get a percentile from a latency histogram
+ *
+ * The value returned is the upper bound of the bucket in which the percentile falls
+ * (limited to the largest sample), so the actual latency is never above it.
+ *
+ * @param[in] hist Histogram, as returned by hap_get_notif_latency()
+ * @param[in] percentile Percentile, from 0 to 100 (Eg. 99.9)
+ *
+ * @return Latency in usec. 0 if the histogram is empty
+ */
+uint32_t hap_notif_latency_percentile(const hap_notif_latency_t *hist, float percentile);
+
+/**
+ * @brief Reset the latency histograms of all the notification stages
+ */
+void hap_reset_notif_latency();
+
+/**
+ * @brief Print a summary of the notification latencies
+ *
+ * Prints count, min, average, p50, p90, p99 and max for every stage.
+ *
+ * @param[in] buckets Set to true to also print the non empty histogram buckets
+ */
+void hap_dump_notif_latency(bool buckets);
+
 /**
  * @brief Get the current value of characteristic
  *
@@ -1101,6 +1509,7 @@ typedef struct {
  * @return HAP_SUCCESS on success
  * @return HAP_FAIL if an error is encountered even for a single characteristic. Actual error
  * value must be reported in the status under \ref hap_write_data_t.
+ * @return HAP_PENDING if the write was deferred using hap_req_defer()
  */
 typedef int (*hap_serv_write_t) (hap_write_data_t write_data[], int count,
 		void *serv_priv, void *write_priv);
@@ -1120,6 +1529,7 @@ typedef int (*hap_serv_write_t) (hap_write_data_t write_data[], int count,
  * @return HAP_SUCCESS on success
  * @return HAP_FAIL if an error is encountered while reading. Actual error
  * value must be reported in the status_code
+ * @return HAP_PENDING if the read was deferred using hap_req_defer()
  */
 typedef int (*hap_serv_read_t) (hap_char_t *hc, hap_status_t *status_code,
 		void *serv_priv, void *read_priv);
@@ -1144,10 +1554,51 @@ typedef int (*hap_serv_read_t) (hap_char_t *hc, hap_status_t *status_code,
  * @return HAP_SUCCESS on success
  * @return HAP_FAIL if an error is encountered even for a single characteristic.
  * Actual error value must be reported in the status under \ref hap_read_data_t.
+ * @return HAP_PENDING if the read was deferred using hap_req_defer()
  */
 typedef int (*hap_serv_bulk_read_t) (hap_read_data_t read_data[], int count,
         void *serv_priv, void *read_priv);
 
+/** Token for completing a deferred service read or write. 0 is never a valid token */
+typedef uint32_t hap_async_token_t;
+
+/**
+ * @brief Defer the service read or write being handled
+ *
+ * This can be used inside service read (\ref hap_serv_read_t), bulk read (\ref hap_serv_bulk_read_t)
+ * and write (\ref hap_serv_write_t) callbacks which have to wait on slow downstream devices,
+ * like Zigbee or Modbus devices behind a bridge. The callback should pass the token to
+ * its own task and return \ref HAP_PENDING. The callbacks for the other services in the
+ * same request get invoked meanwhile, and the response is sent once all of them have
+ * completed, or CONFIG_HAP_ASYNC_REQ_TIMEOUT_MS has elapsed.
+ *
+ * @note The read_data/write_data array, including string and data values, remains valid
+ * only till the completion is reported or the deadline elapses. Copy anything which may
+ * be required later.
+ *
+ * @return Token to be passed to hap_async_complete()
+ * @return 0 if called outside a callback or if too many callbacks are pending.
+ * The callback must complete synchronously in this case.
+ */
+hap_async_token_t hap_req_defer(void);
+
+/**
+ * @brief Complete a deferred service read or write
+ *
+ * For reads, the new values must be set using hap_char_update_val() before calling this.
+ *
+ * @param[in] token Token returned by hap_req_defer()
+ * @param[in] ret HAP_SUCCESS or HAP_FAIL, as the callback would have returned.
+ * @param[in] status Statuses of the characteristics, in the same order as the array passed
+ * to the callback. Can be NULL, in which case all are reported as HAP_STATUS_SUCCESS on
+ * success and HAP_STATUS_COMM_ERR on failure.
+ * @param[in] count Number of entries in status.
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL if the token is invalid or the request has already timed out.
+ */
+int hap_async_complete(hap_async_token_t token, int ret, const hap_status_t status[], int count);
+
 /**
  * @brief Register Service Write callback
  *
@@ -1187,6 +1638,21 @@ void hap_serv_set_bulk_read_cb(hap_serv_t *hs, hap_serv_bulk_read_t read);
  */
 void hap_serv_set_priv(hap_serv_t *hs, void *priv);
 
+/**
+ * @brief Set the notification coalescing window for a service
+ *
+ * Applicable for all the characteristics of the service, which do not have their own
+ * window set using hap_char_set_notif_window().
+ *
+ * @param[in] hs HAP service object handle
+ * @param[in] window_ms Window in milliseconds. 0 to send notifications immediately.
+ * HAP_NOTIF_WINDOW_INHERIT to use the default (CONFIG_HAP_NOTIF_WINDOW_MS).
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL on failure
+ */
+int hap_serv_set_notif_window(hap_serv_t *hs, uint16_t window_ms);
+
 /**
  * @brief Get Service private
  *
@@ -1424,6 +1890,139 @@ char *hap_req_get_ctrl_id(void *priv);
  */
 int hap_factory_keystore_get(const char *name_space, const char *key, uint8_t *val, size_t *val_size);
 
+/**
+ * @brief Start batching keystore writes
+ *
+ * Values written after this are kept in the keystore RAM cache, and committed together
+ * by hap_keystore_end_batch() or hap_keystore_flush(). Calls can be nested.
+ * Writes outside a batch are committed immediately.
+ *
+ * Example: Wrap multiple hap_get_unique_aid() calls while adding bridged accessories
+ * after hap_start(). The calls between hap_init() and hap_start() are already batched.
+ *
+ * @note This has no effect if CONFIG_HAP_KEYSTORE_CACHE is disabled.
+ */
+void hap_keystore_begin_batch(void);
+
+/**
+ * @brief End a batch of keystore writes
+ *
+ * Ends the batch started by hap_keystore_begin_batch(). If this was the outermost
+ * batch, all pending writes are committed.
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL if the pending writes could not be committed
+ */
+int hap_keystore_end_batch(void);
+
+/**
+ * @brief Commit all pending keystore writes
+ *
+ * This is a durability point: all values written so far are persistent once this
+ * returns successfully, even if a batch is in progress.
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL on failure
+ */
+int hap_keystore_flush(void);
+
+/** Keystore usage statistics, accumulated since boot */
+typedef struct {
+    /** Number of get calls */
+    uint32_t reads;
+    /** Get calls served from the RAM cache */
+    uint32_t cache_hits;
+    /** Get calls which had to read the flash */
+    uint32_t nvs_reads;
+    /** Number of set and delete calls */
+    uint32_t writes;
+    /** Values actually written to flash */
+    uint32_t nvs_writes;
+    /** Number of commits */
+    uint32_t commits;
+    /** Counter updates appended to the flash journal */
+    uint32_t journal_writes;
+    /** Journal sector erases (i.e. compactions) */
+    uint32_t journal_erases;
+    /** Total time spent in the keystore calls, in microseconds */
+    int64_t time_us;
+} hap_keystore_stats_t;
+
+/**
+ * @brief Get the keystore usage statistics
+ *
+ * @param[out] stats Pointer to the structure to be populated
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL on failure
+ */
+int hap_keystore_get_stats(hap_keystore_stats_t *stats);
+
+/** Startup phases, as reported by hap_get_boot_report() */
+typedef enum {
+    /** Keystore init, in hap_init() */
+    HAP_BOOT_PHASE_KEYSTORE = 0,
+    /** Accessory id, keys, controllers and counters, in hap_init() */
+    HAP_BOOT_PHASE_DATABASE,
+    /** Setup id, setup info, setup hash and firmware revision check, in hap_start() */
+    HAP_BOOT_PHASE_ACC_SETUP,
+    /** Restoring persistent characteristic values */
+    HAP_BOOT_PHASE_CHAR_RESTORE,
+    /** Session and async request init */
+    HAP_BOOT_PHASE_SESSIONS,
+    /** HTTP server start */
+    HAP_BOOT_PHASE_HTTPD,
+    /** Event notification queue init */
+    HAP_BOOT_PHASE_EVENT_QUEUE,
+    /** HAP main loop start */
+    HAP_BOOT_PHASE_LOOP,
+    /** mDNS init */
+    HAP_BOOT_PHASE_MDNS,
+    /** IP services start, including the first mDNS announcement */
+    HAP_BOOT_PHASE_IP_SERVICES,
+    /** Number of phases */
+    HAP_BOOT_PHASE_MAX,
+} hap_boot_phase_t;
+
+/** Timing of a startup phase */
+typedef struct {
+    /** Time (as per esp_timer_get_time()) at which the phase started. 0 if it has not run */
+    int64_t start_us;
+    /** Time taken by the phase, in microseconds */
+    uint32_t duration_us;
+} hap_boot_phase_time_t;
+
+/** Startup report, as returned by hap_get_boot_report() */
+typedef struct {
+    /** Timing of the individual phases */
+    hap_boot_phase_time_t phases[HAP_BOOT_PHASE_MAX];
+    /** Time at which hap_start() completed and the accessory became reachable. 0 till then */
+    int64_t ready_us;
+    /** Keystore gets which had to read the flash, till hap_start() completed */
+    uint32_t nvs_reads;
+    /** true if the fast-start snapshot was used */
+    bool fast_start;
+} hap_boot_report_t;
+
+/**
+ * @brief Get the startup report
+ *
+ * Phases which have not run yet have a start_us of 0.
+ *
+ * @param[out] report Pointer to the structure to be populated
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL on failure
+ */
+int hap_get_boot_report(hap_boot_report_t *report);
+
+/**
+ * @brief Print the startup report
+ *
+ * This is printed by hap_start() as well, at the info level.
+ */
+void hap_print_boot_report(void);
+
 /**
  * Enable MFi authentication
  *
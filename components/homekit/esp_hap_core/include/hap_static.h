@@ -0,0 +1,189 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+#ifndef _HAP_STATIC_H_
+#define _HAP_STATIC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <hap.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Statically described accessory databases
+ *
+ * An accessory can be described completely at build time (typically by the
+ * tools/acc_graph_gen script) as constant tables of services and characteristics,
+ * with the instance IDs already assigned. hap_acc_create_static() then sets up the
+ * accessory in the storage provided alongside the tables, without any heap allocation,
+ * and the accessory can be added using hap_add_accessory()/hap_add_bridged_accessory()
+ * just like one created using hap_acc_create().
+ */
+
+/** Size of the storage required by one characteristic */
+#define HAP_CHAR_STATIC_SIZE    (96 + 24 * sizeof(void *))
+/** Size of the storage required by one service */
+#define HAP_SERV_STATIC_SIZE    (32 + 16 * sizeof(void *))
+/** Size of the storage required by one accessory */
+#define HAP_ACC_STATIC_SIZE     (16 + 8 * sizeof(void *))
+
+/** Storage for a characteristic of a static accessory */
+typedef union {
+    uint8_t buf[HAP_CHAR_STATIC_SIZE];
+    uint64_t align;
+} hap_char_static_t;
+
+/** Storage for a service of a static accessory */
+typedef union {
+    uint8_t buf[HAP_SERV_STATIC_SIZE];
+    uint64_t align;
+} hap_serv_static_t;
+
+/** Storage for a static accessory */
+typedef union {
+    uint8_t buf[HAP_ACC_STATIC_SIZE];
+    uint64_t align;
+} hap_acc_static_t;
+
+/** Storage for a link between two services of a static accessory */
+typedef struct {
+    void *hs;
+    void *next;
+} hap_linked_serv_static_t;
+
+/** Minimum value constraint (hap_char_desc_t::min) */
+#define HAP_CHAR_DESC_MIN       (1 << 0)
+/** Maximum value constraint (hap_char_desc_t::max) */
+#define HAP_CHAR_DESC_MAX       (1 << 1)
+/** Step value constraint (hap_char_desc_t::step) */
+#define HAP_CHAR_DESC_STEP      (1 << 2)
+/** Maximum length for strings (hap_char_desc_t::max.i) */
+#define HAP_CHAR_DESC_MAXLEN    (1 << 3)
+/** Maximum length for data (hap_char_desc_t::max.i) */
+#define HAP_CHAR_DESC_MAXDATALEN    (1 << 4)
+
+/** Characteristic description */
+typedef struct {
+    /** Characteristic type UUID */
+    const char *type_uuid;
+    /** Instance ID. Should be non zero and unique across the accessory */
+    uint32_t iid;
+    /** Permissions (HAP_CHAR_PERM_*) */
+    uint16_t perms;
+    /** Format of the value */
+    hap_char_format_t format;
+    /** Initial value. For strings, the string will be used in place
+     * until the first hap_char_update_val(), when it gets copied to RAM.
+     */
+    hap_val_t val;
+    /** Constraints applicable (HAP_CHAR_DESC_*) */
+    uint8_t constraints;
+    /** Minimum value */
+    hap_val_t min;
+    /** Maximum value, or the maximum length for strings/data */
+    hap_val_t max;
+    /** Step value */
+    hap_val_t step;
+    /** Optional description */
+    const char *description;
+    /** Optional unit (HAP_CHAR_UNIT_*) */
+    const char *unit;
+    /** Optional list of valid values */
+    const uint8_t *valid_vals;
+    /** Number of entries in valid_vals */
+    size_t valid_vals_cnt;
+    /** Optional 2 byte array with the valid values range */
+    const uint8_t *valid_vals_range;
+} hap_char_desc_t;
+
+/** Service description */
+typedef struct {
+    /** Service type UUID */
+    const char *type_uuid;
+    /** Instance ID. Should be non zero and unique across the accessory */
+    uint32_t iid;
+    /** Primary service */
+    bool primary;
+    /** Hidden service */
+    bool hidden;
+    /** Characteristics of the service */
+    const hap_char_desc_t *chars;
+    /** Number of entries in chars */
+    uint16_t num_chars;
+    /** Instance IDs of the linked services, from the same accessory */
+    const uint32_t *linked_iids;
+    /** Number of entries in linked_iids */
+    uint16_t num_linked;
+} hap_serv_desc_t;
+
+/** Accessory description */
+typedef struct {
+    /** Services of the accessory. For the primary accessory, these should include
+     * the Accessory Information and the Protocol Information services.
+     * All accessories should have the Accessory Information service.
+     */
+    const hap_serv_desc_t *servs;
+    /** Number of entries in servs */
+    uint16_t num_servs;
+    /** Category Identifier. Used only for the accessory having the Protocol Information service */
+    hap_cid_t cid;
+    /** Identify routine for the accessory */
+    hap_identify_routine_t identify_routine;
+    /** Storage for the accessory */
+    hap_acc_static_t *acc_storage;
+    /** Storage for the services. Should have num_servs entries */
+    hap_serv_static_t *serv_storage;
+    /** Storage for the characteristics. Should have an entry for each characteristic of each service */
+    hap_char_static_t *char_storage;
+    /** Storage for the service links. Should have an entry for each linked service of each service */
+    hap_linked_serv_static_t *link_storage;
+} hap_acc_desc_t;
+
+/**
+ * @brief Create an accessory from a static description
+ *
+ * The accessory, services and characteristics are set up in the storage referred to
+ * by the description, using the instance IDs from the description. No heap memory is
+ * used. Services and characteristics added later using the regular APIs will get
+ * instance IDs above the highest one in the description.
+ *
+ * The write callback for the "Identify" characteristic is registered internally, just like
+ * hap_acc_create(). The callbacks and private data for the other services can be set by
+ * looking up the services using hap_acc_get_serv_by_iid().
+ *
+ * @param[in] desc Accessory description. It should remain valid for as long as the accessory is in use.
+ *
+ * @return Accessory Object on success
+ * @return NULL on failure (invalid description or the accessory already created)
+ */
+hap_acc_t *hap_acc_create_static(const hap_acc_desc_t *desc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _HAP_STATIC_H_ */
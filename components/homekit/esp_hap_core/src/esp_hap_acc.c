@@ -23,6 +23,8 @@
  */
 #include <string.h>
 #include <esp_wifi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <hap_platform_memory.h>
 #include <esp_hap_acc.h>
 #include <esp_mfi_debug.h>
@@ -33,12 +35,45 @@
 #include <esp_hap_database.h>
 #include <esp_hap_keystore.h>
 #include <esp_hap_main.h>
+#include <crc32.h>
 
 /* Primary Accessory Pointer */
 static __hap_acc_t *primary_acc;
+/* Set once the Protocol Information Service has been added to an accessory */
+static bool proto_info_added;
+/* Held while bridged accessories get added to or removed from the list, and by the HAP
+ * internal walks of the whole database which run in other tasks, like the hash computation.
+ */
+static SemaphoreHandle_t hap_db_mutex;
 
 /*****************************************************************************************************/
 
+int hap_db_lock_init()
+{
+    if (!hap_db_mutex) {
+        hap_db_mutex = xSemaphoreCreateRecursiveMutex();
+        if (!hap_db_mutex) {
+            return HAP_FAIL;
+        }
+    }
+    return HAP_SUCCESS;
+}
+
+void hap_db_lock()
+{
+    /* Accessories added before hap_init() cannot race with anything */
+    if (hap_db_mutex) {
+        xSemaphoreTakeRecursive(hap_db_mutex, portMAX_DELAY);
+    }
+}
+
+void hap_db_unlock()
+{
+    if (hap_db_mutex) {
+        xSemaphoreGiveRecursive(hap_db_mutex);
+    }
+}
+
 hap_acc_t *hap_get_first_acc()
 {
     return (hap_acc_t *)primary_acc;
@@ -78,9 +113,8 @@ static int hap_acc_info_write(hap_write_data_t write_data[], int count,
  */
 hap_acc_t *hap_acc_create(hap_acc_cfg_t *acc_cfg)
 {
-    static bool first = true;
     int ret = 0;
-    __hap_acc_t *_ha = hap_platform_memory_calloc(1, sizeof(__hap_acc_t));
+    __hap_acc_t *_ha = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_DATABASE, 1, sizeof(__hap_acc_t));
     if (!_ha) {
         return NULL;
     }
@@ -111,7 +145,7 @@ hap_acc_t *hap_acc_create(hap_acc_cfg_t *acc_cfg)
     hap_serv_set_priv(hs,(void *)_ha);
     hap_acc_add_serv((hap_acc_t *)_ha, hs);
 
-    if (first) {
+    if (!proto_info_added) {
         /* Add the Procol Information Service Internally */
         hs = hap_serv_create("A2");
         if (!hs) {
@@ -124,7 +158,7 @@ hap_acc_t *hap_acc_create(hap_acc_cfg_t *acc_cfg)
         }
         hap_acc_add_serv((hap_acc_t *)_ha, hs);
         hap_priv.cid = acc_cfg->cid;
-        first = false;
+        proto_info_added = true;
     }
 
     return (hap_acc_t *)_ha;
@@ -134,6 +168,148 @@ acc_create_fail:
     return NULL;
 }
 
+_Static_assert(sizeof(__hap_acc_t) <= sizeof(hap_acc_static_t), "HAP_ACC_STATIC_SIZE too small");
+
+/* Instance ID of a service (k = -1) or its k'th characteristic in a static description */
+static uint32_t hap_static_desc_iid(const hap_serv_desc_t *sd, int k)
+{
+    return (k < 0) ? sd->iid : sd->chars[k].iid;
+}
+
+/* Check that the instance IDs in a static accessory description are unique
+ * and that all linked services are present.
+ */
+static int hap_acc_check_static_desc(const hap_acc_desc_t *desc)
+{
+    int i, j, k, l;
+    bool acc_info = false;
+    for (i = 0; i < desc->num_servs; i++) {
+        const hap_serv_desc_t *sd = &desc->servs[i];
+        if (sd->type_uuid && !strcmp(sd->type_uuid, HAP_SERV_UUID_ACCESSORY_INFORMATION)) {
+            acc_info = true;
+        }
+        /* Compare each instance ID only with the ones after it */
+        for (k = -1; k < sd->num_chars; k++) {
+            uint32_t iid = hap_static_desc_iid(sd, k);
+            for (j = i; j < desc->num_servs; j++) {
+                const hap_serv_desc_t *od = &desc->servs[j];
+                for (l = (j == i) ? k + 1 : -1; l < od->num_chars; l++) {
+                    if (hap_static_desc_iid(od, l) == iid) {
+                        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Duplicate iid %u", iid);
+                        return HAP_FAIL;
+                    }
+                }
+            }
+        }
+        for (k = 0; k < sd->num_linked; k++) {
+            for (j = 0; j < desc->num_servs; j++) {
+                if (desc->servs[j].iid == sd->linked_iids[k]) {
+                    break;
+                }
+            }
+            if (j == desc->num_servs) {
+                ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Linked service %u not found", sd->linked_iids[k]);
+                return HAP_FAIL;
+            }
+        }
+    }
+    if (!acc_info) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Accessory Information Service missing");
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
+/**
+ * @brief HAP create an accessory from a static description
+ */
+hap_acc_t *hap_acc_create_static(const hap_acc_desc_t *desc)
+{
+    if (!desc || !desc->servs || !desc->num_servs || !desc->acc_storage
+            || !desc->serv_storage || !desc->char_storage) {
+        return NULL;
+    }
+    __hap_acc_t *_ha = (__hap_acc_t *)desc->acc_storage;
+    if (_ha->static_alloc) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Static accessory already created");
+        return NULL;
+    }
+    if (hap_acc_check_static_desc(desc) != HAP_SUCCESS) {
+        return NULL;
+    }
+    memset(_ha, 0, sizeof(__hap_acc_t));
+    _ha->identify_routine = desc->identify_routine;
+
+    uint32_t max_iid = 0;
+    bool proto_info = false;
+    hap_char_static_t *char_storage = desc->char_storage;
+    __hap_serv_t *last = NULL;
+    int i, j;
+    for (i = 0; i < desc->num_servs; i++) {
+        const hap_serv_desc_t *sd = &desc->servs[i];
+        __hap_serv_t *_hs = (__hap_serv_t *)hap_serv_init_static(&desc->serv_storage[i], sd, char_storage);
+        if (!_hs) {
+            return NULL;
+        }
+        char_storage += sd->num_chars;
+        _hs->parent = (hap_acc_t *)_ha;
+        if (last) {
+            last->next_serv = (hap_serv_t *)_hs;
+        } else {
+            _ha->servs = (hap_serv_t *)_hs;
+        }
+        last = _hs;
+
+        if (sd->iid > max_iid) {
+            max_iid = sd->iid;
+        }
+        for (j = 0; j < sd->num_chars; j++) {
+            if (sd->chars[j].iid > max_iid) {
+                max_iid = sd->chars[j].iid;
+            }
+        }
+        if (!strcmp(sd->type_uuid, HAP_SERV_UUID_ACCESSORY_INFORMATION)) {
+            _hs->write_cb = hap_acc_info_write;
+            _hs->priv = _ha;
+        } else if (!strcmp(sd->type_uuid, HAP_SERV_UUID_PROTOCOL_INFORMATION)) {
+            proto_info = true;
+        }
+    }
+
+    /* Links are resolved after all the services are set up, since a service can be
+     * linked to one appearing after it in the description.
+     */
+    hap_linked_serv_t *link = (hap_linked_serv_t *)desc->link_storage;
+    __hap_serv_t *_hs = (__hap_serv_t *)_ha->servs;
+    for (i = 0; i < desc->num_servs; i++, _hs = (__hap_serv_t *)_hs->next_serv) {
+        const hap_serv_desc_t *sd = &desc->servs[i];
+        if (sd->num_linked && !link) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "No storage for linked services");
+            return NULL;
+        }
+        hap_linked_serv_t *prev = NULL;
+        for (j = 0; j < sd->num_linked; j++, link++) {
+            link->hs = hap_acc_get_serv_by_iid((hap_acc_t *)_ha, sd->linked_iids[j]);
+            link->next = NULL;
+            if (prev) {
+                prev->next = link;
+            } else {
+                _hs->linked_servs = link;
+            }
+            prev = link;
+        }
+        _hs->static_links = sd->num_linked;
+    }
+
+    _ha->next_iid = max_iid + 1;
+    if (proto_info) {
+        hap_priv.cid = desc->cid;
+        proto_info_added = true;
+    }
+    _ha->static_alloc = true;
+    return (hap_acc_t *)_ha;
+}
+
 int hap_acc_add_accessory_flags(hap_acc_t *ha, uint32_t flags)
 {
     if (!ha) {
@@ -353,25 +529,238 @@ static void hap_remove_acc_from_list(__hap_acc_t *primary, __hap_acc_t *old)
     cur->next = cur->next->next;
 }
 
-#define HAP_BRIDGE_KEYSTORE     "hap_bridge"
+#define HAP_KEY_AID_MAP         "aid_map"
+#define HAP_AID_MAP_VERSION     1
+#define HAP_AID_MAP_BUCKETS     64
+#define HAP_AID_MAP_MAX_ID_LEN  255
 
-int hap_get_unique_aid(const char *id)
+/* Bridged accessory id -> aid map. It is loaded from the keystore once and kept in a hash
+ * table. It is persisted as a single blob:
+ *
+ * | version (1) | count (2) | { aid (4) | id length (1) | id } x count | CRC32 |
+ *
+ * The CRC32 covers everything before it. It is kept in the hap_main namespace, along with the
+ * current aid, so that both are always erased together.
+ */
+typedef struct hap_aid_map_entry {
+    struct hap_aid_map_entry *next;
+    int aid;
+    uint8_t id_len;
+    char id[];
+} hap_aid_map_entry_t;
+
+static hap_aid_map_entry_t *hap_aid_map[HAP_AID_MAP_BUCKETS];
+static int hap_aid_map_cnt;
+static bool hap_aid_map_loaded;
+
+static uint32_t hap_aid_map_hash(const char *id, size_t len)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    while (len--) {
+        hash ^= (uint8_t)*id++;
+        hash *= 16777619u;
+    }
+    return hash % HAP_AID_MAP_BUCKETS;
+}
+
+static hap_aid_map_entry_t *hap_aid_map_find(const char *id, size_t len)
+{
+    hap_aid_map_entry_t *entry = hap_aid_map[hap_aid_map_hash(id, len)];
+    for (; entry; entry = entry->next) {
+        if ((entry->id_len == len) && !memcmp(entry->id, id, len)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static int hap_aid_map_add(const char *id, size_t len, int aid)
+{
+    hap_aid_map_entry_t *entry = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_DATABASE, 1,
+            sizeof(hap_aid_map_entry_t) + len);
+    if (!entry) {
+        return HAP_FAIL;
+    }
+    entry->aid = aid;
+    entry->id_len = len;
+    memcpy(entry->id, id, len);
+    uint32_t bucket = hap_aid_map_hash(id, len);
+    entry->next = hap_aid_map[bucket];
+    hap_aid_map[bucket] = entry;
+    hap_aid_map_cnt++;
+    return HAP_SUCCESS;
+}
+
+static int hap_aid_map_store()
+{
+    size_t len = 1 + 2 + sizeof(uint32_t);
+    int i;
+    hap_aid_map_entry_t *entry;
+    for (i = 0; i < HAP_AID_MAP_BUCKETS; i++) {
+        for (entry = hap_aid_map[i]; entry; entry = entry->next) {
+            len += sizeof(int32_t) + 1 + entry->id_len;
+        }
+    }
+    uint8_t *buf = hap_platform_memory_malloc(len);
+    if (!buf) {
+        return HAP_FAIL;
+    }
+    uint8_t *p = buf;
+    uint16_t count = hap_aid_map_cnt;
+    *p++ = HAP_AID_MAP_VERSION;
+    memcpy(p, &count, sizeof(count));
+    p += sizeof(count);
+    for (i = 0; i < HAP_AID_MAP_BUCKETS; i++) {
+        for (entry = hap_aid_map[i]; entry; entry = entry->next) {
+            int32_t aid = entry->aid;
+            memcpy(p, &aid, sizeof(aid));
+            p += sizeof(aid);
+            *p++ = entry->id_len;
+            memcpy(p, entry->id, entry->id_len);
+            p += entry->id_len;
+        }
+    }
+    uint32_t crc = hap_crc32(0, buf, p - buf);
+    memcpy(p, &crc, sizeof(crc));
+    int ret = hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_AID_MAP, buf, len);
+    hap_platform_memory_free(buf);
+    return ret;
+}
+
+static void hap_aid_map_load()
+{
+    if (hap_aid_map_loaded) {
+        return;
+    }
+    hap_aid_map_loaded = true;
+    /* Get the length first, since the map can be of any size */
+    size_t len = 0;
+    if ((hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_AID_MAP, NULL, &len) != HAP_SUCCESS) || !len) {
+        return;
+    }
+    uint8_t *buf = hap_platform_memory_malloc(len);
+    if (!buf) {
+        return;
+    }
+    if (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_AID_MAP, buf, &len) != HAP_SUCCESS) {
+        goto load_end;
+    }
+    uint32_t crc;
+    if ((len < 1 + 2 + sizeof(crc)) || (buf[0] != HAP_AID_MAP_VERSION)) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Unsupported bridged aid map format");
+        goto load_end;
+    }
+    memcpy(&crc, buf + len - sizeof(crc), sizeof(crc));
+    if (crc != hap_crc32(0, buf, len - sizeof(crc))) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Bridged aid map corrupted");
+        goto load_end;
+    }
+    uint16_t count;
+    memcpy(&count, buf + 1, sizeof(count));
+    const uint8_t *p = buf + 1 + sizeof(count);
+    const uint8_t *end = buf + len - sizeof(crc);
+    while (count--) {
+        int32_t aid;
+        if (p + sizeof(aid) + 1 > end) {
+            break;
+        }
+        memcpy(&aid, p, sizeof(aid));
+        p += sizeof(aid);
+        uint8_t id_len = *p++;
+        if (p + id_len > end) {
+            break;
+        }
+        hap_aid_map_add((const char *)p, id_len, aid);
+        p += id_len;
+    }
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Loaded %d bridged accessory aids", hap_aid_map_cnt);
+load_end:
+    hap_platform_memory_free(buf);
+}
+
+void hap_aid_map_reset()
+{
+    hap_aid_map_entry_t *entry, *next;
+    for (int i = 0; i < HAP_AID_MAP_BUCKETS; i++) {
+        for (entry = hap_aid_map[i]; entry; entry = next) {
+            next = entry->next;
+            hap_platform_memory_free_tagged(entry);
+        }
+        hap_aid_map[i] = NULL;
+    }
+    hap_aid_map_cnt = 0;
+    hap_aid_map_loaded = false;
+}
+
+/* Looks up the aid for an id, assigning a new one if required. "added" is set to true if the
+ * map was modified and needs to be stored.
+ */
+static int hap_aid_map_get(const char *id, bool *added)
 {
     if (!id) {
         return -1;
     }
+    size_t len = strlen(id);
+    if (len > HAP_AID_MAP_MAX_ID_LEN) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Bridged accessory id %s too long", id);
+        return -1;
+    }
+    hap_aid_map_load();
+    hap_aid_map_entry_t *entry = hap_aid_map_find(id, len);
+    if (entry) {
+        return entry->aid;
+    }
     int aid = 0;
     size_t aid_size = sizeof(aid);
-    if (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, id, (uint8_t *)&aid, &aid_size) != HAP_SUCCESS) {
+    /* Older firmware stored one key per id. Pick that up, if present */
+    if (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, id, (uint8_t *)&aid, &aid_size) == HAP_SUCCESS) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Migrating aid = %d for Bridged accessory %s", aid, id);
+    } else {
         aid = hap_get_next_aid();
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Assigning aid = %d for Bridged accessory %s", aid, id);
-        hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, id, (uint8_t *)&aid, sizeof(aid));
-    } else {
-        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Using aid = %d for Bridged accessory %s", aid, id);
+    }
+    if (hap_aid_map_add(id, len, aid) == HAP_SUCCESS) {
+        *added = true;
     }
     return aid;
 }
 
+int hap_get_unique_aid(const char *id)
+{
+    int aid;
+    int ret = hap_get_unique_aids(&id, 1, &aid);
+    if ((ret != HAP_SUCCESS) && (aid > 0)) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Could not persist aid = %d for Bridged accessory %s", aid, id);
+    }
+    return aid;
+}
+
+int hap_get_unique_aids(const char *ids[], int count, int aids[])
+{
+    if (!ids || !aids || (count <= 0)) {
+        return HAP_FAIL;
+    }
+    int ret = HAP_SUCCESS;
+    bool added = false;
+    int i;
+    /* The current aid and the map get committed together */
+    hap_keystore_begin_batch();
+    for (i = 0; i < count; i++) {
+        aids[i] = hap_aid_map_get(ids[i], &added);
+        if (aids[i] < 0) {
+            ret = HAP_FAIL;
+        }
+    }
+    if (added && (hap_aid_map_store() != HAP_SUCCESS)) {
+        ret = HAP_FAIL;
+    }
+    if (hap_keystore_end_batch() != HAP_SUCCESS) {
+        ret = HAP_FAIL;
+    }
+    return ret;
+}
+
 /**
  * @brief HAP add accessory to HAP kernel
  */
@@ -395,12 +784,167 @@ void hap_add_accessory(hap_acc_t *ha)
         hap_char_t *hc = hap_serv_get_char_by_uuid(hs, HAP_CHAR_UUID_NAME);
         snprintf(name, sizeof(name), "%s-%02X%02X%02X", ((__hap_char_t *)hc)->val.s,
                 eth_mac[3], eth_mac[4], eth_mac[5]);
-        hap_platform_memory_free(((__hap_char_t *)hc)->val.s);
-        ((__hap_char_t *)hc)->val.s = strdup(name);
+        hap_char_store_string((__hap_char_t *)hc, name);
     }
     hap_acc_get_info(&hap_priv.primary_acc);
 }
 
+/* Structural hash of the accessory database.
+ * This covers everything which goes into the /accessories response, other than the values
+ * and the notification state, so that an identical database (say, after a bridge re-adds the
+ * same devices, maybe in a different order) gives the same hash. Each accessory is hashed
+ * as a CRC32 over its fields in a fixed order, with strings length prefixed.
+ */
+static uint32_t hap_db_hash_u32(uint32_t crc, uint32_t val)
+{
+    uint8_t buf[4] = {val & 0xff, (val >> 8) & 0xff, (val >> 16) & 0xff, (val >> 24) & 0xff};
+    return hap_crc32(crc, buf, sizeof(buf));
+}
+
+static uint32_t hap_db_hash_str(uint32_t crc, const char *str)
+{
+    if (!str) {
+        return hap_db_hash_u32(crc, 0xffffffff);
+    }
+    size_t len = strlen(str);
+    crc = hap_db_hash_u32(crc, len);
+    return hap_crc32(crc, str, len);
+}
+
+/* Only the member relevant for the format is used, since the rest of the union may be garbage */
+static uint32_t hap_db_hash_val(uint32_t crc, hap_char_format_t format, const hap_val_t *val)
+{
+    switch (format) {
+        case HAP_CHAR_FORMAT_FLOAT: {
+            uint32_t bits;
+            memcpy(&bits, &val->f, sizeof(bits));
+            return hap_db_hash_u32(crc, bits);
+        }
+        case HAP_CHAR_FORMAT_UINT64:
+            crc = hap_db_hash_u32(crc, (uint32_t)val->i64);
+            return hap_db_hash_u32(crc, (uint32_t)(val->i64 >> 32));
+        case HAP_CHAR_FORMAT_INT:
+            return hap_db_hash_u32(crc, (uint32_t)val->i);
+        default:
+            return hap_db_hash_u32(crc, val->u);
+    }
+}
+
+static uint32_t hap_db_hash_char(uint32_t crc, __hap_char_t *_hc)
+{
+    crc = hap_db_hash_u32(crc, _hc->iid);
+    crc = hap_db_hash_str(crc, _hc->type_uuid);
+    crc = hap_db_hash_u32(crc, _hc->permission);
+    crc = hap_db_hash_u32(crc, _hc->format);
+    crc = hap_db_hash_u32(crc, _hc->constraint_flags);
+    if (_hc->constraint_flags & HAP_CHAR_MIN_FLAG) {
+        crc = hap_db_hash_val(crc, _hc->format, &_hc->min);
+    }
+    if (_hc->constraint_flags & HAP_CHAR_STEP_FLAG) {
+        crc = hap_db_hash_val(crc, _hc->format, &_hc->step);
+    }
+    if (_hc->constraint_flags & (HAP_CHAR_MAX_FLAG | HAP_CHAR_MAXLEN_FLAG | HAP_CHAR_MAXDATALEN_FLAG)) {
+        hap_char_format_t format = (_hc->constraint_flags & HAP_CHAR_MAX_FLAG) ?
+                _hc->format : HAP_CHAR_FORMAT_INT;
+        crc = hap_db_hash_val(crc, format, &_hc->max);
+    }
+    crc = hap_db_hash_str(crc, _hc->description);
+    crc = hap_db_hash_str(crc, _hc->unit);
+    if (_hc->valid_vals) {
+        crc = hap_db_hash_u32(crc, _hc->valid_vals_cnt);
+        crc = hap_crc32(crc, _hc->valid_vals, _hc->valid_vals_cnt);
+    } else {
+        crc = hap_db_hash_u32(crc, 0xffffffff);
+    }
+    if (_hc->valid_vals_range) {
+        crc = hap_crc32(crc, _hc->valid_vals_range, 2);
+    } else {
+        crc = hap_db_hash_u32(crc, 0xffffffff);
+    }
+    return crc;
+}
+
+static uint32_t hap_db_hash_serv(uint32_t crc, __hap_serv_t *_hs)
+{
+    crc = hap_db_hash_u32(crc, _hs->iid);
+    crc = hap_db_hash_str(crc, _hs->type_uuid);
+    crc = hap_db_hash_u32(crc, (_hs->hidden ? 1 : 0) | (_hs->primary ? 2 : 0));
+    hap_linked_serv_t *linked = _hs->linked_servs;
+    while (linked) {
+        crc = hap_db_hash_u32(crc, hap_serv_get_iid(linked->hs));
+        linked = linked->next;
+    }
+    /* Terminator, so that linked service iids cannot get mixed up with the characteristics */
+    crc = hap_db_hash_u32(crc, 0);
+    hap_char_t *hc;
+    for (hc = hap_serv_get_first_char((hap_serv_t *)_hs); hc; hc = hap_char_get_next(hc)) {
+        crc = hap_db_hash_char(crc, (__hap_char_t *)hc);
+    }
+    return hap_db_hash_u32(crc, 0);
+}
+
+uint32_t hap_acc_db_hash()
+{
+    /* Controllers identify accessories by aid, so the order of the accessories in the list
+     * does not matter. The individual hashes are combined in an order independent way.
+     */
+    uint32_t sum = 0, xor_all = 0, count = 0;
+    __hap_acc_t *_ha;
+    hap_db_lock();
+    for (_ha = primary_acc; _ha; _ha = _ha->next) {
+        uint32_t crc = hap_db_hash_u32(0, _ha->aid);
+        hap_serv_t *hs;
+        for (hs = hap_acc_get_first_serv((hap_acc_t *)_ha); hs; hs = hap_serv_get_next(hs)) {
+            crc = hap_db_hash_serv(crc, (__hap_serv_t *)hs);
+        }
+        sum += crc;
+        xor_all ^= crc;
+        count++;
+    }
+    hap_db_unlock();
+    uint32_t crc = hap_db_hash_u32(0, count);
+    crc = hap_db_hash_u32(crc, sum);
+    return hap_db_hash_u32(crc, xor_all);
+}
+
+/* Nesting depth of hap_db_update_begin() and whether anything changed in between */
+static int hap_db_update_depth;
+static bool hap_db_update_dirty;
+
+static void hap_acc_db_changed()
+{
+    if (hap_priv.cfg.disable_config_num_update) {
+        return;
+    }
+    if (hap_db_update_depth) {
+        hap_db_update_dirty = true;
+        return;
+    }
+    hap_report_db_change(false);
+}
+
+void hap_db_update_begin()
+{
+    hap_db_update_depth++;
+}
+
+int hap_db_update_commit()
+{
+    if (!hap_db_update_depth) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "hap_db_update_commit() without hap_db_update_begin()");
+        return HAP_FAIL;
+    }
+    if (--hap_db_update_depth || !hap_db_update_dirty) {
+        return HAP_SUCCESS;
+    }
+    hap_db_update_dirty = false;
+    /* The config number is of relevance only once HAP has started */
+    if (!is_hap_loop_started()) {
+        return HAP_SUCCESS;
+    }
+    return hap_report_db_change(true);
+}
+
 void hap_add_bridged_accessory(hap_acc_t *ha, int aid)
 {
     if (!ha) {
@@ -413,10 +957,10 @@ void hap_add_bridged_accessory(hap_acc_t *ha, int aid)
         _ha->aid = hap_get_next_aid();
     }
 
+    hap_db_lock();
     hap_add_acc_to_list(primary_acc, _ha);
-    if (!hap_priv.cfg.disable_config_num_update) {
-        hap_update_config_number();
-    }
+    hap_db_unlock();
+    hap_acc_db_changed();
 }
 
 void hap_remove_bridged_accessory(hap_acc_t *ha)
@@ -425,10 +969,10 @@ void hap_remove_bridged_accessory(hap_acc_t *ha)
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Cannot remove primary accessory");
     } else {
         if (ha) {
+            hap_db_lock();
             hap_remove_acc_from_list(primary_acc, (__hap_acc_t *)ha);
-            if (!hap_priv.cfg.disable_config_num_update) {
-                hap_update_config_number();
-            }
+            hap_db_unlock();
+            hap_acc_db_changed();
         }
 
     }
@@ -450,7 +994,12 @@ void hap_acc_delete(hap_acc_t *ha)
 		hap_serv_delete((hap_serv_t *)_hs);
 		_hs = (__hap_serv_t *)_ha->servs;
 	}
-    hap_platform_memory_free(_ha);
+    if (_ha->static_alloc) {
+        /* Allow the storage to be used again by hap_acc_create_static() */
+        _ha->static_alloc = false;
+    } else {
+        hap_platform_memory_free_tagged(_ha);
+    }
 }
 
 /**
@@ -0,0 +1,271 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <hap.h>
+#include <esp_mfi_debug.h>
+#include <esp_hap_async.h>
+
+#ifdef CONFIG_HAP_ASYNC_MAX_PENDING
+#define HAP_ASYNC_MAX_BATCHES   CONFIG_HAP_ASYNC_MAX_PENDING
+#else /* CONFIG_HAP_ASYNC_MAX_PENDING */
+#define HAP_ASYNC_MAX_BATCHES   16
+#endif /* CONFIG_HAP_ASYNC_MAX_PENDING */
+
+#ifdef CONFIG_HAP_ASYNC_REQ_TIMEOUT_MS
+#define HAP_ASYNC_TIMEOUT_MS    CONFIG_HAP_ASYNC_REQ_TIMEOUT_MS
+#else /* CONFIG_HAP_ASYNC_REQ_TIMEOUT_MS */
+#define HAP_ASYNC_TIMEOUT_MS    3000
+#endif /* CONFIG_HAP_ASYNC_REQ_TIMEOUT_MS */
+
+/* A batch is the set of characteristics passed to a single service callback */
+typedef struct {
+    hap_status_t *status;
+    int count;
+    int ret;
+    uint16_t gen;
+    /* hap_req_defer() was called for this batch */
+    bool deferred;
+    /* Waiting for hap_async_complete() */
+    bool pending;
+} hap_async_batch_t;
+
+static hap_async_batch_t hap_async_batches[HAP_ASYNC_MAX_BATCHES];
+/* Batches allocated for the current request */
+static int hap_async_batch_cnt;
+/* Number of batches pending completion */
+static int hap_async_outstanding;
+/* Incremented at the end of every request, so that stale tokens get rejected */
+static uint16_t hap_async_gen;
+
+/* Callbacks being invoked. A batch gets allocated only if hap_req_defer() is called.
+ * Nesting is required for the default bulk read, which invokes the read callback
+ * for every characteristic.
+ */
+#define HAP_ASYNC_MAX_DEPTH     2
+typedef struct {
+    hap_status_t *status;
+    int count;
+    int batch;
+} hap_async_frame_t;
+static hap_async_frame_t hap_async_frames[HAP_ASYNC_MAX_DEPTH];
+static int hap_async_depth;
+static TaskHandle_t hap_async_owner;
+/* Protects the batches against hap_async_complete() from other tasks */
+static SemaphoreHandle_t hap_async_mutex;
+/* Given when the last pending batch completes */
+static SemaphoreHandle_t hap_async_done;
+
+/* Token is the generation in the upper 16 bits and (batch + 1) in the lower, so it is never 0 */
+#define HAP_ASYNC_TOKEN(gen, batch)     (((hap_async_token_t)(gen) << 16) | ((batch) + 1))
+#define HAP_ASYNC_TOKEN_GEN(token)      ((uint16_t)((token) >> 16))
+#define HAP_ASYNC_TOKEN_BATCH(token)    ((int)((token) & 0xffff) - 1)
+
+int hap_async_init(void)
+{
+    if (!hap_async_mutex) {
+        hap_async_mutex = xSemaphoreCreateMutex();
+        if (!hap_async_mutex) {
+            return HAP_FAIL;
+        }
+    }
+    if (!hap_async_done) {
+        hap_async_done = xSemaphoreCreateBinary();
+        if (!hap_async_done) {
+            return HAP_FAIL;
+        }
+    }
+    return HAP_SUCCESS;
+}
+
+static void hap_async_set_status(hap_async_batch_t *b, hap_status_t status)
+{
+    int i;
+    for (i = 0; i < b->count; i++) {
+        b->status[i] = status;
+    }
+}
+
+void hap_async_req_begin(void)
+{
+    if (!hap_async_mutex) {
+        return;
+    }
+    xSemaphoreTake(hap_async_mutex, portMAX_DELAY);
+    hap_async_owner = xTaskGetCurrentTaskHandle();
+    hap_async_batch_cnt = 0;
+    hap_async_outstanding = 0;
+    hap_async_depth = 0;
+    /* Clear any stale completion signal */
+    xSemaphoreTake(hap_async_done, 0);
+    xSemaphoreGive(hap_async_mutex);
+}
+
+int hap_async_batch_begin(hap_status_t *status, int count)
+{
+    int cookie = hap_async_depth;
+    if (hap_async_depth < HAP_ASYNC_MAX_DEPTH) {
+        hap_async_frame_t *f = &hap_async_frames[hap_async_depth];
+        f->status = status;
+        f->count = count;
+        f->batch = -1;
+    }
+    hap_async_depth++;
+    return cookie;
+}
+
+int hap_async_batch_end(int cookie, int ret)
+{
+    int batch = -1;
+    if (hap_async_depth && (hap_async_depth <= HAP_ASYNC_MAX_DEPTH)) {
+        batch = hap_async_frames[hap_async_depth - 1].batch;
+    }
+    hap_async_depth = cookie;
+    if (batch < 0) {
+        if (ret == HAP_PENDING) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Callback returned HAP_PENDING without hap_req_defer()");
+            return HAP_FAIL;
+        }
+        return ret;
+    }
+    xSemaphoreTake(hap_async_mutex, portMAX_DELAY);
+    hap_async_batch_t *b = &hap_async_batches[batch];
+    if (ret == HAP_PENDING) {
+        /* The actual result gets collected by hap_async_req_end() */
+        ret = HAP_SUCCESS;
+    } else if (b->pending) {
+        /* Deferred, but completed synchronously after all. Any later completion is ignored */
+        b->pending = false;
+        b->deferred = false;
+        hap_async_outstanding--;
+    }
+    xSemaphoreGive(hap_async_mutex);
+    return ret;
+}
+
+int hap_async_req_end(void)
+{
+    if (!hap_async_mutex) {
+        return HAP_SUCCESS;
+    }
+    TickType_t start = xTaskGetTickCount();
+    TickType_t timeout = pdMS_TO_TICKS(HAP_ASYNC_TIMEOUT_MS);
+    xSemaphoreTake(hap_async_mutex, portMAX_DELAY);
+    while (hap_async_outstanding > 0) {
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= timeout) {
+            break;
+        }
+        xSemaphoreGive(hap_async_mutex);
+        xSemaphoreTake(hap_async_done, timeout - elapsed);
+        xSemaphoreTake(hap_async_mutex, portMAX_DELAY);
+    }
+    int ret = HAP_SUCCESS;
+    int i;
+    for (i = 0; i < hap_async_batch_cnt; i++) {
+        hap_async_batch_t *b = &hap_async_batches[i];
+        if (!b->deferred) {
+            continue;
+        }
+        if (b->pending) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Deferred read/write timed out after %d msec",
+                    HAP_ASYNC_TIMEOUT_MS);
+            hap_async_set_status(b, HAP_STATUS_TIMEOUT);
+            ret = HAP_FAIL;
+        } else if (b->ret != HAP_SUCCESS) {
+            ret = HAP_FAIL;
+        }
+    }
+    /* Invalidate all tokens handed out for this request */
+    hap_async_gen++;
+    hap_async_batch_cnt = 0;
+    hap_async_outstanding = 0;
+    hap_async_depth = 0;
+    hap_async_owner = NULL;
+    xSemaphoreGive(hap_async_mutex);
+    return ret;
+}
+
+hap_async_token_t hap_req_defer(void)
+{
+    if (!hap_async_depth || (hap_async_depth > HAP_ASYNC_MAX_DEPTH) ||
+            (hap_async_owner != xTaskGetCurrentTaskHandle())) {
+        return 0;
+    }
+    hap_async_frame_t *f = &hap_async_frames[hap_async_depth - 1];
+    xSemaphoreTake(hap_async_mutex, portMAX_DELAY);
+    if (f->batch < 0) {
+        if (hap_async_batch_cnt >= HAP_ASYNC_MAX_BATCHES) {
+            xSemaphoreGive(hap_async_mutex);
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Too many deferred callbacks. Complete synchronously");
+            return 0;
+        }
+        f->batch = hap_async_batch_cnt++;
+        hap_async_batch_t *b = &hap_async_batches[f->batch];
+        b->status = f->status;
+        b->count = f->count;
+        b->ret = HAP_SUCCESS;
+        b->gen = hap_async_gen;
+        b->deferred = true;
+        b->pending = true;
+        hap_async_outstanding++;
+    }
+    hap_async_token_t token = HAP_ASYNC_TOKEN(hap_async_gen, f->batch);
+    xSemaphoreGive(hap_async_mutex);
+    return token;
+}
+
+int hap_async_complete(hap_async_token_t token, int ret, const hap_status_t status[], int count)
+{
+    int batch = HAP_ASYNC_TOKEN_BATCH(token);
+    if (!hap_async_mutex || (batch < 0) || (batch >= HAP_ASYNC_MAX_BATCHES)) {
+        return HAP_FAIL;
+    }
+    xSemaphoreTake(hap_async_mutex, portMAX_DELAY);
+    hap_async_batch_t *b = &hap_async_batches[batch];
+    if ((batch >= hap_async_batch_cnt) || (HAP_ASYNC_TOKEN_GEN(token) != hap_async_gen) ||
+            (b->gen != hap_async_gen) || !b->pending) {
+        xSemaphoreGive(hap_async_mutex);
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Ignoring completion for a stale or timed out request");
+        return HAP_FAIL;
+    }
+    if (status) {
+        if (count > b->count) {
+            count = b->count;
+        }
+        memcpy(b->status, status, count * sizeof(hap_status_t));
+    } else {
+        hap_async_set_status(b, (ret == HAP_SUCCESS) ? HAP_STATUS_SUCCESS : HAP_STATUS_COMM_ERR);
+    }
+    b->ret = (ret == HAP_SUCCESS) ? HAP_SUCCESS : HAP_FAIL;
+    b->pending = false;
+    if (--hap_async_outstanding == 0) {
+        xSemaphoreGive(hap_async_done);
+    }
+    xSemaphoreGive(hap_async_mutex);
+    return HAP_SUCCESS;
+}
@@ -62,10 +62,16 @@ void hap_handle_bct_change_name()
     new_name = NULL;
 }
 
+/* Stop the network for a hot plug test. hap_handle_hot_plug_resume() should be called
+ * after some time (10 seconds) to restart it.
+ */
 void hap_handle_hot_plug()
 {
     esp_wifi_stop();
-    vTaskDelay((10 * 1000) / portTICK_PERIOD_MS); /* Wait for 10 seconds */
+}
+
+void hap_handle_hot_plug_resume()
+{
     esp_wifi_start();
     esp_wifi_connect();
 }
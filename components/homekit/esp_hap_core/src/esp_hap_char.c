@@ -23,8 +23,13 @@
  */
 
 #include <hap_platform_memory.h>
+#include <hap_platform_os.h>
 #include <math.h>
 #include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
 #include "esp_mfi_debug.h"
 
 #include <esp_hap_main.h>
@@ -32,8 +37,45 @@
 #include <esp_hap_char.h>
 #include <esp_hap_ip_services.h>
 #include <esp_hap_database.h>
+#include <esp_hap_notif_latency.h>
+#include <esp_hap_keystore.h>
+#include <crc32.h>
 
-static QueueHandle_t hap_event_queue;
+/* Characteristics with a pending notification. Each characteristic is linked at most once
+ * (tracked by its notif_pending flag), so repeated updates get coalesced and the list can
+ * never overflow. Protected by the hap_platform_os critical section, since updates can
+ * come from an ISR.
+ */
+static hap_char_t *hap_notif_head;
+static hap_char_t *hap_notif_tail;
+static int hap_notif_cnt;
+/* Set if a HAP_INTERNAL_EVENT_TRIGGER_NOTIF has been posted, but the list has not been taken yet */
+static bool hap_notif_triggered;
+#ifdef CONFIG_HAP_NOTIF_LATENCY_STATS
+/* Time (in usec) at which the notification pass was last triggered, for latency tracking */
+static int64_t hap_notif_trigger_ts;
+#endif /* CONFIG_HAP_NOTIF_LATENCY_STATS */
+
+/* Characteristics taken by the notification pass, but not yet popped by it */
+static hap_char_t *hap_notif_taken;
+/* Held by a notification pass while it accesses the characteristics it has popped, and by
+ * hap_char_delete(), so that a characteristic never gets freed under a pass.
+ * It is not held while sending, since an HTTP handler which deletes characteristics
+ * can be holding the session lock the send waits on.
+ */
+static SemaphoreHandle_t hap_notif_pass_mutex;
+
+#ifdef CONFIG_HAP_NOTIF_WINDOW_MS
+#define HAP_NOTIF_WINDOW_DEFAULT    CONFIG_HAP_NOTIF_WINDOW_MS
+#else /* CONFIG_HAP_NOTIF_WINDOW_MS */
+#define HAP_NOTIF_WINDOW_DEFAULT    0
+#endif /* CONFIG_HAP_NOTIF_WINDOW_MS */
+
+/* Timer for triggering the notification pass at the end of a coalescing window */
+static esp_timer_handle_t hap_notif_timer;
+/* Time (in usec) at which the timer is due. 0 if not armed */
+static int64_t hap_notif_due;
+static hap_notif_stats_t hap_notif_stats;
 
 /**
  * @brief get characteristics's value
@@ -67,117 +109,1162 @@ static double esp_mfi_fmod(double a, double b)
     return fmod(a, b);
 }
 
+static void hap_notif_timer_cb(void *arg)
+{
+    bool need_trigger = false;
+    hap_platform_os_enter_critical();
+    hap_notif_due = 0;
+    if (hap_notif_head && !hap_notif_triggered) {
+        hap_notif_triggered = true;
+        need_trigger = true;
+    }
+    hap_platform_os_exit_critical();
+    if (need_trigger) {
+        hap_trigger_notif();
+    }
+}
+
+void hap_notif_pass_lock()
+{
+    /* Nothing can be running a pass before hap_event_queue_init() */
+    if (hap_notif_pass_mutex) {
+        xSemaphoreTakeRecursive(hap_notif_pass_mutex, portMAX_DELAY);
+    }
+}
+
+void hap_notif_pass_unlock()
+{
+    if (hap_notif_pass_mutex) {
+        xSemaphoreGiveRecursive(hap_notif_pass_mutex);
+    }
+}
+
 int hap_event_queue_init()
 {
-    hap_event_queue = xQueueCreate( hap_priv.cfg.max_event_notif_chars,
-                    sizeof(hap_char_t *) );
-    if (hap_event_queue) {
+    if (!hap_notif_pass_mutex) {
+        hap_notif_pass_mutex = xSemaphoreCreateRecursiveMutex();
+        if (!hap_notif_pass_mutex) {
+            return HAP_FAIL;
+        }
+    }
+    hap_platform_os_enter_critical();
+    hap_notif_head = hap_notif_tail = hap_notif_taken = NULL;
+    hap_notif_cnt = 0;
+    hap_notif_triggered = false;
+    hap_notif_due = 0;
+    hap_platform_os_exit_critical();
+    if (!hap_notif_timer) {
+        esp_timer_create_args_t timer_args = {
+            .callback = hap_notif_timer_cb,
+            .name = "hap_notif",
+        };
+        if (esp_timer_create(&timer_args, &hap_notif_timer) != ESP_OK) {
+            /* Notifications will just be sent without any coalescing window */
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Failed to create notification timer");
+            hap_notif_timer = NULL;
+        }
+    }
+    return HAP_SUCCESS;
+}
+
+/* Coalescing window (in msec) applicable for a characteristic */
+static uint32_t hap_char_get_notif_window(__hap_char_t *_hc)
+{
+    /* Stateless events (like Programmable Switch Event) are never delayed */
+    if (_hc->permission & HAP_CHAR_PERM_SPECIAL_READ) {
+        return 0;
+    }
+    if (_hc->notif_window) {
+        return _hc->notif_window - 1;
+    }
+    __hap_serv_t *_hs = (__hap_serv_t *)_hc->parent;
+    if (_hs && _hs->notif_window) {
+        return _hs->notif_window - 1;
+    }
+    return HAP_NOTIF_WINDOW_DEFAULT;
+}
+
+int hap_char_set_notif_window(hap_char_t *hc, uint16_t window_ms)
+{
+    if (!hc) {
+        return HAP_FAIL;
+    }
+    ((__hap_char_t *)hc)->notif_window = (window_ms == HAP_NOTIF_WINDOW_INHERIT) ? 0 : window_ms + 1;
+    return HAP_SUCCESS;
+}
+
+int hap_get_notif_stats(hap_notif_stats_t *stats)
+{
+    if (!stats) {
+        return HAP_FAIL;
+    }
+    hap_platform_os_enter_critical();
+    *stats = hap_notif_stats;
+    hap_platform_os_exit_critical();
+    return HAP_SUCCESS;
+}
+
+void hap_reset_notif_stats()
+{
+    hap_platform_os_enter_critical();
+    memset(&hap_notif_stats, 0, sizeof(hap_notif_stats));
+    hap_platform_os_exit_critical();
+}
+
+/* Account for a notification pass, which sent the given number of EVENT messages,
+ * using the given number of distinct payloads.
+ */
+void hap_notif_count_pass(int messages, int payloads)
+{
+    hap_platform_os_enter_critical();
+    hap_notif_stats.passes++;
+    hap_notif_stats.messages += messages;
+    hap_notif_stats.payloads += payloads;
+    hap_platform_os_exit_critical();
+}
+
+/* Take all the characteristics with pending notifications. They should then be walked
+ * using hap_pop_pending_notif_char(). Returns the number of characteristics taken.
+ * If trigger_ts is not NULL, it is set to the time at which this pass was triggered
+ * (0 if not known).
+ */
+int hap_take_pending_notif_chars(int64_t *trigger_ts)
+{
+    int cnt;
+    hap_platform_os_enter_critical();
+    /* A pass always walks all the characteristics it took, before taking more */
+    hap_notif_taken = hap_notif_head;
+    cnt = hap_notif_cnt;
+    if (trigger_ts) {
+#ifdef CONFIG_HAP_NOTIF_LATENCY_STATS
+        *trigger_ts = hap_notif_triggered ? hap_notif_trigger_ts : 0;
+#else
+        *trigger_ts = 0;
+#endif /* CONFIG_HAP_NOTIF_LATENCY_STATS */
+    }
+    hap_notif_head = hap_notif_tail = NULL;
+    hap_notif_cnt = 0;
+    hap_notif_triggered = false;
+    /* A timer which is still armed will just trigger an empty pass */
+    hap_notif_due = 0;
+    hap_platform_os_exit_critical();
+    return cnt;
+}
+
+/* Get the next characteristic taken using hap_take_pending_notif_chars().
+ * Should be called with hap_notif_pass_lock() held, and the lock kept till the pass is
+ * done accessing the characteristic returned.
+ * Its pending flag is cleared before returning, so that an update after this point
+ * queues it again, rather than getting lost.
+ * If notif_ts is not NULL, it is set to the time at which the characteristic got queued
+ * (0 if latency tracking is not enabled).
+ */
+hap_char_t *hap_pop_pending_notif_char(int64_t *notif_ts)
+{
+    hap_platform_os_enter_critical();
+    __hap_char_t *_hc = (__hap_char_t *)hap_notif_taken;
+    if (_hc) {
+        hap_notif_taken = _hc->next_notif;
+        if (notif_ts) {
+#ifdef CONFIG_HAP_NOTIF_LATENCY_STATS
+            *notif_ts = _hc->notif_ts;
+#else
+            *notif_ts = 0;
+#endif /* CONFIG_HAP_NOTIF_LATENCY_STATS */
+        }
+        _hc->next_notif = NULL;
+        _hc->notif_pending = false;
+    }
+    hap_platform_os_exit_critical();
+    return (hap_char_t *)_hc;
+}
+
+/* Unlink a characteristic from a list, given its head (and tail, if maintained).
+ * Returns true if it was found.
+ */
+static bool hap_notif_list_remove(hap_char_t **head, hap_char_t **tail, __hap_char_t *_hc)
+{
+    __hap_char_t *prev = NULL;
+    hap_char_t *cur = *head;
+    while (cur && cur != (hap_char_t *)_hc) {
+        prev = (__hap_char_t *)cur;
+        cur = prev->next_notif;
+    }
+    if (!cur) {
+        return false;
+    }
+    if (prev) {
+        prev->next_notif = _hc->next_notif;
+    } else {
+        *head = _hc->next_notif;
+    }
+    if (tail && (*tail == (hap_char_t *)_hc)) {
+        *tail = (hap_char_t *)prev;
+    }
+    return true;
+}
+
+/* Drop a characteristic with a pending notification. Used when the characteristic is
+ * deleted. It may either still be pending, or taken by a notification pass and yet to be
+ * popped.
+ */
+static void hap_unqueue_event(__hap_char_t *_hc)
+{
+    hap_platform_os_enter_critical();
+    if (_hc->notif_pending) {
+        if (hap_notif_list_remove(&hap_notif_head, &hap_notif_tail, _hc)) {
+            hap_notif_cnt--;
+        } else {
+            hap_notif_list_remove(&hap_notif_taken, NULL, _hc);
+        }
+        _hc->next_notif = NULL;
+        _hc->notif_pending = false;
+    }
+    hap_platform_os_exit_critical();
+}
+
+/* Queue a characteristic for notification. If "trigger" is false, the caller is responsible
+ * for triggering the notification pass. Returns true if a trigger is required, i.e. there
+ * is no notification pass already triggered and the characteristic has no coalescing window.
+ * With a window, the pass gets triggered by hap_notif_timer at the end of the window.
+ * "isr_ts" is the time of the update, for updates which came from an ISR (via the
+ * ISR update ring). NULL otherwise.
+ */
+static bool hap_queue_event(hap_char_t *hc, bool trigger, const int64_t *isr_ts)
+{
+    __hap_char_t *_hc = (__hap_char_t *)hc;
+    bool need_trigger = false;
+    uint32_t window_ms = hap_char_get_notif_window(_hc);
+    /* Updates from an ISR are sent immediately. The timer cannot be started from an ISR anyways */
+    if (!hap_notif_timer || isr_ts || xPortInIsrContext() == pdTRUE) {
+        window_ms = 0;
+    }
+    int64_t due = window_ms ? esp_timer_get_time() + window_ms * 1000LL : 0;
+    bool arm_timer = false;
+#ifdef CONFIG_HAP_NOTIF_LATENCY_STATS
+    int64_t now = isr_ts ? *isr_ts : hap_notif_latency_now();
+#endif /* CONFIG_HAP_NOTIF_LATENCY_STATS */
+
+    hap_platform_os_enter_critical();
+    hap_notif_stats.updates++;
+    if (!_hc->notif_pending) {
+        _hc->notif_pending = true;
+        _hc->next_notif = NULL;
+        if (hap_notif_tail) {
+            ((__hap_char_t *)hap_notif_tail)->next_notif = hc;
+        } else {
+            hap_notif_head = hc;
+        }
+        hap_notif_tail = hc;
+        hap_notif_cnt++;
+#ifdef CONFIG_HAP_NOTIF_LATENCY_STATS
+        _hc->notif_ts = now;
+#endif /* CONFIG_HAP_NOTIF_LATENCY_STATS */
+    } else {
+        hap_notif_stats.coalesced++;
+    }
+    if (!hap_notif_triggered) {
+        if (!window_ms) {
+            hap_notif_triggered = true;
+            need_trigger = true;
+            hap_notif_stats.immediate++;
+        } else if (!hap_notif_due || due < hap_notif_due) {
+            /* Arm the timer, unless it is already due earlier */
+            hap_notif_due = due;
+            arm_timer = true;
+        }
+    }
+    hap_platform_os_exit_critical();
+
+    if (arm_timer) {
+        esp_timer_stop(hap_notif_timer);
+        if (esp_timer_start_once(hap_notif_timer, window_ms * 1000ULL) != ESP_OK) {
+            hap_notif_timer_cb(NULL);
+        }
+    }
+    if (need_trigger && trigger) {
+        hap_trigger_notif();
+    }
+    return need_trigger;
+}
+
+/* Trigger a notification pass. If the event could not be posted, the next update
+ * will try again.
+ */
+void hap_trigger_notif()
+{
+#ifdef CONFIG_HAP_NOTIF_LATENCY_STATS
+    int64_t now = hap_notif_latency_now();
+    hap_platform_os_enter_critical();
+    hap_notif_trigger_ts = now;
+    hap_platform_os_exit_critical();
+#endif /* CONFIG_HAP_NOTIF_LATENCY_STATS */
+    if (hap_send_event(HAP_INTERNAL_EVENT_TRIGGER_NOTIF) != HAP_SUCCESS) {
+        hap_notif_trigger_failed();
+    }
+}
+
+/* To be called if a triggered notification pass could not be scheduled, so that
+ * the next update triggers it again.
+ */
+void hap_notif_trigger_failed()
+{
+    hap_platform_os_enter_critical();
+    hap_notif_triggered = false;
+    hap_platform_os_exit_critical();
+}
+
+/**
+ * @brief check if characteristics value is at the range
+ */
+int hap_char_check_val_constraints(__hap_char_t *_hc, hap_val_t *val)
+{
+    if (!_hc->constraint_flags)
         return HAP_SUCCESS;
+
+    if (_hc->format == HAP_CHAR_FORMAT_INT) {
+        int value = val->i;
+        int remainder;
+
+        if (value > _hc->max.i
+            || value < _hc->min.i)
+            return HAP_FAIL;
+
+        if (!_hc->step.i)
+            return HAP_SUCCESS;
+
+        remainder = (value - _hc->min.i) % _hc->step.i;
+        if (remainder)
+            return HAP_FAIL;
+    } else if (_hc->format == HAP_CHAR_FORMAT_FLOAT) {
+        float value = val->f;
+
+        if (value > _hc->max.f
+            || value < _hc->min.f)
+            return HAP_FAIL;
+# if 0
+        /* Check for step value for floats has a high chance of failure,
+         * because of precision issues. Hence, better to skip it.
+         */
+        double remainder;
+        if (_hc->step.f == 0.0)
+            return HAP_SUCCESS;
+
+        remainder = esp_mfi_fmod(value - _hc->min.f, _hc->step.f);
+        if (remainder != 0.0)
+            return HAP_FAIL;
+#endif
+    } else if (_hc->format == HAP_CHAR_FORMAT_UINT8
+               || _hc->format == HAP_CHAR_FORMAT_UINT16
+               || _hc->format == HAP_CHAR_FORMAT_UINT32) {
+        uint32_t value = val->u;
+        uint32_t remainder;
+
+
+        if (value > _hc->max.u
+            || value < _hc->min.u)
+            return HAP_FAIL;
+
+        if (!_hc->step.u)
+            return HAP_SUCCESS;
+
+        remainder = (value - _hc->min.u) % _hc->step.u;
+        if (remainder)
+            return HAP_FAIL;
+    } else if (_hc->format == HAP_CHAR_FORMAT_UINT64) {
+        /* TODO: Add support. Currently, there is no particular 64-bit characteristic */
+    }
+
+    return HAP_SUCCESS;
+}
+
+/* Header for the reference counted buffers handed out by hap_data_buf_alloc() */
+typedef struct {
+    uint32_t refcnt;
+    uint32_t size;
+} __attribute__((aligned(8))) hap_data_buf_hdr_t;
+
+#define HAP_DATA_BUF_HDR(buf)   ((hap_data_buf_hdr_t *)(buf) - 1)
+
+uint8_t *hap_data_buf_alloc(size_t size)
+{
+    hap_data_buf_hdr_t *hdr = hap_platform_memory_malloc_tagged(HAP_MEM_TAG_DATABASE,
+            sizeof(hap_data_buf_hdr_t) + size);
+    if (!hdr) {
+        return NULL;
+    }
+    hdr->refcnt = 1;
+    hdr->size = size;
+    return (uint8_t *)(hdr + 1);
+}
+
+void hap_data_buf_ref(uint8_t *buf)
+{
+    if (!buf) {
+        return;
+    }
+    hap_platform_os_enter_critical();
+    HAP_DATA_BUF_HDR(buf)->refcnt++;
+    hap_platform_os_exit_critical();
+}
+
+void hap_data_buf_unref(uint8_t *buf)
+{
+    if (!buf) {
+        return;
+    }
+    hap_data_buf_hdr_t *hdr = HAP_DATA_BUF_HDR(buf);
+    hap_platform_os_enter_critical();
+    uint32_t refcnt = --hdr->refcnt;
+    hap_platform_os_exit_critical();
+    if (refcnt == 0) {
+        hap_platform_memory_free_tagged(hdr);
+    }
+}
+
+/* Writer side of the per characteristic sequence lock.
+ *
+ * Writers are serialised by the critical section and make the sequence number odd
+ * while a value is being modified. Readers (like the httpd task) never block. They retry
+ * if the sequence number was odd or changed while they were copying the value.
+ * Nothing that can allocate or free memory should be done between begin and end.
+ */
+static inline void hap_char_write_begin(__hap_char_t *_hc)
+{
+    hap_platform_os_enter_critical();
+    _hc->seq++;
+    __sync_synchronize();
+}
+
+static inline void hap_char_write_end(__hap_char_t *_hc)
+{
+    __sync_synchronize();
+    _hc->seq++;
+    hap_platform_os_exit_critical();
+}
+
+static inline uint32_t hap_char_read_begin(__hap_char_t *_hc)
+{
+    uint32_t seq;
+    do {
+        seq = _hc->seq;
+    } while (seq & 1);
+    __sync_synchronize();
+    return seq;
+}
+
+static inline bool hap_char_read_retry(__hap_char_t *_hc, uint32_t seq)
+{
+    __sync_synchronize();
+    return _hc->seq != seq;
+}
+
+/* Free a String/Data value buffer, as per how it was owned */
+static void hap_val_buf_free(void *buf, uint8_t own)
+{
+    if (!buf) {
+        return;
+    }
+    switch (own) {
+        case HAP_DATA_OWN_COPY:
+            hap_platform_memory_free_tagged(buf);
+            break;
+        case HAP_DATA_OWN_ADOPT:
+            hap_platform_memory_free(buf);
+            break;
+        case HAP_DATA_OWN_SHARED:
+            hap_data_buf_unref(buf);
+            break;
+        default:
+            break;
+    }
+}
+
+/* Value buffers replaced by a writer while some reader may still be copying from them */
+typedef struct hap_val_retired {
+    struct hap_val_retired *next;
+    void *buf;
+    uint8_t own;
+} hap_val_retired_t;
+
+/* Number of readers which may be accessing a String/Data value buffer outside the critical
+ * section, and the buffers retired meanwhile. The last reader to finish frees those.
+ */
+static uint32_t hap_val_readers;
+static hap_val_retired_t *hap_val_retired;
+
+static void hap_val_read_hold()
+{
+    hap_platform_os_enter_critical();
+    hap_val_readers++;
+    hap_platform_os_exit_critical();
+}
+
+static void hap_val_read_release()
+{
+    hap_val_retired_t *list = NULL;
+    hap_platform_os_enter_critical();
+    if (--hap_val_readers == 0) {
+        list = hap_val_retired;
+        hap_val_retired = NULL;
+    }
+    hap_platform_os_exit_critical();
+    while (list) {
+        hap_val_retired_t *next = list->next;
+        hap_val_buf_free(list->buf, list->own);
+        hap_platform_memory_free_tagged(list);
+        list = next;
+    }
+}
+
+/* Free a value buffer which has been replaced using hap_char_swap_val_buf(). If there are
+ * readers active, the free is deferred till they are done.
+ */
+static void hap_val_buf_retire(void *buf, uint8_t own)
+{
+    if (!buf || own == HAP_DATA_OWN_REF) {
+        return;
+    }
+    hap_val_retired_t *node = hap_platform_memory_malloc_tagged(HAP_MEM_TAG_DATABASE, sizeof(hap_val_retired_t));
+    bool readers;
+    hap_platform_os_enter_critical();
+    readers = hap_val_readers ? true : false;
+    if (readers && node) {
+        node->buf = buf;
+        node->own = own;
+        node->next = hap_val_retired;
+        hap_val_retired = node;
+    }
+    hap_platform_os_exit_critical();
+    if (readers && node) {
+        return;
+    }
+    if (node) {
+        hap_platform_memory_free_tagged(node);
+    }
+    /* Out of memory. Readers never block and copy a bounded amount, so they finish soon */
+    while (readers) {
+        vTaskDelay(1);
+        hap_platform_os_enter_critical();
+        readers = hap_val_readers ? true : false;
+        hap_platform_os_exit_critical();
+    }
+    hap_val_buf_free(buf, own);
+}
+
+/* Replace the buffer holding the String/Data value. Should be called between
+ * hap_char_write_begin() and hap_char_write_end(). The old buffer is returned in
+ * old_buf/old_own and should be released using hap_val_buf_retire() after hap_char_write_end().
+ */
+static void hap_char_swap_val_buf(__hap_char_t *_hc, void *buf, size_t cap, uint8_t own,
+        void **old_buf, uint8_t *old_own)
+{
+    if (_hc->format == HAP_CHAR_FORMAT_STRING) {
+        *old_buf = _hc->val.s;
+        _hc->val.s = buf;
     } else {
+        *old_buf = _hc->val.d.buf;
+        _hc->val.d.buf = buf;
+    }
+    *old_own = _hc->val_own;
+    _hc->val_cap = cap;
+    _hc->val_own = own;
+}
+
+static void hap_char_release_val_buf(__hap_char_t *_hc)
+{
+    void *old_buf;
+    uint8_t old_own;
+    hap_char_write_begin(_hc);
+    hap_char_swap_val_buf(_hc, NULL, 0, HAP_DATA_OWN_REF, &old_buf, &old_own);
+    if (_hc->format != HAP_CHAR_FORMAT_STRING) {
+        _hc->val.d.buflen = 0;
+    }
+    hap_char_write_end(_hc);
+    hap_val_buf_retire(old_buf, old_own);
+}
+
+/* Copy "len" bytes from "src" into a new owned value buffer of "cap" bytes and replace
+ * the current one with it.
+ */
+static int hap_char_realloc_val_buf(__hap_char_t *_hc, size_t cap, const void *src, size_t len)
+{
+    void *old_buf;
+    uint8_t old_own;
+    uint8_t *buf = hap_platform_memory_malloc_tagged(HAP_MEM_TAG_DATABASE, cap);
+    if (!buf) {
+        return HAP_FAIL;
+    }
+    if (len) {
+        memcpy(buf, src, len);
+    }
+    if (_hc->format == HAP_CHAR_FORMAT_STRING) {
+        /* See hap_char_string_equals() */
+        buf[cap - 1] = '\0';
+    }
+    hap_char_write_begin(_hc);
+    hap_char_swap_val_buf(_hc, buf, cap, HAP_DATA_OWN_COPY, &old_buf, &old_own);
+    if (_hc->format != HAP_CHAR_FORMAT_STRING) {
+        _hc->val.d.buflen = len;
+    }
+    hap_char_write_end(_hc);
+    hap_val_buf_retire(old_buf, old_own);
+    return HAP_SUCCESS;
+}
+
+/* Check if the String value is the same as "s", without the critical section, like a reader.
+ * The last byte of every owned String buffer is always 0, since values (including the
+ * termination) never exceed the capacity. So, the comparison stays within the buffer
+ * even if it is being modified.
+ */
+static bool hap_char_string_equals(__hap_char_t *_hc, const char *s)
+{
+    uint32_t seq;
+    bool equal;
+    hap_val_read_hold();
+    do {
+        seq = hap_char_read_begin(_hc);
+        const char *cur = _hc->val.s;
+        equal = (cur && s && !strcmp(cur, s)) ? true : false;
+    } while (hap_char_read_retry(_hc, seq));
+    hap_val_read_release();
+    return equal;
+}
+
+/* A value which fits in the existing buffer is copied into it within the critical section,
+ * whatever its size. Even a TLV8 of a few hundred bytes takes far less time to copy than the
+ * heap calls which a new buffer would need. Readers which overlap the copy just retry.
+ * Only a value larger than the buffer gets a new one, copied outside the critical section.
+ */
+int hap_char_store_string(__hap_char_t *_hc, const char *s)
+{
+    if (!s) {
+        hap_char_release_val_buf(_hc);
+        return HAP_SUCCESS;
+    }
+    size_t len = strlen(s) + 1;
+    hap_char_write_begin(_hc);
+    /* The capacity is checked under the lock, since another writer may replace the buffer */
+    if (_hc->val.s && len <= _hc->val_cap) {
+        if (_hc->val.s != s) {
+            memmove(_hc->val.s, s, len);
+        }
+        hap_char_write_end(_hc);
+        return HAP_SUCCESS;
+    }
+    hap_char_write_end(_hc);
+    /* Round up the size, so that small changes in length do not need a reallocation */
+    return hap_char_realloc_val_buf(_hc, (len + 15) & ~15, s, len);
+}
+
+static int hap_char_store_data(__hap_char_t *_hc, hap_data_val_t *d)
+{
+    void *old_buf = NULL;
+    uint8_t old_own = HAP_DATA_OWN_REF;
+    if (!d->buf) {
+        hap_char_release_val_buf(_hc);
+        return HAP_SUCCESS;
+    }
+    switch (_hc->data_mode) {
+        case HAP_DATA_OWN_COPY:
+            hap_char_write_begin(_hc);
+            if (_hc->val_own == HAP_DATA_OWN_COPY && d->buflen <= _hc->val_cap) {
+                if (_hc->val.d.buf != d->buf) {
+                    memmove(_hc->val.d.buf, d->buf, d->buflen);
+                }
+                _hc->val.d.buflen = d->buflen;
+                hap_char_write_end(_hc);
+                break;
+            }
+            hap_char_write_end(_hc);
+            return hap_char_realloc_val_buf(_hc, d->buflen ? d->buflen : 1, d->buf, d->buflen);
+        case HAP_DATA_OWN_SHARED:
+            if (_hc->val.d.buf != d->buf || _hc->val_own != HAP_DATA_OWN_SHARED) {
+                hap_data_buf_ref(d->buf);
+                hap_char_write_begin(_hc);
+                hap_char_swap_val_buf(_hc, d->buf, 0, HAP_DATA_OWN_SHARED, &old_buf, &old_own);
+            } else {
+                hap_char_write_begin(_hc);
+            }
+            _hc->val.d.buflen = d->buflen;
+            hap_char_write_end(_hc);
+            break;
+        case HAP_DATA_OWN_ADOPT:
+        default:
+            hap_char_write_begin(_hc);
+            if (_hc->val.d.buf != d->buf) {
+                hap_char_swap_val_buf(_hc, d->buf, 0, _hc->data_mode, &old_buf, &old_own);
+            } else {
+                _hc->val_own = _hc->data_mode;
+            }
+            _hc->val.d.buflen = d->buflen;
+            hap_char_write_end(_hc);
+            break;
+    }
+    hap_val_buf_retire(old_buf, old_own);
+    return HAP_SUCCESS;
+}
+
+int hap_char_get_val_snapshot(__hap_char_t *_hc, hap_val_t *val, uint8_t *buf, size_t *buf_size)
+{
+    uint32_t seq;
+    size_t len;
+    int ret;
+    /* The copy is done outside the critical section. Holding a read reference makes sure
+     * that a buffer replaced meanwhile is not freed while it is being copied from.
+     */
+    hap_val_read_hold();
+    do {
+        seq = hap_char_read_begin(_hc);
+        *val = _hc->val;
+        ret = HAP_SUCCESS;
+        if (_hc->format == HAP_CHAR_FORMAT_STRING && val->s) {
+            if (*buf_size == 0) {
+                len = HAP_CHAR_STRING_MAX_LEN + 1;
+                ret = HAP_FAIL;
+                continue;
+            }
+            /* The copy is bounded, since a torn read may not find the NULL termination */
+            len = strnlen(val->s, *buf_size - 1);
+            memcpy(buf, val->s, len);
+            buf[len] = '\0';
+            val->s = (char *)buf;
+        } else if ((_hc->format == HAP_CHAR_FORMAT_DATA || _hc->format == HAP_CHAR_FORMAT_TLV8)
+                && val->d.buf) {
+            if (val->d.buflen > *buf_size) {
+                len = val->d.buflen;
+                ret = HAP_FAIL;
+                continue;
+            }
+            if (val->d.buflen) {
+                memcpy(buf, val->d.buf, val->d.buflen);
+                val->d.buf = buf;
+            }
+        }
+    } while (hap_char_read_retry(_hc, seq));
+    hap_val_read_release();
+    if (ret != HAP_SUCCESS) {
+        *buf_size = len;
+    }
+    return ret;
+}
+
+int hap_char_data_set_ownership(hap_char_t *hc, hap_data_own_t mode)
+{
+    if (!hc || mode > HAP_DATA_OWN_SHARED) {
+        return HAP_FAIL;
+    }
+    __hap_char_t *_hc = (__hap_char_t *)hc;
+    if (_hc->format != HAP_CHAR_FORMAT_DATA && _hc->format != HAP_CHAR_FORMAT_TLV8) {
+        return HAP_FAIL;
+    }
+    _hc->data_mode = mode;
+    return HAP_SUCCESS;
+}
+
+/* Replace the value buffer with an owned one of at least "cap" bytes, keeping the current value.
+ * The value is copied outside the critical section, like a reader would, and the buffers are
+ * swapped only if no writer changed the value meanwhile. Else, the copy is done again.
+ */
+static int hap_char_grow_val_buf(__hap_char_t *_hc, size_t cap)
+{
+    void *old_buf = NULL;
+    uint8_t old_own = HAP_DATA_OWN_REF;
+    uint8_t *buf = hap_platform_memory_malloc_tagged(HAP_MEM_TAG_DATABASE, cap);
+    if (!buf) {
+        return HAP_FAIL;
+    }
+    hap_val_read_hold();
+    while (1) {
+        uint32_t seq = hap_char_read_begin(_hc);
+        size_t len;
+        if (_hc->format == HAP_CHAR_FORMAT_STRING) {
+            const char *s = _hc->val.s;
+            len = s ? strnlen(s, cap - 1) : 0;
+            if (len) {
+                memcpy(buf, s, len);
+            }
+            buf[len] = '\0';
+            buf[cap - 1] = '\0';
+        } else {
+            len = _hc->val.d.buf ? _hc->val.d.buflen : 0;
+            if (len > cap) {
+                /* Grown meanwhile */
+                hap_platform_memory_free_tagged(buf);
+                cap = len;
+                buf = hap_platform_memory_malloc_tagged(HAP_MEM_TAG_DATABASE, cap);
+                if (!buf) {
+                    hap_val_read_release();
+                    return HAP_FAIL;
+                }
+                continue;
+            }
+            if (len) {
+                memcpy(buf, _hc->val.d.buf, len);
+            }
+        }
+        hap_char_write_begin(_hc);
+        /* The write has made the sequence number odd. It was "seq" just before that, if there
+         * was no other write since the copy.
+         */
+        if (_hc->seq == seq + 1) {
+            hap_char_swap_val_buf(_hc, buf, cap, HAP_DATA_OWN_COPY, &old_buf, &old_own);
+            if (_hc->format != HAP_CHAR_FORMAT_STRING) {
+                _hc->val.d.buflen = len;
+            }
+            hap_char_write_end(_hc);
+            break;
+        }
+        hap_char_write_end(_hc);
+    }
+    hap_val_read_release();
+    hap_val_buf_retire(old_buf, old_own);
+    return HAP_SUCCESS;
+}
+
+int hap_char_reserve_val(hap_char_t *hc, size_t size)
+{
+    if (!hc) {
         return HAP_FAIL;
     }
+    __hap_char_t *_hc = (__hap_char_t *)hc;
+    if (_hc->format == HAP_CHAR_FORMAT_STRING) {
+        if (size > HAP_CHAR_STRING_MAX_LEN) {
+            return HAP_FAIL;
+        }
+        if (size + 1 <= _hc->val_cap) {
+            return HAP_SUCCESS;
+        }
+        return hap_char_grow_val_buf(_hc, size + 1);
+    } else if ((_hc->format == HAP_CHAR_FORMAT_DATA || _hc->format == HAP_CHAR_FORMAT_TLV8)
+            && _hc->data_mode == HAP_DATA_OWN_COPY) {
+        if (_hc->val_own == HAP_DATA_OWN_COPY && size <= _hc->val_cap) {
+            return HAP_SUCCESS;
+        }
+        return hap_char_grow_val_buf(_hc, size ? size : 1);
+    }
+    return HAP_FAIL;
 }
 
-hap_char_t * hap_get_pending_notif_char()
+#define HAP_CHAR_KEYSTORE           "hap_chars"
+#define HAP_KEY_CHAR_VALS           "char_vals"
+#define HAP_CHAR_VALS_VERSION       1
+/* Longer String/Data/TLV8 values are not persisted */
+#define HAP_CHAR_PERSIST_MAX_LEN    HAP_CHAR_STRING_MAX_LEN
+
+/* Values of the characteristics marked using hap_char_set_persist() are saved as a single blob:
+ *
+ * | version (1) | count (2) | { aid (4) | iid (4) | format (1) | length (2) | value } x count | CRC32 |
+ *
+ * The CRC32 covers everything before it. Updates only set hap_char_persist_dirty and
+ * let the HAP main loop know, which flushes the blob once per HAP_CHAR_PERSIST_INTERVAL_MS at most.
+ */
+static volatile bool hap_char_persist_dirty;
+
+int hap_char_set_persist(hap_char_t *hc, bool persist)
 {
+    if (!hc) {
+        return HAP_FAIL;
+    }
+    __hap_char_t *_hc = (__hap_char_t *)hc;
+    /* Stateless characteristics (like Programmable Switch Event) have nothing to restore */
+    if (persist && (_hc->permission & HAP_CHAR_PERM_SPECIAL_READ)) {
+        return HAP_FAIL;
+    }
+    _hc->persist = persist;
+    return HAP_SUCCESS;
+}
+
+static void hap_char_persist_mark_dirty()
+{
+    if (!hap_char_persist_dirty) {
+        hap_char_persist_dirty = true;
+        /* If the loop is not running yet, the flag is picked up once it starts */
+        hap_send_event(HAP_INTERNAL_EVENT_CHAR_PERSIST);
+    }
+}
+
+bool hap_char_persist_pending()
+{
+    return hap_char_persist_dirty;
+}
+
+/* Length of the value as saved in the blob. 0 for unsupported formats */
+static size_t hap_char_persist_val_len(uint8_t format)
+{
+    switch (format) {
+        case HAP_CHAR_FORMAT_BOOL:
+            return 1;
+        case HAP_CHAR_FORMAT_UINT8:
+        case HAP_CHAR_FORMAT_UINT16:
+        case HAP_CHAR_FORMAT_UINT32:
+        case HAP_CHAR_FORMAT_INT:
+        case HAP_CHAR_FORMAT_FLOAT:
+            return sizeof(uint32_t);
+        case HAP_CHAR_FORMAT_UINT64:
+            return sizeof(uint64_t);
+        case HAP_CHAR_FORMAT_STRING:
+        case HAP_CHAR_FORMAT_DATA:
+        case HAP_CHAR_FORMAT_TLV8:
+            return HAP_CHAR_PERSIST_MAX_LEN;
+        default:
+            return 0;
+    }
+}
+
+/* Append the record for a characteristic at "p". Returns the number of bytes added,
+ * 0 if the value cannot be persisted.
+ */
+static size_t hap_char_persist_add(uint8_t *p, uint32_t aid, __hap_char_t *_hc)
+{
+    uint8_t tmp[HAP_CHAR_PERSIST_MAX_LEN + 1];
+    size_t tmp_len = sizeof(tmp);
+    hap_val_t val;
+    if (hap_char_get_val_snapshot(_hc, &val, tmp, &tmp_len) != HAP_SUCCESS) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Value of aid %u iid %u too long to persist",
+                (unsigned)aid, (unsigned)_hc->iid);
+        return 0;
+    }
+    const void *src;
+    size_t len = hap_char_persist_val_len(_hc->format);
+    switch (_hc->format) {
+        case HAP_CHAR_FORMAT_BOOL:
+            src = &val.b;
+            break;
+        case HAP_CHAR_FORMAT_UINT64:
+            src = &val.i64;
+            break;
+        case HAP_CHAR_FORMAT_STRING:
+            src = val.s;
+            len = val.s ? strlen(val.s) : 0;
+            break;
+        case HAP_CHAR_FORMAT_DATA:
+        case HAP_CHAR_FORMAT_TLV8:
+            src = val.d.buf;
+            len = val.d.buf ? val.d.buflen : 0;
+            break;
+        default:
+            src = &val.u;
+            break;
+    }
+    if (len > HAP_CHAR_PERSIST_MAX_LEN) {
+        return 0;
+    }
+    uint8_t *start = p;
+    uint32_t iid = _hc->iid;
+    uint16_t len16 = len;
+    memcpy(p, &aid, sizeof(aid));
+    p += sizeof(aid);
+    memcpy(p, &iid, sizeof(iid));
+    p += sizeof(iid);
+    *p++ = _hc->format;
+    memcpy(p, &len16, sizeof(len16));
+    p += sizeof(len16);
+    if (len) {
+        memcpy(p, src, len);
+        p += len;
+    }
+    return p - start;
+}
+
+#define HAP_CHAR_PERSIST_REC_HDR_LEN    (sizeof(uint32_t) + sizeof(uint32_t) + 1 + sizeof(uint16_t))
+
+int hap_char_persist_flush(void)
+{
+    if (!hap_char_persist_dirty) {
+        return HAP_SUCCESS;
+    }
+    /* Cleared before taking the values, so that any update in between triggers another flush */
+    hap_char_persist_dirty = false;
+    hap_acc_t *ha;
+    hap_serv_t *hs;
     hap_char_t *hc;
-    if (xQueueReceive(hap_event_queue, &hc, 0) != pdTRUE) {
-        return NULL;
+    size_t len = 1 + sizeof(uint16_t) + sizeof(uint32_t);
+    /* Bridged accessories may be removed and deleted by the application meanwhile */
+    hap_db_lock();
+    for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
+        for (hs = hap_acc_get_first_serv(ha); hs; hs = hap_serv_get_next(hs)) {
+            for (hc = hap_serv_get_first_char(hs); hc; hc = hap_char_get_next(hc)) {
+                __hap_char_t *_hc = (__hap_char_t *)hc;
+                if (_hc->persist) {
+                    len += HAP_CHAR_PERSIST_REC_HDR_LEN + hap_char_persist_val_len(_hc->format);
+                }
+            }
+        }
+    }
+    uint8_t *buf = hap_platform_memory_malloc(len);
+    if (!buf) {
+        hap_db_unlock();
+        hap_char_persist_dirty = true;
+        return HAP_FAIL;
+    }
+    uint8_t *p = buf + 1 + sizeof(uint16_t);
+    /* Where the CRC goes. Guards against characteristics marked after the length was taken */
+    uint8_t *end = buf + len - sizeof(uint32_t);
+    uint16_t count = 0;
+    for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
+        uint32_t aid = hap_acc_get_aid(ha);
+        for (hs = hap_acc_get_first_serv(ha); hs; hs = hap_serv_get_next(hs)) {
+            for (hc = hap_serv_get_first_char(hs); hc; hc = hap_char_get_next(hc)) {
+                __hap_char_t *_hc = (__hap_char_t *)hc;
+                if (!_hc->persist || (p + HAP_CHAR_PERSIST_REC_HDR_LEN +
+                            hap_char_persist_val_len(_hc->format) > end)) {
+                    continue;
+                }
+                size_t rec_len = hap_char_persist_add(p, aid, _hc);
+                if (rec_len) {
+                    p += rec_len;
+                    count++;
+                }
+            }
+        }
     }
-    return hc;
+    hap_db_unlock();
+    buf[0] = HAP_CHAR_VALS_VERSION;
+    memcpy(buf + 1, &count, sizeof(count));
+    uint32_t crc = hap_crc32(0, buf, p - buf);
+    memcpy(p, &crc, sizeof(crc));
+    p += sizeof(crc);
+    int ret = hap_keystore_set(HAP_CHAR_KEYSTORE, HAP_KEY_CHAR_VALS, buf, p - buf);
+    hap_platform_memory_free(buf);
+    if (ret != HAP_SUCCESS) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to save characteristic values");
+        hap_char_persist_dirty = true;
+        return HAP_FAIL;
+    }
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Saved %u characteristic values", count);
+    return HAP_SUCCESS;
 }
 
-static int hap_queue_event(hap_char_t *hc)
+/* Apply a saved value, without marking the characteristic for notification or persistence */
+static int hap_char_persist_apply(__hap_char_t *_hc, const uint8_t *src, size_t len)
 {
-    int ret;
-    if (!hap_event_queue) {
+    char str[HAP_CHAR_PERSIST_MAX_LEN + 1];
+    hap_val_t val = {0};
+    if (_hc->format == HAP_CHAR_FORMAT_STRING) {
+        memcpy(str, src, len);
+        str[len] = '\0';
+        val.s = str;
+    } else if (_hc->format == HAP_CHAR_FORMAT_DATA || _hc->format == HAP_CHAR_FORMAT_TLV8) {
+        val.d.buf = (uint8_t *)src;
+        val.d.buflen = len;
+    } else if (len == hap_char_persist_val_len(_hc->format)) {
+        if (_hc->format == HAP_CHAR_FORMAT_BOOL) {
+            val.b = src[0] ? true : false;
+        } else {
+            memcpy(&val, src, len);
+        }
+    } else {
         return HAP_FAIL;
     }
-    if (xPortInIsrContext() == pdTRUE) {
-        ret = xQueueSendFromISR(hap_event_queue, &hc, NULL);
-    } else {
-        ret = xQueueSend(hap_event_queue, &hc, 0);
+    if (hap_char_check_val_constraints(_hc, &val) != HAP_SUCCESS) {
+        return HAP_FAIL;
     }
-    if (ret == pdTRUE) {
-        hap_send_event(HAP_INTERNAL_EVENT_TRIGGER_NOTIF);
-        return HAP_SUCCESS;
+    switch (_hc->format) {
+        case HAP_CHAR_FORMAT_STRING:
+            return hap_char_store_string(_hc, str);
+        case HAP_CHAR_FORMAT_DATA:
+        case HAP_CHAR_FORMAT_TLV8:
+            /* Always copied, since the source buffer is temporary */
+            return hap_char_realloc_val_buf(_hc, len ? len : 1, src, len);
+        default:
+            hap_char_write_begin(_hc);
+            _hc->val = val;
+            hap_char_write_end(_hc);
+            return HAP_SUCCESS;
     }
-    return HAP_FAIL;
 }
 
-
-/**
- * @brief check if characteristics value is at the range
- */
-int hap_char_check_val_constraints(__hap_char_t *_hc, hap_val_t *val)
+void hap_char_persist_restore()
 {
-    if (!_hc->constraint_flags)
-        return HAP_SUCCESS;
-
-    if (_hc->format == HAP_CHAR_FORMAT_INT) {
-        int value = val->i;
-        int remainder;
-
-        if (value > _hc->max.i
-            || value < _hc->min.i)
-            return HAP_FAIL;
-
-        if (!_hc->step.i)
-            return HAP_SUCCESS;
-
-        remainder = (value - _hc->min.i) % _hc->step.i;
-        if (remainder)
-            return HAP_FAIL;
-    } else if (_hc->format == HAP_CHAR_FORMAT_FLOAT) {
-        float value = val->f;
-
-        if (value > _hc->max.f
-            || value < _hc->min.f)
-            return HAP_FAIL;
-# if 0
-        /* Check for step value for floats has a high chance of failure,
-         * because of precision issues. Hence, better to skip it.
-         */
-        double remainder;
-        if (_hc->step.f == 0.0)
-            return HAP_SUCCESS;
-
-        remainder = esp_mfi_fmod(value - _hc->min.f, _hc->step.f);
-        if (remainder != 0.0)
-            return HAP_FAIL;
-#endif
-    } else if (_hc->format == HAP_CHAR_FORMAT_UINT8
-               || _hc->format == HAP_CHAR_FORMAT_UINT16
-               || _hc->format == HAP_CHAR_FORMAT_UINT32) {
-        uint32_t value = val->u;
-        uint32_t remainder;
-
-
-        if (value > _hc->max.u
-            || value < _hc->min.u)
-            return HAP_FAIL;
-
-        if (!_hc->step.u)
-            return HAP_SUCCESS;
-
-        remainder = (value - _hc->min.u) % _hc->step.u;
-        if (remainder)
-            return HAP_FAIL;
-    } else if (_hc->format == HAP_CHAR_FORMAT_UINT64) {
-        /* TODO: Add support. Currently, there is no particular 64-bit characteristic */
+    hap_char_persist_dirty = false;
+    size_t len = 0;
+    uint8_t *buf = NULL;
+    int restored = 0;
+    if ((hap_keystore_get(HAP_CHAR_KEYSTORE, HAP_KEY_CHAR_VALS, NULL, &len) != HAP_SUCCESS) || !len) {
+        goto restore_end;
+    }
+    buf = hap_platform_memory_malloc(len);
+    if (!buf) {
+        goto restore_end;
+    }
+    if (hap_keystore_get(HAP_CHAR_KEYSTORE, HAP_KEY_CHAR_VALS, buf, &len) != HAP_SUCCESS) {
+        goto restore_end;
+    }
+    uint32_t crc;
+    if ((len < 1 + sizeof(uint16_t) + sizeof(crc)) || (buf[0] != HAP_CHAR_VALS_VERSION)) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Unsupported characteristic values format");
+        goto restore_end;
+    }
+    memcpy(&crc, buf + len - sizeof(crc), sizeof(crc));
+    if (crc != hap_crc32(0, buf, len - sizeof(crc))) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Saved characteristic values corrupted");
+        goto restore_end;
+    }
+    uint16_t count;
+    memcpy(&count, buf + 1, sizeof(count));
+    const uint8_t *p = buf + 1 + sizeof(count);
+    const uint8_t *end = buf + len - sizeof(crc);
+    hap_db_lock();
+    while (count--) {
+        uint32_t aid, iid;
+        uint16_t val_len;
+        if (p + HAP_CHAR_PERSIST_REC_HDR_LEN > end) {
+            break;
+        }
+        memcpy(&aid, p, sizeof(aid));
+        p += sizeof(aid);
+        memcpy(&iid, p, sizeof(iid));
+        p += sizeof(iid);
+        uint8_t format = *p++;
+        memcpy(&val_len, p, sizeof(val_len));
+        p += sizeof(val_len);
+        if ((p + val_len > end) || (val_len > HAP_CHAR_PERSIST_MAX_LEN)) {
+            break;
+        }
+        hap_acc_t *ha = hap_acc_get_by_aid(aid);
+        __hap_char_t *_hc = ha ? (__hap_char_t *)hap_acc_get_char_by_iid(ha, iid) : NULL;
+        /* Skip the values of characteristics which are gone or have changed */
+        if (_hc && _hc->persist && (_hc->format == format)
+                && (hap_char_persist_apply(_hc, p, val_len) == HAP_SUCCESS)) {
+            restored++;
+        }
+        p += val_len;
+    }
+    hap_db_unlock();
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Restored %d characteristic values", restored);
+restore_end:
+    if (buf) {
+        hap_platform_memory_free(buf);
+    }
+    /* Save the blob again if some values are missing from it (Eg. on the first boot) */
+    int persisted = 0;
+    hap_acc_t *ha;
+    hap_serv_t *hs;
+    hap_char_t *hc;
+    hap_db_lock();
+    for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
+        for (hs = hap_acc_get_first_serv(ha); hs; hs = hap_serv_get_next(hs)) {
+            for (hc = hap_serv_get_first_char(hs); hc; hc = hap_char_get_next(hc)) {
+                if (((__hap_char_t *)hc)->persist) {
+                    persisted++;
+                }
+            }
+        }
+    }
+    hap_db_unlock();
+    if (persisted != restored) {
+        hap_char_persist_dirty = true;
     }
-
-    return HAP_SUCCESS;
 }
 
-/**
- * @brief user update characteristics value, preparing for notification
+/* Update the value and queue a notification if required.
+ * Returns true in "queued" if the characteristic was queued for notification.
+ * "isr_ts" is as per hap_queue_event().
  */
-int hap_char_update_val(hap_char_t *hc, hap_val_t *val)
+static int __hap_char_update_val(hap_char_t *hc, hap_val_t *val, bool trigger, bool *queued,
+        const int64_t *isr_ts)
 {
-    if (!hc || !val) {
-        return HAP_FAIL;
-    }
     __hap_char_t *_hc = (__hap_char_t *)hc;
     _hc->update_called = true;
     if (hap_char_check_val_constraints(_hc, val) != HAP_SUCCESS)
@@ -192,7 +1279,9 @@ int hap_char_update_val(hap_char_t *hc, hap_val_t *val)
 	switch (_hc->format) {
 		case HAP_CHAR_FORMAT_BOOL:
 			if (_hc->val.b != val->b) {
+				hap_char_write_begin(_hc);
 				_hc->val.b = val->b;
+				hap_char_write_end(_hc);
 				value_changed = true;
 			}
 			break;
@@ -201,13 +1290,17 @@ int hap_char_update_val(hap_char_t *hc, hap_val_t *val)
 		case HAP_CHAR_FORMAT_UINT16:
 		case HAP_CHAR_FORMAT_UINT32:
 			if (_hc->val.i != val->i) {
+				hap_char_write_begin(_hc);
 				_hc->val.i = val->i;
+				hap_char_write_end(_hc);
 				value_changed = true;
 			}
 			break;
 		case HAP_CHAR_FORMAT_FLOAT:
 			if (_hc->val.f != val->f) {
+				hap_char_write_begin(_hc);
 				_hc->val.f = val->f;
+				hap_char_write_end(_hc);
 				value_changed = true;
 			}
 			break;
@@ -220,46 +1313,238 @@ int hap_char_update_val(hap_char_t *hc, hap_val_t *val)
 			 * Old value NULL, New non-NULL
 			 * Old value non-NULL, new NULL
 			 */
-			if (_hc->val.s && val->s && !strcmp(_hc->val.s, val->s))
+			if (hap_char_string_equals(_hc, val->s))
 				value_changed = false;
 			else
 				value_changed = true;
 
-			if (_hc->val.s) {
-				hap_platform_memory_free(_hc->val.s);
-                _hc->val.s = NULL;
-            }
-
-			if (val->s) {
-				_hc->val.s = strdup(val->s);
-				if (!_hc->val.s)
-					return HAP_FAIL;
-			}
+			/* The value is copied into the buffer owned by the characteristic,
+			 * which gets reallocated only if the new value does not fit.
+			 */
+			if (value_changed && hap_char_store_string(_hc, val->s) != HAP_SUCCESS)
+				return HAP_FAIL;
 			break;
         case HAP_CHAR_FORMAT_DATA:
         case HAP_CHAR_FORMAT_TLV8: {
-            _hc->val.d.buf = val->d.buf;
-            _hc->val.d.buflen = val->d.buflen;
+            if (hap_char_store_data(_hc, &val->d) != HAP_SUCCESS) {
+                return HAP_FAIL;
+            }
             value_changed = true;
             }
             break;
 		default:
 			break;
 	}
+	if (value_changed && _hc->persist) {
+        hap_char_persist_mark_dirty();
+    }
 	if (value_changed || (_hc->permission & HAP_CHAR_PERM_SPECIAL_READ)) {
 		ESP_MFI_DEBUG_INTR(ESP_MFI_DEBUG_INFO, "Value Changed");
-        hap_queue_event(hc);
+        if (hap_queue_event(hc, trigger, isr_ts) && queued) {
+            *queued = true;
+        }
 	} else {
         /* If there is no value change, reset the owner flag here itself, as no notification
          * is being sent anyways. In the absence of this, if there is a GET /characteristics
          * followed by some value change from hardware, the owner_ctrl stays assigned to a
          * stale value, and so the controller misses a notification.
          */
-        _hc->owner_ctrl = 0;
+        hap_char_reset_owner_ctrl(hc);
     }
 	return HAP_SUCCESS;
 }
 
+/**
+ * @brief user update characteristics value, preparing for notification
+ */
+int hap_char_update_val(hap_char_t *hc, hap_val_t *val)
+{
+    if (!hc || !val) {
+        return HAP_FAIL;
+    }
+    if (xPortInIsrContext() == pdTRUE) {
+        return hap_char_update_val_from_isr(hc, val);
+    }
+    return __hap_char_update_val(hc, val, true, NULL, NULL);
+}
+
+/* Ring buffer for updates from ISRs. The ISRs only push into it, and everything else
+ * (constraint checks, value copy, notification) happens when it is drained from task context,
+ * before every notification pass. Producers are serialised by the hap_platform_os critical
+ * section, held just for the slot copy. The consumer (the notification pass) does not take
+ * any lock. It owns hap_isr_ring_tail, while the producers own hap_isr_ring_head.
+ */
+#ifdef CONFIG_HAP_ISR_UPDATE_RING_SIZE
+#define HAP_ISR_RING_SIZE   CONFIG_HAP_ISR_UPDATE_RING_SIZE
+#else /* CONFIG_HAP_ISR_UPDATE_RING_SIZE */
+#define HAP_ISR_RING_SIZE   16
+#endif /* CONFIG_HAP_ISR_UPDATE_RING_SIZE */
+
+typedef struct {
+    hap_char_t *hc;
+    hap_val_t val;
+    int64_t ts;
+} hap_isr_update_t;
+
+static hap_isr_update_t hap_isr_ring[HAP_ISR_RING_SIZE];
+static volatile uint32_t hap_isr_ring_head;
+static volatile uint32_t hap_isr_ring_tail;
+static hap_isr_update_stats_t hap_isr_stats;
+
+int hap_char_update_val_from_isr(hap_char_t *hc, const hap_val_t *val)
+{
+    int64_t start = esp_timer_get_time();
+    __hap_char_t *_hc = (__hap_char_t *)hc;
+    if (!hc || !val) {
+        return HAP_FAIL;
+    }
+    switch (_hc->format) {
+        case HAP_CHAR_FORMAT_BOOL:
+        case HAP_CHAR_FORMAT_INT:
+        case HAP_CHAR_FORMAT_UINT8:
+        case HAP_CHAR_FORMAT_UINT16:
+        case HAP_CHAR_FORMAT_UINT32:
+        case HAP_CHAR_FORMAT_FLOAT:
+            break;
+        default:
+            return HAP_FAIL;
+    }
+    int ret = HAP_SUCCESS;
+    hap_platform_os_enter_critical();
+    uint32_t head = hap_isr_ring_head;
+    uint32_t next = (head + 1) % HAP_ISR_RING_SIZE;
+    if (next == hap_isr_ring_tail) {
+        hap_isr_stats.dropped++;
+        ret = HAP_FAIL;
+    } else {
+        hap_isr_ring[head].hc = hc;
+        hap_isr_ring[head].val = *val;
+        hap_isr_ring[head].ts = start;
+        /* Make the slot visible before publishing it */
+        __sync_synchronize();
+        hap_isr_ring_head = next;
+        hap_isr_stats.pushed++;
+        uint32_t used = (next + HAP_ISR_RING_SIZE - hap_isr_ring_tail) % HAP_ISR_RING_SIZE;
+        if (used > hap_isr_stats.high_water) {
+            hap_isr_stats.high_water = used;
+        }
+    }
+    hap_platform_os_exit_critical();
+    if (ret == HAP_SUCCESS) {
+        /* Wake up the notification task directly, rather than going through the main loop */
+        if (hap_http_send_notif_from_isr() != HAP_SUCCESS) {
+            hap_trigger_notif();
+        }
+    }
+    uint32_t isr_us = (uint32_t)(esp_timer_get_time() - start);
+    hap_platform_os_enter_critical();
+    if (isr_us > hap_isr_stats.max_isr_us) {
+        hap_isr_stats.max_isr_us = isr_us;
+    }
+    hap_platform_os_exit_critical();
+    return ret;
+}
+
+/* Apply the updates pushed by ISRs. Called from task context, before a notification pass.
+ * hap_notif_pass_lock() is held throughout, so that a characteristic whose update has been
+ * taken out of the ring cannot get deleted before the update is applied.
+ */
+void hap_char_drain_isr_updates()
+{
+    hap_notif_pass_lock();
+    uint32_t tail = hap_isr_ring_tail;
+    uint32_t head = hap_isr_ring_head;
+    __sync_synchronize();
+    while (tail != head) {
+        hap_isr_update_t update = hap_isr_ring[tail];
+        __sync_synchronize();
+        tail = (tail + 1) % HAP_ISR_RING_SIZE;
+        /* Release the slot before applying, so that the ISR can reuse it */
+        hap_isr_ring_tail = tail;
+        /* The characteristic is set to NULL if it got deleted while in the ring */
+        if (update.hc) {
+            __hap_char_update_val(update.hc, &update.val, false, NULL, &update.ts);
+            hap_platform_os_enter_critical();
+            hap_isr_stats.applied++;
+            hap_platform_os_exit_critical();
+        }
+        if (tail == head) {
+            head = hap_isr_ring_head;
+            __sync_synchronize();
+        }
+    }
+    hap_notif_pass_unlock();
+}
+
+/* Drop the updates of a characteristic from the ISR ring. Used when the characteristic is
+ * deleted, with hap_notif_pass_lock() held so that no drain is in progress.
+ */
+static void hap_char_purge_isr_updates(hap_char_t *hc)
+{
+    hap_platform_os_enter_critical();
+    uint32_t i;
+    for (i = hap_isr_ring_tail; i != hap_isr_ring_head; i = (i + 1) % HAP_ISR_RING_SIZE) {
+        if (hap_isr_ring[i].hc == hc) {
+            hap_isr_ring[i].hc = NULL;
+        }
+    }
+    hap_platform_os_exit_critical();
+}
+
+int hap_get_isr_update_stats(hap_isr_update_stats_t *stats)
+{
+    if (!stats) {
+        return HAP_FAIL;
+    }
+    hap_platform_os_enter_critical();
+    *stats = hap_isr_stats;
+    hap_platform_os_exit_critical();
+    return HAP_SUCCESS;
+}
+
+int hap_char_update_vals(hap_char_update_t *updates, int count)
+{
+    int i;
+    if (!updates || count <= 0) {
+        return HAP_FAIL;
+    }
+    /* Validate everything first, so that either all values get applied, or none */
+    for (i = 0; i < count; i++) {
+        __hap_char_t *_hc = (__hap_char_t *)updates[i].hc;
+        if (!_hc || hap_char_check_val_constraints(_hc, &updates[i].val) != HAP_SUCCESS) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Invalid value at index %d of batch update", i);
+            return HAP_FAIL;
+        }
+        /* Make sure that applying the value will not need an allocation */
+        if (_hc->format == HAP_CHAR_FORMAT_STRING && updates[i].val.s) {
+            if (hap_char_reserve_val(updates[i].hc, strlen(updates[i].val.s)) != HAP_SUCCESS) {
+                return HAP_FAIL;
+            }
+        } else if ((_hc->format == HAP_CHAR_FORMAT_DATA || _hc->format == HAP_CHAR_FORMAT_TLV8)
+                && _hc->data_mode == HAP_DATA_OWN_COPY && updates[i].val.d.buf) {
+            if (hap_char_reserve_val(updates[i].hc, updates[i].val.d.buflen) != HAP_SUCCESS) {
+                return HAP_FAIL;
+            }
+        }
+    }
+    /* Values which fit are copied into the buffers reserved above, so this cannot fail,
+     * unless another task released one of those buffers meanwhile
+     */
+    bool queued = false;
+    int ret = HAP_SUCCESS;
+    for (i = 0; i < count; i++) {
+        if (__hap_char_update_val(updates[i].hc, &updates[i].val, false, &queued, NULL) != HAP_SUCCESS) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to apply the value at index %d of batch update", i);
+            ret = HAP_FAIL;
+        }
+    }
+    /* Single notification pass for the complete batch */
+    if (queued) {
+        hap_trigger_notif();
+    }
+    return ret;
+}
+
 const hap_val_t *hap_char_get_val(hap_char_t *hc)
 {
     if (!hc)
@@ -320,7 +1605,7 @@ static hap_char_t *hap_char_create(char *type_uuid, uint32_t permission, hap_cha
             return NULL;
     }
 
-    new_ch = hap_platform_memory_calloc(1, sizeof(__hap_char_t));
+    new_ch = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_DATABASE, 1, sizeof(__hap_char_t));
     if (!new_ch) {
         return NULL;
     }
@@ -333,6 +1618,49 @@ static hap_char_t *hap_char_create(char *type_uuid, uint32_t permission, hap_cha
     return (hap_char_t *) new_ch;
 }
 
+_Static_assert(sizeof(__hap_char_t) <= sizeof(hap_char_static_t), "HAP_CHAR_STATIC_SIZE too small");
+_Static_assert(HAP_CHAR_DESC_MIN == HAP_CHAR_MIN_FLAG && HAP_CHAR_DESC_MAX == HAP_CHAR_MAX_FLAG
+        && HAP_CHAR_DESC_STEP == HAP_CHAR_STEP_FLAG && HAP_CHAR_DESC_MAXLEN == HAP_CHAR_MAXLEN_FLAG
+        && HAP_CHAR_DESC_MAXDATALEN == HAP_CHAR_MAXDATALEN_FLAG, "Constraint flags mismatch");
+
+/* Set up a characteristic from its static description, in the given storage.
+ * Nothing is allocated. The description, including the initial value, valid values, etc.
+ * is referred to in place.
+ */
+hap_char_t *hap_char_init_static(hap_char_static_t *storage, const hap_char_desc_t *desc)
+{
+    if (!desc->type_uuid || !desc->iid) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Invalid static characteristic description");
+        return NULL;
+    }
+    if (desc->format == HAP_CHAR_FORMAT_STRING && desc->val.s
+            && strlen(desc->val.s) > HAP_CHAR_STRING_MAX_LEN) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "String too long for characteristic %s", desc->type_uuid);
+        return NULL;
+    }
+    __hap_char_t *_hc = (__hap_char_t *)storage;
+    memset(_hc, 0, sizeof(__hap_char_t));
+    _hc->iid = desc->iid;
+    _hc->type_uuid = desc->type_uuid;
+    _hc->permission = desc->perms;
+    _hc->format = desc->format;
+    /* A String/Data value remains a reference to the description (val_cap = 0)
+     * and so, it will get copied to an owned buffer on the first update.
+     */
+    _hc->val = desc->val;
+    _hc->constraint_flags = desc->constraints;
+    _hc->min = desc->min;
+    _hc->max = desc->max;
+    _hc->step = desc->step;
+    _hc->description = (char *)desc->description;
+    _hc->unit = (char *)desc->unit;
+    _hc->valid_vals = (uint8_t *)desc->valid_vals;
+    _hc->valid_vals_cnt = desc->valid_vals ? desc->valid_vals_cnt : 0;
+    _hc->valid_vals_range = (uint8_t *)desc->valid_vals_range;
+    _hc->static_alloc = true;
+    return (hap_char_t *)_hc;
+}
+
 hap_char_t *hap_char_bool_create(char *type_uuid, uint16_t perms, bool b)
 {
     hap_val_t val = {.b = b};
@@ -370,12 +1698,15 @@ hap_char_t *hap_char_float_create(char *type_uuid, uint16_t perms, float f)
 }
 hap_char_t *hap_char_string_create(char *type_uuid, uint16_t perms, char *s)
 {
-    hap_val_t val;
-    if (s)
-        val.s = strdup(s);
-    else
-        val.s = NULL;
-    return hap_char_create(type_uuid, perms, HAP_CHAR_FORMAT_STRING, val);
+    hap_val_t val = {0};
+    if (s && strlen(s) > HAP_CHAR_STRING_MAX_LEN)
+        return NULL;
+    hap_char_t *hc = hap_char_create(type_uuid, perms, HAP_CHAR_FORMAT_STRING, val);
+    if (hc && hap_char_store_string((__hap_char_t *)hc, s) != HAP_SUCCESS) {
+        hap_char_delete(hc);
+        return NULL;
+    }
+    return hc;
 }
 
 hap_char_t *hap_char_data_create(char *type_uuid, uint16_t perms, hap_data_val_t *d)
@@ -439,22 +1770,31 @@ hap_char_format_t hap_char_get_format(hap_char_t *hc)
 /**
  * @brief HAP delete target characteristics
  */
+static void hap_char_remove_all_subs(__hap_char_t *_hc);
 void hap_char_delete(hap_char_t *hc)
 {
     ESP_MFI_ASSERT(hc);
     __hap_char_t *_hc = (__hap_char_t *)hc;
-    if (_hc->format == HAP_CHAR_FORMAT_STRING) {
-        if (_hc->val.s) {
-            hap_platform_memory_free(_hc->val.s);
-        }
+    /* Wait for any notification pass which may be accessing the characteristic */
+    hap_notif_pass_lock();
+    hap_unqueue_event(_hc);
+    hap_char_purge_isr_updates(hc);
+    hap_char_remove_all_subs(_hc);
+    if (_hc->format == HAP_CHAR_FORMAT_STRING || _hc->format == HAP_CHAR_FORMAT_DATA
+            || _hc->format == HAP_CHAR_FORMAT_TLV8) {
+        hap_char_release_val_buf(_hc);
     }
-    if (_hc->valid_vals) {
-        hap_platform_memory_free(_hc->valid_vals);
-    }
-    if (_hc->valid_vals_range) {
-        hap_platform_memory_free(_hc->valid_vals_range);
+    /* For static characteristics, the valid values are part of the description */
+    if (!_hc->static_alloc) {
+        if (_hc->valid_vals) {
+            hap_platform_memory_free_tagged(_hc->valid_vals);
+        }
+        if (_hc->valid_vals_range) {
+            hap_platform_memory_free_tagged(_hc->valid_vals_range);
+        }
+        hap_platform_memory_free_tagged(_hc);
     }
-    hap_platform_memory_free(_hc);
+    hap_notif_pass_unlock();
 }
 
 /**
@@ -524,13 +1864,77 @@ hap_serv_t *hap_char_get_parent(hap_char_t *hc)
 
 #define set_bit(val, index)	((val) |= (1 << index))
 #define reset_bit(val, index)	((val) &= ~(1 << index))
-void hap_char_manage_notification(hap_char_t *hc, int index, bool ev)
+/* Reverse index of the subscriptions. For every session index, a list of the characteristics
+ * for which it has enabled notifications. This is kept consistent with the ev_ctrls bitmaps,
+ * so that a session teardown needs to walk only its own subscriptions.
+ */
+typedef struct hap_ev_sub {
+    hap_char_t *hc;
+    struct hap_ev_sub *next;
+} hap_ev_sub_t;
+
+static hap_ev_sub_t *hap_ev_subs[HAP_MAX_SESSIONS];
+
+/* Unlink the subscription of a characteristic from the list for a session index.
+ * Should be called in the critical section. Returns the node, to be freed by the caller.
+ */
+static hap_ev_sub_t *hap_ev_sub_unlink(hap_char_t *hc, int index)
+{
+    hap_ev_sub_t **prev = &hap_ev_subs[index];
+    hap_ev_sub_t *cur;
+    for (cur = *prev; cur; prev = &cur->next, cur = cur->next) {
+        if (cur->hc == hc) {
+            *prev = cur->next;
+            return cur;
+        }
+    }
+    return NULL;
+}
+
+int hap_char_manage_notification(hap_char_t *hc, int index, bool ev)
 {
 	__hap_char_t *_hc = (__hap_char_t *)hc;
-	if (ev)
+    if (index < 0 || index >= HAP_MAX_SESSIONS) {
+        return HAP_FAIL;
+    }
+    if (ev) {
+        if (_hc->ev_ctrls & (1 << index)) {
+            return HAP_SUCCESS;
+        }
+        hap_ev_sub_t *sub = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_SESSION, 1, sizeof(hap_ev_sub_t));
+        if (!sub) {
+            return HAP_FAIL;
+        }
+        sub->hc = hc;
+        hap_platform_os_enter_critical();
+        sub->next = hap_ev_subs[index];
+        hap_ev_subs[index] = sub;
 		set_bit(_hc->ev_ctrls, index);
-	else
+        hap_platform_os_exit_critical();
+    } else {
+        if (!(_hc->ev_ctrls & (1 << index))) {
+            return HAP_SUCCESS;
+        }
+        hap_platform_os_enter_critical();
+        hap_ev_sub_t *sub = hap_ev_sub_unlink(hc, index);
 		reset_bit(_hc->ev_ctrls, index);
+        hap_platform_os_exit_critical();
+        if (sub) {
+            hap_platform_memory_free_tagged(sub);
+        }
+    }
+    return HAP_SUCCESS;
+}
+
+/* Remove all subscriptions for a characteristic. Used when it is deleted */
+static void hap_char_remove_all_subs(__hap_char_t *_hc)
+{
+    int i;
+    for (i = 0; _hc->ev_ctrls && i < HAP_MAX_SESSIONS; i++) {
+        if (_hc->ev_ctrls & (1 << i)) {
+            hap_char_manage_notification((hap_char_t *)_hc, i, false);
+        }
+    }
 }
 
 bool hap_char_is_ctrl_subscribed(hap_char_t *hc, int index)
@@ -539,11 +1943,37 @@ bool hap_char_is_ctrl_subscribed(hap_char_t *hc, int index)
 	return (_hc->ev_ctrls & (1 << index)) ? true : false;
 }
 
+/* The owner is set and reset by the HTTP server, while the notification pass takes it.
+ * So, all of these are done in the critical section.
+ */
 void hap_char_set_owner_ctrl(hap_char_t *hc, int index)
 {
 	__hap_char_t *_hc = (__hap_char_t *)hc;
+    hap_platform_os_enter_critical();
+    _hc->owner_ctrl = (1 << index);
+    hap_platform_os_exit_critical();
+}
+
+void hap_char_reset_owner_ctrl(hap_char_t *hc)
+{
+	__hap_char_t *_hc = (__hap_char_t *)hc;
+    hap_platform_os_enter_critical();
+    _hc->owner_ctrl = 0;
+    hap_platform_os_exit_critical();
+}
+
+/* Get the controllers to be notified of a value change, i.e. the subscribed ones excluding
+ * the owner (the controller which itself modified the value). Since there can be only one
+ * owner, which is anyways being skipped, the owner is reset.
+ */
+uint16_t hap_char_take_notif_ctrls(hap_char_t *hc)
+{
+	__hap_char_t *_hc = (__hap_char_t *)hc;
+    hap_platform_os_enter_critical();
+    uint16_t ctrls = _hc->ev_ctrls & ~_hc->owner_ctrl;
     _hc->owner_ctrl = 0;
-    set_bit(_hc->owner_ctrl, index);
+    hap_platform_os_exit_critical();
+    return ctrls;
 }
 
 bool hap_char_is_ctrl_owner(hap_char_t *hc, int index)
@@ -561,18 +1991,22 @@ void hap_char_set_iid(hap_char_t *hc, int32_t iid)
 
 void hap_disable_all_char_notif(int index)
 {
-    /* Just loop through all characteristic objects and reset the
-     * bit indicating event notifications. This is the simplest way
-     */
-    hap_acc_t *ha;
-    hap_serv_t *hs;
-    hap_char_t *hc;
-    for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
-        for (hs = hap_acc_get_first_serv(ha); hs; hs = hap_serv_get_next(hs)) {
-            for (hc = hap_serv_get_first_char(hs); hc; hc = hap_char_get_next(hc)) {
-                reset_bit(((__hap_char_t *)hc)->ev_ctrls, index);
-            }
-        }
+    if (index < 0 || index >= HAP_MAX_SESSIONS) {
+        return;
+    }
+    /* Only the characteristics subscribed by this session need to be looked at */
+    hap_platform_os_enter_critical();
+    hap_ev_sub_t *sub = hap_ev_subs[index];
+    hap_ev_subs[index] = NULL;
+    hap_ev_sub_t *cur;
+    for (cur = sub; cur; cur = cur->next) {
+        reset_bit(((__hap_char_t *)cur->hc)->ev_ctrls, index);
+    }
+    hap_platform_os_exit_critical();
+    while (sub) {
+        cur = sub;
+        sub = sub->next;
+        hap_platform_memory_free_tagged(cur);
     }
 }
 
@@ -581,7 +2015,7 @@ void hap_char_add_valid_vals(hap_char_t *hc, const uint8_t *valid_vals, size_t v
     if (!hc)
         return;
     __hap_char_t *_hc = (__hap_char_t *)hc;
-    _hc->valid_vals = hap_platform_memory_malloc(valid_val_cnt);
+    _hc->valid_vals = hap_platform_memory_malloc_tagged(HAP_MEM_TAG_DATABASE, valid_val_cnt);
     if (_hc->valid_vals) {
         memcpy(_hc->valid_vals, valid_vals, valid_val_cnt);
         _hc->valid_vals_cnt = valid_val_cnt;
@@ -593,7 +2027,7 @@ void hap_char_add_valid_vals_range(hap_char_t *hc, uint8_t start_val, uint8_t en
     if (!hc)
         return;
     __hap_char_t *_hc = (__hap_char_t *)hc;
-    _hc->valid_vals_range = hap_platform_memory_malloc(sizeof(uint8_t));
+    _hc->valid_vals_range = hap_platform_memory_malloc_tagged(HAP_MEM_TAG_DATABASE, sizeof(uint8_t) * 2);
     if (_hc->valid_vals_range) {
         _hc->valid_vals_range[0] = start_val;
         _hc->valid_vals_range[1] = end_val;
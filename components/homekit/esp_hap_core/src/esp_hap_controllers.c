@@ -30,16 +30,107 @@
 #include <esp_hap_database.h>
 #include <esp_hap_controllers.h>
 #include <esp_hap_keystore.h>
+#include <hap_platform_memory.h>
+#include <crc32.h>
 
 #define HAP_KEYSTORE_NAMESPACE_CTRL "hap_ctrl"
+#define HAP_KEY_CTRL_TABLE          "ctrl_tbl"
+#define HAP_CTRL_TABLE_VERSION      1
 
-int hap_controllers_init()
+/* The controller table is stored as a single blob, so that it loads in one read and every
+ * pairing add/remove replaces it atomically:
+ *
+ * | hap_ctrl_table_hdr_t | hap_ctrl_info_t for each bit set in valid_mask, in index order | CRC32 |
+ *
+ * The CRC32 covers everything before it.
+ */
+typedef struct {
+    uint8_t version;
+    uint8_t reserved;
+    uint16_t valid_mask;
+} __attribute__((packed)) hap_ctrl_table_hdr_t;
+
+#define HAP_CTRL_TABLE_MAX_LEN  (sizeof(hap_ctrl_table_hdr_t) + \
+        (HAP_MAX_CONTROLLERS * sizeof(hap_ctrl_info_t)) + sizeof(uint32_t))
+
+static int hap_controllers_store()
+{
+    uint8_t *buf = hap_platform_memory_calloc(1, HAP_CTRL_TABLE_MAX_LEN);
+    if (!buf) {
+        return HAP_FAIL;
+    }
+    hap_ctrl_table_hdr_t *hdr = (hap_ctrl_table_hdr_t *)buf;
+    hdr->version = HAP_CTRL_TABLE_VERSION;
+    size_t len = sizeof(hap_ctrl_table_hdr_t);
+    int i;
+    for (i = 0; i < HAP_MAX_CONTROLLERS; i++) {
+        if (hap_priv.controllers[i].valid) {
+            hdr->valid_mask |= (1 << i);
+            memcpy(buf + len, &hap_priv.controllers[i].info, sizeof(hap_ctrl_info_t));
+            len += sizeof(hap_ctrl_info_t);
+        }
+    }
+    uint32_t crc = hap_crc32(0, buf, len);
+    memcpy(buf + len, &crc, sizeof(crc));
+    len += sizeof(crc);
+    int ret = hap_keystore_set(HAP_KEYSTORE_NAMESPACE_CTRL, HAP_KEY_CTRL_TABLE, buf, len);
+    hap_platform_memory_free(buf);
+    return ret;
+}
+
+/* Returns HAP_SUCCESS if a valid table was found, even if it has no controllers */
+static int hap_controllers_load_table()
+{
+    int ret = HAP_FAIL;
+    size_t len = HAP_CTRL_TABLE_MAX_LEN;
+    uint8_t *buf = hap_platform_memory_calloc(1, len);
+    if (!buf) {
+        return HAP_FAIL;
+    }
+    if (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_CTRL, HAP_KEY_CTRL_TABLE, buf, &len) != HAP_SUCCESS) {
+        goto load_end;
+    }
+    hap_ctrl_table_hdr_t *hdr = (hap_ctrl_table_hdr_t *)buf;
+    if ((len < sizeof(hap_ctrl_table_hdr_t) + sizeof(uint32_t)) ||
+            (hdr->version != HAP_CTRL_TABLE_VERSION)) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Unsupported controller table format");
+        goto load_end;
+    }
+    size_t expected_len = sizeof(hap_ctrl_table_hdr_t) + sizeof(uint32_t);
+    int i;
+    for (i = 0; i < HAP_MAX_CONTROLLERS; i++) {
+        if (hdr->valid_mask & (1 << i)) {
+            expected_len += sizeof(hap_ctrl_info_t);
+        }
+    }
+    uint32_t crc;
+    memcpy(&crc, buf + len - sizeof(crc), sizeof(crc));
+    if ((len != expected_len) || (crc != hap_crc32(0, buf, len - sizeof(crc)))) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Controller table corrupted");
+        goto load_end;
+    }
+    const uint8_t *p = buf + sizeof(hap_ctrl_table_hdr_t);
+    for (i = 0; i < HAP_MAX_CONTROLLERS; i++) {
+        if (hdr->valid_mask & (1 << i)) {
+            memcpy(&hap_priv.controllers[i].info, p, sizeof(hap_ctrl_info_t));
+            hap_priv.controllers[i].index = i;
+            hap_priv.controllers[i].valid = true;
+            p += sizeof(hap_ctrl_info_t);
+        }
+    }
+    ret = HAP_SUCCESS;
+load_end:
+    hap_platform_memory_free(buf);
+    return ret;
+}
+
+/* Moves the controllers stored with one key per index, by older firmware, into the table */
+static void hap_controllers_migrate()
 {
-	memset(hap_priv.controllers, 0, sizeof(hap_priv.controllers));
     char index_str[4];
     uint8_t i;
     size_t info_size;
-    bool acc_paired = false;
+    bool found = false;
 	for (i = 0; i < HAP_MAX_CONTROLLERS; i++) {
         snprintf(index_str, sizeof(index_str), "%d", i);
         info_size = sizeof(hap_ctrl_info_t);
@@ -48,11 +139,39 @@ int hap_controllers_init()
             if (info_size == sizeof(hap_ctrl_info_t)) {
                 hap_priv.controllers[i].index = i;
                 hap_priv.controllers[i].valid = true;
-                acc_paired = true;
+                found = true;
             }
         }
     }
-    if (acc_paired) {
+    if (!found) {
+        /* An empty table, so that the next boots need not look for the old keys again */
+        hap_controllers_store();
+        return;
+    }
+    /* The old keys get erased only after the table has been written. If a reboot happens
+     * in between, the table just gets used on the next boot.
+     */
+    if (hap_controllers_store() != HAP_SUCCESS) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to migrate controllers");
+        return;
+    }
+	for (i = 0; i < HAP_MAX_CONTROLLERS; i++) {
+        if (hap_priv.controllers[i].valid) {
+            snprintf(index_str, sizeof(index_str), "%d", i);
+            hap_keystore_delete(HAP_KEYSTORE_NAMESPACE_CTRL, index_str);
+        }
+    }
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Migrated controllers to the table format");
+}
+
+int hap_controllers_init()
+{
+	memset(hap_priv.controllers, 0, sizeof(hap_priv.controllers));
+    if (hap_controllers_load_table() != HAP_SUCCESS) {
+        memset(hap_priv.controllers, 0, sizeof(hap_priv.controllers));
+        hap_controllers_migrate();
+    }
+    if (is_accessory_paired()) {
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Accessory is Paired with atleast one controller");
     } else {
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Accessory is not Paired with any controller");
@@ -106,10 +225,7 @@ bool is_admin_paired()
 int hap_controller_save(hap_ctrl_data_t *ctrl_data)
 {
 	ctrl_data->valid = true;
-    char index_str[4];
-    snprintf(index_str, sizeof(index_str), "%d", ctrl_data->index);
-    int ret = hap_keystore_set(HAP_KEYSTORE_NAMESPACE_CTRL, index_str,
-            (const uint8_t *)&ctrl_data->info, (size_t)sizeof(hap_ctrl_info_t));
+    int ret = hap_controllers_store();
 
     if (ret != HAP_SUCCESS) {
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to store controller %d", ctrl_data->index);
@@ -123,12 +239,12 @@ void hap_controller_remove(hap_ctrl_data_t *ctrl_data)
 {
 	if (!ctrl_data)
         return;
-    char index_str[4];
-    snprintf(index_str, sizeof(index_str), "%d", ctrl_data->index);
     char id[HAP_CTRL_ID_LEN];
     strncpy(id, ctrl_data->info.id, sizeof(id));
-    hap_keystore_delete(HAP_KEYSTORE_NAMESPACE_CTRL, index_str);
     memset(ctrl_data, 0, sizeof(hap_ctrl_data_t));
+    if (hap_controllers_store() != HAP_SUCCESS) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to update controller table");
+    }
     hap_report_event(HAP_EVENT_CTRL_UNPAIRED, id, sizeof(id));
 }
 
@@ -34,7 +34,9 @@
 #include <esp_hap_main.h>
 #include <esp_hap_keystore.h>
 #include <esp_hap_database.h>
+#include <esp_hap_acc.h>
 #include <esp_hap_controllers.h>
+#include <crc32.h>
 
 #include <esp_mfi_base64.h>
 
@@ -45,6 +47,8 @@
 #define HAP_KEY_FW_REV                  "fw_rev"
 #define HAP_KEY_CUR_AID                 "cur_aid"
 #define HAP_KEY_STATE_NUM              "state_num"
+#define HAP_KEY_DB_HASH                 "db_hash"
+#define HAP_KEY_FAST_START              "fast_start"
 
 #define HAP_KEY_SETUP_ID                "setup_id"
 #define HAP_KEY_SETUP_SALT              "setup_salt"
@@ -68,18 +72,26 @@ hap_priv_t hap_priv = {
     }
 };
 
+/* The state number and the config number get updated often, so they are kept as journaled
+ * counters, each in its own sector of the journal partition, if there is one.
+ */
+#define HAP_JOURNAL_SECTOR_STATE_NUM    0
+#define HAP_JOURNAL_SECTOR_CONFIG_NUM   1
+
+static hap_keystore_counter_t hap_config_num_ctr;
+static hap_keystore_counter_t hap_state_num_ctr;
+
 static void hap_save_config_number()
 {
-
-    hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_CONFIG_NUM,
-            (uint8_t *)&hap_priv.config_num, sizeof(hap_priv.config_num));
+    hap_keystore_counter_set(&hap_config_num_ctr, hap_priv.config_num);
 }
 
 static void hap_get_config_number()
 {
-    size_t config_num_len = sizeof(hap_priv.config_num);
-    if (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_CONFIG_NUM,
-                (uint8_t *)&hap_priv.config_num, &config_num_len) != HAP_SUCCESS) {
+    if (hap_keystore_counter_init(&hap_config_num_ctr, HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_CONFIG_NUM,
+                sizeof(hap_priv.config_num), HAP_JOURNAL_SECTOR_CONFIG_NUM) == HAP_SUCCESS) {
+        hap_priv.config_num = hap_config_num_ctr.val;
+    } else {
         hap_priv.config_num = 1;
         hap_save_config_number();
     }
@@ -89,6 +101,28 @@ static void hap_get_config_number()
     }
 }
 
+/* Structural hash of the accessory database at the time the config number was last incremented */
+static uint32_t hap_db_hash;
+static bool hap_db_hash_saved;
+
+static void hap_save_db_hash(uint32_t hash)
+{
+    if (hap_db_hash_saved && hash == hap_db_hash) {
+        return;
+    }
+    hap_fast_start_invalidate();
+    hap_db_hash = hash;
+    hap_db_hash_saved = (hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_DB_HASH,
+            (uint8_t *)&hap_db_hash, sizeof(hap_db_hash)) == HAP_SUCCESS);
+}
+
+static void hap_get_db_hash()
+{
+    size_t hash_len = sizeof(hap_db_hash);
+    hap_db_hash_saved = (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_DB_HASH,
+                (uint8_t *)&hap_db_hash, &hash_len) == HAP_SUCCESS) && (hash_len == sizeof(hap_db_hash));
+}
+
 void hap_increment_and_save_config_num()
 {
     hap_priv.config_num++;
@@ -96,13 +130,27 @@ void hap_increment_and_save_config_num()
         hap_priv.config_num = 1;
     }
     hap_save_config_number();
+    hap_save_db_hash(hap_acc_db_hash());
+}
+
+bool hap_update_config_num_if_db_changed()
+{
+    uint32_t hash = hap_acc_db_hash();
+    if (hap_db_hash_saved && hash == hap_db_hash) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Accessory database unchanged. Retaining config number %u",
+                (unsigned)hap_priv.config_num);
+        return false;
+    }
+    hap_increment_and_save_config_num();
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Accessory database changed. Config number %u",
+            (unsigned)hap_priv.config_num);
+    return true;
 }
 
 
 static void hap_save_state_number()
 {
-    hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_STATE_NUM,
-            (uint8_t *)&hap_priv.state_num, sizeof(hap_priv.state_num));
+    hap_keystore_counter_set(&hap_state_num_ctr, hap_priv.state_num);
 }
 
 void hap_increment_and_save_state_num()
@@ -122,20 +170,21 @@ void hap_increment_and_save_state_num()
 
 static void hap_init_state_number()
 {
-    size_t state_num_len = sizeof(hap_priv.state_num);
-    if (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_STATE_NUM,
-                (uint8_t *)&hap_priv.state_num, &state_num_len) != HAP_SUCCESS) {
+    if (hap_keystore_counter_init(&hap_state_num_ctr, HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_STATE_NUM,
+                sizeof(hap_priv.state_num), HAP_JOURNAL_SECTOR_STATE_NUM) != HAP_SUCCESS) {
         /* If state number is not found, initialise with 1 and store.
          */
         hap_priv.state_num = 1;
         hap_save_state_number();
     } else {
+        hap_priv.state_num = hap_state_num_ctr.val;
         hap_increment_and_save_state_num();
     }
 }
 
 static void hap_save_cur_aid()
 {
+    hap_fast_start_invalidate();
     hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_CUR_AID,
             (uint8_t *)&hap_priv.cur_aid, sizeof(hap_priv.cur_aid));
 }
@@ -154,6 +203,130 @@ static void hap_get_cur_aid()
     }
 }
 
+#define HAP_FAST_START_VERSION      3
+#define HAP_FAST_START_FW_REV_LEN   64
+
+/* Fast-start snapshot. The state which otherwise needs a number of keystore reads, and the
+ * setup hash computation, at every boot is saved as a single blob once hap_acc_setup_init()
+ * has all of it:
+ *
+ * | hap_fast_start_hdr_t | CRC32 |
+ *
+ * The CRC32 covers the header. The long term keys and the controllers are not part of it, so
+ * that the private key is stored just once. Both get read from their own keys, the
+ * controllers in a single read of their table.
+ * The snapshot is erased before any of the keys it mirrors gets written, and it gets saved
+ * again on the next boot. That alone does not cover writes which get flushed out of order
+ * from a keystore batch, or the ones made by a firmware which does not know about the
+ * snapshot. So src_crc also records the current aid and firmware revision keys as they were
+ * when the snapshot was saved, and a snapshot which does not match them is not used.
+ */
+typedef struct {
+    uint8_t version;
+    uint8_t db_hash_saved;
+    uint8_t raw_acc_id[6];
+    uint32_t cur_aid;
+    uint32_t db_hash;
+    char setup_id[SETUP_ID_LEN + 1];
+    uint8_t setup_hash[SETUP_HASH_LEN];
+    char fw_rev[HAP_FAST_START_FW_REV_LEN];
+    uint32_t src_crc;
+} __attribute__((packed)) hap_fast_start_hdr_t;
+
+#define HAP_FAST_START_LEN  (sizeof(hap_fast_start_hdr_t) + sizeof(uint32_t))
+
+/* Snapshot found at boot, for hap_acc_setup_init() */
+static hap_fast_start_hdr_t hap_fast_start;
+static bool hap_fast_start_loaded;
+/* Set while a valid snapshot is in the keystore */
+static bool hap_fast_start_saved;
+
+/* CRC32 over the values, and lengths, of the source keys which the snapshot gets checked
+ * against.
+ */
+static uint32_t hap_fast_start_src_crc()
+{
+    uint32_t crc = 0;
+    uint8_t val[HAP_FAST_START_FW_REV_LEN];
+    const char *keys[] = {HAP_KEY_CUR_AID, HAP_KEY_FW_REV};
+    int i;
+    for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        size_t len = sizeof(val);
+        if (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, keys[i], val, &len) != HAP_SUCCESS) {
+            len = 0;
+        }
+        uint32_t len32 = len;
+        crc = hap_crc32(crc, &len32, sizeof(len32));
+        crc = hap_crc32(crc, val, len);
+    }
+    return crc;
+}
+
+static void hap_fast_start_load()
+{
+    uint8_t buf[HAP_FAST_START_LEN];
+    size_t len = sizeof(buf);
+    if (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_FAST_START, buf, &len) != HAP_SUCCESS) {
+        return;
+    }
+    hap_fast_start_hdr_t *hdr = (hap_fast_start_hdr_t *)buf;
+    uint32_t crc;
+    if ((len != sizeof(buf)) || (hdr->version != HAP_FAST_START_VERSION)) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Unsupported fast-start snapshot format");
+        return;
+    }
+    memcpy(&crc, buf + sizeof(hap_fast_start_hdr_t), sizeof(crc));
+    if (crc != hap_crc32(0, buf, sizeof(hap_fast_start_hdr_t))) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Fast-start snapshot corrupted");
+        return;
+    }
+    if (hdr->src_crc != hap_fast_start_src_crc()) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Fast-start snapshot out of date");
+        return;
+    }
+    memcpy(&hap_fast_start, hdr, sizeof(hap_fast_start));
+    hap_priv.cur_aid = hdr->cur_aid;
+    hap_db_hash = hdr->db_hash;
+    hap_db_hash_saved = hdr->db_hash_saved;
+    hap_fast_start_loaded = true;
+    hap_fast_start_saved = true;
+}
+
+static void hap_fast_start_save()
+{
+    if (strlen(hap_priv.primary_acc.fw_rev) >= HAP_FAST_START_FW_REV_LEN) {
+        return;
+    }
+    uint8_t buf[HAP_FAST_START_LEN] = {0};
+    hap_fast_start_hdr_t *hdr = (hap_fast_start_hdr_t *)buf;
+    hdr->version = HAP_FAST_START_VERSION;
+    hdr->db_hash_saved = hap_db_hash_saved;
+    memcpy(hdr->raw_acc_id, hap_priv.raw_acc_id, sizeof(hdr->raw_acc_id));
+    hdr->cur_aid = hap_priv.cur_aid;
+    hdr->db_hash = hap_db_hash;
+    memcpy(hdr->setup_id, hap_priv.setup_id, sizeof(hdr->setup_id));
+    memcpy(hdr->setup_hash, hap_priv.setup_hash, sizeof(hdr->setup_hash));
+    strcpy(hdr->fw_rev, hap_priv.primary_acc.fw_rev);
+    hdr->src_crc = hap_fast_start_src_crc();
+    uint32_t crc = hap_crc32(0, buf, sizeof(hap_fast_start_hdr_t));
+    memcpy(buf + sizeof(hap_fast_start_hdr_t), &crc, sizeof(crc));
+    hap_fast_start_saved = (hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_FAST_START,
+                buf, sizeof(buf)) == HAP_SUCCESS);
+}
+
+void hap_fast_start_invalidate()
+{
+    if (hap_fast_start_saved) {
+        hap_fast_start_saved = false;
+        hap_keystore_delete(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_FAST_START);
+    }
+}
+
+bool hap_fast_start_used()
+{
+    return hap_fast_start_loaded;
+}
+
 static int hap_get_setup_id()
 {
     /* Read setup id from NVS, only if it is not already set from the accessory code */
@@ -200,9 +373,16 @@ static void hap_check_fw_version()
 {
     char fw_rev[64] = {0};
     size_t fw_rev_len = sizeof(fw_rev);
-    /* Check if the firmware revision is stored in NVS */
-    if (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_FW_REV,
-                (uint8_t *)fw_rev, &fw_rev_len) == HAP_SUCCESS) {
+    bool found;
+    if (hap_fast_start_loaded) {
+        strncpy(fw_rev, hap_fast_start.fw_rev, sizeof(fw_rev) - 1);
+        found = true;
+    } else {
+        /* Check if the firmware revision is stored in NVS */
+        found = (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_FW_REV,
+                    (uint8_t *)fw_rev, &fw_rev_len) == HAP_SUCCESS);
+    }
+    if (found) {
         /* If the firmware revision is found, compare with the current revision.
          * If it is the same, no need to do anything. So, just return
          */
@@ -217,6 +397,7 @@ static void hap_check_fw_version()
         }
     }
     /* Save the new firmare revision to NVS */
+    hap_fast_start_invalidate();
     hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_FW_REV,
             (uint8_t *)hap_priv.primary_acc.fw_rev,
             strlen(hap_priv.primary_acc.fw_rev));
@@ -236,27 +417,42 @@ int hap_acc_setup_init()
         return HAP_FAIL;
     }
 
-    uint8_t digest[MFI_SHA512_SIZE] = {0};
-    esp_mfi_sha_ctx_t ctx = 0;
-    ctx = esp_mfi_sha512_new();
-    if (!ctx) {
-        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Out of Memory");
-        return HAP_FAIL;
+    /* The accessory id comes from the snapshot itself, so only the setup id needs a check */
+    if (hap_fast_start_loaded && !strncmp(hap_fast_start.setup_id, hap_priv.setup_id,
+                sizeof(hap_fast_start.setup_id))) {
+        memcpy(hap_priv.setup_hash, hap_fast_start.setup_hash, SETUP_HASH_LEN);
+    } else {
+        uint8_t digest[MFI_SHA512_SIZE] = {0};
+        esp_mfi_sha_ctx_t ctx = 0;
+        ctx = esp_mfi_sha512_new();
+        if (!ctx) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Out of Memory");
+            return HAP_FAIL;
+        }
+        /* Compute setup hash by taking a SHA512 hash of the setup id and device id */
+        esp_mfi_sha512_init(ctx);
+        esp_mfi_sha512_update(ctx, (const uint8_t *)hap_priv.setup_id, strlen(hap_priv.setup_id));
+        esp_mfi_sha512_update(ctx, (const uint8_t *)hap_priv.acc_id, strlen(hap_priv.acc_id));
+        esp_mfi_sha512_final(ctx, digest);
+        /* Copy only the first 4 bytes as the setup hash */
+        memcpy(hap_priv.setup_hash, digest, SETUP_HASH_LEN);
+        esp_mfi_sha512_free(ctx);
+        /* The snapshot has a different setup id */
+        hap_fast_start_invalidate();
     }
-    /* Compute setup hash by taking a SHA512 hash of the setup id and device id */
-    esp_mfi_sha512_init(ctx);
-    esp_mfi_sha512_update(ctx, (const uint8_t *)hap_priv.setup_id, strlen(hap_priv.setup_id));
-    esp_mfi_sha512_update(ctx, (const uint8_t *)hap_priv.acc_id, strlen(hap_priv.acc_id));
-    esp_mfi_sha512_final(ctx, digest);
-    /* Copy only the first 4 bytes as the setup hash */
-    memcpy(hap_priv.setup_hash, digest, SETUP_HASH_LEN);
-    esp_mfi_sha512_free(ctx);
 
     int hash_size = sizeof(hap_priv.setup_hash_str);
     esp_mfi_base64_encode((const char *)hap_priv.setup_hash, SETUP_HASH_LEN,
             hap_priv.setup_hash_str, hash_size, &hash_size);
 
     hap_check_fw_version();
+    /* If there is no hash yet, the config number already stands for the current database */
+    if (!hap_db_hash_saved) {
+        hap_save_db_hash(hap_acc_db_hash());
+    }
+    if (!hap_fast_start_saved) {
+        hap_fast_start_save();
+    }
 
     return HAP_SUCCESS;
 }
@@ -265,7 +461,17 @@ int hap_database_init(void)
 {
     uint8_t id[6];
     size_t val_size = sizeof(id);
-    if (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_ACC_ID, id, &val_size) == HAP_SUCCESS) {
+    if (hap_db_lock_init() != HAP_SUCCESS) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Database lock creation failed");
+        return HAP_FAIL;
+    }
+    hap_fast_start_load();
+    if (hap_fast_start_loaded || (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_ACC_ID,
+                    id, &val_size) == HAP_SUCCESS)) {
+        /* The accessory id, current aid and database hash come from the snapshot, if any */
+        if (hap_fast_start_loaded) {
+            memcpy(id, hap_fast_start.raw_acc_id, sizeof(id));
+        }
         val_size = sizeof(hap_priv.ltska);
         hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_LTSKA, hap_priv.ltska, &val_size);
         val_size = sizeof(hap_priv.ltpka);
@@ -287,7 +493,10 @@ int hap_database_init(void)
 
 	hap_controllers_init();
     hap_get_config_number();
-    hap_get_cur_aid();
+    if (!hap_fast_start_loaded) {
+        hap_get_db_hash();
+        hap_get_cur_aid();
+    }
     hap_init_state_number();
     ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Database initialised. Accessory Device ID: %s", hap_priv.acc_id);
 	return HAP_SUCCESS;
@@ -307,7 +516,10 @@ int hap_get_next_aid(char *id)
 
 void hap_erase_accessory_info()
 {
+    /* The snapshot and the bridged aid map are in the same namespace */
+    hap_fast_start_saved = false;
     hap_keystore_delete_namespace(HAP_KEYSTORE_NAMESPACE_HAPMAIN);
+    hap_aid_map_reset();
 }
 
 void hap_configure_unique_param(hap_unique_param_t param)
@@ -35,6 +35,8 @@
 #include <esp_hap_acc.h>
 #include <esp_hap_serv.h>
 #include <esp_hap_char.h>
+#include <esp_hap_async.h>
+#include <esp_hap_notif_latency.h>
 #include <esp_hap_mdns.h>
 #include <esp_hap_wac.h>
 #include <esp_hap_wifi.h>
@@ -83,6 +85,25 @@ int hap_httpd_get_data(httpd_req_t *req, char *buffer, int len)
     return read_len;
 }
 
+/* Common entry point for the handlers used on pair verified sessions. The actual handler
+ * is passed as the user_ctx. The session lock is taken once the HTTP response starts going
+ * out, and held till the handler returns, so that the complete response goes out on the
+ * socket without any EVENT message from the notification task getting in between.
+ * Till then, Eg. while waiting for a deferred read, EVENT messages still go out.
+ */
+static int hap_http_session_handler(httpd_req_t *req)
+{
+    int (*handler)(httpd_req_t *req) = (int (*)(httpd_req_t *))req->user_ctx;
+    hap_secure_session_t *session = (hap_secure_session_t *)hap_platform_httpd_get_sess_ctx(req);
+    if (!hap_is_req_secure(session)) {
+        return handler(req);
+    }
+    hap_session_req_begin(session);
+    int ret = handler(req);
+    hap_session_req_end(session);
+    return ret;
+}
+
 static int hap_http_pair_setup_handler(httpd_req_t *req)
 {
 	uint8_t buf[1200];
@@ -144,7 +165,7 @@ static int hap_http_pair_verify_handler(httpd_req_t *req)
     ESP_MFI_DEBUG_PLAIN("Socket fd: %d; HTTP Request %s %s\n", httpd_req_to_sockfd(req), hap_platform_httpd_get_req_method(req), hap_platform_httpd_get_req_uri(req));
 	if (!ctx) {
 		if (hap_pair_verify_context_init(&ctx, buf, sizeof(buf), &outlen) == HAP_SUCCESS) {
-            hap_platform_httpd_set_sess_ctx(req, ctx, NULL, true);
+            hap_platform_httpd_set_sess_ctx(req, ctx, hap_pair_verify_ctx_clean, true);
 		}
 	}
 	int data_len = httpd_req_recv(req, (char *)buf, sizeof(buf));
@@ -268,6 +289,36 @@ static int hap_add_char_val_json(hap_char_format_t format, char *key,
 	return HAP_SUCCESS;
 }
 
+/* Add the current value of a characteristic, using a consistent snapshot of it,
+ * since the value can get updated concurrently by the application.
+ */
+static int hap_add_char_cur_val_json(__hap_char_t *hc, char *key, json_gen_str_t *jptr)
+{
+    hap_val_t val;
+    if (hc->format == HAP_CHAR_FORMAT_STRING) {
+        uint8_t str_buf[HAP_CHAR_STRING_MAX_LEN + 1];
+        size_t buf_size = sizeof(str_buf);
+        hap_char_get_val_snapshot(hc, &val, str_buf, &buf_size);
+        return hap_add_char_val_json(hc->format, key, &val, jptr);
+    } else if (hc->format == HAP_CHAR_FORMAT_DATA || hc->format == HAP_CHAR_FORMAT_TLV8) {
+        uint8_t *data_buf = NULL;
+        size_t buf_size = 0;
+        /* Retry with a larger buffer if the value grew in between */
+        while (hap_char_get_val_snapshot(hc, &val, data_buf, &buf_size) != HAP_SUCCESS) {
+            hap_platform_memory_free_tagged(data_buf);
+            data_buf = hap_platform_memory_malloc_tagged(HAP_MEM_TAG_JSON, buf_size);
+            if (!data_buf) {
+                return json_gen_obj_set_null(jptr, key);
+            }
+        }
+        int ret = hap_add_char_val_json(hc->format, key, &val, jptr);
+        hap_platform_memory_free_tagged(data_buf);
+        return ret;
+    }
+    hap_char_get_val_snapshot(hc, &val, NULL, NULL);
+    return hap_add_char_val_json(hc->format, key, &val, jptr);
+}
+
 static int hap_add_char_format_json(__hap_char_t *hc, json_gen_str_t *jptr)
 {
 	switch (hc->format) {
@@ -386,7 +437,7 @@ static int hap_prepare_char_db(__hap_char_t *hc, json_gen_str_t *jptr, int sessi
      * Else, the controller will  miss the next notification.
      */
     if (!hc->update_called)   {
-        hc->owner_ctrl = 0;
+        hap_char_reset_owner_ctrl((hap_char_t *)hc);
     }
     hc->update_called = false;
 
@@ -394,7 +445,7 @@ static int hap_prepare_char_db(__hap_char_t *hc, json_gen_str_t *jptr, int sessi
         if (hc->permission & HAP_CHAR_PERM_SPECIAL_READ) {
             json_gen_obj_set_null(jptr, "value");
         } else {
-            hap_add_char_val_json(hc->format, "value", &hc->val, jptr);
+            hap_add_char_cur_val_json(hc, "value", jptr);
         }
 	}
 	hap_add_char_type(hc, jptr);
@@ -436,14 +487,14 @@ static int hap_prepare_serv_db(__hap_serv_t *hs, json_gen_str_t *jptr, int sessi
         }
     }
     if (char_cnt) {
-        hap_read_data_t *read_arr = hap_platform_memory_calloc(char_cnt, sizeof(hap_read_data_t));
+        hap_read_data_t *read_arr = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_JSON, char_cnt, sizeof(hap_read_data_t));
         if (!read_arr) {
             return HAP_FAIL;
         }
 
-        hap_status_t *status_codes = hap_platform_memory_calloc(char_cnt, sizeof(hap_status_t));
+        hap_status_t *status_codes = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_JSON, char_cnt, sizeof(hap_status_t));
         if (!status_codes) {
-            hap_platform_memory_free(read_arr);
+            hap_platform_memory_free_tagged(read_arr);
             return HAP_FAIL;
         }
 
@@ -460,9 +511,12 @@ static int hap_prepare_serv_db(__hap_serv_t *hs, json_gen_str_t *jptr, int sessi
             }
         }
 
-        hs->bulk_read(&read_arr[0], char_cnt, hs->priv, NULL);
-        hap_platform_memory_free(read_arr);
-        hap_platform_memory_free(status_codes);
+        hap_async_req_begin();
+        int cookie = hap_async_batch_begin(status_codes, char_cnt);
+        hap_async_batch_end(cookie, hs->bulk_read(&read_arr[0], char_cnt, hs->priv, NULL));
+        hap_async_req_end();
+        hap_platform_memory_free_tagged(read_arr);
+        hap_platform_memory_free_tagged(status_codes);
     }
     for (hc = hap_serv_get_first_char((hap_serv_t *)hs); hc; hc = hap_char_get_next(hc)) {
 		hap_prepare_char_db((__hap_char_t *)hc, jptr, session_index);
@@ -538,7 +592,8 @@ static int hap_http_get_accessories(httpd_req_t *req)
 static struct httpd_uri hap_accessories = {
 	.uri = "/accessories",
     .method = HTTP_GET,
-    .handler = hap_http_get_accessories,
+    .handler = hap_http_session_handler,
+    .user_ctx = hap_http_get_accessories,
 };
 
 static void hap_set_char_report_status(bool *include_status, json_gen_str_t *jstr,
@@ -598,8 +653,8 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
 	if (cnt <= 0)
 		return HAP_FAIL;
 
-    hap_write_data_t *write_arr = hap_platform_memory_calloc(cnt, sizeof(hap_write_data_t));
-	hap_status_t *status_arr = hap_platform_memory_calloc(cnt, sizeof(hap_status_t));
+    hap_write_data_t *write_arr = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_JSON, cnt, sizeof(hap_write_data_t));
+	hap_status_t *status_arr = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_JSON, cnt, sizeof(hap_status_t));
 	if (!write_arr || !status_arr)
 		goto set_char_end;
 
@@ -657,7 +712,11 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
 		if (json_obj_get_bool(jctx, "ev", &ev) == HAP_SUCCESS) {
             if (hc->permission & HAP_CHAR_PERM_EV) {
                 int index = hap_get_ctrl_session_index(session);
-                hap_char_manage_notification((hap_char_t *)hc, index, ev);
+                if (hap_char_manage_notification((hap_char_t *)hc, index, ev) != HAP_SUCCESS) {
+                    hap_set_char_report_status(&include_status, &jstr,
+                            aid, iid, HAP_STATUS_OO_RES);
+                    continue;
+                }
                 ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Events %s for aid=%d iid=%d",
                         ev ? "Enabled" : "Disabled", aid, iid);
             } else {
@@ -813,7 +872,10 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
 	 * have been looped through.
 	 * So, last iteration will invoke the write callback for the last
 	 * set of characteritics.
+	 * Callbacks which return HAP_PENDING proceed in parallel with the
+	 * following ones, and are waited for after the loop.
 	 */
+	hap_async_req_begin();
 	for (i = 0; i <= char_cnt; i++) {
 		if ((i < char_cnt) && ((hap_serv_t *)hs == hap_char_get_parent(write_arr[i].hc)))
 			continue;
@@ -823,8 +885,9 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
 			 * Number of elements of the array are indicated by
 			 * i - hs_index
 			 */
-			if (hs->write_cb(&write_arr[hs_index], i - hs_index,
-					hs->priv, hap_platform_httpd_get_sess_ctx(req)) != HAP_SUCCESS)
+			int cookie = hap_async_batch_begin(write_arr[hs_index].status, i - hs_index);
+			if (hap_async_batch_end(cookie, hs->write_cb(&write_arr[hs_index], i - hs_index,
+					hs->priv, hap_platform_httpd_get_sess_ctx(req))) != HAP_SUCCESS)
 				write_err = true;
 			if (i < char_cnt) {
 				hs = (__hap_serv_t *)hap_char_get_parent(write_arr[i].hc);
@@ -832,6 +895,8 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
 			}
 		}
 	}
+	if (hap_async_req_end() != HAP_SUCCESS)
+		write_err = true;
 	if (write_err || include_status) {
 		for (i = 0; i < char_cnt; i++) {
             /* TODO: The code to get aid looks complex. Simplify */
@@ -866,9 +931,9 @@ set_char_end:
 		}
 	}
 	if (write_arr)
-		hap_platform_memory_free(write_arr);
+		hap_platform_memory_free_tagged(write_arr);
 	if (status_arr)
-		hap_platform_memory_free(status_arr);
+		hap_platform_memory_free_tagged(status_arr);
 	return ret;
 }
 
@@ -891,7 +956,7 @@ static int hap_http_put_characteristics(httpd_req_t *req)
      */
     int content_len = hap_platform_httpd_get_content_len(req);
     if (content_len > sizeof(stack_inbuf)) {
-        heap_inbuf = hap_platform_memory_calloc(content_len + 1, 1); /* Allocating an extra byte for NULL termination */
+        heap_inbuf = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_JSON, content_len + 1, 1); /* Allocating an extra byte for NULL termination */
         if (!heap_inbuf) {
             ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to read HTTPD Data");
             httpd_resp_set_status(req, HTTPD_500);
@@ -906,7 +971,7 @@ static int hap_http_put_characteristics(httpd_req_t *req)
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to read HTTPD Data");
 		httpd_resp_set_status(req, HTTPD_500);
         if (heap_inbuf) {
-            hap_platform_memory_free(heap_inbuf);
+            hap_platform_memory_free_tagged(heap_inbuf);
             ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Freed allocated buffer for PUT");
         }
 		return httpd_resp_send(req, NULL, 0);
@@ -917,7 +982,7 @@ static int hap_http_put_characteristics(httpd_req_t *req)
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to parse HTTPD JSON Data");
 		httpd_resp_set_status(req, HTTPD_500);
         if (heap_inbuf) {
-            hap_platform_memory_free(heap_inbuf);
+            hap_platform_memory_free_tagged(heap_inbuf);
             ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Freed allocated buffer for PUT");
         }
 		return httpd_resp_send(req, NULL, 0);
@@ -945,7 +1010,7 @@ static int hap_http_put_characteristics(httpd_req_t *req)
     json_parse_end(&jctx);
 
     if (heap_inbuf) {
-        hap_platform_memory_free(heap_inbuf);
+        hap_platform_memory_free_tagged(heap_inbuf);
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Freed allocated buffer for PUT");
     }
 
@@ -979,7 +1044,7 @@ static int hap_http_get_characteristics(httpd_req_t *req)
     const char *uri = hap_platform_httpd_get_req_uri(req);
     /* Allocate on heap, if URI is longer */
     if (strlen(uri) > sizeof(stack_val_buf)) {
-        heap_val_buf = hap_platform_memory_calloc(strlen(uri) + 1, 1); /* Allocating an extra byte for NULL termination */
+        heap_val_buf = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_JSON, strlen(uri) + 1, 1); /* Allocating an extra byte for NULL termination */
         if (!heap_val_buf) {
             ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to read URL");
             httpd_resp_set_status(req, HTTPD_500);
@@ -990,7 +1055,7 @@ static int hap_http_get_characteristics(httpd_req_t *req)
         val = heap_val_buf;
     }
     size_t url_query_str_len = httpd_req_get_url_query_len(req);
-    char * url_query_str = hap_platform_memory_calloc(1, url_query_str_len + 1);
+    char * url_query_str = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_JSON, 1, url_query_str_len + 1);
     if (!url_query_str) {
 		httpd_resp_set_status(req, HTTPD_400);
 		httpd_resp_set_type(req, "application/hap+json");
@@ -1039,7 +1104,7 @@ static int hap_http_get_characteristics(httpd_req_t *req)
 	 * So, it is better to maintain a list of characteristics pointers,
 	 * read all the values, and only then create the response
 	 */
-	hap_read_data_t *read_arr = hap_platform_memory_calloc(char_cnt, sizeof(hap_read_data_t));
+	hap_read_data_t *read_arr = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_JSON, char_cnt, sizeof(hap_read_data_t));
     if (!read_arr) {
 		httpd_resp_set_status(req, HTTPD_500);
 		httpd_resp_set_type(req, "application/hap+json");
@@ -1047,9 +1112,9 @@ static int hap_http_get_characteristics(httpd_req_t *req)
 		httpd_resp_send(req, outbuf, strlen(outbuf));
         goto get_char_return;
     }
-    hap_status_t *status_codes = hap_platform_memory_calloc(char_cnt, sizeof(hap_status_t));
+    hap_status_t *status_codes = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_JSON, char_cnt, sizeof(hap_status_t));
     if (!status_codes) {
-        hap_platform_memory_free(read_arr);
+        hap_platform_memory_free_tagged(read_arr);
 		httpd_resp_set_status(req, HTTPD_500);
 		httpd_resp_set_type(req, "application/hap+json");
 		snprintf(outbuf, sizeof(outbuf),"{\"status\":-70407}");
@@ -1118,7 +1183,10 @@ static int hap_http_get_characteristics(httpd_req_t *req)
 	 * have been looped through.
 	 * So, last iteration will invoke the read callback for the last
 	 * set of characteritics.
+	 * Callbacks which return HAP_PENDING proceed in parallel with the
+	 * following ones, and are waited for after the loop.
 	 */
+	hap_async_req_begin();
 	for (i = 0; i <= char_cnt; i++) {
 		if ((i < char_cnt) && ((hap_serv_t *)hs == hap_char_get_parent(read_arr[i].hc)))
 			continue;
@@ -1128,7 +1196,9 @@ static int hap_http_get_characteristics(httpd_req_t *req)
 			 * Number of elements of the array are indicated by
 			 * i - hs_index
 			 */
-			if (hs->bulk_read(&read_arr[hs_index], i - hs_index, hs->priv, hap_platform_httpd_get_sess_ctx(req)) != HAP_SUCCESS)
+			int cookie = hap_async_batch_begin(read_arr[hs_index].status, i - hs_index);
+			if (hap_async_batch_end(cookie, hs->bulk_read(&read_arr[hs_index], i - hs_index,
+					hs->priv, hap_platform_httpd_get_sess_ctx(req))) != HAP_SUCCESS)
 				read_err = true;
 			if (i < char_cnt) {
 				hs = (__hap_serv_t *)hap_char_get_parent(read_arr[i].hc);
@@ -1136,6 +1206,8 @@ static int hap_http_get_characteristics(httpd_req_t *req)
 			}
 		}
 	}
+	if (hap_async_req_end() != HAP_SUCCESS)
+		read_err = true;
     if (!include_status) {
         if (!read_err) {
             /* If "include_status" is false, it means there
@@ -1156,7 +1228,7 @@ static int hap_http_get_characteristics(httpd_req_t *req)
          * Else, the controller will  miss the next notification.
          */
         if (!hc->update_called) {
-            hc->owner_ctrl = 0;
+            hap_char_reset_owner_ctrl((hap_char_t *)hc);
         }
         hc->update_called = false;
 
@@ -1170,7 +1242,7 @@ static int hap_http_get_characteristics(httpd_req_t *req)
         } else {
             /* Include "value" only if status is SUCCESS */
             if (*read_arr[i].status == HAP_STATUS_SUCCESS) {
-                hap_add_char_val_json(hc->format, "value", &hc->val, &jstr);
+                hap_add_char_cur_val_json(hc, "value", &jstr);
             }
         }
 		/* Include status only if it was already included because of
@@ -1196,20 +1268,20 @@ get_char_end:
 	json_gen_end_object(&jstr);
 	json_gen_str_end(&jstr);
 
-	hap_platform_memory_free(read_arr);
-    hap_platform_memory_free(status_codes);
+	hap_platform_memory_free_tagged(read_arr);
+    hap_platform_memory_free_tagged(status_codes);
 
     /* This indicates the last chunk */
     httpd_resp_send_chunk(req, NULL, 0);
     ESP_MFI_DEBUG_PLAIN("\n");
 get_char_return:
     if (heap_val_buf) {
-        hap_platform_memory_free(heap_val_buf);
+        hap_platform_memory_free_tagged(heap_val_buf);
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Freed allocated buffer for GET");
     }
 
     if (url_query_str) {
-        hap_platform_memory_free(url_query_str);
+        hap_platform_memory_free_tagged(url_query_str);
     }
 
     hap_report_event(HAP_EVENT_GET_CHAR_COMPLETED, NULL, 0);
@@ -1218,12 +1290,14 @@ get_char_return:
 static struct httpd_uri hap_characteristics_get = {
 	.uri = "/characteristics",
     .method = HTTP_GET,
-    .handler = hap_http_get_characteristics,
+    .handler = hap_http_session_handler,
+    .user_ctx = hap_http_get_characteristics,
 };
 static struct httpd_uri hap_characteristics_put = {
 	.uri = "/characteristics",
     .method = HTTP_PUT,
-    .handler = hap_http_put_characteristics,
+    .handler = hap_http_session_handler,
+    .user_ctx = hap_http_put_characteristics,
 };
 
 static int hap_http_pairings_handler(httpd_req_t *req)
@@ -1247,7 +1321,8 @@ static int hap_http_pairings_handler(httpd_req_t *req)
 static struct httpd_uri hap_pairings = {
 	.uri = "/pairings",
     .method = HTTP_POST,
-    .handler = hap_http_pairings_handler,
+    .handler = hap_http_session_handler,
+    .user_ctx = hap_http_pairings_handler,
 };
 
 static int hap_http_post_identify(httpd_req_t *req)
@@ -1272,7 +1347,8 @@ static int hap_http_post_identify(httpd_req_t *req)
 static struct httpd_uri hap_identify = {
 	.uri = "/identify",
     .method = HTTP_POST,
-    .handler = hap_http_post_identify,
+    .handler = hap_http_session_handler,
+    .user_ctx = hap_http_post_identify,
 };
 
 static int hap_http_put_prepare(httpd_req_t *req)
@@ -1318,106 +1394,307 @@ static int hap_http_put_prepare(httpd_req_t *req)
 static struct httpd_uri hap_prepare = {
 	.uri = "/prepare",
     .method = HTTP_PUT,
-    .handler = hap_http_put_prepare,
+    .handler = hap_http_session_handler,
+    .user_ctx = hap_http_put_prepare,
 };
 
-static void hap_send_notification(void *arg)
-{
-    int num_char = hap_priv.cfg.max_event_notif_chars;
-    hap_char_t *hc;
-    hap_char_t **char_arr = hap_platform_memory_calloc(num_char, sizeof(hap_char_t *));
+#define HTTPD_HDR_STR      "EVENT/1.0 200 OK\r\n"                   \
+		"Content-Type: application/hap+json\r\n"           \
+		"Content-Length: %d\r\n"
+/* Space reserved at the start of the EVENT payload buffer, so that the HTTP header
+ * can be put in front of the JSON and the complete message sent in one go.
+ */
+#define HAP_NOTIF_HDR_SPACE     96
+/* Initial size of the EVENT payload buffer. It grows as required */
+#define HAP_NOTIF_PAYLOAD_INIT_SIZE 512
+
+/* State for a single notification pass */
+typedef struct {
+    /* Characteristics in the current chunk */
+    hap_char_t **char_arr;
+    /* Controllers to be notified, for each characteristic in char_arr */
+    uint16_t *masks;
+    /* Time at which each characteristic in char_arr got queued, for latency tracking */
+    int64_t *ts;
+    /* EVENT payload buffer being encoded */
+    char *buf;
+    size_t buf_size;
+    /* Length of the JSON in buf, after HAP_NOTIF_HDR_SPACE */
+    size_t json_len;
+    bool json_err;
+    /* Sessions found active when the current chunk was encoded, with a reference held
+     * on each till the chunk is sent
+     */
+    hap_secure_session_t *sessions[HAP_MAX_SESSIONS];
+    /* Encoded EVENT messages of the current chunk, one per distinct set of characteristics,
+     * along with the controllers (session indices) each is for. The buffers are reused
+     * across chunks and freed at the end of the pass.
+     */
+    int num_groups;
+    uint16_t group_ctrls[HAP_MAX_SESSIONS];
+    char *group_bufs[HAP_MAX_SESSIONS];
+    size_t group_buf_sizes[HAP_MAX_SESSIONS];
+    char *group_msgs[HAP_MAX_SESSIONS];
+    size_t group_msg_lens[HAP_MAX_SESSIONS];
+    int messages;
+    int payloads;
+    /* Flag to indicate if any controller was connected */
+    bool ctrl_connected;
+} hap_notif_pass_t;
 
-    if (!char_arr) {
+/* Flush callback for the JSON generator, to collect the EVENT payload in a growing buffer */
+static void hap_notif_json_flush(char *data, void *priv)
+{
+    hap_notif_pass_t *pass = (hap_notif_pass_t *)priv;
+    size_t len = strlen(data);
+    if (pass->json_err || !len) {
         return;
     }
+    size_t required = HAP_NOTIF_HDR_SPACE + pass->json_len + len + 1;
+    if (required > pass->buf_size) {
+        size_t new_size = pass->buf_size ? pass->buf_size : HAP_NOTIF_PAYLOAD_INIT_SIZE;
+        while (new_size < required) {
+            new_size *= 2;
+        }
+        char *new_buf = hap_platform_memory_malloc_tagged(HAP_MEM_TAG_JSON, new_size);
+        if (!new_buf) {
+            pass->json_err = true;
+            return;
+        }
+        if (pass->buf) {
+            memcpy(new_buf + HAP_NOTIF_HDR_SPACE, pass->buf + HAP_NOTIF_HDR_SPACE, pass->json_len);
+            hap_platform_memory_free_tagged(pass->buf);
+        }
+        pass->buf = new_buf;
+        pass->buf_size = new_size;
+    }
+    memcpy(pass->buf + HAP_NOTIF_HDR_SPACE + pass->json_len, data, len + 1);
+    pass->json_len += len;
+}
 
-    int i, num_notif_chars;
-    for (i = 0; i < num_char; i++) {
-        hc = hap_get_pending_notif_char();
-        if (hc) {
-            char_arr[i] = hc;
-        } else {
-            break;
+/* Encode the EVENT payload for the controller at the given session index */
+static int hap_encode_notification(hap_notif_pass_t *pass, int num_notif_chars, int index)
+{
+    char chunk[256];
+    int j;
+    pass->json_len = 0;
+    pass->json_err = false;
+    json_gen_str_t jstr;
+    json_gen_str_start(&jstr, chunk, sizeof(chunk), hap_notif_json_flush, pass);
+    json_gen_start_object(&jstr);
+    json_gen_push_array(&jstr, "characteristics");
+    for (j = 0; j < num_notif_chars; j++) {
+        if (!(pass->masks[j] & (1 << index)))
+            continue;
+        __hap_char_t *_hc = (__hap_char_t *)pass->char_arr[j];
+        json_gen_start_object(&jstr);
+        hap_acc_t *ha = hap_serv_get_parent(hap_char_get_parent((hap_char_t *)_hc));
+        int aid = ((__hap_acc_t *)ha)->aid;
+        json_gen_obj_set_int(&jstr, "aid", aid);
+        json_gen_obj_set_int(&jstr, "iid", _hc->iid);
+        hap_add_char_cur_val_json(_hc, "value", &jstr);
+        json_gen_end_object(&jstr);
+    }
+    json_gen_pop_array(&jstr);
+    json_gen_end_object(&jstr);
+    json_gen_str_end(&jstr);
+    if (pass->json_err || !pass->buf) {
+        return HAP_FAIL;
+    }
+    pass->payloads++;
+    return HAP_SUCCESS;
+}
+
+/* Check if the controllers at session indices a and b get the same set of characteristics */
+static bool hap_notif_same_set(hap_notif_pass_t *pass, int num_notif_chars, int a, int b)
+{
+    int j;
+    for (j = 0; j < num_notif_chars; j++) {
+        if (((pass->masks[j] >> a) ^ (pass->masks[j] >> b)) & 1) {
+            return false;
         }
     }
-    /* If no characteristic notifications are pending, free char_arr and exit */ 
-    if (i == 0) {
-	hap_platform_memory_free(char_arr); 
-        return;
+    return true;
+}
+
+/* Encode the notifications for a set of characteristics, as a single EVENT message per controller.
+ * The payload is encoded once for every distinct set of characteristics, and shared by
+ * all the controllers which have subscribed to the same ones among these.
+ * Should be called with hap_notif_pass_lock() held, since the characteristics get accessed.
+ */
+static void hap_encode_notification_chunk(hap_notif_pass_t *pass, int num_notif_chars)
+{
+    int i, j, k;
+    /* Controllers to be notified for each characteristic, from its subscriptions, excluding the
+     * owner (the controller which itself modified the value). Only the sessions present in the
+     * union of these need to be looked at.
+     */
+    uint16_t all_masks = 0;
+    for (j = 0; j < num_notif_chars; j++) {
+        pass->masks[j] = hap_char_take_notif_ctrls(pass->char_arr[j]);
+        all_masks |= pass->masks[j];
     }
-    num_notif_chars = i;
-	hap_secure_session_t *session;
-    /* Flag to indicate if any controller was connected */
-    bool ctrl_connected = false;
-	char buf[250];
+    uint16_t active = hap_sessions_get_all(pass->sessions);
+    if (active) {
+        pass->ctrl_connected = true;
+    }
+    pass->num_groups = 0;
+    uint16_t pending = all_masks & active;
 	for (i = 0; i < HAP_MAX_SESSIONS; i++) {
-		session = hap_priv.sessions[i];
-		if (!session)
-			continue;
-        ctrl_connected = true;
-		int fd = session->conn_identifier;
-#define HTTPD_HDR_STR      "EVENT/1.0 200 OK\r\n"                   \
-		"Content-Type: application/hap+json\r\n"           \
-		"Content-Length: %d\r\n"
-		char notif_json[1024];
-		json_gen_str_t jstr;
-		json_gen_str_start(&jstr, notif_json, sizeof(notif_json), NULL, NULL);
-		json_gen_start_object(&jstr);
-		json_gen_push_array(&jstr, "characteristics");
-
-        int j;
-        bool notif_to_send = false;
-        for (j = 0; j < num_notif_chars; j++) {
-            hc = char_arr[j];
-            __hap_char_t *_hc = ( __hap_char_t *)hc;
-            /* If the controller is the owner, dont send notification to it */
-            if (hap_char_is_ctrl_owner(hc, i)) {
-                /* Since there can be only one owner, which we are anyways skipping,
-                 * we can reset owner value to 0
-                 */
-                _hc->owner_ctrl = 0;
-                continue;
+        if (!(pending & (1 << i))) {
+            continue;
+        }
+        uint16_t group = (1 << i);
+        for (k = i + 1; k < HAP_MAX_SESSIONS; k++) {
+            if ((pending & (1 << k)) && hap_notif_same_set(pass, num_notif_chars, i, k)) {
+                group |= (1 << k);
             }
-            if (!hap_char_is_ctrl_subscribed(hc, i))
-                continue;
-
-            json_gen_start_object(&jstr);
-            hap_acc_t *ha = hap_serv_get_parent(hap_char_get_parent(hc));
-            int aid = ((__hap_acc_t *)ha)->aid;
-            json_gen_obj_set_int(&jstr, "aid", aid);
-            json_gen_obj_set_int(&jstr, "iid", _hc->iid);
-            hap_add_char_val_json(_hc->format, "value", &_hc->val, &jstr);
-            json_gen_end_object(&jstr);
-            notif_to_send = true;
         }
-        if (!notif_to_send) {
-            /* No notification required for this controller. Just continue */
+        pending &= ~group;
+        int g = pass->num_groups;
+        int64_t start = hap_notif_latency_now();
+        pass->buf = pass->group_bufs[g];
+        pass->buf_size = pass->group_buf_sizes[g];
+        int ret = hap_encode_notification(pass, num_notif_chars, i);
+        pass->group_bufs[g] = pass->buf;
+        pass->group_buf_sizes[g] = pass->buf_size;
+        if (ret != HAP_SUCCESS) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to encode notification");
             continue;
         }
+        hap_notif_latency_record(HAP_NOTIF_STAGE_ENCODE, hap_notif_latency_now() - start);
+        char hdr[HAP_NOTIF_HDR_SPACE];
+        /* Additional headers can go before the last "\r\n" */
+        int hdr_len = snprintf(hdr, sizeof(hdr), HTTPD_HDR_STR "\r\n", (int)pass->json_len);
+        pass->group_msgs[g] = pass->buf + HAP_NOTIF_HDR_SPACE - hdr_len;
+        memcpy(pass->group_msgs[g], hdr, hdr_len);
+        pass->group_msg_lens[g] = hdr_len + pass->json_len;
+        pass->group_ctrls[g] = group;
+        pass->num_groups++;
+	}
+    pass->buf = NULL;
+    pass->buf_size = 0;
+}
 
-        json_gen_pop_array(&jstr);
-		json_gen_end_object(&jstr);
-		json_gen_str_end(&jstr);
+/* Send the EVENT messages encoded by hap_encode_notification_chunk(), and release the
+ * sessions. The characteristics are not accessed here, so hap_notif_pass_lock() need not be
+ * held. Neither is hap_sessions_lock(), so that a slow socket does not hold up the HTTP
+ * server from adding or freeing other sessions.
+ */
+static void hap_send_notification_chunk(hap_notif_pass_t *pass, int num_notif_chars)
+{
+    int g, j, k;
+    for (g = 0; g < pass->num_groups; g++) {
+        for (k = 0; k < HAP_MAX_SESSIONS; k++) {
+            if (!(pass->group_ctrls[g] & (1 << k))) {
+                continue;
+            }
+            int fd = pass->sessions[k]->conn_identifier;
+            int64_t start = hap_notif_latency_now();
+            /* Fails if the controller disconnected after encoding */
+            if (hap_session_send(pass->sessions[k], pass->group_msgs[g],
+                        pass->group_msg_lens[g], 0) < 0) {
+                continue;
+            }
+            int64_t sent = hap_notif_latency_now();
+            hap_notif_latency_record(HAP_NOTIF_STAGE_SEND, sent - start);
+            for (j = 0; j < num_notif_chars; j++) {
+                if ((pass->masks[j] & (1 << k)) && pass->ts[j]) {
+                    hap_notif_latency_record(HAP_NOTIF_STAGE_TOTAL, sent - pass->ts[j]);
+                }
+            }
+            httpd_sess_update_lru_counter(hap_priv.server, fd);
+            pass->messages++;
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Notification Sent");
+            ESP_MFI_DEBUG_PLAIN("Socket fd: %d; Event message: %s\n", fd,
+                    pass->group_bufs[g] + HAP_NOTIF_HDR_SPACE);
+        }
+    }
+    for (k = 0; k < HAP_MAX_SESSIONS; k++) {
+        hap_session_put(pass->sessions[k]);
+        pass->sessions[k] = NULL;
+    }
+}
 
-		snprintf(buf, sizeof(buf), HTTPD_HDR_STR,
-				strlen(notif_json));
-		hap_httpd_send(hap_priv.server, fd, buf, strlen(buf), 0);
-		/* Space for sending additional headers based on set_header */
-		hap_httpd_send(hap_priv.server, fd, "\r\n", strlen("\r\n"), 0);
-		hap_httpd_send(hap_priv.server, fd, notif_json, strlen(notif_json), 0);
-        httpd_sess_update_lru_counter(hap_priv.server, fd);
-		ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Notification Sent");
-        ESP_MFI_DEBUG_PLAIN("Socket fd: %d; Event message: %s\n", fd, notif_json);
-	}
+static void hap_send_notification(void *arg)
+{
+    int64_t trigger_ts;
+    /* Apply the updates from ISRs first, so that they go out in this pass itself */
+    hap_char_drain_isr_updates();
+    /* Take everything pending at this point. Updates from now on will trigger another pass */
+    int num_pending = hap_take_pending_notif_chars(&trigger_ts);
+    int64_t pass_ts = hap_notif_latency_now();
+    if (trigger_ts) {
+        hap_notif_latency_record(HAP_NOTIF_STAGE_DISPATCH, pass_ts - trigger_ts);
+    }
+
+    /* If no characteristic notifications are pending, just exit */
+    if (num_pending == 0) {
+        return;
+    }
+
+    /* The characteristics are sent in chunks of max_event_notif_chars per EVENT message */
+    int num_char = hap_priv.cfg.max_event_notif_chars;
+    if (num_char <= 0 || num_char > num_pending) {
+        num_char = num_pending;
+    }
+    hap_notif_pass_t pass = {0};
+    /* Single allocation for the queue timestamps, characteristic pointers and the per
+     * characteristic controller masks, in that order to keep each array aligned
+     */
+    pass.ts = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_JSON, num_char,
+            sizeof(int64_t) + sizeof(hap_char_t *) + sizeof(uint16_t));
+    if (pass.ts) {
+        pass.char_arr = (hap_char_t **)&pass.ts[num_char];
+        pass.masks = (uint16_t *)&pass.char_arr[num_char];
+    }
+
+    int i, g;
+    do {
+        hap_char_t *hc;
+        int64_t notif_ts;
+        i = 0;
+        /* The characteristics popped cannot get deleted till the chunk is encoded */
+        hap_notif_pass_lock();
+        while ((i < num_char) && (hc = hap_pop_pending_notif_char(&notif_ts)) != NULL) {
+            if (!pass.char_arr) {
+                /* Nothing can be sent. Just drain the list */
+                continue;
+            }
+            if (notif_ts) {
+                /* Time spent waiting for the trigger. 0 if the pass was already triggered */
+                hap_notif_latency_record(HAP_NOTIF_STAGE_QUEUE,
+                        (trigger_ts > notif_ts) ? trigger_ts - notif_ts : 0);
+            }
+            pass.ts[i] = notif_ts;
+            pass.char_arr[i++] = hc;
+        }
+        if (i) {
+            hap_encode_notification_chunk(&pass, i);
+        }
+        hap_notif_pass_unlock();
+        if (i) {
+            hap_send_notification_chunk(&pass, i);
+        }
+    } while (i);
+    hap_notif_count_pass(pass.messages, pass.payloads);
     /* If no controller was connected and no disconnected event was sent,
      * reannaounce mDNS. That will increment state number as required
      * by HAP Spec R15.
      */
-    if (!ctrl_connected && !hap_priv.disconnected_event_sent) {
-        hap_mdns_announce(false);
+    if (!pass.ctrl_connected && !hap_priv.disconnected_event_sent) {
+        /* Rate limited by the HAP main loop */
+        hap_send_event(HAP_INTERNAL_EVENT_MDNS_ANNOUNCE);
         hap_priv.disconnected_event_sent = true;
     }
-    hap_platform_memory_free(char_arr);
+    for (g = 0; g < HAP_MAX_SESSIONS; g++) {
+        if (pass.group_bufs[g]) {
+            hap_platform_memory_free_tagged(pass.group_bufs[g]);
+        }
+    }
+    if (pass.ts) {
+        hap_platform_memory_free_tagged(pass.ts);
+    }
 }
 
 void hap_http_debug_enable()
@@ -1430,9 +1707,62 @@ void hap_http_debug_disable()
     http_debug = false;
 }
 
+/* Notifications are sent from a dedicated task, so that the HTTP server can keep serving
+ * requests while a large set of EVENT messages is being encrypted and written out.
+ * Writes on a socket are serialised with the HTTP server using the session lock.
+ */
+static TaskHandle_t hap_notif_task_handle;
+
+static void hap_notif_task(void *arg)
+{
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "HAP Notification Task Started");
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        hap_send_notification(NULL);
+    }
+}
+
+static int hap_notif_task_start()
+{
+    if (hap_notif_task_handle) {
+        return HAP_SUCCESS;
+    }
+    if (xTaskCreate(hap_notif_task, "hap-notif", CONFIG_HAP_NOTIF_TASK_STACK_SIZE, NULL,
+                CONFIG_HAP_NOTIF_TASK_PRIORITY, &hap_notif_task_handle) != pdPASS) {
+        hap_notif_task_handle = NULL;
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
 void hap_http_send_notif()
 {
-	httpd_queue_work(hap_priv.server, hap_send_notification, NULL);
+    if (hap_notif_task_handle) {
+        xTaskNotifyGive(hap_notif_task_handle);
+        return;
+    }
+    /* Fall back to sending from the HTTP server's context */
+	if (httpd_queue_work(hap_priv.server, hap_send_notification, NULL) != ESP_OK) {
+        hap_notif_trigger_failed();
+    }
+}
+
+/* Wake up the notification task for updates from an ISR. Can be called from task context too */
+int hap_http_send_notif_from_isr()
+{
+    if (!hap_notif_task_handle) {
+        return HAP_FAIL;
+    }
+    if (xPortInIsrContext() == pdTRUE) {
+        BaseType_t higher_prio_task_woken = pdFALSE;
+        vTaskNotifyGiveFromISR(hap_notif_task_handle, &higher_prio_task_woken);
+        if (higher_prio_task_woken == pdTRUE) {
+            portYIELD_FROM_ISR();
+        }
+    } else {
+        xTaskNotifyGive(hap_notif_task_handle);
+    }
+    return HAP_SUCCESS;
 }
 
 static bool hap_http_registered;
@@ -1497,8 +1827,10 @@ int hap_mdns_deannounce(void)
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Deannouncing _hap._tcp mDNS service");
         ret = hap_mdns_serv_stop(&hap_priv.hap_mdns_handle);
         if (ret == HAP_SUCCESS) {
-            /* Wait for some time for the packets to go out on network */
-            vTaskDelay(2000 / hap_platform_os_get_msec_per_tick());
+            /* This does not wait for the packets to go out on the network.
+             * The caller should allow some time (HAP_MDNS_DEANNOUNCE_WAIT_MS) for that
+             * before going down.
+             */
             first_announce_done = false;
         }
     }
@@ -1603,6 +1935,9 @@ int hap_ip_services_start()
     if (hap_ip_services_started) {
         return HAP_SUCCESS;
     }
+    if (hap_notif_task_start() != HAP_SUCCESS) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Failed to create notification task. Notifications will be sent by the HTTP server");
+    }
     hap_register_http_handlers();
     if (hap_mdns_announce(false) != HAP_SUCCESS) {
         hap_unregister_http_handlers();
@@ -21,13 +21,201 @@
  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  *
  */
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
 #include <hap.h>
 #include <esp_mfi_debug.h>
 #include <hap_platform_keystore.h>
+#include <hap_platform_memory.h>
+#include <esp_hap_keystore.h>
 
 static bool keystore_init_done;
 static char *hap_platform_nvs_partition;
 static char *hap_platform_factory_nvs_partition;
+/* Serialises the cache as well as the platform calls */
+static SemaphoreHandle_t keystore_mutex;
+static hap_keystore_stats_t keystore_stats;
+
+#define KEYSTORE_LOCK()     xSemaphoreTake(keystore_mutex, portMAX_DELAY)
+#define KEYSTORE_UNLOCK()   xSemaphoreGive(keystore_mutex)
+
+#ifdef CONFIG_HAP_KEYSTORE_CACHE
+/* Maximum key and namespace length supported by NVS, including the NULL termination */
+#define HAP_KEYSTORE_NAME_LEN   16
+
+/* A cached key. If "present" is false, the key is known to be absent from the keystore.
+ * If "dirty" is true, the value (or the deletion) is yet to be written.
+ */
+typedef struct hap_keystore_entry {
+    struct hap_keystore_entry *next;
+    char key[HAP_KEYSTORE_NAME_LEN];
+    bool present;
+    bool dirty;
+    size_t len;
+    uint8_t val[];
+} hap_keystore_entry_t;
+
+typedef struct hap_keystore_ns {
+    struct hap_keystore_ns *next;
+    const char *part_name;
+    char name[HAP_KEYSTORE_NAME_LEN];
+    bool dirty;
+    hap_keystore_entry_t *entries;
+} hap_keystore_ns_t;
+
+static hap_keystore_ns_t *keystore_cache;
+/* Depth of nested hap_keystore_begin_batch() calls */
+static int keystore_batch_depth;
+
+static hap_keystore_ns_t *hap_keystore_find_ns(const char *part_name, const char *name_space, bool create)
+{
+    hap_keystore_ns_t *ns;
+    for (ns = keystore_cache; ns; ns = ns->next) {
+        if ((ns->part_name == part_name) && !strcmp(ns->name, name_space)) {
+            return ns;
+        }
+    }
+    if (!create || (strlen(name_space) >= HAP_KEYSTORE_NAME_LEN)) {
+        return NULL;
+    }
+    ns = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_KEYSTORE, 1, sizeof(hap_keystore_ns_t));
+    if (ns) {
+        ns->part_name = part_name;
+        strcpy(ns->name, name_space);
+        ns->next = keystore_cache;
+        keystore_cache = ns;
+    }
+    return ns;
+}
+
+static hap_keystore_entry_t *hap_keystore_find_entry(hap_keystore_ns_t *ns, const char *key)
+{
+    hap_keystore_entry_t *entry;
+    for (entry = ns->entries; entry; entry = entry->next) {
+        if (!strcmp(entry->key, key)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Adds or replaces the cached value of a key. A NULL val caches the key as absent */
+static hap_keystore_entry_t *hap_keystore_cache_put(hap_keystore_ns_t *ns, const char *key,
+        const uint8_t *val, size_t len)
+{
+    if (strlen(key) >= HAP_KEYSTORE_NAME_LEN) {
+        return NULL;
+    }
+    if (!val) {
+        len = 0;
+    }
+    hap_keystore_entry_t **prev = &ns->entries;
+    hap_keystore_entry_t *entry = ns->entries;
+    while (entry && strcmp(entry->key, key)) {
+        prev = &entry->next;
+        entry = entry->next;
+    }
+    if (!entry || (entry->len != len)) {
+        hap_keystore_entry_t *new_entry = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_KEYSTORE, 1,
+                sizeof(hap_keystore_entry_t) + len);
+        if (!new_entry) {
+            return NULL;
+        }
+        strcpy(new_entry->key, key);
+        if (entry) {
+            new_entry->next = entry->next;
+            new_entry->dirty = entry->dirty;
+            hap_platform_memory_free_tagged(entry);
+        } else {
+            new_entry->next = NULL;
+        }
+        *prev = new_entry;
+        entry = new_entry;
+    }
+    entry->present = val ? true : false;
+    entry->len = len;
+    if (val) {
+        memcpy(entry->val, val, len);
+    }
+    return entry;
+}
+
+static void hap_keystore_free_ns_entries(hap_keystore_ns_t *ns)
+{
+    while (ns->entries) {
+        hap_keystore_entry_t *entry = ns->entries;
+        ns->entries = entry->next;
+        hap_platform_memory_free_tagged(entry);
+    }
+    ns->dirty = false;
+}
+
+static int hap_keystore_flush_ns(hap_keystore_ns_t *ns)
+{
+    if (!ns->dirty) {
+        return HAP_SUCCESS;
+    }
+    int ret = HAP_SUCCESS;
+    hap_keystore_entry_t *entry;
+    for (entry = ns->entries; entry; entry = entry->next) {
+        if (!entry->dirty) {
+            continue;
+        }
+        if (hap_platform_keystore_write(ns->part_name, ns->name, entry->key,
+                    entry->present ? entry->val : NULL, entry->len) != 0) {
+            ret = HAP_FAIL;
+            continue;
+        }
+        keystore_stats.nvs_writes++;
+        entry->dirty = false;
+    }
+    if (hap_platform_keystore_commit(ns->part_name, ns->name) != 0) {
+        ret = HAP_FAIL;
+    } else {
+        keystore_stats.commits++;
+    }
+    if (ret == HAP_SUCCESS) {
+        ns->dirty = false;
+    }
+    return ret;
+}
+
+static int hap_keystore_flush_all(void)
+{
+    int ret = HAP_SUCCESS;
+    hap_keystore_ns_t *ns;
+    for (ns = keystore_cache; ns; ns = ns->next) {
+        if (hap_keystore_flush_ns(ns) != HAP_SUCCESS) {
+            ret = HAP_FAIL;
+        }
+    }
+    return ret;
+}
+#endif /* CONFIG_HAP_KEYSTORE_CACHE */
+
+/* Journaled counters.
+ * Each counter owns one sector of the (optional) journal partition. An update just programs
+ * the next free 8 byte record {val, ~val} in the sector, so the flash sees no erase and no
+ * NVS entry rewrite. The records get written in order, so the erased ones (all 0xff) are a
+ * suffix of the sector. When the sector fills up, or the counter wraps around, the value is
+ * first checkpointed to NVS and then the sector is erased, so that an interruption at any
+ * point loses at most the update being made.
+ * The latest value is the larger of the last complete record and the NVS checkpoint. The
+ * checkpoint is the newer one if the erase after it got interrupted, or if a firmware
+ * without the journal partition has updated the key since.
+ */
+#define HAP_KEYSTORE_MAX_COUNTERS   4
+
+typedef struct {
+    uint32_t val;
+    uint32_t inv;
+} hap_keystore_journal_rec_t;
+
+static size_t journal_size;
+static size_t journal_sector_size;
+static hap_keystore_counter_t *keystore_counters[HAP_KEYSTORE_MAX_COUNTERS];
 
 int hap_keystore_init()
 {
@@ -35,15 +223,26 @@ int hap_keystore_init()
         return HAP_SUCCESS;
     }
 
+    keystore_mutex = xSemaphoreCreateMutex();
+    if (!keystore_mutex) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Keystore mutex creation failed");
+        return HAP_FAIL;
+    }
     hap_platform_nvs_partition = hap_platform_keystore_get_nvs_partition_name();
     int err = hap_platform_keystore_init_partition(hap_platform_nvs_partition, false);
     if (err != 0) {
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Error (%d) NVS init failed", err);
+        vSemaphoreDelete(keystore_mutex);
+        keystore_mutex = NULL;
         return HAP_FAIL;
     }
     /* Not cheking the return value, as this partition may be absent */
     hap_platform_factory_nvs_partition = hap_platform_keystore_get_factory_nvs_partition_name();
     hap_platform_keystore_init_partition(hap_platform_factory_nvs_partition, true);
+    /* The journal partition is optional too. Counters live just in NVS without it */
+    if (hap_platform_keystore_journal_open(&journal_size, &journal_sector_size) != 0) {
+        journal_size = journal_sector_size = 0;
+    }
 
     keystore_init_done = true;
     ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Keystore initialised");
@@ -56,11 +255,47 @@ int __hap_keystore_get(const char *part_name, const char *name_space, const char
         return HAP_FAIL;
     }
 
-    int err  = hap_platform_keystore_get(part_name, name_space, key, val, val_size);
-    if (err != 0) {
-        return HAP_FAIL;
+    int ret = HAP_FAIL;
+    KEYSTORE_LOCK();
+    int64_t start = esp_timer_get_time();
+    keystore_stats.reads++;
+#ifdef CONFIG_HAP_KEYSTORE_CACHE
+    hap_keystore_ns_t *ns = hap_keystore_find_ns(part_name, name_space, true);
+    hap_keystore_entry_t *entry = ns ? hap_keystore_find_entry(ns, key) : NULL;
+    if (entry) {
+        keystore_stats.cache_hits++;
+        /* Same semantics as the NVS blob read, including a NULL val to get the length */
+        if (entry->present && (!val || (entry->len <= *val_size))) {
+            if (val) {
+                memcpy(val, entry->val, entry->len);
+            }
+            *val_size = entry->len;
+            ret = HAP_SUCCESS;
+        }
+        goto get_end;
     }
-    return HAP_SUCCESS;
+#endif /* CONFIG_HAP_KEYSTORE_CACHE */
+    keystore_stats.nvs_reads++;
+    int err = hap_platform_keystore_get(part_name, name_space, key, val, val_size);
+    if (err == 0) {
+        ret = HAP_SUCCESS;
+    }
+#ifdef CONFIG_HAP_KEYSTORE_CACHE
+    if (ns) {
+        if ((err == 0) && val) {
+            hap_keystore_cache_put(ns, key, val, *val_size);
+        } else if (err == -2) {
+            /* Cache the key as absent only if it really does not exist, and not if the
+             * buffer was just too small for it.
+             */
+            hap_keystore_cache_put(ns, key, NULL, 0);
+        }
+    }
+get_end:
+#endif /* CONFIG_HAP_KEYSTORE_CACHE */
+    keystore_stats.time_us += esp_timer_get_time() - start;
+    KEYSTORE_UNLOCK();
+    return ret;
 }
 int hap_keystore_get(const char *name_space, const char *key, uint8_t *val, size_t *val_size)
 {
@@ -72,18 +307,60 @@ int hap_factory_keystore_get(const char *name_space, const char *key, uint8_t *v
     return __hap_keystore_get(hap_platform_factory_nvs_partition, name_space, key, val, val_size);
 }
 
-int __hap_keystore_set(const char *part_name, const char *name_space, const char *key, const uint8_t *val, const size_t val_len)
-
+/* Writes (val != NULL) or deletes (val == NULL) a key. If "sync" is set, the write is
+ * committed right away even within a batch.
+ */
+static int __hap_keystore_write(const char *part_name, const char *name_space, const char *key,
+        const uint8_t *val, const size_t val_len, bool sync)
 {
     if (!keystore_init_done) {
         return HAP_FAIL;
     }
 
-    int err  = hap_platform_keystore_set(part_name, name_space, key, val, val_len);
-    if (err != 0) {
+    int ret = HAP_FAIL;
+    KEYSTORE_LOCK();
+    int64_t start = esp_timer_get_time();
+    keystore_stats.writes++;
+#ifdef CONFIG_HAP_KEYSTORE_CACHE
+    hap_keystore_ns_t *ns = hap_keystore_find_ns(part_name, name_space, true);
+    hap_keystore_entry_t *entry = ns ? hap_keystore_cache_put(ns, key, val, val_len) : NULL;
+    if (entry) {
+        entry->dirty = true;
+        ns->dirty = true;
+        /* Outside a batch, writes are committed right away */
+        ret = (keystore_batch_depth && !sync) ? HAP_SUCCESS : hap_keystore_flush_ns(ns);
+        goto write_end;
+    }
+    /* Could not be cached. Drop any stale entry and write through */
+    if (ns) {
+        hap_keystore_free_ns_entries(ns);
+    }
+#endif /* CONFIG_HAP_KEYSTORE_CACHE */
+    int err;
+    if (val) {
+        err = hap_platform_keystore_set(part_name, name_space, key, val, val_len);
+    } else {
+        err = hap_platform_keystore_delete(part_name, name_space, key);
+    }
+    if (err == 0) {
+        keystore_stats.nvs_writes++;
+        keystore_stats.commits++;
+        ret = HAP_SUCCESS;
+    }
+#ifdef CONFIG_HAP_KEYSTORE_CACHE
+write_end:
+#endif /* CONFIG_HAP_KEYSTORE_CACHE */
+    keystore_stats.time_us += esp_timer_get_time() - start;
+    KEYSTORE_UNLOCK();
+    return ret;
+}
+
+int __hap_keystore_set(const char *part_name, const char *name_space, const char *key, const uint8_t *val, const size_t val_len)
+{
+    if (!val) {
         return HAP_FAIL;
     }
-    return HAP_SUCCESS;
+    return __hap_keystore_write(part_name, name_space, key, val, val_len, false);
 }
 
 int hap_keystore_set(const char *name_space, const char *key, const uint8_t *val, const size_t val_len)
@@ -96,26 +373,201 @@ int hap_factory_keystore_set(const char *name_space, const char *key, const uint
     return __hap_keystore_set(hap_platform_factory_nvs_partition, name_space, key, val, val_len);
 }
 
-int hap_keystore_delete(const char *name_space, const char *key)
+static uint32_t hap_keystore_journal_recs()
 {
-    if (!keystore_init_done) {
-        return HAP_FAIL;
+    return journal_sector_size / sizeof(hap_keystore_journal_rec_t);
+}
+
+static size_t hap_keystore_journal_offset(hap_keystore_counter_t *ctr, uint32_t index)
+{
+    return ctr->sector * journal_sector_size + index * sizeof(hap_keystore_journal_rec_t);
+}
+
+static bool hap_keystore_journal_read_rec(hap_keystore_counter_t *ctr, uint32_t index,
+        hap_keystore_journal_rec_t *rec)
+{
+    if (hap_platform_keystore_journal_read(hap_keystore_journal_offset(ctr, index), rec, sizeof(*rec)) != 0) {
+        /* Treat it as used, so that it never gets written */
+        rec->val = rec->inv = 0;
+        return false;
     }
+    return true;
+}
 
-    int err = hap_platform_keystore_delete(hap_platform_nvs_partition, name_space, key);
-    if (err != 0) {
+/* Erases the journal sector of a counter. Should be called with the keystore lock held */
+static int hap_keystore_journal_reset(hap_keystore_counter_t *ctr)
+{
+    keystore_stats.journal_erases++;
+    if (hap_platform_keystore_journal_erase(ctr->sector * journal_sector_size, journal_sector_size) != 0) {
+        /* Force a compaction attempt on the next update */
+        ctr->next = hap_keystore_journal_recs();
         return HAP_FAIL;
     }
+    ctr->next = 0;
     return HAP_SUCCESS;
 }
 
+/* Finds the latest value in the journal and the next free record.
+ * Should be called with the keystore lock held.
+ */
+static bool hap_keystore_journal_scan(hap_keystore_counter_t *ctr)
+{
+    hap_keystore_journal_rec_t rec;
+    uint32_t lo = 0, hi = hap_keystore_journal_recs();
+    /* Binary search for the first erased record */
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        hap_keystore_journal_read_rec(ctr, mid, &rec);
+        if (rec.val == 0xffffffff && rec.inv == 0xffffffff) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    ctr->next = lo;
+    /* The last record may have been only partially programmed because of a power loss */
+    while (lo--) {
+        hap_keystore_journal_read_rec(ctr, lo, &rec);
+        if (rec.val == ~rec.inv) {
+            ctr->val = rec.val;
+            return true;
+        }
+    }
+    return false;
+}
+
+int hap_keystore_counter_init(hap_keystore_counter_t *ctr, const char *name_space, const char *key,
+        size_t val_size, int sector)
+{
+    if (!keystore_init_done || !ctr || val_size > sizeof(ctr->val)) {
+        return HAP_FAIL;
+    }
+    memset(ctr, 0, sizeof(*ctr));
+    ctr->name_space = name_space;
+    ctr->key = key;
+    ctr->val_size = val_size;
+    ctr->sector = -1;
+    if (journal_sector_size && sector >= 0 && ((sector + 1) * journal_sector_size <= journal_size)) {
+        int i, free_slot = -1;
+        for (i = 0; i < HAP_KEYSTORE_MAX_COUNTERS; i++) {
+            if (keystore_counters[i] == ctr) {
+                free_slot = i;
+                break;
+            } else if (!keystore_counters[i] && free_slot < 0) {
+                free_slot = i;
+            }
+        }
+        if (free_slot >= 0) {
+            keystore_counters[free_slot] = ctr;
+            ctr->sector = sector;
+        }
+    }
+    bool found = false;
+    if (ctr->sector >= 0) {
+        KEYSTORE_LOCK();
+        found = hap_keystore_journal_scan(ctr);
+        KEYSTORE_UNLOCK();
+    }
+    uint32_t val = 0;
+    size_t len = val_size;
+    if (hap_keystore_get(name_space, key, (uint8_t *)&val, &len) == HAP_SUCCESS) {
+        if (!found || val > ctr->val) {
+            ctr->val = val;
+        }
+        found = true;
+    }
+    return found ? HAP_SUCCESS : HAP_FAIL;
+}
+
+int hap_keystore_counter_set(hap_keystore_counter_t *ctr, uint32_t val)
+{
+    if (!keystore_init_done || !ctr) {
+        return HAP_FAIL;
+    }
+    /* A smaller value has to go to NVS, else the larger one in there would win on the next init */
+    bool wrapped = (val < ctr->val);
+    ctr->val = val;
+    if (ctr->sector < 0) {
+        return hap_keystore_set(ctr->name_space, ctr->key, (uint8_t *)&ctr->val, ctr->val_size);
+    }
+    KEYSTORE_LOCK();
+    if (!wrapped && ctr->next < hap_keystore_journal_recs()) {
+        hap_keystore_journal_rec_t rec = {
+            .val = val,
+            .inv = ~val,
+        };
+        int64_t start = esp_timer_get_time();
+        int err = hap_platform_keystore_journal_write(hap_keystore_journal_offset(ctr, ctr->next),
+                &rec, sizeof(rec));
+        /* Move ahead even on a failure, since the record may have got partially programmed */
+        ctr->next++;
+        keystore_stats.journal_writes++;
+        keystore_stats.time_us += esp_timer_get_time() - start;
+        if (err == 0) {
+            KEYSTORE_UNLOCK();
+            return HAP_SUCCESS;
+        }
+    }
+    KEYSTORE_UNLOCK();
+    /* Compaction. The checkpoint has to be on the flash before the journal gets erased */
+    if (__hap_keystore_write(hap_platform_nvs_partition, ctr->name_space, ctr->key,
+                (uint8_t *)&ctr->val, ctr->val_size, true) != HAP_SUCCESS) {
+        return HAP_FAIL;
+    }
+    KEYSTORE_LOCK();
+    int ret = hap_keystore_journal_reset(ctr);
+    KEYSTORE_UNLOCK();
+    return ret;
+}
+
+/* Erases the journals of the counters in a namespace. For a NULL namespace, the complete
+ * journal partition, including any sectors not claimed in this run, gets erased.
+ * Should be called with the keystore lock held
+ */
+static void hap_keystore_counters_reset(const char *name_space)
+{
+    if (!name_space) {
+        keystore_stats.journal_erases++;
+        hap_platform_keystore_journal_erase(0, journal_size - (journal_size % journal_sector_size));
+    }
+    int i;
+    for (i = 0; i < HAP_KEYSTORE_MAX_COUNTERS; i++) {
+        hap_keystore_counter_t *ctr = keystore_counters[i];
+        if (!ctr) {
+            continue;
+        }
+        if (!name_space) {
+            ctr->next = 0;
+            ctr->val = 0;
+        } else if (!strcmp(ctr->name_space, name_space)) {
+            hap_keystore_journal_reset(ctr);
+            ctr->val = 0;
+        }
+    }
+}
+
+int hap_keystore_delete(const char *name_space, const char *key)
+{
+    return __hap_keystore_write(hap_platform_nvs_partition, name_space, key, NULL, 0, false);
+}
+
 int hap_keystore_delete_namespace(const char *name_space)
 {
     if (!keystore_init_done) {
         return HAP_FAIL;
     }
 
+    KEYSTORE_LOCK();
+#ifdef CONFIG_HAP_KEYSTORE_CACHE
+    /* Pending writes to this namespace are moot now */
+    hap_keystore_ns_t *ns = hap_keystore_find_ns(hap_platform_nvs_partition, name_space, false);
+    if (ns) {
+        hap_keystore_free_ns_entries(ns);
+    }
+#endif /* CONFIG_HAP_KEYSTORE_CACHE */
+    hap_keystore_counters_reset(name_space);
     int err = hap_platform_keystore_delete_namespace(hap_platform_nvs_partition, name_space);
+    KEYSTORE_UNLOCK();
     if (err != 0) {
         return HAP_FAIL;
     }
@@ -124,5 +576,83 @@ int hap_keystore_delete_namespace(const char *name_space)
 
 void hap_keystore_erase_all_data()
 {
+    if (keystore_mutex) {
+        KEYSTORE_LOCK();
+    }
+#ifdef CONFIG_HAP_KEYSTORE_CACHE
+    hap_keystore_ns_t *ns;
+    for (ns = keystore_cache; ns; ns = ns->next) {
+        if (ns->part_name == hap_platform_nvs_partition) {
+            hap_keystore_free_ns_entries(ns);
+        }
+    }
+#endif /* CONFIG_HAP_KEYSTORE_CACHE */
     hap_platfrom_keystore_erase_partition(hap_platform_nvs_partition);
+    if (journal_size) {
+        hap_keystore_counters_reset(NULL);
+    }
+    if (keystore_mutex) {
+        KEYSTORE_UNLOCK();
+    }
+}
+
+void hap_keystore_begin_batch(void)
+{
+#ifdef CONFIG_HAP_KEYSTORE_CACHE
+    if (!keystore_init_done) {
+        return;
+    }
+    KEYSTORE_LOCK();
+    keystore_batch_depth++;
+    KEYSTORE_UNLOCK();
+#endif /* CONFIG_HAP_KEYSTORE_CACHE */
+}
+
+int hap_keystore_flush(void)
+{
+    int ret = HAP_SUCCESS;
+#ifdef CONFIG_HAP_KEYSTORE_CACHE
+    if (!keystore_init_done) {
+        return HAP_FAIL;
+    }
+    KEYSTORE_LOCK();
+    int64_t start = esp_timer_get_time();
+    ret = hap_keystore_flush_all();
+    keystore_stats.time_us += esp_timer_get_time() - start;
+    KEYSTORE_UNLOCK();
+    if (ret != HAP_SUCCESS) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Keystore flush failed");
+    }
+#endif /* CONFIG_HAP_KEYSTORE_CACHE */
+    return ret;
+}
+
+int hap_keystore_end_batch(void)
+{
+#ifdef CONFIG_HAP_KEYSTORE_CACHE
+    if (!keystore_init_done) {
+        return HAP_FAIL;
+    }
+    KEYSTORE_LOCK();
+    if (keystore_batch_depth) {
+        keystore_batch_depth--;
+    }
+    bool flush = (keystore_batch_depth == 0);
+    KEYSTORE_UNLOCK();
+    if (flush) {
+        return hap_keystore_flush();
+    }
+#endif /* CONFIG_HAP_KEYSTORE_CACHE */
+    return HAP_SUCCESS;
+}
+
+int hap_keystore_get_stats(hap_keystore_stats_t *stats)
+{
+    if (!stats || !keystore_init_done) {
+        return HAP_FAIL;
+    }
+    KEYSTORE_LOCK();
+    *stats = keystore_stats;
+    KEYSTORE_UNLOCK();
+    return HAP_SUCCESS;
 }
@@ -22,11 +22,14 @@
  *
  */
 #include <errno.h>
+#include <string.h>
 #include <unistd.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/queue.h>
+#include <freertos/event_groups.h>
 #include <esp_event.h>
+#include <esp_timer.h>
 #include <esp_wifi.h>
 
 #include <esp_mfi_debug.h>
@@ -41,138 +44,525 @@
 #include <esp_hap_wac.h>
 #include <esp_hap_bct_priv.h>
 #include <esp_hap_pair_verify.h>
+#include <esp_hap_async.h>
 #include <hap_platform_os.h>
 
+/* Idempotent internal events are posted as bits in hap_loop_events, so that any number of
+ * them coalesce into a single run of the handler. Only one-shot commands go on xQueue,
+ * so bursts of notifications or bridge updates can never crowd out control events like
+ * a pairing reset.
+ */
+#define HAP_LOOP_BIT_CMD            (1 << 0) /* Command posted on xQueue */
+#define HAP_LOOP_BIT_NOTIF          (1 << 1) /* Send pending notifications */
+#define HAP_LOOP_BIT_CONFIG_NUM     (1 << 2) /* Increment config number and re-announce */
+#define HAP_LOOP_BIT_MDNS_ANNOUNCE  (1 << 3) /* Re-announce mDNS */
+#define HAP_LOOP_BIT_DB_CHANGED     (1 << 4) /* Database changed. Debounced config number update */
+#define HAP_LOOP_BIT_DB_COMMITTED   (1 << 5) /* Database changes complete. Update config number now */
+#define HAP_LOOP_BIT_CHAR_PERSIST   (1 << 6) /* Persistent characteristic values changed */
+#define HAP_LOOP_BITS_ALL           (HAP_LOOP_BIT_CMD | HAP_LOOP_BIT_NOTIF | \
+                                    HAP_LOOP_BIT_CONFIG_NUM | HAP_LOOP_BIT_MDNS_ANNOUNCE | \
+                                    HAP_LOOP_BIT_DB_CHANGED | HAP_LOOP_BIT_DB_COMMITTED | \
+                                    HAP_LOOP_BIT_CHAR_PERSIST)
+#define HAP_LOOP_CMD_QUEUE_LEN      10
+
 static QueueHandle_t xQueue;
+static EventGroupHandle_t hap_loop_events;
 ESP_EVENT_DEFINE_BASE(HAP_EVENT);
 
 const char * hap_get_version(void)
 {
     return MFI_VER;
 }
+/* Delay before acting on a command, so that the response can reach the controller, or the
+ * caller gets some time for any additional operations
+ */
+#define HAP_CMD_DELAY_MS            1000
+/* Time for which the network stays down for a BCT hot plug */
+#define HAP_HOT_PLUG_DOWN_MS        (10 * 1000)
+/* Quiet period after the last database change, before the config number gets incremented */
+#ifdef CONFIG_HAP_CONFIG_NUM_DEBOUNCE_MS
+#define HAP_CONFIG_NUM_DEBOUNCE_MS  CONFIG_HAP_CONFIG_NUM_DEBOUNCE_MS
+#else /* CONFIG_HAP_CONFIG_NUM_DEBOUNCE_MS */
+#define HAP_CONFIG_NUM_DEBOUNCE_MS  2000
+#endif /* CONFIG_HAP_CONFIG_NUM_DEBOUNCE_MS */
+/* A continuous stream of changes cannot hold back the update for longer than this */
+#define HAP_CONFIG_NUM_MAX_DELAY_MS (5 * HAP_CONFIG_NUM_DEBOUNCE_MS)
+/* Minimum interval between two mDNS re-announcements */
+#ifdef CONFIG_HAP_MDNS_MIN_INTERVAL_MS
+#define HAP_MDNS_MIN_INTERVAL_MS        CONFIG_HAP_MDNS_MIN_INTERVAL_MS
+#else /* CONFIG_HAP_MDNS_MIN_INTERVAL_MS */
+#define HAP_MDNS_MIN_INTERVAL_MS        1000
+#endif /* CONFIG_HAP_MDNS_MIN_INTERVAL_MS */
+/* Minimum interval between two saves of the persistent characteristic values */
+#ifdef CONFIG_HAP_CHAR_PERSIST_INTERVAL_MS
+#define HAP_CHAR_PERSIST_INTERVAL_MS    CONFIG_HAP_CHAR_PERSIST_INTERVAL_MS
+#else /* CONFIG_HAP_CHAR_PERSIST_INTERVAL_MS */
+#define HAP_CHAR_PERSIST_INTERVAL_MS    10000
+#endif /* CONFIG_HAP_CHAR_PERSIST_INTERVAL_MS */
+
+/* Delayed actions are kept on a hashed timer wheel, run by the HAP main loop itself.
+ * An action scheduled "delay" ticks ahead goes into slot (cur + delay) % HAP_WHEEL_SLOTS
+ * with (delay - 1) / HAP_WHEEL_SLOTS full rotations to wait for. The loop just waits for
+ * the next wheel tick along with its events, so nothing blocks while an action is pending.
+ */
+#define HAP_WHEEL_SLOTS             16
+#define HAP_WHEEL_TICK_MS           100
+#define HAP_WHEEL_MAX_ACTIONS       8
+
+typedef struct hap_wheel_entry {
+    hap_loop_action_t action;
+    void *arg;
+    uint32_t rotations;
+    struct hap_wheel_entry *next;
+} hap_wheel_entry_t;
+
+static hap_wheel_entry_t hap_wheel_pool[HAP_WHEEL_MAX_ACTIONS];
+static hap_wheel_entry_t *hap_wheel_free_list;
+static hap_wheel_entry_t *hap_wheel[HAP_WHEEL_SLOTS];
+static uint32_t hap_wheel_cur;
+static int hap_wheel_cnt;
+/* OS tick at which the wheel last moved */
+static TickType_t hap_wheel_last;
+static TaskHandle_t hap_loop_task_handle;
+
+static TickType_t hap_wheel_tick_period()
+{
+    TickType_t period = HAP_WHEEL_TICK_MS / hap_platform_os_get_msec_per_tick();
+    return period ? period : 1;
+}
+
+static void hap_wheel_init()
+{
+    int i;
+    memset(hap_wheel, 0, sizeof(hap_wheel));
+    hap_wheel_free_list = NULL;
+    for (i = 0; i < HAP_WHEEL_MAX_ACTIONS; i++) {
+        hap_wheel_pool[i].next = hap_wheel_free_list;
+        hap_wheel_free_list = &hap_wheel_pool[i];
+    }
+    hap_wheel_cur = 0;
+    hap_wheel_cnt = 0;
+}
+
+/* Schedule an action to be run by the HAP main loop after delay_ms.
+ * Can be called only from the HAP main loop, i.e. from an event handler or another action.
+ */
+int hap_loop_schedule(hap_loop_action_t action, void *arg, uint32_t delay_ms)
+{
+    if (!action || !hap_loop_task_handle ||
+            xTaskGetCurrentTaskHandle() != hap_loop_task_handle) {
+        return HAP_FAIL;
+    }
+    hap_wheel_entry_t *entry = hap_wheel_free_list;
+    if (!entry) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "No free slot for a delayed action");
+        return HAP_FAIL;
+    }
+    hap_wheel_free_list = entry->next;
+    if (!hap_wheel_cnt) {
+        /* Start counting from now, rather than the last time the wheel moved */
+        hap_wheel_last = xTaskGetTickCount();
+    }
+    uint32_t ticks = (delay_ms + HAP_WHEEL_TICK_MS - 1) / HAP_WHEEL_TICK_MS;
+    if (!ticks) {
+        ticks = 1;
+    }
+    uint32_t slot = (hap_wheel_cur + ticks) % HAP_WHEEL_SLOTS;
+    entry->action = action;
+    entry->arg = arg;
+    entry->rotations = (ticks - 1) / HAP_WHEEL_SLOTS;
+    entry->next = hap_wheel[slot];
+    hap_wheel[slot] = entry;
+    hap_wheel_cnt++;
+    return HAP_SUCCESS;
+}
+
+/* Schedule an action, or as a last resort, if that fails, wait and run it right away */
+static void hap_loop_run_later(hap_loop_action_t action, void *arg, uint32_t delay_ms)
+{
+    if (hap_loop_schedule(action, arg, delay_ms) != HAP_SUCCESS) {
+        vTaskDelay(delay_ms / hap_platform_os_get_msec_per_tick());
+        action(arg);
+    }
+}
+
+/* Move the wheel up to the current time, running the actions which are due */
+static void hap_wheel_advance()
+{
+    TickType_t period = hap_wheel_tick_period();
+    while (hap_wheel_cnt && (TickType_t)(xTaskGetTickCount() - hap_wheel_last) >= period) {
+        hap_wheel_last += period;
+        hap_wheel_cur++;
+        uint32_t slot = hap_wheel_cur % HAP_WHEEL_SLOTS;
+        /* Unlink the due entries first, since the actions may schedule new ones */
+        hap_wheel_entry_t *due = NULL;
+        hap_wheel_entry_t **prev = &hap_wheel[slot];
+        while (*prev) {
+            hap_wheel_entry_t *entry = *prev;
+            if (entry->rotations) {
+                entry->rotations--;
+                prev = &entry->next;
+            } else {
+                *prev = entry->next;
+                entry->next = due;
+                due = entry;
+                hap_wheel_cnt--;
+            }
+        }
+        while (due) {
+            hap_wheel_entry_t *entry = due;
+            due = entry->next;
+            hap_loop_action_t action = entry->action;
+            void *arg = entry->arg;
+            entry->next = hap_wheel_free_list;
+            hap_wheel_free_list = entry;
+            action(arg);
+        }
+    }
+}
+
+/* Ticks to wait for the next wheel tick. portMAX_DELAY if nothing is scheduled */
+static TickType_t hap_wheel_wait_ticks()
+{
+    if (!hap_wheel_cnt) {
+        return portMAX_DELAY;
+    }
+    TickType_t period = hap_wheel_tick_period();
+    TickType_t elapsed = xTaskGetTickCount() - hap_wheel_last;
+    return (elapsed >= period) ? 0 : period - elapsed;
+}
+
+static void hap_bct_change_name_action(void *arg)
+{
+    hap_handle_bct_change_name();
+}
+
+static void hap_hot_plug_resume_action(void *arg)
+{
+    hap_handle_hot_plug_resume();
+}
+
+static void hap_hot_plug_action(void *arg)
+{
+    hap_handle_hot_plug();
+    hap_loop_run_later(hap_hot_plug_resume_action, NULL, HAP_HOT_PLUG_DOWN_MS);
+}
+
 static void hap_nw_configured_sm(hap_internal_event_t event, hap_state_t *state)
 {
     switch (event) {
-        case HAP_INTERNAL_EVENT_ACC_PAIRED:
-            hap_mdns_announce(false);
-            break;
-        case HAP_INTERNAL_EVENT_ACC_UNPAIRED:
-            hap_mdns_announce(false);
-            break;
-        case HAP_INTERNAL_EVENT_CONFIG_NUM_UPDATED:
-            hap_increment_and_save_config_num();
-            hap_mdns_announce(false);
-            break;
         case HAP_INTERNAL_EVENT_BCT_CHANGE_NAME:
             /* Waiting for sometime to allow the response to reach the host */
-            vTaskDelay(1000 / hap_platform_os_get_msec_per_tick());
-            hap_handle_bct_change_name();
+            hap_loop_run_later(hap_bct_change_name_action, NULL, HAP_CMD_DELAY_MS);
             break;
         case HAP_INTERNAL_EVENT_BCT_HOT_PLUG:
             /* Waiting for sometime to allow the response to reach the host */
-            vTaskDelay(1000 / hap_platform_os_get_msec_per_tick());
-            hap_handle_hot_plug();
+            hap_loop_run_later(hap_hot_plug_action, NULL, HAP_CMD_DELAY_MS);
             break;
         default:
             break;
     }
 }
 
-static void hap_common_sm(hap_internal_event_t event)
+/* Set once a reset or reboot is under way. Any further such commands are ignored */
+static bool hap_reboot_pending;
+
+static void hap_restart_action(void *arg)
+{
+    esp_restart();
+}
+
+/* Second step of a reset/reboot, once the mDNS de-announcement has gone out.
+ * Erase the information as required and reboot after some time.
+ */
+static void hap_reset_erase_action(void *arg)
 {
+    hap_internal_event_t event = (hap_internal_event_t)(intptr_t)arg;
     char *reboot_reason = HAP_REBOOT_REASON_UNKNOWN;
     switch (event) {
         case HAP_INTERNAL_EVENT_RESET_PAIRINGS:
-            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Resetting all Pairing Information");
-            /* Wait for some time before erasing the information, so that the callee
-             * gets some time for any additional operations
-             */
-            vTaskDelay(1000 / hap_platform_os_get_msec_per_tick());
-            hap_close_all_sessions();
-            hap_mdns_deannounce();
             hap_erase_controller_info();
             hap_erase_accessory_info();
             reboot_reason = HAP_REBOOT_REASON_RESET_PAIRINGS;
             break;
         case HAP_INTERNAL_EVENT_RESET_TO_FACTORY:
-            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Resetting to Factory Defaults");
-            /* Wait for some time before erasing the information, so that the callee
-             * gets some time for any additional operations
-             */
-            vTaskDelay(1000 / hap_platform_os_get_msec_per_tick());
-            hap_close_all_sessions();
-            hap_mdns_deannounce();
             hap_keystore_erase_all_data();
             reboot_reason = HAP_REBOOT_REASON_RESET_TO_FACTORY;
             break;
         case HAP_INTERNAL_EVENT_RESET_HOMEKIT_DATA:
-            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Resetting all HomeKit Data");
-            /* Wait for some time before erasing the information, so that the callee
-             * gets some time for any additional operations
-             */
-            vTaskDelay(1000 / hap_platform_os_get_msec_per_tick());
-            hap_close_all_sessions();
-            hap_mdns_deannounce();
             hap_erase_controller_info();
             hap_erase_network_info();
             hap_erase_accessory_info();
             reboot_reason = HAP_REBOOT_REASON_RESET_HOMEKIT_DATA;
             break;
         case HAP_INTERNAL_EVENT_REBOOT:
-            vTaskDelay(1000 / hap_platform_os_get_msec_per_tick());
-            /* Wait for some time and then close all the active sessions
-             */
-            hap_close_all_sessions();
-            hap_mdns_deannounce();
             reboot_reason = HAP_REBOOT_REASON_REBOOT_ACC;
             break;
         case HAP_INTERNAL_EVENT_RESET_NETWORK:
-            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Resetting Network Credentials");
-            /* Wait for some time, close all the active sessions and then
-             * erase network info.
-             */
-            vTaskDelay(1000 / hap_platform_os_get_msec_per_tick());
-            hap_close_all_sessions();
-            hap_mdns_deannounce();
             hap_erase_network_info();
             reboot_reason = HAP_REBOOT_REASON_RESET_NETWORK;
             break;
-        case HAP_INTERNAL_EVENT_TRIGGER_NOTIF:
-/* TODO: Avoid direct http function. Notification could be even for iCloud or BLE.
- */
-            hap_http_send_notif();
-            return;
         default:
-            return;
-        }
+            break;
+    }
 
     /* Wait for some time after peeforming the operations and then reboot */
     ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Rebooting...");
     hap_report_event(HAP_EVENT_ACC_REBOOTING, reboot_reason, strlen(reboot_reason) + 1);
-    vTaskDelay(1000 / hap_platform_os_get_msec_per_tick());
-    esp_restart();
+    hap_loop_run_later(hap_restart_action, NULL, HAP_CMD_DELAY_MS);
+}
+
+/* First step of a reset/reboot. Close all the active sessions and de-announce mDNS */
+static void hap_reset_close_action(void *arg)
+{
+    /* Save any characteristic values still waiting for the flush interval */
+    hap_char_persist_flush();
+    hap_close_all_sessions();
+    hap_mdns_deannounce();
+    hap_loop_run_later(hap_reset_erase_action, arg, HAP_MDNS_DEANNOUNCE_WAIT_MS);
+}
+
+static void hap_common_sm(hap_internal_event_t event)
+{
+    switch (event) {
+        case HAP_INTERNAL_EVENT_RESET_PAIRINGS:
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Resetting all Pairing Information");
+            break;
+        case HAP_INTERNAL_EVENT_RESET_TO_FACTORY:
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Resetting to Factory Defaults");
+            break;
+        case HAP_INTERNAL_EVENT_RESET_HOMEKIT_DATA:
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Resetting all HomeKit Data");
+            break;
+        case HAP_INTERNAL_EVENT_REBOOT:
+            break;
+        case HAP_INTERNAL_EVENT_RESET_NETWORK:
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Resetting Network Credentials");
+            break;
+        default:
+            return;
+    }
+    if (hap_reboot_pending) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Reset/Reboot already in progress. Ignoring");
+        return;
+    }
+    hap_reboot_pending = true;
+    /* Wait for some time before closing the sessions and erasing the information,
+     * so that the callee gets some time for any additional operations.
+     * The loop keeps handling other events (like notifications) in the meanwhile.
+     */
+    hap_loop_run_later(hap_reset_close_action, (void *)(intptr_t)event, HAP_CMD_DELAY_MS);
+}
+
+/* Database changes (like bridged accessories getting added or removed) are not reflected
+ * in the config number right away. The increment, and so the flash write and the mDNS
+ * announcement, happen only once there has been no change for HAP_CONFIG_NUM_DEBOUNCE_MS,
+ * so that hot plugging a bunch of devices makes the controllers refetch the database just once.
+ * Even then, the config number is incremented only if the structural hash of the database
+ * differs from the one saved along with the config number.
+ * These are accessed only from the HAP main loop.
+ */
+static bool hap_db_change_pending;
+static bool hap_db_change_scheduled;
+static TickType_t hap_db_change_first;
+static TickType_t hap_db_change_last;
+
+static uint32_t hap_ticks_to_msec(TickType_t ticks)
+{
+    return ticks * hap_platform_os_get_msec_per_tick();
+}
+
+static void hap_db_change_action(void *arg);
+static void hap_mdns_announce_request();
+
+static void hap_db_change_flush()
+{
+    hap_db_change_pending = false;
+    if (hap_update_config_num_if_db_changed()) {
+        hap_mdns_announce_request();
+    }
+}
+
+static void hap_db_change_schedule(uint32_t delay_ms)
+{
+    if (hap_loop_schedule(hap_db_change_action, NULL, delay_ms) == HAP_SUCCESS) {
+        hap_db_change_scheduled = true;
+    } else {
+        /* No free slot. Rather than waiting, just update right away */
+        hap_db_change_flush();
+    }
+}
+
+static void hap_db_change_action(void *arg)
+{
+    hap_db_change_scheduled = false;
+    if (!hap_db_change_pending) {
+        /* Already covered by an explicit config number update */
+        return;
+    }
+    TickType_t now = xTaskGetTickCount();
+    uint32_t quiet_ms = hap_ticks_to_msec(now - hap_db_change_last);
+    uint32_t total_ms = hap_ticks_to_msec(now - hap_db_change_first);
+    if (quiet_ms < HAP_CONFIG_NUM_DEBOUNCE_MS && total_ms < HAP_CONFIG_NUM_MAX_DELAY_MS) {
+        uint32_t delay_ms = HAP_CONFIG_NUM_DEBOUNCE_MS - quiet_ms;
+        if (delay_ms > HAP_CONFIG_NUM_MAX_DELAY_MS - total_ms) {
+            delay_ms = HAP_CONFIG_NUM_MAX_DELAY_MS - total_ms;
+        }
+        hap_db_change_schedule(delay_ms);
+        return;
+    }
+    hap_db_change_flush();
+}
+
+static void hap_db_change_note()
+{
+    TickType_t now = xTaskGetTickCount();
+    hap_db_change_last = now;
+    if (!hap_db_change_pending) {
+        hap_db_change_pending = true;
+        hap_db_change_first = now;
+    }
+    if (!hap_db_change_scheduled) {
+        hap_db_change_schedule(HAP_CONFIG_NUM_DEBOUNCE_MS);
+    }
+}
+
+/* mDNS re-announcements go out at most once per HAP_MDNS_MIN_INTERVAL_MS. Requests which
+ * come in sooner get merged into a single announcement at the end of the interval, carrying
+ * the latest TXT records (and a single state number increment).
+ * Accessed only from the HAP main loop.
+ */
+static bool hap_mdns_announce_scheduled;
+static bool hap_mdns_announce_done;
+static TickType_t hap_mdns_announce_last;
+
+static void hap_mdns_announce_now()
+{
+    /* The service should not come back after the de-announcement for a reset/reboot */
+    if (hap_reboot_pending) {
+        return;
+    }
+    hap_mdns_announce(false);
+    hap_mdns_announce_last = xTaskGetTickCount();
+    hap_mdns_announce_done = true;
+}
+
+static void hap_mdns_announce_action(void *arg)
+{
+    hap_mdns_announce_scheduled = false;
+    hap_mdns_announce_now();
+}
+
+static void hap_mdns_announce_request()
+{
+    if (hap_mdns_announce_scheduled) {
+        return;
+    }
+    uint32_t elapsed_ms = hap_ticks_to_msec(xTaskGetTickCount() - hap_mdns_announce_last);
+    if (!hap_mdns_announce_done || elapsed_ms >= HAP_MDNS_MIN_INTERVAL_MS) {
+        hap_mdns_announce_now();
+    } else if (hap_loop_schedule(hap_mdns_announce_action, NULL,
+                HAP_MDNS_MIN_INTERVAL_MS - elapsed_ms) == HAP_SUCCESS) {
+        hap_mdns_announce_scheduled = true;
+    } else {
+        hap_mdns_announce_now();
+    }
+}
+
+/* Persistent characteristic values are saved HAP_CHAR_PERSIST_INTERVAL_MS after the first
+ * change, so that any further changes in the meanwhile need no additional flash writes.
+ * Accessed only from the HAP main loop.
+ */
+static bool hap_char_persist_scheduled;
+
+static void hap_char_persist_action(void *arg)
+{
+    hap_char_persist_scheduled = false;
+    hap_char_persist_flush();
+}
+
+static void hap_char_persist_note()
+{
+    if (hap_char_persist_scheduled || !hap_char_persist_pending()) {
+        return;
+    }
+    if (hap_loop_schedule(hap_char_persist_action, NULL, HAP_CHAR_PERSIST_INTERVAL_MS) == HAP_SUCCESS) {
+        hap_char_persist_scheduled = true;
+    } else {
+        hap_char_persist_flush();
+    }
+}
+
+/* Handle the coalesced idempotent events */
+static void hap_loop_handle_bits(EventBits_t bits)
+{
+    if (bits & HAP_LOOP_BIT_CONFIG_NUM) {
+        /* Any number of updates in a burst need just a single increment.
+         * This also covers any database changes waiting for the quiet period.
+         */
+        hap_db_change_pending = false;
+        hap_increment_and_save_config_num();
+    } else if (bits & HAP_LOOP_BIT_DB_COMMITTED) {
+        hap_db_change_flush();
+    } else if (bits & HAP_LOOP_BIT_DB_CHANGED) {
+        hap_db_change_note();
+    }
+    if (bits & (HAP_LOOP_BIT_CONFIG_NUM | HAP_LOOP_BIT_MDNS_ANNOUNCE)) {
+        hap_mdns_announce_request();
+    }
+    if (bits & HAP_LOOP_BIT_NOTIF) {
+/* TODO: Avoid direct http function. Notification could be even for iCloud or BLE.
+ */
+        hap_http_send_notif();
+    }
+    if (bits & HAP_LOOP_BIT_CHAR_PERSIST) {
+        hap_char_persist_note();
+    }
 }
 
 static void hap_loop_task(void *param)
 {
     hap_state_t cur_state = HAP_STATE_NONE;
-    xQueue = xQueueCreate( 10, sizeof(hap_event_ctx_t) );
     hap_event_ctx_t hap_event;
     bool loop_continue = true;
+    hap_loop_task_handle = xTaskGetCurrentTaskHandle();
     ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "HAP Main Loop Started");
+    /* Values which changed before the loop was running */
+    hap_char_persist_note();
     while (loop_continue) {
-        if (xQueueReceive(xQueue, &hap_event, portMAX_DELAY) != pdTRUE) {
-            continue;
+        /* Wait for an event or the next wheel tick, and then take and clear all the bits
+         * in one go, so that nothing set in between gets handled twice or lost.
+         */
+        xEventGroupWaitBits(hap_loop_events, HAP_LOOP_BITS_ALL, pdFALSE, pdFALSE,
+                hap_wheel_wait_ticks());
+        EventBits_t bits = xEventGroupClearBits(hap_loop_events, HAP_LOOP_BITS_ALL) & HAP_LOOP_BITS_ALL;
+        hap_wheel_advance();
+        /* Commands are handled first, so that they never wait behind the idempotent events */
+        while (loop_continue && xQueueReceive(xQueue, &hap_event, 0) == pdTRUE) {
+            if (hap_event.event == HAP_INTERNAL_EVENT_LOOP_STOP) {
+                loop_continue = false;
+                break;
+            }
+            hap_common_sm(hap_event.event);
+            hap_nw_configured_sm(hap_event.event, &cur_state);
         }
-        if (hap_event.event == HAP_INTERNAL_EVENT_LOOP_STOP) {
-            loop_continue = false;
-            continue;
+        if (loop_continue) {
+            hap_loop_handle_bits(bits);
         }
-        hap_common_sm(hap_event.event);
-        hap_nw_configured_sm(hap_event.event, &cur_state);
     }
-    vQueueDelete(xQueue);
+    if (hap_db_change_pending) {
+        /* Do not lose the update just because the loop stopped within the quiet period */
+        hap_db_change_pending = false;
+        hap_update_config_num_if_db_changed();
+    }
+    hap_char_persist_flush();
+    hap_loop_task_handle = NULL;
+    QueueHandle_t queue = xQueue;
+    EventGroupHandle_t events = hap_loop_events;
     xQueue = NULL;
+    hap_loop_events = NULL;
+    vQueueDelete(queue);
+    vEventGroupDelete(events);
     vTaskDelete(NULL);
 }
 
@@ -180,9 +570,29 @@ static bool loop_started;
 int hap_loop_start()
 {
     if (!loop_started) {
+        xQueue = xQueueCreate(HAP_LOOP_CMD_QUEUE_LEN, sizeof(hap_event_ctx_t));
+        hap_loop_events = xEventGroupCreate();
+        if (!xQueue || !hap_loop_events) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to create HAP Main Loop queue");
+            if (xQueue) {
+                vQueueDelete(xQueue);
+                xQueue = NULL;
+            }
+            if (hap_loop_events) {
+                vEventGroupDelete(hap_loop_events);
+                hap_loop_events = NULL;
+            }
+            return HAP_FAIL;
+        }
         loop_started = true;
+        hap_wheel_init();
+        hap_db_change_pending = false;
+        hap_db_change_scheduled = false;
+        hap_char_persist_scheduled = false;
+        hap_mdns_announce_scheduled = false;
+        hap_mdns_announce_done = false;
         xTaskCreate(hap_loop_task, "hap-loop", hap_priv.cfg.task_stack_size, NULL,
-                        hap_priv.cfg.task_priority, NULL);
+                        hap_priv.cfg.task_priority, &hap_loop_task_handle);
     }
     return HAP_SUCCESS;
 }
@@ -191,14 +601,59 @@ bool is_hap_loop_started()
 {
     return loop_started;
 }
+
+/* Event group bit for the idempotent events. 0 for one-shot commands */
+static EventBits_t hap_event_to_bit(hap_internal_event_t event)
+{
+    switch (event) {
+        case HAP_INTERNAL_EVENT_TRIGGER_NOTIF:
+            return HAP_LOOP_BIT_NOTIF;
+        case HAP_INTERNAL_EVENT_CONFIG_NUM_UPDATED:
+            return HAP_LOOP_BIT_CONFIG_NUM;
+        case HAP_INTERNAL_EVENT_DB_CHANGED:
+            return HAP_LOOP_BIT_DB_CHANGED;
+        case HAP_INTERNAL_EVENT_DB_COMMITTED:
+            return HAP_LOOP_BIT_DB_COMMITTED;
+        case HAP_INTERNAL_EVENT_CHAR_PERSIST:
+            return HAP_LOOP_BIT_CHAR_PERSIST;
+        case HAP_INTERNAL_EVENT_ACC_PAIRED:
+        case HAP_INTERNAL_EVENT_ACC_UNPAIRED:
+        case HAP_INTERNAL_EVENT_MDNS_ANNOUNCE:
+            return HAP_LOOP_BIT_MDNS_ANNOUNCE;
+        default:
+            return 0;
+    }
+}
+
+static int hap_loop_set_bits(EventBits_t bits)
+{
+    if (xPortInIsrContext() == pdTRUE) {
+        BaseType_t higher_prio_task_woken = pdFALSE;
+        if (xEventGroupSetBitsFromISR(hap_loop_events, bits, &higher_prio_task_woken) != pdPASS) {
+            return HAP_FAIL;
+        }
+        if (higher_prio_task_woken == pdTRUE) {
+            portYIELD_FROM_ISR();
+        }
+    } else {
+        xEventGroupSetBits(hap_loop_events, bits);
+    }
+    return HAP_SUCCESS;
+}
+
 int hap_send_event(hap_internal_event_t event)
 {
     if (!is_hap_loop_started()) {
         return HAP_FAIL;
     }
-    if (!xQueue) {
+    if (!xQueue || !hap_loop_events) {
         return HAP_FAIL;
     }
+    EventBits_t bit = hap_event_to_bit(event);
+    if (bit) {
+        /* Setting an already set bit is a no-op, so these can never overflow */
+        return hap_loop_set_bits(bit);
+    }
     hap_event_ctx_t hap_event = {
         .event = event,
     };
@@ -208,10 +663,11 @@ int hap_send_event(hap_internal_event_t event)
     } else {
         ret = xQueueSend(xQueue, &hap_event, 0);
     }
-    if (ret == pdTRUE) {
-        return HAP_SUCCESS;
+    if (ret != pdTRUE) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "HAP Main Loop command queue full. Dropping event %d", event);
+        return HAP_FAIL;
     }
-    return HAP_FAIL;
+    return hap_loop_set_bits(HAP_LOOP_BIT_CMD);
 }
 
 int hap_update_config_number()
@@ -219,6 +675,11 @@ int hap_update_config_number()
     return hap_send_event(HAP_INTERNAL_EVENT_CONFIG_NUM_UPDATED);
 }
 
+int hap_report_db_change(bool settled)
+{
+    return hap_send_event(settled ? HAP_INTERNAL_EVENT_DB_COMMITTED : HAP_INTERNAL_EVENT_DB_CHANGED);
+}
+
 int hap_loop_stop()
 {
     return hap_send_event(HAP_INTERNAL_EVENT_LOOP_STOP);
@@ -234,6 +695,55 @@ static void hap_network_event_handler(void* arg, esp_event_base_t event_base,
     }
 }
 #endif
+static hap_boot_report_t hap_boot_report;
+
+static const char *hap_boot_phase_names[HAP_BOOT_PHASE_MAX] = {
+    [HAP_BOOT_PHASE_KEYSTORE] = "Keystore",
+    [HAP_BOOT_PHASE_DATABASE] = "Database",
+    [HAP_BOOT_PHASE_ACC_SETUP] = "Accessory setup",
+    [HAP_BOOT_PHASE_CHAR_RESTORE] = "Char restore",
+    [HAP_BOOT_PHASE_SESSIONS] = "Sessions",
+    [HAP_BOOT_PHASE_HTTPD] = "HTTP server",
+    [HAP_BOOT_PHASE_EVENT_QUEUE] = "Event queue",
+    [HAP_BOOT_PHASE_LOOP] = "Main loop",
+    [HAP_BOOT_PHASE_MDNS] = "mDNS",
+    [HAP_BOOT_PHASE_IP_SERVICES] = "IP services",
+};
+
+/* Record a phase which started at "start_us" and has just ended */
+static void hap_boot_phase_end(hap_boot_phase_t phase, int64_t start_us)
+{
+    hap_boot_report.phases[phase].start_us = start_us;
+    hap_boot_report.phases[phase].duration_us = esp_timer_get_time() - start_us;
+}
+
+int hap_get_boot_report(hap_boot_report_t *report)
+{
+    if (!report) {
+        return HAP_FAIL;
+    }
+    *report = hap_boot_report;
+    return HAP_SUCCESS;
+}
+
+void hap_print_boot_report(void)
+{
+    int i;
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Startup report (%s fast-start snapshot):",
+            hap_boot_report.fast_start ? "with" : "without");
+    for (i = 0; i < HAP_BOOT_PHASE_MAX; i++) {
+        if (hap_boot_report.phases[i].start_us) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "  %-16s at %8lld us, took %7u us", hap_boot_phase_names[i],
+                    (long long)hap_boot_report.phases[i].start_us,
+                    (unsigned)hap_boot_report.phases[i].duration_us);
+        }
+    }
+    if (hap_boot_report.ready_us) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "  Reachable at %lld us, after %u keystore reads from flash",
+                (long long)hap_boot_report.ready_us, (unsigned)hap_boot_report.nvs_reads);
+    }
+}
+
 int hap_init(hap_transport_t method)
 {
     int ret = HAP_SUCCESS;
@@ -244,15 +754,22 @@ int hap_init(hap_transport_t method)
 
     hap_priv.transport = method;
 
+    int64_t phase_start = esp_timer_get_time();
     ret = hap_keystore_init();
+    hap_boot_phase_end(HAP_BOOT_PHASE_KEYSTORE, phase_start);
     if (ret != 0 ) {
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "HAP Key Store Init failed");
         return ret;
     }
 
+    /* Keystore writes till hap_start() get committed together */
+    hap_keystore_begin_batch();
+    phase_start = esp_timer_get_time();
     ret = hap_database_init();
+    hap_boot_phase_end(HAP_BOOT_PHASE_DATABASE, phase_start);
     if (ret != 0 ) {
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "HAP Database Init failed");
+        hap_keystore_end_batch();
         return ret;
     }
     ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "HAP Initialization succeeded. Version : %s", hap_get_version());
@@ -313,40 +830,90 @@ int hap_start(void)
         return HAP_FAIL;
     }
 
+    int64_t phase_start = esp_timer_get_time();
     ret = hap_acc_setup_init();
+    hap_boot_phase_end(HAP_BOOT_PHASE_ACC_SETUP, phase_start);
+    /* Commit the keystore writes batched since hap_init() */
+    hap_keystore_end_batch();
     if (ret != HAP_SUCCESS) {
          ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Accessory Setup init failed");
          return ret;
     }
+    /* Before the HTTP server starts, so that controllers never see the default values */
+    phase_start = esp_timer_get_time();
+    hap_char_persist_restore();
+    hap_boot_phase_end(HAP_BOOT_PHASE_CHAR_RESTORE, phase_start);
+    hap_keystore_stats_t ks_stats;
+    if (hap_keystore_get_stats(&ks_stats) == HAP_SUCCESS) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Keystore at start: %u reads (%u from flash), %u writes (%u to flash), %u commits, %lld us",
+                (unsigned)ks_stats.reads, (unsigned)ks_stats.nvs_reads, (unsigned)ks_stats.writes,
+                (unsigned)ks_stats.nvs_writes, (unsigned)ks_stats.commits, (long long)ks_stats.time_us);
+    }
+
+    phase_start = esp_timer_get_time();
+    ret = hap_sessions_init();
+    if (ret != HAP_SUCCESS) {
+         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Session lock creation failed");
+         return ret;
+    }
 
+    ret = hap_async_init();
+    hap_boot_phase_end(HAP_BOOT_PHASE_SESSIONS, phase_start);
+    if (ret != HAP_SUCCESS) {
+         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Async request init failed");
+         return ret;
+    }
+
+    phase_start = esp_timer_get_time();
     ret = hap_httpd_start();
+    hap_boot_phase_end(HAP_BOOT_PHASE_HTTPD, phase_start);
     if (ret != HAP_SUCCESS) {
          ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "HTTPD START Failed [%d]", ret);
          return ret;
     }
 
+    phase_start = esp_timer_get_time();
     ret = hap_event_queue_init();
+    hap_boot_phase_end(HAP_BOOT_PHASE_EVENT_QUEUE, phase_start);
     if (ret != HAP_SUCCESS) {
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Queue Initialisation for Event Notifications Failed");
         return ret;
     }
 
+    phase_start = esp_timer_get_time();
     ret = hap_loop_start();
+    hap_boot_phase_end(HAP_BOOT_PHASE_LOOP, phase_start);
     if (ret != 0) {
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "HAP Loop Failed: [%d]", ret);
         return ret;
     }
+    if (!hap_priv.cfg.disable_config_num_update) {
+        /* Compare the database with the one from the last run, once any accessories which
+         * get added right after hap_start() have settled.
+         */
+        hap_report_db_change(false);
+    }
+    phase_start = esp_timer_get_time();
     ret = hap_mdns_init();
+    hap_boot_phase_end(HAP_BOOT_PHASE_MDNS, phase_start);
     if (ret != 0 ) {
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "HAP mDNS Init failed");
         return ret;
     }
 
+    phase_start = esp_timer_get_time();
     ret = hap_ip_services_start();
+    hap_boot_phase_end(HAP_BOOT_PHASE_IP_SERVICES, phase_start);
     if (ret != 0) {
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "HAP IP Services Start Failed [%d]", ret);
         return ret;
     }
+    hap_boot_report.ready_us = esp_timer_get_time();
+    hap_boot_report.fast_start = hap_fast_start_used();
+    if (hap_keystore_get_stats(&ks_stats) == HAP_SUCCESS) {
+        hap_boot_report.nvs_reads = ks_stats.nvs_reads;
+    }
+    hap_print_boot_report();
     return HAP_SUCCESS;
 }
 
@@ -27,21 +27,73 @@
 
 static bool mdns_init_done;
 
+/* Remember the published TXT items. Items which do not fit are not remembered at all,
+ * so that the next update sends the full set.
+ */
+static void hap_mdns_save_txt(hap_mdns_handle_t *handle, mdns_txt_item_t *txt_records, size_t num_txt)
+{
+    size_t i;
+    handle->num_txt = 0;
+    if (num_txt > HAP_MDNS_MAX_TXT) {
+        return;
+    }
+    for (i = 0; i < num_txt; i++) {
+        if ((strlen(txt_records[i].key) >= HAP_MDNS_TXT_KEY_LEN)
+                || (strlen(txt_records[i].value) >= HAP_MDNS_TXT_VAL_LEN)) {
+            return;
+        }
+        strcpy(handle->txt[i].key, txt_records[i].key);
+        strcpy(handle->txt[i].value, txt_records[i].value);
+    }
+    handle->num_txt = num_txt;
+}
+
 int hap_mdns_serv_start(hap_mdns_handle_t *handle, const char *name, const char *type,
         const char *protocol, int port, mdns_txt_item_t *txt_records, size_t num_txt)
 {
     strcpy(handle->type, type);
     strcpy(handle->proto, protocol);
+    handle->num_txt = 0;
     if (mdns_service_add(name, type, protocol, port, txt_records, num_txt) != 0) {
         return HAP_FAIL;
     }
+    hap_mdns_save_txt(handle, txt_records, num_txt);
     return HAP_SUCCESS;
 }
 
 int hap_mdns_serv_update_txt(hap_mdns_handle_t *handle, mdns_txt_item_t *txt_records, size_t num_txt)
 {
-    if (mdns_service_txt_set(handle->type, handle->proto, txt_records, num_txt) != 0) {
-        return HAP_FAIL;
+    /* Every TXT update goes out as a multicast announcement. So, send nothing if no value
+     * has changed, and just the item if a single one has. The full set is sent otherwise,
+     * so that the mDNS responder still has to announce only once.
+     */
+    int changed = 0, last = 0;
+    size_t i = 0;
+    if (num_txt == handle->num_txt) {
+        for (i = 0; i < num_txt; i++) {
+            if (strcmp(handle->txt[i].key, txt_records[i].key)
+                    || (strlen(txt_records[i].value) >= HAP_MDNS_TXT_VAL_LEN)) {
+                break;
+            }
+            if (strcmp(handle->txt[i].value, txt_records[i].value)) {
+                changed++;
+                last = i;
+            }
+        }
+    }
+    if (num_txt != handle->num_txt || i != num_txt || changed > 1) {
+        if (mdns_service_txt_set(handle->type, handle->proto, txt_records, num_txt) != 0) {
+            handle->num_txt = 0;
+            return HAP_FAIL;
+        }
+        hap_mdns_save_txt(handle, txt_records, num_txt);
+    } else if (changed == 1) {
+        if (mdns_service_txt_item_set(handle->type, handle->proto, txt_records[last].key,
+                    txt_records[last].value) != 0) {
+            handle->num_txt = 0;
+            return HAP_FAIL;
+        }
+        strcpy(handle->txt[last].value, txt_records[last].value);
     }
     return HAP_SUCCESS;
 }
@@ -56,6 +108,7 @@ int hap_mdns_serv_name_change(hap_mdns_handle_t *handle, const char * instance_n
 
 int hap_mdns_serv_stop(hap_mdns_handle_t *handle)
 {
+    handle->num_txt = 0;
     if (mdns_service_remove(handle->type, handle->proto) == ESP_OK) {
         return HAP_SUCCESS;
     }
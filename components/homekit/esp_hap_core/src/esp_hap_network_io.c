@@ -23,6 +23,7 @@
  */
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/socket.h>
 
 #include <sodium/crypto_aead_chacha20poly1305.h>
@@ -154,25 +155,77 @@ int hap_decrypt_data(hap_decrypt_frame_t *frame, hap_secure_session_t *session,
 	return bytes;
 }
 
+/* Encrypt and send data on a pair verified session.
+ * The session lock is held for the complete message, so that frames from the HTTP server
+ * and the notification task never get interleaved on the socket.
+ */
+int hap_session_send(hap_secure_session_t *session, const char *buf, unsigned buf_len, int flags)
+{
+    int ret = buf_len;
+    int sockfd = session->conn_identifier;
+    hap_session_lock(session);
+    uint8_t *buf_ptr = (uint8_t *)buf;
+    int tmp_buf_len = buf_len;
+    if (session->closed) {
+        /* Freed by the HTTP server, with the socket possibly reused already */
+        ret = HAP_FAIL;
+        tmp_buf_len = 0;
+    }
+    while (tmp_buf_len) {
+        hap_encrypt_frame_t encrypt_frame;
+        memset(&encrypt_frame, 0, sizeof(encrypt_frame));
+        int len = min(tmp_buf_len, HAP_MAX_NW_FRAME_SIZE);
+        int send_len = hap_encrypt_data(&encrypt_frame, session, buf_ptr, len);
+        if (send(sockfd, (uint8_t *)&encrypt_frame, send_len, flags) <= 0) {
+            ret = HAP_FAIL;
+            break;
+        }
+        tmp_buf_len -= len;
+        buf_ptr += len;
+    }
+    hap_session_unlock(session);
+    /* Return the total length at the end since the HTTP server expects so
+     */
+    return ret;
+}
+
+/* Mark the start of an HTTP request on a pair verified session. The session lock is not
+ * taken till the response starts going out, so that a request which waits (Eg. for a deferred
+ * read) does not hold up the EVENT messages to this session, and so, to all the others.
+ */
+void hap_session_req_begin(hap_secure_session_t *session)
+{
+    session->in_req = true;
+    session->resp_locked = false;
+}
+
+void hap_session_req_end(hap_secure_session_t *session)
+{
+    session->in_req = false;
+    if (session->resp_locked) {
+        session->resp_locked = false;
+        hap_session_unlock(session);
+    }
+}
+
+/* Send a part of an HTTP response on a pair verified session. Within a request, the session
+ * lock is taken with the first part and held till hap_session_req_end(), so that no EVENT
+ * message gets in between the parts of the response.
+ */
+int hap_session_resp_send(hap_secure_session_t *session, const char *buf, unsigned buf_len, int flags)
+{
+    if (session->in_req && !session->resp_locked) {
+        hap_session_lock(session);
+        session->resp_locked = true;
+    }
+    return hap_session_send(session, buf, buf_len, flags);
+}
+
 int hap_httpd_send(httpd_handle_t hd, int sockfd, const char *buf, unsigned buf_len, int flags)
 {
 	hap_secure_session_t *session = httpd_sess_get_ctx(hap_priv.server, sockfd);
 	if (session && (session->state == STATE_VERIFIED)) {
-		uint8_t *buf_ptr = (uint8_t *)buf;
-		int tmp_buf_len = buf_len;
-		while (tmp_buf_len) {
-			hap_encrypt_frame_t encrypt_frame;
-			memset(&encrypt_frame, 0, sizeof(encrypt_frame));
-			int len = min(tmp_buf_len, HAP_MAX_NW_FRAME_SIZE);
-			int send_len = hap_encrypt_data(&encrypt_frame, session, buf_ptr, len);
-			if (send(sockfd, (uint8_t *)&encrypt_frame, send_len, flags) <= 0)
-				return HAP_FAIL;
-			tmp_buf_len -= len;
-			buf_ptr += len;
-		}
-		/* Return the total length at the end since this API expects so
-		 */
-		return buf_len;
+		return hap_session_resp_send(session, buf, buf_len, flags);
 	}
 	return send(sockfd, buf, buf_len, flags);
 }
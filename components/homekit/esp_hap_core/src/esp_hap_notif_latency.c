@@ -0,0 +1,193 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <hap.h>
+#include <hap_platform_os.h>
+#include <esp_hap_notif_latency.h>
+
+/* Number of linear sub-buckets per power of 2 (as 1 << HAP_NOTIF_LATENCY_SUB_BITS) */
+#define HAP_NOTIF_LATENCY_SUB_BITS  2
+#define HAP_NOTIF_LATENCY_SUB_CNT   (1 << HAP_NOTIF_LATENCY_SUB_BITS)
+
+uint32_t hap_notif_latency_bucket_floor(int index)
+{
+    if (index < 0) {
+        return 0;
+    }
+    if (index >= HAP_NOTIF_LATENCY_BUCKETS) {
+        index = HAP_NOTIF_LATENCY_BUCKETS - 1;
+    }
+    if (index < HAP_NOTIF_LATENCY_SUB_CNT) {
+        return index;
+    }
+    index -= HAP_NOTIF_LATENCY_SUB_CNT;
+    return (uint32_t)(HAP_NOTIF_LATENCY_SUB_CNT + (index % HAP_NOTIF_LATENCY_SUB_CNT)) <<
+        (index / HAP_NOTIF_LATENCY_SUB_CNT);
+}
+
+uint32_t hap_notif_latency_percentile(const hap_notif_latency_t *hist, float percentile)
+{
+    if (!hist || !hist->count) {
+        return 0;
+    }
+    if (percentile < 0) {
+        percentile = 0;
+    } else if (percentile > 100) {
+        percentile = 100;
+    }
+    /* Rank of the sample at the percentile, 1 based */
+    uint64_t rank = (uint64_t)((hist->count * (double)percentile) / 100.0 + 0.999999);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    int i;
+    for (i = 0; i < HAP_NOTIF_LATENCY_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    if (i >= HAP_NOTIF_LATENCY_BUCKETS - 1) {
+        return hist->max_us;
+    }
+    uint32_t upper = hap_notif_latency_bucket_floor(i + 1) - 1;
+    return upper < hist->max_us ? upper : hist->max_us;
+}
+
+#ifdef CONFIG_HAP_NOTIF_LATENCY_STATS
+static const char *hap_notif_stage_str[HAP_NOTIF_STAGE_MAX] = {
+    [HAP_NOTIF_STAGE_QUEUE] = "queue",
+    [HAP_NOTIF_STAGE_DISPATCH] = "dispatch",
+    [HAP_NOTIF_STAGE_ENCODE] = "encode",
+    [HAP_NOTIF_STAGE_SEND] = "send",
+    [HAP_NOTIF_STAGE_TOTAL] = "total",
+};
+
+static hap_notif_latency_t hap_notif_latency[HAP_NOTIF_STAGE_MAX];
+
+static int hap_notif_latency_bucket(uint32_t usec)
+{
+    if (usec < HAP_NOTIF_LATENCY_SUB_CNT) {
+        return usec;
+    }
+    /* Position of the most significant bit. The next HAP_NOTIF_LATENCY_SUB_BITS bits
+     * select the sub-bucket.
+     */
+    int msb = 31 - __builtin_clz(usec);
+    int shift = msb - HAP_NOTIF_LATENCY_SUB_BITS;
+    int index = HAP_NOTIF_LATENCY_SUB_CNT + shift * HAP_NOTIF_LATENCY_SUB_CNT +
+        ((usec >> shift) & (HAP_NOTIF_LATENCY_SUB_CNT - 1));
+    return index < HAP_NOTIF_LATENCY_BUCKETS ? index : HAP_NOTIF_LATENCY_BUCKETS - 1;
+}
+
+void hap_notif_latency_record(hap_notif_stage_t stage, int64_t usec)
+{
+    if (stage >= HAP_NOTIF_STAGE_MAX || usec < 0) {
+        return;
+    }
+    uint32_t val = usec > UINT32_MAX ? UINT32_MAX : (uint32_t)usec;
+    int index = hap_notif_latency_bucket(val);
+    hap_notif_latency_t *hist = &hap_notif_latency[stage];
+    hap_platform_os_enter_critical();
+    if (!hist->count || val < hist->min_us) {
+        hist->min_us = val;
+    }
+    if (val > hist->max_us) {
+        hist->max_us = val;
+    }
+    hist->count++;
+    hist->sum_us += val;
+    hist->buckets[index]++;
+    hap_platform_os_exit_critical();
+}
+
+int hap_get_notif_latency(hap_notif_stage_t stage, hap_notif_latency_t *hist)
+{
+    if (!hist || stage >= HAP_NOTIF_STAGE_MAX) {
+        return HAP_FAIL;
+    }
+    hap_platform_os_enter_critical();
+    memcpy(hist, &hap_notif_latency[stage], sizeof(*hist));
+    hap_platform_os_exit_critical();
+    return HAP_SUCCESS;
+}
+
+void hap_reset_notif_latency()
+{
+    hap_platform_os_enter_critical();
+    memset(hap_notif_latency, 0, sizeof(hap_notif_latency));
+    hap_platform_os_exit_critical();
+}
+
+void hap_dump_notif_latency(bool buckets)
+{
+    hap_notif_latency_t hist;
+    int stage, i;
+    printf("%-9s %8s %10s %10s %10s %10s %10s %10s\n", "stage(us)", "count", "min", "avg",
+            "p50", "p90", "p99", "max");
+    for (stage = 0; stage < HAP_NOTIF_STAGE_MAX; stage++) {
+        hap_get_notif_latency(stage, &hist);
+        printf("%-9s %8u %10u %10u %10u %10u %10u %10u\n", hap_notif_stage_str[stage],
+                (unsigned)hist.count, (unsigned)hist.min_us,
+                (unsigned)(hist.count ? hist.sum_us / hist.count : 0),
+                (unsigned)hap_notif_latency_percentile(&hist, 50),
+                (unsigned)hap_notif_latency_percentile(&hist, 90),
+                (unsigned)hap_notif_latency_percentile(&hist, 99),
+                (unsigned)hist.max_us);
+    }
+    if (!buckets) {
+        return;
+    }
+    for (stage = 0; stage < HAP_NOTIF_STAGE_MAX; stage++) {
+        hap_get_notif_latency(stage, &hist);
+        if (!hist.count) {
+            continue;
+        }
+        printf("%s:\n", hap_notif_stage_str[stage]);
+        for (i = 0; i < HAP_NOTIF_LATENCY_BUCKETS; i++) {
+            if (hist.buckets[i]) {
+                printf("  >= %10u us: %u\n", (unsigned)hap_notif_latency_bucket_floor(i),
+                        (unsigned)hist.buckets[i]);
+            }
+        }
+    }
+}
+#else /* !CONFIG_HAP_NOTIF_LATENCY_STATS */
+int hap_get_notif_latency(hap_notif_stage_t stage, hap_notif_latency_t *hist)
+{
+    return HAP_FAIL;
+}
+
+void hap_reset_notif_latency()
+{
+}
+
+void hap_dump_notif_latency(bool buckets)
+{
+    printf("Notification latency tracking not enabled. Enable CONFIG_HAP_NOTIF_LATENCY_STATS.\n");
+}
+#endif /* CONFIG_HAP_NOTIF_LATENCY_STATS */
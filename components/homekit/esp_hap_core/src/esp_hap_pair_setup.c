@@ -440,7 +440,7 @@ static pair_setup_ctx_t *hap_pair_setup_ctx_action(int action)
 		if (ps_ctx)
 			return NULL;
 		else {
-			ps_ctx = hap_platform_memory_calloc(sizeof(pair_setup_ctx_t), 1);
+			ps_ctx = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_PAIRING, sizeof(pair_setup_ctx_t), 1);
             if (ps_ctx) {
                 ps_ctx->timer = xTimerCreate("hap_setup_timer", HAP_SETUP_TIMEOUT_IN_TICKS,
                             pdFALSE, (void *) ps_ctx, hap_pair_setup_timeout);
@@ -457,7 +457,7 @@ static pair_setup_ctx_t *hap_pair_setup_ctx_action(int action)
                 xTimerDelete(ps_ctx->timer, 100);
             }
             mu_srp_free(&ps_ctx->srp_hd);
-			hap_platform_memory_free(ps_ctx);
+			hap_platform_memory_free_tagged(ps_ctx);
 		}
 		ps_ctx = NULL;
 	}
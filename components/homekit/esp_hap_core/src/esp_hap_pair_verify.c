@@ -116,9 +116,54 @@ void hap_close_all_sessions()
 	}
 }
 
+/* Lock protecting the hap_priv.sessions[] table and the session reference counts.
+ * A per session lock is never taken with this held, so nothing is sent under it.
+ */
+static SemaphoreHandle_t hap_sessions_mutex;
+
+int hap_sessions_init(void)
+{
+    if (!hap_sessions_mutex) {
+        hap_sessions_mutex = xSemaphoreCreateMutex();
+        if (!hap_sessions_mutex) {
+            return HAP_FAIL;
+        }
+    }
+    return HAP_SUCCESS;
+}
+
+void hap_sessions_lock(void)
+{
+    if (hap_sessions_mutex) {
+        xSemaphoreTake(hap_sessions_mutex, portMAX_DELAY);
+    }
+}
+
+void hap_sessions_unlock(void)
+{
+    if (hap_sessions_mutex) {
+        xSemaphoreGive(hap_sessions_mutex);
+    }
+}
+
+void hap_session_lock(hap_secure_session_t *session)
+{
+    if (session && session->lock) {
+        xSemaphoreTakeRecursive(session->lock, portMAX_DELAY);
+    }
+}
+
+void hap_session_unlock(hap_secure_session_t *session)
+{
+    if (session && session->lock) {
+        xSemaphoreGiveRecursive(session->lock);
+    }
+}
+
 static void hap_add_secure_session(hap_secure_session_t *session)
 {
 	int i;
+    hap_sessions_lock();
 	for (i = 0; i < HAP_MAX_SESSIONS; i++) {
 		if (hap_priv.sessions[i] == NULL) {
 			hap_priv.sessions[i] = session;
@@ -136,6 +181,44 @@ static void hap_add_secure_session(hap_secure_session_t *session)
 			break;
 		}
 	}
+    hap_sessions_unlock();
+}
+
+/* Take a reference on every session in the table, so that these can be used without
+ * hap_sessions_lock() held, e.g. to send on them. Returns the bitmap of the session
+ * indices found. Every session returned should be released using hap_session_put().
+ */
+uint16_t hap_sessions_get_all(hap_secure_session_t *sessions[])
+{
+    int i;
+    uint16_t active = 0;
+    hap_sessions_lock();
+    for (i = 0; i < HAP_MAX_SESSIONS; i++) {
+        sessions[i] = hap_priv.sessions[i];
+        if (sessions[i]) {
+            sessions[i]->refcnt++;
+            active |= (1 << i);
+        }
+    }
+    hap_sessions_unlock();
+    return active;
+}
+
+void hap_session_put(hap_secure_session_t *session)
+{
+    if (!session) {
+        return;
+    }
+    hap_sessions_lock();
+    bool last = (--session->refcnt == 0);
+    hap_sessions_unlock();
+    if (!last) {
+        return;
+    }
+    if (session->lock) {
+        vSemaphoreDelete(session->lock);
+    }
+	hap_platform_memory_free_tagged(session);
 }
 
 void hap_free_session(void *session)
@@ -143,6 +226,7 @@ void hap_free_session(void *session)
 	if (!session)
 		return;
 	int i;
+    hap_sessions_lock();
 	for (i = 0; i < HAP_MAX_SESSIONS; i++) {
 		if (hap_priv.sessions[i] == session) {
 			/* Disable all characteristic notifications on this session */
@@ -152,7 +236,19 @@ void hap_free_session(void *session)
 			break;
 		}
 	}
-	hap_platform_memory_free(session);
+    hap_sessions_unlock();
+    /* Wait for an EVENT message being sent on it, if any, and stop any more from going out.
+     * A notification pass may still hold a reference, in which case it frees the session.
+     */
+    hap_session_lock(session);
+    ((hap_secure_session_t *)session)->closed = true;
+    hap_session_unlock(session);
+    hap_session_put(session);
+}
+
+void hap_pair_verify_ctx_clean(void *ctx)
+{
+	hap_platform_memory_free_tagged(ctx);
 }
 
 static int hap_pair_verify_process_start(pair_verify_ctx_t *pv_ctx, uint8_t *buf, int inlen,
@@ -371,12 +467,21 @@ static int hap_pair_verify_process_finish(pair_verify_ctx_t *pv_ctx, uint8_t *bu
 	}
 
 	/* Allocate memory for the secure session information */
-	hap_secure_session_t *session = hap_platform_memory_calloc(sizeof(hap_secure_session_t), 1);
+	hap_secure_session_t *session = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_SESSION, sizeof(hap_secure_session_t), 1);
 	if (!session) {
 		hap_prepare_error_tlv(STATE_M4, kTLVError_Unknown, buf, bufsize, outlen);
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Memory allocation failed");
 		return HAP_FAIL;
 	}
+	/* Reference for the HTTP server, dropped by hap_free_session() */
+	session->refcnt = 1;
+	session->lock = xSemaphoreCreateRecursiveMutex();
+	if (!session->lock) {
+		hap_prepare_error_tlv(STATE_M4, kTLVError_Unknown, buf, bufsize, outlen);
+		hap_platform_memory_free_tagged(session);
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Session lock creation failed");
+		return HAP_FAIL;
+	}
 	/* Construct the response M4 */
 	hap_tlv_data_t tlv_data;
 	tlv_data.bufptr = buf;
@@ -385,7 +490,8 @@ static int hap_pair_verify_process_finish(pair_verify_ctx_t *pv_ctx, uint8_t *bu
 	state = STATE_M4;
 	if (add_tlv(&tlv_data, kTLVType_State, 1, &state) < 0) {
 		hap_prepare_error_tlv(STATE_M4, kTLVError_Unknown, buf, bufsize, outlen);
-		hap_platform_memory_free(session);
+		vSemaphoreDelete(session->lock);
+		hap_platform_memory_free_tagged(session);
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "TLV creation failed");
 		return HAP_FAIL;
 	}
@@ -438,7 +544,7 @@ int hap_pair_verify_process(void **ctx, uint8_t *buf, int inlen, int bufsize, in
 			 */
 			if (ret == HAP_SUCCESS) {
 				hap_secure_session_t *session = pv_ctx->session;
-				hap_platform_memory_free(pv_ctx);
+				hap_platform_memory_free_tagged(pv_ctx);
 				*ctx = session;
 			}
 			return ret;
@@ -453,7 +559,7 @@ int hap_pair_verify_context_init(void **ctx, uint8_t *buf, int bufsize, int *out
 {
 	pair_verify_ctx_t *pv_ctx;
 
-	pv_ctx = (pair_verify_ctx_t *) hap_platform_memory_calloc(sizeof(pair_verify_ctx_t), 1);
+	pv_ctx = (pair_verify_ctx_t *) hap_platform_memory_calloc_tagged(HAP_MEM_TAG_PAIRING, sizeof(pair_verify_ctx_t), 1);
 	if (!pv_ctx) {
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to create Pair Verify Context");
 		hap_prepare_error_tlv(STATE_M2, kTLVError_Unknown, buf, bufsize, outlen);
@@ -70,12 +70,15 @@ bool hap_is_req_secure(hap_secure_session_t *session)
 void hap_remove_all_controllers()
 {
 	int i;
+    /* Write the controller table just once, after all removals */
+    hap_keystore_begin_batch();
 	for (i = 0; i < HAP_MAX_CONTROLLERS; i++) {
 		if (hap_priv.controllers[i].valid) {
 			hap_close_sessions_of_ctrl(&hap_priv.controllers[i]);
 			hap_controller_remove(&hap_priv.controllers[i]);
 		}
 	}
+    hap_keystore_end_batch();
 }
 static int hap_process_pair_remove(uint8_t *buf, int inlen, int bufsize, int *outlen)
 {
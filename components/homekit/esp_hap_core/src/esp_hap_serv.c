@@ -25,6 +25,7 @@
 #include <hap_platform_memory.h>
 
 #include <esp_hap_serv.h>
+#include <esp_hap_async.h>
 #include <esp_mfi_debug.h>
 
 void hap_serv_mark_primary(hap_serv_t *hs)
@@ -136,7 +137,10 @@ static int hap_serv_def_bulk_read_cb(hap_read_data_t read_data[], int count,
 
     int ret = HAP_SUCCESS;
     for (i = 0; i < count; i++) {
-       if (hs->read_cb(read_data[i].hc, read_data[i].status, serv_priv, read_priv) != HAP_SUCCESS) {
+       /* Each read can be deferred independently of the others */
+       int cookie = hap_async_batch_begin(read_data[i].status, 1);
+       if (hap_async_batch_end(cookie, hs->read_cb(read_data[i].hc, read_data[i].status,
+                       serv_priv, read_priv)) != HAP_SUCCESS) {
            ret = HAP_FAIL;
        }
     }
@@ -148,7 +152,7 @@ static int hap_serv_def_bulk_read_cb(hap_read_data_t read_data[], int count,
 hap_serv_t *hap_serv_create(char *type_uuid)
 {
     ESP_MFI_ASSERT(type_uuid);
-    __hap_serv_t *_hs = hap_platform_memory_calloc(1, sizeof(__hap_serv_t));
+    __hap_serv_t *_hs = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_DATABASE, 1, sizeof(__hap_serv_t));
     if (!_hs) {
         return NULL;
     }
@@ -159,12 +163,62 @@ hap_serv_t *hap_serv_create(char *type_uuid)
     return (hap_serv_t *)_hs;
 }
 
+_Static_assert(sizeof(__hap_serv_t) <= sizeof(hap_serv_static_t), "HAP_SERV_STATIC_SIZE too small");
+_Static_assert(sizeof(hap_linked_serv_t) <= sizeof(hap_linked_serv_static_t), "Linked service storage too small");
+
+/* Set up a service, along with its characteristics from its static description.
+ * The characteristics are set up in char_storage, which should have desc->num_chars entries.
+ * Linked services are resolved by the caller, since they may not be set up yet.
+ */
+hap_serv_t *hap_serv_init_static(hap_serv_static_t *storage, const hap_serv_desc_t *desc,
+        hap_char_static_t *char_storage)
+{
+    if (!desc->type_uuid || !desc->iid || (desc->num_chars && !desc->chars)) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Invalid static service description");
+        return NULL;
+    }
+    __hap_serv_t *_hs = (__hap_serv_t *)storage;
+    memset(_hs, 0, sizeof(__hap_serv_t));
+    _hs->type_uuid = (char *)desc->type_uuid;
+    _hs->iid = desc->iid;
+    _hs->primary = desc->primary;
+    _hs->hidden = desc->hidden;
+    _hs->bulk_read = hap_serv_def_bulk_read_cb;
+    _hs->static_alloc = true;
+
+    __hap_char_t *last = NULL;
+    int i;
+    for (i = 0; i < desc->num_chars; i++) {
+        __hap_char_t *_hc = (__hap_char_t *)hap_char_init_static(&char_storage[i], &desc->chars[i]);
+        if (!_hc) {
+            return NULL;
+        }
+        _hc->parent = (hap_serv_t *)_hs;
+        if (last) {
+            last->next_char = (hap_char_t *)_hc;
+        } else {
+            _hs->chars = (hap_char_t *)_hc;
+        }
+        last = _hc;
+    }
+    return (hap_serv_t *)_hs;
+}
+
+int hap_serv_set_notif_window(hap_serv_t *hs, uint16_t window_ms)
+{
+    if (!hs) {
+        return HAP_FAIL;
+    }
+    ((__hap_serv_t *)hs)->notif_window = (window_ms == HAP_NOTIF_WINDOW_INHERIT) ? 0 : window_ms + 1;
+    return HAP_SUCCESS;
+}
+
 int hap_serv_link_serv(hap_serv_t *hs, hap_serv_t *linked_serv)
 {
     if (!hs || !linked_serv)
         return HAP_FAIL;
 
-    hap_linked_serv_t *cur = hap_platform_memory_calloc(1, sizeof(hap_linked_serv_t));
+    hap_linked_serv_t *cur = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_DATABASE, 1, sizeof(hap_linked_serv_t));
     if (!cur)
         return HAP_FAIL;
     cur->hs = linked_serv;
@@ -225,17 +279,21 @@ void hap_serv_delete(hap_serv_t *hs)
 		hap_char_delete((hap_char_t *)_hc);
 		_hc = (__hap_char_t *)_hs->chars;
 	}
-    if (_hs->linked_servs) {
-        hap_linked_serv_t *cur = _hs->linked_servs;
+    hap_linked_serv_t *cur = _hs->linked_servs;
+    int static_links = _hs->static_links;
+    while (cur) {
         hap_linked_serv_t *next = cur->next;
-        while (next) {
-            hap_platform_memory_free(cur);
-            cur = next;
-            next = cur->next;
+        /* Links from a static description are at the start of the list */
+        if (static_links) {
+            static_links--;
+        } else {
+            hap_platform_memory_free_tagged(cur);
         }
-        hap_platform_memory_free(cur);
+        cur = next;
+    }
+    if (!_hs->static_alloc) {
+        hap_platform_memory_free_tagged(hs);
     }
-    hap_platform_memory_free(hs);
 }
 
 /**
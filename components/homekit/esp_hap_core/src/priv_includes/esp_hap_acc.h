@@ -39,11 +39,23 @@ typedef struct esp_mfi_accessory {
     bool                power_off;
     uint32_t next_iid;
     hap_identify_routine_t identify_routine;
+    /* Set up in application provided storage using hap_acc_create_static() */
+    bool static_alloc;
 } __hap_acc_t;
 hap_char_t *hap_acc_get_char_by_iid(hap_acc_t *ha, int32_t iid);
 hap_acc_t *hap_acc_get_by_aid(int32_t aid);
 int hap_acc_get_info(hap_acc_cfg_t *acc_cfg);
 const hap_val_t *hap_get_product_data();
+/* Takes hap_db_lock() itself */
+uint32_t hap_acc_db_hash();
+int hap_db_lock_init();
+/* Recursive lock, guarding the accessory list against bridged accessories being added or
+ * removed by the application while a HAP task walks it
+ */
+void hap_db_lock();
+void hap_db_unlock();
+/* Drops the in memory bridged aid map, once its keystore copy has been erased */
+void hap_aid_map_reset();
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,44 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+#ifndef _HAP_ASYNC_H_
+#define _HAP_ASYNC_H_
+#include <hap.h>
+
+/* Deferred service reads and writes.
+ *
+ * A request handler starts a request with hap_async_req_begin() and wraps every service
+ * callback between hap_async_batch_begin() and hap_async_batch_end(). Callbacks which
+ * returned HAP_PENDING are then waited for, up to the deadline, by hap_async_req_end().
+ * All of these must be called from the same task.
+ */
+int hap_async_init(void);
+void hap_async_req_begin(void);
+/* Returns a cookie to be passed to the matching hap_async_batch_end(). These can be nested */
+int hap_async_batch_begin(hap_status_t *status, int count);
+/* Returns the callback's ret, or HAP_SUCCESS if it is pending */
+int hap_async_batch_end(int cookie, int ret);
+/* Returns HAP_FAIL if any pending callback failed or timed out */
+int hap_async_req_end(void);
+
+#endif /* _HAP_ASYNC_H_ */
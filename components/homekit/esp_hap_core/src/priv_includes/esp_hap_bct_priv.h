@@ -25,4 +25,5 @@
 #define _HAP_BCT_PRIV_H_
 void hap_handle_bct_change_name();
 void hap_handle_hot_plug();
+void hap_handle_hot_plug_resume();
 #endif /* _HAP_BCT_PRIV_H_ */
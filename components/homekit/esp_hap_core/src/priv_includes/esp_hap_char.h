@@ -30,6 +30,7 @@
 #include <sys/errno.h>
 
 #include <hap.h>
+#include <hap_static.h>
 #include <esp_hap_serv.h>
 
 #ifdef __cplusplus
@@ -81,16 +82,53 @@ typedef struct  {
     uint8_t *valid_vals;
     size_t valid_vals_cnt;
     bool update_called;
+
+    /* Size of the buffer holding a String/Data value. 0 if the buffer is not owned by the characteristic */
+    uint32_t val_cap;
+    /* How the buffer currently holding a String/Data value is owned (hap_data_own_t) */
+    uint8_t val_own;
+    /* Ownership mode for Data/TLV8 updates (hap_data_own_t) */
+    uint8_t data_mode;
+    /* Sequence lock for the value. Odd while an update is in progress */
+    volatile uint32_t seq;
+    /* Set up in application provided storage using hap_acc_create_static() */
+    bool static_alloc;
+    /* Set while the characteristic is in the pending notification list */
+    bool notif_pending;
+    /* Next characteristic in the pending notification list */
+    hap_char_t *next_notif;
+    /* Notification coalescing window in msec, plus 1. 0 to use the one from the service */
+    uint16_t notif_window;
+    /* Value saved across reboots. See hap_char_set_persist() */
+    bool persist;
+#ifdef CONFIG_HAP_NOTIF_LATENCY_STATS
+    /* Time (in usec) at which the characteristic was added to the pending notification list */
+    int64_t notif_ts;
+#endif /* CONFIG_HAP_NOTIF_LATENCY_STATS */
 } __hap_char_t;
 
-void hap_char_manage_notification(hap_char_t *hc, int index, bool ev);
+int hap_char_manage_notification(hap_char_t *hc, int index, bool ev);
 bool hap_char_is_ctrl_subscribed(hap_char_t *hc, int index);
 void hap_char_set_owner_ctrl(hap_char_t *hc, int index);
+void hap_char_reset_owner_ctrl(hap_char_t *hc);
+uint16_t hap_char_take_notif_ctrls(hap_char_t *hc);
 bool hap_char_is_ctrl_owner(hap_char_t *hc, int index);
 void hap_disable_all_char_notif(int index);
 int hap_char_check_val_constraints(__hap_char_t *_hc, hap_val_t *val);
+int hap_char_store_string(__hap_char_t *_hc, const char *s);
+int hap_char_get_val_snapshot(__hap_char_t *_hc, hap_val_t *val, uint8_t *buf, size_t *buf_size);
+hap_char_t *hap_char_init_static(hap_char_static_t *storage, const hap_char_desc_t *desc);
 int hap_event_queue_init();
-hap_char_t * hap_get_pending_notif_char();
+void hap_notif_pass_lock();
+void hap_notif_pass_unlock();
+int hap_take_pending_notif_chars(int64_t *trigger_ts);
+hap_char_t *hap_pop_pending_notif_char(int64_t *notif_ts);
+void hap_trigger_notif();
+void hap_char_drain_isr_updates();
+void hap_notif_trigger_failed();
+void hap_notif_count_pass(int messages, int payloads);
+bool hap_char_persist_pending();
+void hap_char_persist_restore();
 #ifdef __cplusplus
 }
 #endif
@@ -88,5 +88,8 @@ int hap_get_next_aid();
 int hap_acc_setup_init();
 void hap_erase_accessory_info();
 void hap_increment_and_save_config_num();
+bool hap_update_config_num_if_db_changed();
 void hap_increment_and_save_state_num();
+void hap_fast_start_invalidate();
+bool hap_fast_start_used();
 #endif /* _HAP_DATABASE_H_ */
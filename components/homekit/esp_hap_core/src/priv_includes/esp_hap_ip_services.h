@@ -30,6 +30,9 @@ int hap_httpd_get_data(httpd_req_t *req, char *buffer, int len);
 int hap_httpd_start();
 int hap_ip_services_start();
 int hap_mdns_announce(bool first);
+/* Time for the de-announcement packets to go out after hap_mdns_deannounce() */
+#define HAP_MDNS_DEANNOUNCE_WAIT_MS     2000
 int hap_mdns_deannounce();
 void hap_http_send_notif();
+int hap_http_send_notif_from_isr();
 #endif /* _HAP_IP_SERVICES_H_ */
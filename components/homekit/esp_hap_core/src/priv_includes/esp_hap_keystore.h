@@ -23,12 +23,35 @@
  */
 #ifndef _HAP_KEYSTORE_H_
 #define _HAP_KEYSTORE_H_
+#include <stdint.h>
+#include <stddef.h>
 #include <hap.h>
 int hap_keystore_init();
+/* Pass val as NULL to just get the length of the value in val_size */
 int hap_keystore_get(const char *name_space, const char *key, uint8_t *val, size_t *val_size);
 int hap_keystore_set(const char *name_space, const char *key, const uint8_t *val, const size_t val_len);
 int hap_keystore_delete(const char *name_space, const char *key);
 int hap_keystore_delete_namespace(const char *name_space);
 int hap_factory_keystore_set(const char *name_space, const char *key, const uint8_t *val, const size_t val_len);
 void hap_keystore_erase_all_data();
+
+/* Counter which gets updated often. With a journal partition, updates are appended to a
+ * flash journal and the NVS key just holds a checkpoint. Without one, it is a plain key.
+ */
+typedef struct {
+    const char *name_space;
+    const char *key;
+    size_t val_size;    /* Size of the value, as stored in NVS */
+    int sector;         /* Journal sector owned by the counter. -1 if not journaled */
+    uint32_t next;      /* Next free record in the journal sector */
+    uint32_t val;
+} hap_keystore_counter_t;
+
+/* Loads the counter value into ctr->val. Returns HAP_FAIL (with val as 0) if there is no value.
+ * The counter itself, as well as name_space and key, should remain valid as long as it is in use.
+ * Counters are expected to only go up, except for a wrap around, which costs an NVS write.
+ */
+int hap_keystore_counter_init(hap_keystore_counter_t *ctr, const char *name_space, const char *key,
+        size_t val_size, int sector);
+int hap_keystore_counter_set(hap_keystore_counter_t *ctr, uint32_t val);
 #endif /* _HAP_KEYSTORE_H_ */
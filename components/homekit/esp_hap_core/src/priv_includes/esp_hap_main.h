@@ -48,6 +48,10 @@ typedef enum {
     HAP_INTERNAL_EVENT_RESET_NETWORK,
     HAP_INTERNAL_EVENT_TRIGGER_NOTIF,
     HAP_INTERNAL_EVENT_RESET_HOMEKIT_DATA,
+    HAP_INTERNAL_EVENT_DB_CHANGED,
+    HAP_INTERNAL_EVENT_DB_COMMITTED,
+    HAP_INTERNAL_EVENT_CHAR_PERSIST,
+    HAP_INTERNAL_EVENT_MDNS_ANNOUNCE,
 } hap_internal_event_t;
 
 typedef struct {
@@ -60,10 +64,18 @@ typedef enum {
     HAP_STATE_NW_CONFIGURED,
 } hap_state_t;
 
+/* Action to be run from the HAP main loop after a delay */
+typedef void (*hap_loop_action_t)(void *arg);
+
 int hap_loop_start();
+int hap_loop_schedule(hap_loop_action_t action, void *arg, uint32_t delay_ms);
 int hap_loop_stop();
 int hap_send_event(hap_internal_event_t event);
 int hap_update_config_number();
+/* Config number update if the database structure changed. If not settled, this happens after
+ * a quiet period, so that a burst of changes needs just one
+ */
+int hap_report_db_change(bool settled);
 bool is_hap_loop_started();
 void hap_report_event(hap_event_t event, void *data, size_t data_size);
 int hap_enable_hw_auth(void);
@@ -27,9 +27,22 @@
 #include <mdns.h>
 #include <hap.h>
 
+#define HAP_MDNS_MAX_TXT        10
+#define HAP_MDNS_TXT_KEY_LEN    9
+#define HAP_MDNS_TXT_VAL_LEN    65
+
+/* Copy of a published TXT item */
+typedef struct {
+    char key[HAP_MDNS_TXT_KEY_LEN];
+    char value[HAP_MDNS_TXT_VAL_LEN];
+} hap_mdns_txt_t;
+
 typedef struct {
     char type[32];
     char proto[32];
+    /* TXT items currently published, so that an update needs to send only the changed ones */
+    hap_mdns_txt_t txt[HAP_MDNS_MAX_TXT];
+    size_t num_txt;
 } hap_mdns_handle_t;
 
 int hap_mdns_serv_start(hap_mdns_handle_t *handle, const char *name, const char *type,
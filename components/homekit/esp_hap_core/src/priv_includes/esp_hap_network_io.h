@@ -25,7 +25,12 @@
 #define _HAP_NETWORK_IO_H_
 #include <stdint.h>
 #include <hap_platform_httpd.h>
+#include <esp_hap_pair_common.h>
 int hap_httpd_send(httpd_handle_t hd, int sockfd, const char *buf, unsigned buf_len, int flags);
+int hap_session_send(hap_secure_session_t *session, const char *buf, unsigned buf_len, int flags);
+int hap_session_resp_send(hap_secure_session_t *session, const char *buf, unsigned buf_len, int flags);
+void hap_session_req_begin(hap_secure_session_t *session);
+void hap_session_req_end(hap_secure_session_t *session);
 int hap_httpd_recv(httpd_handle_t hd, int sockfd, char *buf, unsigned buf_len, int flags);
 
 #endif /* _HAP_NETWORK_IO_H_ */
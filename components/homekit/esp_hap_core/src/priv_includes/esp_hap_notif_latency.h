@@ -0,0 +1,43 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+#ifndef _HAP_NOTIF_LATENCY_H_
+#define _HAP_NOTIF_LATENCY_H_
+#include <stdint.h>
+#include <hap.h>
+
+#ifdef CONFIG_HAP_NOTIF_LATENCY_STATS
+#include <esp_timer.h>
+/* Timestamp for latency tracking */
+#define hap_notif_latency_now()     esp_timer_get_time()
+/* Account a sample of "usec" microseconds for a stage. Negative samples are ignored */
+void hap_notif_latency_record(hap_notif_stage_t stage, int64_t usec);
+#else /* !CONFIG_HAP_NOTIF_LATENCY_STATS */
+/* Tracking disabled. Timestamps are always 0 and samples are dropped */
+#define hap_notif_latency_now()     ((int64_t)0)
+static inline void hap_notif_latency_record(hap_notif_stage_t stage, int64_t usec)
+{
+}
+#endif /* CONFIG_HAP_NOTIF_LATENCY_STATS */
+
+#endif /* _HAP_NOTIF_LATENCY_H_ */
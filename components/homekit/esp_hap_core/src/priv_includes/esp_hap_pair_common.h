@@ -25,6 +25,8 @@
 #define _HAP_PAIR_COMMON_H_
 
 #include <stdint.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <esp_hap_controllers.h>
 #define ENCRYPT_KEY_LEN		32
 #define POLY_AUTHTAG_LEN	16
@@ -104,6 +106,24 @@ typedef struct {
 	 * Need to make this generic later.
 	 */
 	int conn_identifier;
+	/* Recursive mutex serialising everything written on this session's socket
+	 * (HTTP responses as well as EVENT notifications), so that encrypted frames
+	 * never interleave and the encrypt nonce stays in order.
+	 */
+	SemaphoreHandle_t lock;
+	/* References held by the HTTP server (till the session is freed) and by notification
+	 * passes, protected by hap_sessions_lock(). The memory is freed when it drops to 0.
+	 */
+	int refcnt;
+	/* Set, under the session lock, once the HTTP server has freed the session. Nothing gets
+	 * sent after that, since the socket number can get reused.
+	 */
+	bool closed;
+	/* Set while the HTTP server handles a request on this session, and once it has taken the
+	 * session lock to write the response. Accessed only by the HTTP server task.
+	 */
+	bool in_req;
+	bool resp_locked;
 } hap_secure_session_t;
 
 void hap_tlv_data_init(hap_tlv_data_t *tlv_data, uint8_t *buf, int buf_size);
@@ -29,8 +29,16 @@ int hap_pair_verify_context_init(void **ctx, uint8_t *buf, int bufsize, int *out
 int hap_pair_verify_process(void **ctx, uint8_t *buf, int inlen, int bufsize, int *outlen);
 uint8_t hap_pair_verify_get_state(void *ctx);
 void hap_free_session(void *session);
+void hap_pair_verify_ctx_clean(void *ctx);
 int hap_get_ctrl_session_index(hap_secure_session_t *session);
 int hap_close_session(hap_secure_session_t *session);
+int hap_sessions_init(void);
+void hap_sessions_lock(void);
+void hap_sessions_unlock(void);
+void hap_session_lock(hap_secure_session_t *session);
+void hap_session_unlock(hap_secure_session_t *session);
+uint16_t hap_sessions_get_all(hap_secure_session_t *sessions[]);
+void hap_session_put(hap_secure_session_t *session);
 void hap_close_sessions_of_ctrl(hap_ctrl_data_t *ctrl);
 void hap_close_all_sessions();
 #endif /* _HAP_PAIR_VERIFY_H_ */
@@ -26,6 +26,7 @@
 #define _HAP_SERV_H_
 
 #include <hap.h>
+#include <hap_static.h>
 #include <esp_hap_char.h>
 #include <esp_hap_acc.h>
 
@@ -64,6 +65,12 @@ typedef struct {
     hap_serv_bulk_read_t bulk_read;
     hap_linked_serv_t *linked_servs;
     void *priv;
+    /* Set up in application provided storage using hap_acc_create_static() */
+    bool static_alloc;
+    /* Number of entries at the start of linked_servs which are in application provided storage */
+    uint16_t static_links;
+    /* Notification coalescing window in msec, plus 1. 0 to use the default */
+    uint16_t notif_window;
 } __hap_serv_t;
 
 bool hap_serv_get_hidden(hap_serv_t *hs);
@@ -73,6 +80,8 @@ hap_char_t *hap_serv_get_char_by_iid(hap_serv_t *hs, int32_t iid);
 hap_serv_t *hap_serv_create(char *type_uuid);
 void hap_serv_delete(hap_serv_t *hs);
 int hap_serv_add_char(hap_serv_t *hs, hap_char_t *hc);
+hap_serv_t *hap_serv_init_static(hap_serv_static_t *storage, const hap_serv_desc_t *desc,
+        hap_char_static_t *char_storage);
 #ifdef __cplusplus
 }
 #endif
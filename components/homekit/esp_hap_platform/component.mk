@@ -3,6 +3,8 @@
 #
 CFLAGS += -Wno-unused-function
 COMPONENT_SRCDIRS := src
+# Only for host builds, which need CMake
+COMPONENT_OBJEXCLUDE += src/hap_platform_keystore_host.o
 ifdef CONFIG_IDF_TARGET_ESP8266
 COMPONENT_OBJEXCLUDE += src/esp_mfi_i2c.o
 endif
@@ -26,6 +26,7 @@
 #define _HAP_PLATFORM_KEYSTORE_H_
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -63,7 +64,8 @@ int hap_platform_keystore_init_partition(const char *part_name, bool read_only);
  * @param[in,out] val_size Size of the allocated value buffer. Will hold the size of value read on success
  *
  * @return 0 on success
- * @return -1 on error
+ * @return -2 if the key (or the name space) does not exist
+ * @return -1 on other errors
  */
 int hap_platform_keystore_get(const char *part_name, const char *name_space, const char *key, uint8_t *val, size_t *val_size);
 
@@ -80,6 +82,32 @@ int hap_platform_keystore_get(const char *part_name, const char *name_space, con
  */
 int hap_platform_keystore_set(const char *part_name, const char *name_space, const char *key, const uint8_t *val, const size_t val_len);
 
+/** Write Value in Key Store without committing
+ *
+ * The value is guaranteed to be persistent only after hap_platform_keystore_commit()
+ * is called for the same name space.
+ *
+ * @param[in] part_name Name of Partition
+ * @param[in] name_space Name space for the key
+ * @param[in] key Name of the key
+ * @param[in] val Pointer to the value buffer. NULL to erase the key.
+ * @param[in] val_len Length of the value buffer
+ *
+ * @return 0 on success
+ * @return -1 on error
+ */
+int hap_platform_keystore_write(const char *part_name, const char *name_space, const char *key, const uint8_t *val, const size_t val_len);
+
+/** Commit pending writes for a Name space in Key Store
+ *
+ * @param[in] part_name Name of Partition
+ * @param[in] name_space Name space
+ *
+ * @return 0 on success
+ * @return -1 on error
+ */
+int hap_platform_keystore_commit(const char *part_name, const char *name_space);
+
 /** Delete Entry from Key Store
  *
  * @param[in] part_name Name of Partition
@@ -109,6 +137,51 @@ int hap_platform_keystore_delete_namespace(const char *part_name, const char *na
  * @return -1 on error
  */
 int hap_platfrom_keystore_erase_partition(const char *part_name);
+
+/** Open the Counter Journal partition
+ *
+ * The journal is a raw flash region, which gets erased in units of sectors and in which
+ * erased bytes read back as 0xff. Bits can only be programmed from 1 to 0 without an erase.
+ *
+ * @param[out] size Size of the journal partition
+ * @param[out] sector_size Size of the erase unit
+ *
+ * @return 0 on success
+ * @return -1 if there is no journal partition
+ */
+int hap_platform_keystore_journal_open(size_t *size, size_t *sector_size);
+
+/** Read from the Counter Journal partition
+ *
+ * @param[in] offset Offset within the partition
+ * @param[out] buf Buffer into which the data will be read
+ * @param[in] len Number of bytes to read
+ *
+ * @return 0 on success
+ * @return -1 on error
+ */
+int hap_platform_keystore_journal_read(size_t offset, void *buf, size_t len);
+
+/** Write to the Counter Journal partition
+ *
+ * @param[in] offset Offset within the partition. The region should have been erased.
+ * @param[in] buf Data to be written
+ * @param[in] len Number of bytes to write
+ *
+ * @return 0 on success
+ * @return -1 on error
+ */
+int hap_platform_keystore_journal_write(size_t offset, const void *buf, size_t len);
+
+/** Erase a region of the Counter Journal partition
+ *
+ * @param[in] offset Offset within the partition. Should be sector aligned.
+ * @param[in] len Number of bytes to erase. Should be a multiple of the sector size.
+ *
+ * @return 0 on success
+ * @return -1 on error
+ */
+int hap_platform_keystore_journal_erase(size_t offset, size_t len);
 #ifdef __cplusplus
 }
 #endif
@@ -24,6 +24,8 @@
 #ifndef _HAP_PLATFORM_MEMORY_H_
 #define _HAP_PLATFORM_MEMORY_H_
 #include <stdlib.h>
+#include <stdint.h>
+#include <sdkconfig.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -61,6 +63,126 @@ void * hap_platform_memory_calloc(size_t count, size_t size);
  */
 void hap_platform_memory_free(void *ptr);
 
+/** Memory accounting tags
+ *
+ * Each tagged allocation is accounted against one of these subsystems.
+ */
+typedef enum {
+    /** Anything not covered by the other tags */
+    HAP_MEM_TAG_OTHER = 0,
+    /** HomeKit secure sessions */
+    HAP_MEM_TAG_SESSION,
+    /** Accessory attribute database (accessories, services, characteristics) */
+    HAP_MEM_TAG_DATABASE,
+    /** Request/response and JSON processing buffers */
+    HAP_MEM_TAG_JSON,
+    /** Pair Setup/Pair Verify contexts */
+    HAP_MEM_TAG_PAIRING,
+    /** Keystore RAM cache */
+    HAP_MEM_TAG_KEYSTORE,
+    /** Number of tags. Not a valid tag */
+    HAP_MEM_TAG_MAX,
+} hap_mem_tag_t;
+
+/** Memory accounting statistics for a tag */
+typedef struct {
+    /** Bytes currently allocated */
+    size_t cur_bytes;
+    /** Highest value that cur_bytes has reached */
+    size_t peak_bytes;
+    /** Number of currently live allocations */
+    uint32_t cur_count;
+    /** Total number of allocations made since boot */
+    uint32_t alloc_count;
+    /** Number of failed allocations */
+    uint32_t fail_count;
+} hap_mem_stats_t;
+
+#ifdef CONFIG_HAP_PLATFORM_MEMORY_TRACKING
+/** Allocate memory accounted against a tag
+ *
+ * Same as hap_platform_memory_malloc(), but the allocation is accounted against the given tag.
+ * Memory allocated using this must be freed using hap_platform_memory_free_tagged().
+ *
+ * @param[in] tag Accounting tag
+ * @param[in] size Number of bytes to be allocated
+ *
+ * @return pointer to the allocated memory
+ * @return NULL on failure
+ */
+void * hap_platform_memory_malloc_tagged(hap_mem_tag_t tag, size_t size);
+
+/** Allocate zeroed contiguous memory for items, accounted against a tag
+ *
+ * Same as hap_platform_memory_calloc(), but the allocation is accounted against the given tag.
+ * Memory allocated using this must be freed using hap_platform_memory_free_tagged().
+ *
+ * @param[in] tag Accounting tag
+ * @param[in] count Number of items
+ * @param[in] size Size of each item
+ *
+ * @return pointer to the allocated memory
+ * @return NULL on failure
+ */
+void * hap_platform_memory_calloc_tagged(hap_mem_tag_t tag, size_t count, size_t size);
+
+/** Free memory allocated by hap_platform_memory_malloc_tagged() or hap_platform_memory_calloc_tagged()
+ *
+ * @param[in] ptr Pointer to the allocated memory
+ */
+void hap_platform_memory_free_tagged(void *ptr);
+
+/** Get the accounting statistics for a tag
+ *
+ * @param[in] tag Accounting tag
+ * @param[out] stats Pointer to the structure to be populated
+ *
+ * @return 0 on success
+ * @return -1 on failure
+ */
+int hap_platform_memory_get_stats(hap_mem_tag_t tag, hap_mem_stats_t *stats);
+
+/** Reset the peak usage of all tags to their current usage
+ */
+void hap_platform_memory_reset_peak();
+
+/** Print the accounting statistics of all tags on the console
+ */
+void hap_platform_memory_dump_stats();
+
+/** Get the name of a memory accounting tag
+ *
+ * @param[in] tag Accounting tag
+ *
+ * @return tag name
+ */
+const char * hap_platform_memory_tag_to_str(hap_mem_tag_t tag);
+#else /* !CONFIG_HAP_PLATFORM_MEMORY_TRACKING */
+/* Tracking disabled. The tagged APIs map directly to the untagged ones */
+static inline void * hap_platform_memory_malloc_tagged(hap_mem_tag_t tag, size_t size)
+{
+    return hap_platform_memory_malloc(size);
+}
+static inline void * hap_platform_memory_calloc_tagged(hap_mem_tag_t tag, size_t count, size_t size)
+{
+    return hap_platform_memory_calloc(count, size);
+}
+static inline void hap_platform_memory_free_tagged(void *ptr)
+{
+    hap_platform_memory_free(ptr);
+}
+static inline int hap_platform_memory_get_stats(hap_mem_tag_t tag, hap_mem_stats_t *stats)
+{
+    return -1;
+}
+static inline void hap_platform_memory_reset_peak() {}
+static inline void hap_platform_memory_dump_stats() {}
+static inline const char * hap_platform_memory_tag_to_str(hap_mem_tag_t tag)
+{
+    return "";
+}
+#endif /* CONFIG_HAP_PLATFORM_MEMORY_TRACKING */
+
 #ifdef __cplusplus
 }
 #endif
@@ -35,6 +35,18 @@ extern "C" {
  */
 uint16_t hap_platform_os_get_msec_per_tick();
 
+/** Enter the HAP critical section
+ *
+ * Disables preemption (and interrupts on the current core) until the matching
+ * hap_platform_os_exit_critical(). Safe to call from task as well as ISR context.
+ * Sections guarded by this should be kept very short.
+ */
+void hap_platform_os_enter_critical();
+
+/** Exit the HAP critical section entered with hap_platform_os_enter_critical()
+ */
+void hap_platform_os_exit_critical();
+
 #ifdef __cplusplus
 }
 #endif
@@ -23,6 +23,7 @@
  */
 #include <esp_log.h>
 #include <nvs_flash.h>
+#include <esp_partition.h>
 #include <string.h>
 
 
@@ -95,48 +96,140 @@ int hap_platform_keystore_init_partition(const char *part_name, bool read_only)
 }
 #endif /* CONFIG_NVS_ENCRYPTION */
 
+/* NVS handles are kept open per namespace, since opening one requires a lookup through
+ * the NVS entries. The HAP keystore serialises all calls into this file.
+ */
+#define HAP_PLATFORM_KEYSTORE_MAX_HANDLES   8
+
+typedef struct {
+    const char *part_name;
+    char name_space[NVS_KEY_NAME_MAX_SIZE];
+    nvs_handle handle;
+    bool read_write;
+} hap_platform_keystore_handle_t;
+
+static hap_platform_keystore_handle_t keystore_handles[HAP_PLATFORM_KEYSTORE_MAX_HANDLES];
+static int keystore_handle_cnt;
+
+static void hap_platform_keystore_close_handle(int index)
+{
+    nvs_close(keystore_handles[index].handle);
+    keystore_handle_cnt--;
+    keystore_handles[index] = keystore_handles[keystore_handle_cnt];
+}
+
+static esp_err_t hap_platform_keystore_open(const char *part_name, const char *name_space,
+        bool read_write, nvs_handle *handle)
+{
+    int i;
+    for (i = 0; i < keystore_handle_cnt; i++) {
+        hap_platform_keystore_handle_t *h = &keystore_handles[i];
+        if (!strcmp(h->part_name, part_name) && !strcmp(h->name_space, name_space)) {
+            if (h->read_write || !read_write) {
+                *handle = h->handle;
+                return ESP_OK;
+            }
+            /* Need to re-open for writing */
+            hap_platform_keystore_close_handle(i);
+            break;
+        }
+    }
+    nvs_handle new_handle;
+    esp_err_t err = nvs_open_from_partition(part_name, name_space,
+            read_write ? NVS_READWRITE : NVS_READONLY, &new_handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (keystore_handle_cnt == HAP_PLATFORM_KEYSTORE_MAX_HANDLES) {
+        /* Evict the oldest one */
+        hap_platform_keystore_close_handle(0);
+    }
+    hap_platform_keystore_handle_t *h = &keystore_handles[keystore_handle_cnt++];
+    h->part_name = part_name;
+    strncpy(h->name_space, name_space, sizeof(h->name_space) - 1);
+    h->name_space[sizeof(h->name_space) - 1] = '\0';
+    h->handle = new_handle;
+    h->read_write = read_write;
+    *handle = new_handle;
+    return ESP_OK;
+}
+
+static void hap_platform_keystore_close_partition(const char *part_name)
+{
+    int i = 0;
+    while (i < keystore_handle_cnt) {
+        if (!strcmp(keystore_handles[i].part_name, part_name)) {
+            hap_platform_keystore_close_handle(i);
+        } else {
+            i++;
+        }
+    }
+}
+
 int hap_platform_keystore_get(const char *part_name, const char *name_space, const char *key, uint8_t *val, size_t *val_size)
 {
     nvs_handle handle;
-    esp_err_t err = nvs_open_from_partition(part_name, name_space, NVS_READONLY, &handle);
-    if (err != ESP_OK) {
-        return -1;
-    } else {
+    esp_err_t err = hap_platform_keystore_open(part_name, name_space, false, &handle);
+    if (err == ESP_OK) {
         err = nvs_get_blob(handle, key, val, val_size);
-        nvs_close(handle);
     }
     if (err == ESP_OK) {
         return 0;
+    } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+        return -2;
     }
     return -1;
 }
 
-int hap_platform_keystore_set(const char *part_name, const char *name_space, const char *key, const uint8_t *val, const size_t val_len)
-
+int hap_platform_keystore_write(const char *part_name, const char *name_space, const char *key, const uint8_t *val, const size_t val_len)
 {
     nvs_handle handle;
-    esp_err_t err = nvs_open_from_partition(part_name, name_space, NVS_READWRITE, &handle);
+    esp_err_t err = hap_platform_keystore_open(part_name, name_space, true, &handle);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Error (%d) opening NVS handle!", err);
-    } else {
+        return -1;
+    }
+    if (val) {
         err = nvs_set_blob(handle, key, val, val_len);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to write %s", key);
-        } else {
-            nvs_commit(handle);
+    } else {
+        err = nvs_erase_key(handle, key);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
         }
-        nvs_close(handle);
     }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write %s", key);
+        return -1;
+    }
+    return 0;
+}
+
+int hap_platform_keystore_commit(const char *part_name, const char *name_space)
+{
+    nvs_handle handle;
+    esp_err_t err = hap_platform_keystore_open(part_name, name_space, true, &handle);
     if (err == ESP_OK) {
-        return 0;
+        err = nvs_commit(handle);
     }
-    return -1;
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error (%d) committing %s", err, name_space);
+        return -1;
+    }
+    return 0;
+}
+
+int hap_platform_keystore_set(const char *part_name, const char *name_space, const char *key, const uint8_t *val, const size_t val_len)
+{
+    if (hap_platform_keystore_write(part_name, name_space, key, val, val_len) != 0) {
+        return -1;
+    }
+    return hap_platform_keystore_commit(part_name, name_space);
 }
 
 int hap_platform_keystore_delete(const char *part_name, const char *name_space, const char *key)
 {
     nvs_handle handle;
-    esp_err_t err = nvs_open_from_partition(part_name, name_space, NVS_READWRITE, &handle);
+    esp_err_t err = hap_platform_keystore_open(part_name, name_space, true, &handle);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Error (%d) opening NVS handle!", err);
     } else {
@@ -146,7 +239,6 @@ int hap_platform_keystore_delete(const char *part_name, const char *name_space,
         } else {
             nvs_commit(handle);
         }
-        nvs_close(handle);
     }
     if (err == ESP_OK) {
         return 0;
@@ -157,7 +249,7 @@ int hap_platform_keystore_delete(const char *part_name, const char *name_space,
 int hap_platform_keystore_delete_namespace(const char *part_name, const char *name_space)
 {
     nvs_handle handle;
-    esp_err_t err = nvs_open_from_partition(part_name, name_space, NVS_READWRITE, &handle);
+    esp_err_t err = hap_platform_keystore_open(part_name, name_space, true, &handle);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Error (%d) opening NVS handle!", err);
     } else {
@@ -167,7 +259,6 @@ int hap_platform_keystore_delete_namespace(const char *part_name, const char *na
         } else {
             nvs_commit(handle);
         }
-        nvs_close(handle);
     }
     if (err == ESP_OK) {
         return 0;
@@ -177,9 +268,63 @@ int hap_platform_keystore_delete_namespace(const char *part_name, const char *na
 
 int hap_platfrom_keystore_erase_partition(const char *part_name)
 {
+    hap_platform_keystore_close_partition(part_name);
     esp_err_t err = nvs_flash_erase_partition(part_name);
     if (err == ESP_OK) {
         return 0;
     }
     return -1;
 }
+
+static const esp_partition_t *hap_journal_partition;
+
+int hap_platform_keystore_journal_open(size_t *size, size_t *sector_size)
+{
+    if (!hap_journal_partition) {
+        hap_journal_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                CONFIG_HAP_PLATFORM_DEF_JOURNAL_PARTITION);
+        if (!hap_journal_partition) {
+            return -1;
+        }
+    }
+    *size = hap_journal_partition->size;
+    *sector_size = SPI_FLASH_SEC_SIZE;
+    return 0;
+}
+
+int hap_platform_keystore_journal_read(size_t offset, void *buf, size_t len)
+{
+    if (!hap_journal_partition) {
+        return -1;
+    }
+    if (esp_partition_read(hap_journal_partition, offset, buf, len) != ESP_OK) {
+        return -1;
+    }
+    return 0;
+}
+
+int hap_platform_keystore_journal_write(size_t offset, const void *buf, size_t len)
+{
+    if (!hap_journal_partition) {
+        return -1;
+    }
+    esp_err_t err = esp_partition_write(hap_journal_partition, offset, buf, len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error (%d) writing journal at %u", err, (unsigned)offset);
+        return -1;
+    }
+    return 0;
+}
+
+int hap_platform_keystore_journal_erase(size_t offset, size_t len)
+{
+    if (!hap_journal_partition) {
+        return -1;
+    }
+    esp_err_t err = esp_partition_erase_range(hap_journal_partition, offset, len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error (%d) erasing journal at %u", err, (unsigned)offset);
+        return -1;
+    }
+    return 0;
+}
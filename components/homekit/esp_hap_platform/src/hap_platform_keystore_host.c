@@ -0,0 +1,718 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* Host (Linux) implementation of the keystore platform APIs, so that the keystore users can be
+ * run and profiled on a workstation.
+ *
+ * Each partition is a file "<dir>/<partition>.kv", where <dir> is taken from the
+ * HAP_KEYSTORE_DIR environment variable (default: current directory). The file is memory
+ * mapped and holds a header followed by an append-only log of records. Every set, delete and
+ * namespace erase appends a record, and an in-memory index points to the latest value of
+ * every live key. On opening, the log is replayed up to the first record which is incomplete
+ * or fails its checksum (i.e. the one being written when the process died) and everything
+ * after that is discarded. Once the log has grown to more than twice the size of the live
+ * data, it is compacted into a new file which then atomically replaces the old one.
+ *
+ * The semantics follow NVS: keys and namespaces are limited to 15 characters, a get for an
+ * absent key or namespace returns -2, deleting an absent key fails, and writes are visible
+ * right away, with a commit just making sure that they are on the disk.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <esp_log.h>
+
+static const char *TAG = "hap_platform_keystore";
+
+#define HAP_KV_NAME_MAX_SIZE        16  /* Same as NVS_KEY_NAME_MAX_SIZE */
+#define HAP_KV_MAX_PARTITIONS       4
+#define HAP_KV_FILE_MAGIC           "HAPKVLOG"
+#define HAP_KV_FILE_VERSION         1
+#define HAP_KV_REC_MAGIC            0x4b564852  /* "RHVK" */
+#define HAP_KV_INITIAL_SIZE         (16 * 1024)
+/* Logs smaller than this are never compacted */
+#define HAP_KV_COMPACT_MIN          (32 * 1024)
+
+#define HAP_KV_REC_SET              1
+#define HAP_KV_REC_DELETE           2
+#define HAP_KV_REC_ERASE_NS         3
+
+#define HAP_KV_ALIGN(len)           (((len) + 3) & ~3)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} hap_kv_file_hdr_t;
+
+/* Name space, key and value follow the record header, with the total padded to 4 bytes */
+typedef struct {
+    uint32_t magic;
+    uint32_t check;     /* FNV-1a over the rest of the header and the data */
+    uint8_t type;
+    uint8_t ns_len;
+    uint8_t key_len;
+    uint8_t reserved;
+    uint32_t val_len;
+} hap_kv_rec_t;
+
+typedef struct {
+    char name_space[HAP_KV_NAME_MAX_SIZE];
+    char key[HAP_KV_NAME_MAX_SIZE];
+    size_t rec_off;     /* Offset of the SET record holding the latest value */
+    size_t rec_len;
+    uint32_t val_len;
+} hap_kv_entry_t;
+
+typedef struct {
+    char name[HAP_KV_NAME_MAX_SIZE];
+    char *path;
+    int fd;
+    uint8_t *map;
+    size_t map_size;
+    size_t used;        /* End of the valid log */
+    size_t synced;      /* Log upto this offset is known to be on the disk */
+    size_t live;        /* Size of the records of all the live entries */
+    hap_kv_entry_t *entries;
+    int entry_cnt;
+    int entry_cap;
+} hap_kv_part_t;
+
+static hap_kv_part_t hap_kv_parts[HAP_KV_MAX_PARTITIONS];
+
+static uint32_t hap_kv_fnv1a(uint32_t hash, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    while (len--) {
+        hash ^= *p++;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static uint32_t hap_kv_rec_check(const hap_kv_rec_t *rec, const uint8_t *data)
+{
+    uint32_t hash = hap_kv_fnv1a(2166136261u, &rec->type, sizeof(*rec) - offsetof(hap_kv_rec_t, type));
+    return hap_kv_fnv1a(hash, data, rec->ns_len + rec->key_len + rec->val_len);
+}
+
+static size_t hap_kv_rec_size(size_t ns_len, size_t key_len, size_t val_len)
+{
+    return sizeof(hap_kv_rec_t) + HAP_KV_ALIGN(ns_len + key_len + val_len);
+}
+
+static hap_kv_part_t *hap_kv_find_part(const char *part_name)
+{
+    int i;
+    for (i = 0; i < HAP_KV_MAX_PARTITIONS; i++) {
+        if (hap_kv_parts[i].map && !strcmp(hap_kv_parts[i].name, part_name)) {
+            return &hap_kv_parts[i];
+        }
+    }
+    return NULL;
+}
+
+static int hap_kv_find_entry(hap_kv_part_t *part, const char *name_space, const char *key)
+{
+    int i;
+    for (i = 0; i < part->entry_cnt; i++) {
+        if (!strcmp(part->entries[i].key, key) && !strcmp(part->entries[i].name_space, name_space)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool hap_kv_ns_exists(hap_kv_part_t *part, const char *name_space)
+{
+    int i;
+    for (i = 0; i < part->entry_cnt; i++) {
+        if (!strcmp(part->entries[i].name_space, name_space)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void hap_kv_remove_entry(hap_kv_part_t *part, int index)
+{
+    part->live -= part->entries[index].rec_len;
+    part->entries[index] = part->entries[--part->entry_cnt];
+}
+
+static int hap_kv_index_set(hap_kv_part_t *part, const char *name_space, const char *key,
+        size_t rec_off, size_t rec_len, uint32_t val_len)
+{
+    int index = hap_kv_find_entry(part, name_space, key);
+    if (index < 0) {
+        if (part->entry_cnt == part->entry_cap) {
+            int cap = part->entry_cap ? part->entry_cap * 2 : 32;
+            hap_kv_entry_t *entries = realloc(part->entries, cap * sizeof(hap_kv_entry_t));
+            if (!entries) {
+                return -1;
+            }
+            part->entries = entries;
+            part->entry_cap = cap;
+        }
+        index = part->entry_cnt++;
+        hap_kv_entry_t *entry = &part->entries[index];
+        strcpy(entry->name_space, name_space);
+        strcpy(entry->key, key);
+    } else {
+        part->live -= part->entries[index].rec_len;
+    }
+    hap_kv_entry_t *entry = &part->entries[index];
+    entry->rec_off = rec_off;
+    entry->rec_len = rec_len;
+    entry->val_len = val_len;
+    part->live += rec_len;
+    return 0;
+}
+
+/* Applies a record to the index. The names in the record are not NULL terminated */
+static int hap_kv_apply(hap_kv_part_t *part, size_t rec_off)
+{
+    hap_kv_rec_t *rec = (hap_kv_rec_t *)(part->map + rec_off);
+    const char *data = (const char *)(rec + 1);
+    char name_space[HAP_KV_NAME_MAX_SIZE];
+    char key[HAP_KV_NAME_MAX_SIZE];
+    memcpy(name_space, data, rec->ns_len);
+    name_space[rec->ns_len] = '\0';
+    memcpy(key, data + rec->ns_len, rec->key_len);
+    key[rec->key_len] = '\0';
+    int index;
+    switch (rec->type) {
+        case HAP_KV_REC_SET:
+            return hap_kv_index_set(part, name_space, key, rec_off,
+                    hap_kv_rec_size(rec->ns_len, rec->key_len, rec->val_len), rec->val_len);
+        case HAP_KV_REC_DELETE:
+            index = hap_kv_find_entry(part, name_space, key);
+            if (index >= 0) {
+                hap_kv_remove_entry(part, index);
+            }
+            return 0;
+        case HAP_KV_REC_ERASE_NS:
+            index = 0;
+            while (index < part->entry_cnt) {
+                if (!strcmp(part->entries[index].name_space, name_space)) {
+                    hap_kv_remove_entry(part, index);
+                } else {
+                    index++;
+                }
+            }
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/* Returns the size of the valid record at the offset, or 0 if there is none */
+static size_t hap_kv_rec_valid(hap_kv_part_t *part, size_t off)
+{
+    if (part->map_size - off < sizeof(hap_kv_rec_t)) {
+        return 0;
+    }
+    hap_kv_rec_t *rec = (hap_kv_rec_t *)(part->map + off);
+    if (rec->magic != HAP_KV_REC_MAGIC || rec->ns_len >= HAP_KV_NAME_MAX_SIZE ||
+            rec->key_len >= HAP_KV_NAME_MAX_SIZE || rec->val_len > part->map_size) {
+        return 0;
+    }
+    size_t rec_len = hap_kv_rec_size(rec->ns_len, rec->key_len, rec->val_len);
+    if (part->map_size - off < rec_len) {
+        return 0;
+    }
+    if (rec->check != hap_kv_rec_check(rec, (const uint8_t *)(rec + 1))) {
+        return 0;
+    }
+    return rec_len;
+}
+
+static int hap_kv_map(hap_kv_part_t *part, size_t size)
+{
+    if (part->map) {
+        munmap(part->map, part->map_size);
+        part->map = NULL;
+    }
+    if (ftruncate(part->fd, size) != 0) {
+        return -1;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, part->fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    part->map = map;
+    part->map_size = size;
+    return 0;
+}
+
+static void hap_kv_close(hap_kv_part_t *part)
+{
+    if (part->map) {
+        munmap(part->map, part->map_size);
+    }
+    if (part->fd >= 0) {
+        close(part->fd);
+    }
+    free(part->entries);
+    free(part->path);
+    memset(part, 0, sizeof(*part));
+    part->fd = -1;
+}
+
+/* Maps the file and rebuilds the index by replaying the log */
+static int hap_kv_load(hap_kv_part_t *part)
+{
+    struct stat st;
+    if (fstat(part->fd, &st) != 0) {
+        return -1;
+    }
+    size_t size = st.st_size;
+    bool fresh = (size < sizeof(hap_kv_file_hdr_t));
+    if (fresh || size < HAP_KV_INITIAL_SIZE) {
+        size = HAP_KV_INITIAL_SIZE;
+    }
+    if (hap_kv_map(part, size) != 0) {
+        return -1;
+    }
+    hap_kv_file_hdr_t *hdr = (hap_kv_file_hdr_t *)part->map;
+    if (fresh) {
+        memcpy(hdr->magic, HAP_KV_FILE_MAGIC, sizeof(hdr->magic));
+        hdr->version = HAP_KV_FILE_VERSION;
+        hdr->reserved = 0;
+    } else if (memcmp(hdr->magic, HAP_KV_FILE_MAGIC, sizeof(hdr->magic)) ||
+            hdr->version != HAP_KV_FILE_VERSION) {
+        ESP_LOGE(TAG, "%s is not a keystore file", part->path);
+        return -1;
+    }
+    part->entry_cnt = 0;
+    part->live = 0;
+    size_t off = sizeof(hap_kv_file_hdr_t);
+    size_t rec_len;
+    while ((rec_len = hap_kv_rec_valid(part, off)) != 0) {
+        if (hap_kv_apply(part, off) != 0) {
+            break;
+        }
+        off += rec_len;
+    }
+    /* Wipe whatever follows the last valid record, so that a torn record can never be
+     * followed by an older one which happens to look valid
+     */
+    memset(part->map + off, 0, part->map_size - off);
+    part->used = off;
+    msync(part->map, part->map_size, MS_SYNC);
+    part->synced = off;
+    return 0;
+}
+
+static int hap_kv_sync(hap_kv_part_t *part)
+{
+    if (part->synced == part->used) {
+        return 0;
+    }
+    /* msync needs a page aligned start */
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = part->synced & ~(page - 1);
+    if (msync(part->map + start, part->used - start, MS_SYNC) != 0) {
+        return -1;
+    }
+    part->synced = part->used;
+    return 0;
+}
+
+/* Writes only the live records into a new file, which then replaces the old one */
+static int hap_kv_compact(hap_kv_part_t *part)
+{
+    size_t tmp_len = strlen(part->path) + 5;
+    char *tmp_path = malloc(tmp_len);
+    if (!tmp_path) {
+        return -1;
+    }
+    snprintf(tmp_path, tmp_len, "%s.tmp", part->path);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(tmp_path);
+        return -1;
+    }
+    size_t new_used = sizeof(hap_kv_file_hdr_t) + part->live;
+    size_t new_size = HAP_KV_INITIAL_SIZE;
+    while (new_size < new_used * 2) {
+        new_size *= 2;
+    }
+    uint8_t *map = NULL;
+    if (ftruncate(fd, new_size) == 0) {
+        map = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (!map || map == MAP_FAILED) {
+        close(fd);
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    memcpy(map, part->map, sizeof(hap_kv_file_hdr_t));
+    size_t off = sizeof(hap_kv_file_hdr_t);
+    int i;
+    for (i = 0; i < part->entry_cnt; i++) {
+        hap_kv_entry_t *entry = &part->entries[i];
+        memcpy(map + off, part->map + entry->rec_off, entry->rec_len);
+        entry->rec_off = off;
+        off += entry->rec_len;
+    }
+    int ret = msync(map, new_size, MS_SYNC);
+    if (ret == 0) {
+        ret = fsync(fd);
+    }
+    if (ret == 0) {
+        ret = rename(tmp_path, part->path);
+    }
+    if (ret != 0) {
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    if (ret != 0) {
+        /* The entries now point into the new file. Reload the old one to get them back */
+        munmap(map, new_size);
+        close(fd);
+        return hap_kv_load(part);
+    }
+    munmap(part->map, part->map_size);
+    close(part->fd);
+    part->fd = fd;
+    part->map = map;
+    part->map_size = new_size;
+    part->used = part->synced = off;
+    ESP_LOGI(TAG, "Compacted %s to %u bytes", part->name, (unsigned)off);
+    return 0;
+}
+
+static int hap_kv_append(hap_kv_part_t *part, uint8_t type, const char *name_space, const char *key,
+        const uint8_t *val, size_t val_len)
+{
+    size_t ns_len = strlen(name_space);
+    size_t key_len = key ? strlen(key) : 0;
+    if (ns_len >= HAP_KV_NAME_MAX_SIZE || key_len >= HAP_KV_NAME_MAX_SIZE || val_len > UINT32_MAX) {
+        return -1;
+    }
+    size_t rec_len = hap_kv_rec_size(ns_len, key_len, val_len);
+    if (part->map_size - part->used < rec_len) {
+        size_t size = part->map_size * 2;
+        while (size - part->used < rec_len) {
+            size *= 2;
+        }
+        if (hap_kv_map(part, size) != 0) {
+            ESP_LOGE(TAG, "Failed to grow %s", part->path);
+            /* Try getting the old mapping back */
+            hap_kv_map(part, part->map_size);
+            return -1;
+        }
+    }
+    size_t rec_off = part->used;
+    hap_kv_rec_t *rec = (hap_kv_rec_t *)(part->map + rec_off);
+    uint8_t *data = (uint8_t *)(rec + 1);
+    memcpy(data, name_space, ns_len);
+    if (key_len) {
+        memcpy(data + ns_len, key, key_len);
+    }
+    if (val_len) {
+        memcpy(data + ns_len + key_len, val, val_len);
+    }
+    rec->type = type;
+    rec->ns_len = ns_len;
+    rec->key_len = key_len;
+    rec->reserved = 0;
+    rec->val_len = val_len;
+    rec->check = hap_kv_rec_check(rec, data);
+    /* The magic goes last, so that a record is never seen before it is complete */
+    __sync_synchronize();
+    rec->magic = HAP_KV_REC_MAGIC;
+    part->used += rec_len;
+    return hap_kv_apply(part, rec_off);
+}
+
+static const char *hap_kv_dir()
+{
+    const char *dir = getenv("HAP_KEYSTORE_DIR");
+    return dir ? dir : ".";
+}
+
+char * hap_platform_keystore_get_nvs_partition_name()
+{
+    return CONFIG_HAP_PLATFORM_DEF_NVS_RUNTIME_PARTITION;
+}
+
+char * hap_platform_keystore_get_factory_nvs_partition_name()
+{
+    return CONFIG_HAP_PLATFORM_DEF_NVS_FACTORY_PARTITION;
+}
+
+int hap_platform_keystore_init_partition(const char *part_name, bool read_only)
+{
+    if (hap_kv_find_part(part_name)) {
+        return 0;
+    }
+    if (strlen(part_name) >= HAP_KV_NAME_MAX_SIZE) {
+        return -1;
+    }
+    hap_kv_part_t *part = NULL;
+    int i;
+    for (i = 0; i < HAP_KV_MAX_PARTITIONS; i++) {
+        if (!hap_kv_parts[i].map) {
+            part = &hap_kv_parts[i];
+            break;
+        }
+    }
+    if (!part) {
+        return -1;
+    }
+    memset(part, 0, sizeof(*part));
+    strcpy(part->name, part_name);
+    size_t path_len = strlen(hap_kv_dir()) + strlen(part_name) + 5;
+    part->path = malloc(path_len);
+    if (!part->path) {
+        return -1;
+    }
+    snprintf(part->path, path_len, "%s/%s.kv", hap_kv_dir(), part_name);
+    /* Like NVS, a read-only (factory) partition has to exist already */
+    part->fd = open(part->path, read_only ? O_RDWR : (O_RDWR | O_CREAT), 0644);
+    if (part->fd < 0 || hap_kv_load(part) != 0) {
+        if (part->fd >= 0) {
+            ESP_LOGE(TAG, "Error opening %s", part->path);
+        }
+        hap_kv_close(part);
+        return -1;
+    }
+    ESP_LOGI(TAG, "%s: %d keys, %u bytes of log", part->path, part->entry_cnt, (unsigned)part->used);
+    return 0;
+}
+
+int hap_platform_keystore_get(const char *part_name, const char *name_space, const char *key, uint8_t *val, size_t *val_size)
+{
+    hap_kv_part_t *part = hap_kv_find_part(part_name);
+    if (!part) {
+        return -1;
+    }
+    int index = hap_kv_find_entry(part, name_space, key);
+    if (index < 0) {
+        return -2;
+    }
+    hap_kv_entry_t *entry = &part->entries[index];
+    if (!val) {
+        *val_size = entry->val_len;
+        return 0;
+    }
+    if (*val_size < entry->val_len) {
+        return -1;
+    }
+    hap_kv_rec_t *rec = (hap_kv_rec_t *)(part->map + entry->rec_off);
+    memcpy(val, (uint8_t *)(rec + 1) + rec->ns_len + rec->key_len, entry->val_len);
+    *val_size = entry->val_len;
+    return 0;
+}
+
+int hap_platform_keystore_write(const char *part_name, const char *name_space, const char *key, const uint8_t *val, const size_t val_len)
+{
+    hap_kv_part_t *part = hap_kv_find_part(part_name);
+    if (!part) {
+        return -1;
+    }
+    if (!val) {
+        if (hap_kv_find_entry(part, name_space, key) < 0) {
+            return 0;
+        }
+        return hap_kv_append(part, HAP_KV_REC_DELETE, name_space, key, NULL, 0);
+    }
+    if (hap_kv_append(part, HAP_KV_REC_SET, name_space, key, val, val_len) != 0) {
+        ESP_LOGE(TAG, "Failed to write %s", key);
+        return -1;
+    }
+    return 0;
+}
+
+int hap_platform_keystore_commit(const char *part_name, const char *name_space)
+{
+    hap_kv_part_t *part = hap_kv_find_part(part_name);
+    if (!part) {
+        return -1;
+    }
+    if (part->used > HAP_KV_COMPACT_MIN && part->live * 2 < part->used - sizeof(hap_kv_file_hdr_t)) {
+        if (hap_kv_compact(part) == 0) {
+            return 0;
+        }
+        ESP_LOGE(TAG, "Failed to compact %s", part->path);
+    }
+    if (hap_kv_sync(part) != 0) {
+        ESP_LOGE(TAG, "Error committing %s", name_space);
+        return -1;
+    }
+    return 0;
+}
+
+int hap_platform_keystore_set(const char *part_name, const char *name_space, const char *key, const uint8_t *val, const size_t val_len)
+{
+    if (hap_platform_keystore_write(part_name, name_space, key, val, val_len) != 0) {
+        return -1;
+    }
+    return hap_platform_keystore_commit(part_name, name_space);
+}
+
+int hap_platform_keystore_delete(const char *part_name, const char *name_space, const char *key)
+{
+    hap_kv_part_t *part = hap_kv_find_part(part_name);
+    if (!part || hap_kv_find_entry(part, name_space, key) < 0) {
+        ESP_LOGE(TAG, "Failed to delete %s", key);
+        return -1;
+    }
+    if (hap_kv_append(part, HAP_KV_REC_DELETE, name_space, key, NULL, 0) != 0) {
+        return -1;
+    }
+    return hap_platform_keystore_commit(part_name, name_space);
+}
+
+int hap_platform_keystore_delete_namespace(const char *part_name, const char *name_space)
+{
+    hap_kv_part_t *part = hap_kv_find_part(part_name);
+    if (!part) {
+        return -1;
+    }
+    if (!hap_kv_ns_exists(part, name_space)) {
+        return 0;
+    }
+    if (hap_kv_append(part, HAP_KV_REC_ERASE_NS, name_space, NULL, NULL, 0) != 0) {
+        ESP_LOGE(TAG, "Failed to delete %s", name_space);
+        return -1;
+    }
+    return hap_platform_keystore_commit(part_name, name_space);
+}
+
+int hap_platfrom_keystore_erase_partition(const char *part_name)
+{
+    hap_kv_part_t *part = hap_kv_find_part(part_name);
+    if (!part) {
+        return -1;
+    }
+    /* Like NVS, the partition remains initialised, just empty */
+    part->entry_cnt = 0;
+    part->live = 0;
+    memset(part->map + sizeof(hap_kv_file_hdr_t), 0, part->map_size - sizeof(hap_kv_file_hdr_t));
+    part->used = sizeof(hap_kv_file_hdr_t);
+    if (hap_kv_map(part, HAP_KV_INITIAL_SIZE) != 0 || msync(part->map, part->map_size, MS_SYNC) != 0) {
+        return -1;
+    }
+    part->synced = part->used;
+    return 0;
+}
+
+/* The counter journal is a plain file "<dir>/<journal partition>.bin" */
+#define HAP_KV_JOURNAL_SECTOR_SIZE  4096
+#define HAP_KV_JOURNAL_SIZE         (4 * HAP_KV_JOURNAL_SECTOR_SIZE)
+
+static int hap_journal_fd = -1;
+
+int hap_platform_keystore_journal_open(size_t *size, size_t *sector_size)
+{
+    if (hap_journal_fd < 0) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/%s.bin", hap_kv_dir(), CONFIG_HAP_PLATFORM_DEF_JOURNAL_PARTITION);
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            return -1;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return -1;
+        }
+        if (st.st_size != HAP_KV_JOURNAL_SIZE) {
+            /* New journal. Start with all sectors erased */
+            uint8_t erased[HAP_KV_JOURNAL_SECTOR_SIZE];
+            memset(erased, 0xff, sizeof(erased));
+            int i;
+            for (i = 0; i < HAP_KV_JOURNAL_SIZE / HAP_KV_JOURNAL_SECTOR_SIZE; i++) {
+                if (pwrite(fd, erased, sizeof(erased), i * sizeof(erased)) != sizeof(erased)) {
+                    close(fd);
+                    return -1;
+                }
+            }
+            if (ftruncate(fd, HAP_KV_JOURNAL_SIZE) != 0) {
+                close(fd);
+                return -1;
+            }
+        }
+        hap_journal_fd = fd;
+    }
+    *size = HAP_KV_JOURNAL_SIZE;
+    *sector_size = HAP_KV_JOURNAL_SECTOR_SIZE;
+    return 0;
+}
+
+int hap_platform_keystore_journal_read(size_t offset, void *buf, size_t len)
+{
+    if (hap_journal_fd < 0 || offset + len > HAP_KV_JOURNAL_SIZE) {
+        return -1;
+    }
+    return (pread(hap_journal_fd, buf, len, offset) == (ssize_t)len) ? 0 : -1;
+}
+
+int hap_platform_keystore_journal_write(size_t offset, const void *buf, size_t len)
+{
+    if (hap_journal_fd < 0 || offset + len > HAP_KV_JOURNAL_SIZE || len > HAP_KV_JOURNAL_SECTOR_SIZE) {
+        return -1;
+    }
+    /* Like flash, writes can only clear bits */
+    uint8_t cur[HAP_KV_JOURNAL_SECTOR_SIZE];
+    if (pread(hap_journal_fd, cur, len, offset) != (ssize_t)len) {
+        return -1;
+    }
+    size_t i;
+    for (i = 0; i < len; i++) {
+        cur[i] &= ((const uint8_t *)buf)[i];
+    }
+    if (pwrite(hap_journal_fd, cur, len, offset) != (ssize_t)len) {
+        return -1;
+    }
+    return fdatasync(hap_journal_fd) == 0 ? 0 : -1;
+}
+
+int hap_platform_keystore_journal_erase(size_t offset, size_t len)
+{
+    if (hap_journal_fd < 0 || offset % HAP_KV_JOURNAL_SECTOR_SIZE || len % HAP_KV_JOURNAL_SECTOR_SIZE ||
+            offset + len > HAP_KV_JOURNAL_SIZE) {
+        return -1;
+    }
+    uint8_t erased[HAP_KV_JOURNAL_SECTOR_SIZE];
+    memset(erased, 0xff, sizeof(erased));
+    size_t off;
+    for (off = offset; off < offset + len; off += sizeof(erased)) {
+        if (pwrite(hap_journal_fd, erased, sizeof(erased), off) != sizeof(erased)) {
+            return -1;
+        }
+    }
+    return fdatasync(hap_journal_fd) == 0 ? 0 : -1;
+}
@@ -22,6 +22,10 @@
  *
  */
 #include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <hap_platform_memory.h>
+#include <hap_platform_os.h>
 
 void * hap_platform_memory_malloc(size_t size)
 {
@@ -37,3 +41,124 @@ void hap_platform_memory_free(void *ptr)
 {
     free(ptr);
 }
+
+#ifdef CONFIG_HAP_PLATFORM_MEMORY_TRACKING
+static const char *hap_mem_tag_names[HAP_MEM_TAG_MAX] = {
+    [HAP_MEM_TAG_OTHER] = "other",
+    [HAP_MEM_TAG_SESSION] = "sessions",
+    [HAP_MEM_TAG_DATABASE] = "database",
+    [HAP_MEM_TAG_JSON] = "json",
+    [HAP_MEM_TAG_PAIRING] = "pairing",
+    [HAP_MEM_TAG_KEYSTORE] = "keystore",
+};
+
+const char * hap_platform_memory_tag_to_str(hap_mem_tag_t tag)
+{
+    if (tag >= HAP_MEM_TAG_MAX) {
+        return "invalid";
+    }
+    return hap_mem_tag_names[tag];
+}
+
+/* Every tagged allocation is prefixed with this header so that the size and tag
+ * are known at the time of free.
+ */
+typedef struct {
+    size_t size;
+    hap_mem_tag_t tag;
+} __attribute__((aligned(8))) hap_mem_hdr_t;
+
+static hap_mem_stats_t hap_mem_stats[HAP_MEM_TAG_MAX];
+
+static void * hap_platform_memory_account(hap_mem_tag_t tag, hap_mem_hdr_t *hdr, size_t size)
+{
+    if (tag >= HAP_MEM_TAG_MAX) {
+        tag = HAP_MEM_TAG_OTHER;
+    }
+    hap_platform_os_enter_critical();
+    hap_mem_stats_t *stats = &hap_mem_stats[tag];
+    if (!hdr) {
+        stats->fail_count++;
+        hap_platform_os_exit_critical();
+        return NULL;
+    }
+    stats->cur_bytes += size;
+    stats->cur_count++;
+    stats->alloc_count++;
+    if (stats->cur_bytes > stats->peak_bytes) {
+        stats->peak_bytes = stats->cur_bytes;
+    }
+    hap_platform_os_exit_critical();
+    hdr->size = size;
+    hdr->tag = tag;
+    return hdr + 1;
+}
+
+void * hap_platform_memory_malloc_tagged(hap_mem_tag_t tag, size_t size)
+{
+    if (size > SIZE_MAX - sizeof(hap_mem_hdr_t)) {
+        return hap_platform_memory_account(tag, NULL, 0);
+    }
+    hap_mem_hdr_t *hdr = malloc(sizeof(hap_mem_hdr_t) + size);
+    return hap_platform_memory_account(tag, hdr, size);
+}
+
+void * hap_platform_memory_calloc_tagged(hap_mem_tag_t tag, size_t count, size_t size)
+{
+    if (size && count > (SIZE_MAX - sizeof(hap_mem_hdr_t)) / size) {
+        return hap_platform_memory_account(tag, NULL, 0);
+    }
+    hap_mem_hdr_t *hdr = calloc(1, sizeof(hap_mem_hdr_t) + count * size);
+    return hap_platform_memory_account(tag, hdr, count * size);
+}
+
+void hap_platform_memory_free_tagged(void *ptr)
+{
+    if (!ptr) {
+        return;
+    }
+    hap_mem_hdr_t *hdr = (hap_mem_hdr_t *)ptr - 1;
+    hap_platform_os_enter_critical();
+    hap_mem_stats_t *stats = &hap_mem_stats[hdr->tag];
+    stats->cur_bytes -= hdr->size;
+    stats->cur_count--;
+    hap_platform_os_exit_critical();
+    free(hdr);
+}
+
+int hap_platform_memory_get_stats(hap_mem_tag_t tag, hap_mem_stats_t *stats)
+{
+    if (tag >= HAP_MEM_TAG_MAX || !stats) {
+        return -1;
+    }
+    hap_platform_os_enter_critical();
+    *stats = hap_mem_stats[tag];
+    hap_platform_os_exit_critical();
+    return 0;
+}
+
+void hap_platform_memory_reset_peak()
+{
+    hap_platform_os_enter_critical();
+    for (int i = 0; i < HAP_MEM_TAG_MAX; i++) {
+        hap_mem_stats[i].peak_bytes = hap_mem_stats[i].cur_bytes;
+    }
+    hap_platform_os_exit_critical();
+}
+
+void hap_platform_memory_dump_stats()
+{
+    hap_mem_stats_t stats;
+    size_t total_cur = 0, total_peak = 0;
+    printf("%-10s %10s %10s %8s %10s %6s\n", "tag", "cur_bytes", "peak_bytes", "cur_cnt", "alloc_cnt", "fails");
+    for (int i = 0; i < HAP_MEM_TAG_MAX; i++) {
+        hap_platform_memory_get_stats(i, &stats);
+        printf("%-10s %10u %10u %8u %10u %6u\n", hap_platform_memory_tag_to_str(i),
+                (unsigned)stats.cur_bytes, (unsigned)stats.peak_bytes, (unsigned)stats.cur_count,
+                (unsigned)stats.alloc_count, (unsigned)stats.fail_count);
+        total_cur += stats.cur_bytes;
+        total_peak += stats.peak_bytes;
+    }
+    printf("%-10s %10u %10u\n", "total", (unsigned)total_cur, (unsigned)total_peak);
+}
+#endif /* CONFIG_HAP_PLATFORM_MEMORY_TRACKING */
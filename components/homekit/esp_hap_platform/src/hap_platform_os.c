@@ -25,8 +25,31 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/FreeRTOSConfig.h>
 #include <freertos/portmacro.h>
+#include <freertos/task.h>
+
+#ifndef CONFIG_IDF_TARGET_ESP8266
+static portMUX_TYPE hap_platform_os_mux = portMUX_INITIALIZER_UNLOCKED;
+#endif
 
 uint16_t hap_platform_os_get_msec_per_tick()
 {
     return portTICK_PERIOD_MS;
 }
+
+void hap_platform_os_enter_critical()
+{
+#ifdef CONFIG_IDF_TARGET_ESP8266
+    portENTER_CRITICAL();
+#else
+    portENTER_CRITICAL_SAFE(&hap_platform_os_mux);
+#endif
+}
+
+void hap_platform_os_exit_critical()
+{
+#ifdef CONFIG_IDF_TARGET_ESP8266
+    portEXIT_CRITICAL();
+#else
+    portEXIT_CRITICAL_SAFE(&hap_platform_os_mux);
+#endif
+}
@@ -0,0 +1,182 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* Default implementations of the HAP functions which the tests do not build the sources for.
+ * They are weak, so that a test can replace any of them, e.g. to count the calls.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <hap.h>
+#include <esp_hap_main.h>
+#include <esp_hap_database.h>
+#include <esp_hap_ip_services.h>
+#include <esp_hap_controllers.h>
+#include <esp_hap_pair_verify.h>
+#include <esp_hap_wifi.h>
+#include <esp_hap_bct_priv.h>
+#include <esp_mfi_rand.h>
+#include <esp_mfi_sha.h>
+#include <esp_mfi_base64.h>
+
+/* esp_hap_database.c */
+__attribute__((weak)) hap_priv_t hap_priv;
+
+__attribute__((weak)) int hap_get_next_aid()
+{
+    return ++hap_priv.cur_aid;
+}
+
+/* esp_hap_main.c */
+__attribute__((weak)) bool is_hap_loop_started()
+{
+    return false;
+}
+
+__attribute__((weak)) int hap_send_event(hap_internal_event_t event)
+{
+    return HAP_SUCCESS;
+}
+
+__attribute__((weak)) int hap_report_db_change(bool settled)
+{
+    return HAP_SUCCESS;
+}
+
+__attribute__((weak)) void hap_report_event(hap_event_t event, void *data, size_t data_size)
+{
+}
+
+/* esp_hap_controllers.c */
+__attribute__((weak)) hap_ctrl_data_t *hap_get_controller(char *ctrl_id)
+{
+    return NULL;
+}
+
+/* esp_mfi_sha.c. Not a real hash, it just folds the input into 64 bytes */
+__attribute__((weak)) esp_mfi_sha_ctx_t esp_mfi_sha512_new(void)
+{
+    return calloc(1, 64);
+}
+
+__attribute__((weak)) void esp_mfi_sha512_init(esp_mfi_sha_ctx_t ctx)
+{
+    memset(ctx, 0, 64);
+}
+
+__attribute__((weak)) void esp_mfi_sha512_update(esp_mfi_sha_ctx_t ctx, const uint8_t *input, int len)
+{
+    for (int i = 0; i < len; i++) {
+        ((uint8_t *)ctx)[i % 64] ^= input[i];
+    }
+}
+
+__attribute__((weak)) void esp_mfi_sha512_final(esp_mfi_sha_ctx_t ctx, uint8_t *digest)
+{
+    memcpy(digest, ctx, 64);
+}
+
+__attribute__((weak)) void esp_mfi_sha512_free(esp_mfi_sha_ctx_t ctx)
+{
+    free(ctx);
+}
+
+/* esp_mfi_base64.c. Not real Base64 either, but the output has the right length */
+__attribute__((weak)) int esp_mfi_base64_encode(const char *src, int len, char *dest, int dest_len, int *out_len)
+{
+    int olen = ((len + 2) / 3) * 4;
+    if (olen >= dest_len) {
+        return -1;
+    }
+    memset(dest, 'A', olen);
+    dest[olen] = '\0';
+    *out_len = olen;
+    return 0;
+}
+
+/* esp_mfi_rand.c */
+__attribute__((weak)) int esp_mfi_get_random(uint8_t *buf, uint16_t len)
+{
+    for (int i = 0; i < len; i++) {
+        buf[i] = rand();
+    }
+    return len;
+}
+
+/* esp_hap_ip_services.c */
+__attribute__((weak)) int hap_http_send_notif_from_isr()
+{
+    return HAP_SUCCESS;
+}
+
+__attribute__((weak)) void hap_http_send_notif()
+{
+}
+
+__attribute__((weak)) int hap_httpd_start(void)
+{
+    return HAP_SUCCESS;
+}
+
+__attribute__((weak)) int hap_mdns_announce(bool first)
+{
+    return HAP_SUCCESS;
+}
+
+__attribute__((weak)) int hap_mdns_deannounce(void)
+{
+    return HAP_SUCCESS;
+}
+
+__attribute__((weak)) int hap_ip_services_start()
+{
+    return hap_mdns_announce(false);
+}
+
+/* esp_hap_pair_verify.c */
+__attribute__((weak)) int hap_sessions_init(void)
+{
+    return HAP_SUCCESS;
+}
+
+__attribute__((weak)) void hap_close_all_sessions()
+{
+}
+
+/* esp_hap_wifi.c */
+__attribute__((weak)) void hap_erase_network_info(void)
+{
+}
+
+/* esp_hap_bct.c */
+__attribute__((weak)) void hap_handle_bct_change_name()
+{
+}
+
+__attribute__((weak)) void hap_handle_hot_plug()
+{
+}
+
+__attribute__((weak)) void hap_handle_hot_plug_resume()
+{
+}
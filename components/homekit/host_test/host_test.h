@@ -0,0 +1,60 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* Helpers for the host tests. Every test is a separate program, built by the Makefile in
+ * this directory, which returns a non zero exit code on the first failure.
+ */
+#ifndef _HOST_TEST_H_
+#define _HOST_TEST_H_
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TEST_ASSERT(cond) do {                                                          \
+        if (!(cond)) {                                                                  \
+            printf("%s:%d: FAIL: %s\n", __FILE__, __LINE__, #cond);                     \
+            exit(1);                                                                    \
+        }                                                                               \
+    } while (0)
+
+#define TEST_ASSERT_EQUAL(expected, actual) do {                                        \
+        long long __exp = (long long)(expected), __act = (long long)(actual);           \
+        if (__exp != __act) {                                                           \
+            printf("%s:%d: FAIL: %s is %lld, expected %lld\n", __FILE__, __LINE__,      \
+                    #actual, __act, __exp);                                             \
+            exit(1);                                                                    \
+        }                                                                               \
+    } while (0)
+
+#define RUN_TEST(fn) do {                                                               \
+        printf("%s\n", #fn);                                                            \
+        fn();                                                                           \
+    } while (0)
+
+/* Make xPortInIsrContext() return true for the calling thread, till host_test_isr_exit() */
+void host_test_isr_enter(void);
+void host_test_isr_exit(void);
+
+#endif /* _HOST_TEST_H_ */
@@ -0,0 +1,41 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* Host (Linux) stand-ins for the FreeRTOS APIs used by the HomeKit components, implemented
+ * on top of pthreads in host_freertos.c. Critical sections are a single process wide recursive
+ * mutex and "ISR context" is a per thread flag, set using host_test_isr_enter().
+ */
+#ifndef _HOST_FREERTOS_H_
+#define _HOST_FREERTOS_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sdkconfig.h>
+#include <freertos/FreeRTOSConfig.h>
+#include <freertos/portmacro.h>
+
+/* From the ROM functions, which the IDF FreeRTOS headers pull in */
+int ets_printf(const char *fmt, ...);
+
+#endif /* _HOST_FREERTOS_H_ */
@@ -0,0 +1,58 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+#ifndef _HOST_PORTMACRO_H_
+#define _HOST_PORTMACRO_H_
+#include <stdint.h>
+#include <freertos/FreeRTOSConfig.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdTRUE                      1
+#define pdFALSE                     0
+#define pdPASS                      pdTRUE
+#define pdFAIL                      pdFALSE
+#define portMAX_DELAY               ((TickType_t)0xffffffff)
+#define portTICK_PERIOD_MS          ((TickType_t)(1000 / configTICK_RATE_HZ))
+#define pdMS_TO_TICKS(ms)           ((TickType_t)((ms) * configTICK_RATE_HZ / 1000))
+
+typedef struct {
+    int unused;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED    { 0 }
+
+void vPortEnterCritical(void);
+void vPortExitCritical(void);
+BaseType_t xPortInIsrContext(void);
+
+#define portENTER_CRITICAL(mux)         vPortEnterCritical()
+#define portEXIT_CRITICAL(mux)          vPortExitCritical()
+#define portENTER_CRITICAL_ISR(mux)     vPortEnterCritical()
+#define portEXIT_CRITICAL_ISR(mux)      vPortExitCritical()
+#define portENTER_CRITICAL_SAFE(mux)    vPortEnterCritical()
+#define portEXIT_CRITICAL_SAFE(mux)     vPortExitCritical()
+#define portYIELD_FROM_ISR()
+
+#endif /* _HOST_PORTMACRO_H_ */
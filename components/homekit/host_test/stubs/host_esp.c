@@ -0,0 +1,300 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* Host implementation of the ESP-IDF APIs (other than FreeRTOS) used by the HomeKit components */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+#include <esp_event.h>
+#include <esp_http_server.h>
+#include <sodium/crypto_sign_ed25519.h>
+#include <sodium/crypto_scalarmult_curve25519.h>
+#include <sodium/crypto_aead_chacha20poly1305.h>
+#include <hkdf-sha.h>
+
+int ets_printf(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int ret = vprintf(fmt, args);
+    va_end(args);
+    return ret;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Timers. All the armed timers are in a list sorted by the due time, which is serviced by a
+ * single thread. As with esp_timer, stopping a timer does not wait for a running callback.
+ */
+struct host_timer {
+    struct host_timer *next;
+    esp_timer_cb_t callback;
+    void *arg;
+    int64_t due;
+    uint64_t period;
+    bool armed;
+};
+
+static pthread_mutex_t host_timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t host_timer_cond;
+static struct host_timer *host_timer_list;
+static bool host_timer_started;
+
+static void host_timer_unlink(struct host_timer *timer)
+{
+    struct host_timer **prev = &host_timer_list;
+    while (*prev && *prev != timer) {
+        prev = &(*prev)->next;
+    }
+    if (*prev) {
+        *prev = timer->next;
+    }
+    timer->next = NULL;
+    timer->armed = false;
+}
+
+static void host_timer_insert(struct host_timer *timer)
+{
+    struct host_timer **prev = &host_timer_list;
+    while (*prev && (*prev)->due <= timer->due) {
+        prev = &(*prev)->next;
+    }
+    timer->next = *prev;
+    *prev = timer;
+    timer->armed = true;
+    pthread_cond_broadcast(&host_timer_cond);
+}
+
+static void *host_timer_task(void *arg)
+{
+    pthread_mutex_lock(&host_timer_lock);
+    while (1) {
+        struct host_timer *timer = host_timer_list;
+        if (!timer) {
+            pthread_cond_wait(&host_timer_cond, &host_timer_lock);
+            continue;
+        }
+        int64_t now = esp_timer_get_time();
+        if (timer->due > now) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            int64_t ns = ts.tv_nsec + (timer->due - now) * 1000;
+            ts.tv_sec += ns / 1000000000;
+            ts.tv_nsec = ns % 1000000000;
+            pthread_cond_timedwait(&host_timer_cond, &host_timer_lock, &ts);
+            continue;
+        }
+        host_timer_unlink(timer);
+        if (timer->period) {
+            timer->due += timer->period;
+            host_timer_insert(timer);
+        }
+        esp_timer_cb_t callback = timer->callback;
+        void *cb_arg = timer->arg;
+        pthread_mutex_unlock(&host_timer_lock);
+        callback(cb_arg);
+        pthread_mutex_lock(&host_timer_lock);
+    }
+    return NULL;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle)
+{
+    if (!args || !args->callback || !handle) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    struct host_timer *timer = calloc(1, sizeof(struct host_timer));
+    if (!timer) {
+        return ESP_ERR_NO_MEM;
+    }
+    timer->callback = args->callback;
+    timer->arg = args->arg;
+    pthread_mutex_lock(&host_timer_lock);
+    if (!host_timer_started) {
+        pthread_condattr_t attr;
+        pthread_t thread;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&host_timer_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        pthread_create(&thread, NULL, host_timer_task, NULL);
+        pthread_detach(thread);
+        host_timer_started = true;
+    }
+    pthread_mutex_unlock(&host_timer_lock);
+    *handle = timer;
+    return ESP_OK;
+}
+
+static esp_err_t host_timer_start(esp_timer_handle_t timer, uint64_t timeout_us, uint64_t period)
+{
+    pthread_mutex_lock(&host_timer_lock);
+    if (timer->armed) {
+        pthread_mutex_unlock(&host_timer_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->due = esp_timer_get_time() + timeout_us;
+    timer->period = period;
+    host_timer_insert(timer);
+    pthread_mutex_unlock(&host_timer_lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    return host_timer_start(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+    return host_timer_start(timer, period_us, period_us);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    pthread_mutex_lock(&host_timer_lock);
+    if (!timer->armed) {
+        pthread_mutex_unlock(&host_timer_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    host_timer_unlink(timer);
+    pthread_mutex_unlock(&host_timer_lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    pthread_mutex_lock(&host_timer_lock);
+    if (timer->armed) {
+        pthread_mutex_unlock(&host_timer_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    pthread_mutex_unlock(&host_timer_lock);
+    free(timer);
+    return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer)
+{
+    pthread_mutex_lock(&host_timer_lock);
+    bool armed = timer->armed;
+    pthread_mutex_unlock(&host_timer_lock);
+    return armed;
+}
+
+esp_err_t esp_wifi_get_mac(wifi_interface_t ifx, uint8_t mac[6])
+{
+    static const uint8_t host_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+    memcpy(mac, host_mac, sizeof(host_mac));
+    mac[5] += ifx;
+    return ESP_OK;
+}
+
+esp_err_t esp_event_post(esp_event_base_t base, int32_t id, void *data, size_t size, TickType_t wait)
+{
+    return ESP_OK;
+}
+
+int crypto_sign_ed25519_keypair(unsigned char *pk, unsigned char *sk)
+{
+    for (unsigned int i = 0; i < crypto_sign_ed25519_SECRETKEYBYTES; i++) {
+        sk[i] = rand();
+    }
+    memcpy(pk, sk + 32, crypto_sign_ed25519_PUBLICKEYBYTES);
+    return 0;
+}
+
+int crypto_sign_ed25519_detached(unsigned char *sig, unsigned long long *siglen_p,
+        const unsigned char *m, unsigned long long mlen, const unsigned char *sk)
+{
+    memset(sig, 0, 64);
+    if (siglen_p) {
+        *siglen_p = 64;
+    }
+    return 0;
+}
+
+int crypto_sign_ed25519_verify_detached(const unsigned char *sig, const unsigned char *m,
+        unsigned long long mlen, const unsigned char *pk)
+{
+    return -1;
+}
+
+int crypto_scalarmult_curve25519(unsigned char *q, const unsigned char *n, const unsigned char *p)
+{
+    return -1;
+}
+
+int crypto_aead_chacha20poly1305_ietf_encrypt_detached(unsigned char *c, unsigned char *mac,
+        unsigned long long *maclen_p, const unsigned char *m, unsigned long long mlen,
+        const unsigned char *ad, unsigned long long adlen, const unsigned char *nsec,
+        const unsigned char *npub, const unsigned char *k)
+{
+    memmove(c, m, mlen);
+    memset(mac, 0, 16);
+    if (maclen_p) {
+        *maclen_p = 16;
+    }
+    return 0;
+}
+
+int crypto_aead_chacha20poly1305_ietf_decrypt_detached(unsigned char *m, unsigned char *nsec,
+        const unsigned char *c, unsigned long long clen, const unsigned char *mac,
+        const unsigned char *ad, unsigned long long adlen, const unsigned char *npub,
+        const unsigned char *k)
+{
+    memmove(m, c, clen);
+    return 0;
+}
+
+int hkdf(SHAversion whichSha, const unsigned char *salt, int salt_len,
+        const unsigned char *ikm, int ikm_len, const unsigned char *info, int info_len,
+        uint8_t okm[ ], int okm_len)
+{
+    memset(okm, 0, okm_len);
+    return 0;
+}
+
+/* The HTTP server is not available. Sessions are set up by the tests themselves */
+esp_err_t httpd_sess_trigger_close(httpd_handle_t handle, int sockfd)
+{
+    return ESP_OK;
+}
+
+void *httpd_sess_get_ctx(httpd_handle_t handle, int sockfd)
+{
+    return NULL;
+}
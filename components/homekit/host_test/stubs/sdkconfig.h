@@ -0,0 +1,25 @@
+/*
+ * Configuration for the host tests. The values are the Kconfig defaults, except for
+ * the ones noted.
+ */
+#define CONFIG_IDF_TARGET_LINUX 1
+#define CONFIG_HAP_NOTIF_WINDOW_MS 0
+#define CONFIG_HAP_NOTIF_TASK_STACK_SIZE 4096
+#define CONFIG_HAP_NOTIF_TASK_PRIORITY 5
+#define CONFIG_HAP_ISR_UPDATE_RING_SIZE 16
+#define CONFIG_HAP_ASYNC_REQ_TIMEOUT_MS 3000
+#define CONFIG_HAP_ASYNC_MAX_PENDING 16
+#define CONFIG_HAP_CONFIG_NUM_DEBOUNCE_MS 2000
+#define CONFIG_HAP_MDNS_MIN_INTERVAL_MS 1000
+#define CONFIG_HAP_CHAR_PERSIST_INTERVAL_MS 10000
+#define CONFIG_HAP_KEYSTORE_CACHE 1
+#define CONFIG_HAP_HTTP_STACK_SIZE 12288
+#define CONFIG_HAP_HTTP_SERVER_PORT 80
+#define CONFIG_HAP_HTTP_CONTROL_PORT 32859
+#define CONFIG_HAP_HTTP_MAX_OPEN_SOCKETS 8
+#define CONFIG_HAP_HTTP_MAX_URI_HANDLERS 16
+#define CONFIG_HAP_PLATFORM_DEF_NVS_RUNTIME_PARTITION "nvs"
+#define CONFIG_HAP_PLATFORM_DEF_NVS_FACTORY_PARTITION "factory_nvs"
+#define CONFIG_HAP_PLATFORM_DEF_JOURNAL_PARTITION "hap_journal"
+/* Not default. Lets the tests check for leaks using hap_platform_memory_get_stats() */
+#define CONFIG_HAP_PLATFORM_MEMORY_TRACKING 1
@@ -0,0 +1,38 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+#ifndef _HOST_CRYPTO_SIGN_ED25519_H_
+#define _HOST_CRYPTO_SIGN_ED25519_H_
+
+#define crypto_sign_ed25519_PUBLICKEYBYTES  32U
+#define crypto_sign_ed25519_SECRETKEYBYTES  64U
+
+/* Not a real key pair. Only good enough for the keys to be stored and compared */
+int crypto_sign_ed25519_keypair(unsigned char *pk, unsigned char *sk);
+/* Not implemented. Signing gives an all zero signature, and verification always fails */
+int crypto_sign_ed25519_detached(unsigned char *sig, unsigned long long *siglen_p,
+        const unsigned char *m, unsigned long long mlen, const unsigned char *sk);
+int crypto_sign_ed25519_verify_detached(const unsigned char *sig, const unsigned char *m,
+        unsigned long long mlen, const unsigned char *pk);
+
+#endif /* _HOST_CRYPTO_SIGN_ED25519_H_ */
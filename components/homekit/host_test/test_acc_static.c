@@ -0,0 +1,228 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+/* An accessory set up by hap_acc_create_static() from the description which acc_graph_gen
+ * generates out of static_graph.json, and then extended and deleted using the regular APIs.
+ */
+#include <string.h>
+#include <hap.h>
+#include <hap_static.h>
+#include <hap_apple_servs.h>
+#include <hap_apple_chars.h>
+#include <hap_platform_memory.h>
+#include <esp_hap_acc.h>
+#include <esp_hap_serv.h>
+#include <esp_hap_char.h>
+#include "static_graph.h"
+#include "host_test.h"
+
+#define TEST_SERVS      4
+/* The highest instance ID in the description */
+#define TEST_MAX_IID    STATIC_GRAPH_LIGHT_BATTERY_SERVICE_STATUS_LOW_BATTERY_IID
+
+int test_identify(hap_acc_t *ha)
+{
+    return HAP_SUCCESS;
+}
+
+/* Allocations so far, and the ones still in use, over all the tags */
+static uint32_t test_alloc_count(uint32_t *in_use)
+{
+    uint32_t count = 0;
+    *in_use = 0;
+    for (int i = 0; i < HAP_MEM_TAG_MAX; i++) {
+        hap_mem_stats_t stats;
+        hap_platform_memory_get_stats(i, &stats);
+        count += stats.alloc_count;
+        *in_use += stats.cur_count;
+    }
+    return count;
+}
+
+/* Whether hs is linked to linked_serv */
+static bool test_is_linked(hap_serv_t *hs, hap_serv_t *linked_serv)
+{
+    hap_linked_serv_t *link;
+    for (link = ((__hap_serv_t *)hs)->linked_servs; link; link = link->next) {
+        if (link->hs == linked_serv) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Descriptions with errors, copied from the generated one. They get rejected before the
+ * storage gets touched.
+ */
+static void test_invalid_desc()
+{
+    const hap_acc_desc_t *desc = &static_graph_light_desc;
+    hap_serv_desc_t servs[TEST_SERVS];
+    hap_acc_desc_t bad = *desc;
+    TEST_ASSERT_EQUAL(TEST_SERVS, desc->num_servs);
+    bad.servs = servs;
+
+    /* A service with the instance ID of a characteristic */
+    memcpy(servs, desc->servs, sizeof(servs));
+    servs[3].iid = STATIC_GRAPH_LIGHT_LIGHTBULB_BRIGHTNESS_IID;
+    TEST_ASSERT(hap_acc_create_static(&bad) == NULL);
+
+    /* Two services with the same instance ID */
+    memcpy(servs, desc->servs, sizeof(servs));
+    servs[3].iid = STATIC_GRAPH_LIGHT_LIGHTBULB_IID;
+    TEST_ASSERT(hap_acc_create_static(&bad) == NULL);
+
+    /* A link to a service which is not there */
+    static const uint32_t missing[] = { TEST_MAX_IID + 1 };
+    memcpy(servs, desc->servs, sizeof(servs));
+    servs[2].linked_iids = missing;
+    TEST_ASSERT(hap_acc_create_static(&bad) == NULL);
+
+    /* No Accessory Information Service */
+    memcpy(servs, desc->servs, sizeof(servs));
+    bad.servs = &servs[1];
+    bad.num_servs = TEST_SERVS - 1;
+    TEST_ASSERT(hap_acc_create_static(&bad) == NULL);
+
+    TEST_ASSERT(!((__hap_acc_t *)desc->acc_storage)->static_alloc);
+}
+
+static hap_acc_t *test_create()
+{
+    const hap_acc_desc_t *desc = &static_graph_light_desc;
+    uint32_t in_use, in_use_after;
+    uint32_t allocs = test_alloc_count(&in_use);
+    hap_acc_t *ha = hap_acc_create_static(desc);
+    TEST_ASSERT(ha);
+    TEST_ASSERT(ha == (hap_acc_t *)desc->acc_storage);
+    /* Set up in the storage of the description, without any allocation */
+    TEST_ASSERT_EQUAL(allocs, test_alloc_count(&in_use_after));
+    TEST_ASSERT_EQUAL(in_use, in_use_after);
+    return ha;
+}
+
+/* The instance IDs, links and values are the ones from the description */
+static void test_static_graph(hap_acc_t *ha)
+{
+    const hap_acc_desc_t *desc = &static_graph_light_desc;
+    int i, j;
+    hap_serv_t *hs = hap_acc_get_first_serv(ha);
+    for (i = 0; i < desc->num_servs; i++, hs = hap_serv_get_next(hs)) {
+        const hap_serv_desc_t *sd = &desc->servs[i];
+        TEST_ASSERT(hs == (hap_serv_t *)&desc->serv_storage[i]);
+        TEST_ASSERT_EQUAL(sd->iid, hap_serv_get_iid(hs));
+        TEST_ASSERT(hap_serv_get_parent(hs) == ha);
+        hap_char_t *hc = hap_serv_get_first_char(hs);
+        for (j = 0; j < sd->num_chars; j++, hc = hap_char_get_next(hc)) {
+            TEST_ASSERT(hc);
+            TEST_ASSERT_EQUAL(sd->chars[j].iid, hap_char_get_iid(hc));
+            TEST_ASSERT(!strcmp(sd->chars[j].type_uuid, hap_char_get_type_uuid(hc)));
+            TEST_ASSERT(hap_char_get_parent(hc) == hs);
+        }
+        TEST_ASSERT(hc == NULL);
+    }
+    TEST_ASSERT(hs == NULL);
+
+    hap_serv_t *lightbulb = hap_acc_get_serv_by_iid(ha, STATIC_GRAPH_LIGHT_LIGHTBULB_IID);
+    hap_serv_t *battery = hap_acc_get_serv_by_iid(ha, STATIC_GRAPH_LIGHT_BATTERY_SERVICE_IID);
+    TEST_ASSERT(lightbulb && battery);
+    TEST_ASSERT(!strcmp(HAP_SERV_UUID_LIGHTBULB, hap_serv_get_type_uuid(lightbulb)));
+    TEST_ASSERT(!strcmp(HAP_SERV_UUID_BATTERY_SERVICE, hap_serv_get_type_uuid(battery)));
+    /* The battery service comes after the lightbulb, in the description */
+    TEST_ASSERT(test_is_linked(lightbulb, battery));
+    TEST_ASSERT(!((__hap_serv_t *)battery)->linked_servs);
+
+    hap_char_t *brightness = hap_acc_get_char_by_iid(ha, STATIC_GRAPH_LIGHT_LIGHTBULB_BRIGHTNESS_IID);
+    TEST_ASSERT(brightness);
+    TEST_ASSERT_EQUAL(50, hap_char_get_val(brightness)->i);
+    hap_char_t *name = hap_acc_get_char_by_iid(ha, STATIC_GRAPH_LIGHT_ACCESSORY_INFORMATION_NAME_IID);
+    TEST_ASSERT(name);
+    TEST_ASSERT(!strcmp("Esp-Light", hap_char_get_val(name)->s));
+}
+
+static void test_static_acc()
+{
+    const hap_acc_desc_t *desc = &static_graph_light_desc;
+    uint32_t in_use, in_use_after;
+    test_alloc_count(&in_use);
+
+    hap_acc_t *ha = test_create();
+    test_static_graph(ha);
+    /* The storage is in use */
+    TEST_ASSERT(hap_acc_create_static(desc) == NULL);
+
+    /* Later additions get instance IDs above the ones in the description */
+    hap_serv_t *lightbulb = hap_acc_get_serv_by_iid(ha, STATIC_GRAPH_LIGHT_LIGHTBULB_IID);
+    hap_char_t *hue = hap_char_hue_create(0);
+    TEST_ASSERT(hue);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_serv_add_char(lightbulb, hue));
+    TEST_ASSERT_EQUAL(TEST_MAX_IID + 1, hap_char_get_iid(hue));
+
+    hap_serv_t *fan = hap_serv_create(HAP_SERV_UUID_FAN);
+    TEST_ASSERT(fan);
+    hap_char_t *on = hap_char_on_create(false);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_serv_add_char(fan, on));
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_acc_add_serv(ha, fan));
+    TEST_ASSERT_EQUAL(TEST_MAX_IID + 2, hap_serv_get_iid(fan));
+    TEST_ASSERT_EQUAL(TEST_MAX_IID + 3, hap_char_get_iid(on));
+    TEST_ASSERT(hap_acc_get_char_by_iid(ha, TEST_MAX_IID + 3) == on);
+
+    /* A link added after the static one, to the dynamic service */
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_serv_link_serv(lightbulb, fan));
+    TEST_ASSERT(test_is_linked(lightbulb, fan));
+    TEST_ASSERT(test_is_linked(lightbulb, hap_acc_get_serv_by_iid(ha, STATIC_GRAPH_LIGHT_BATTERY_SERVICE_IID)));
+
+    /* Updates, with the string getting copied out of the description */
+    hap_val_t val = { .i = 80 };
+    hap_char_t *brightness = hap_acc_get_char_by_iid(ha, STATIC_GRAPH_LIGHT_LIGHTBULB_BRIGHTNESS_IID);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_update_val(brightness, &val));
+    hap_char_t *name = hap_acc_get_char_by_iid(ha, STATIC_GRAPH_LIGHT_ACCESSORY_INFORMATION_NAME_IID);
+    val.s = "Renamed";
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_update_val(name, &val));
+    TEST_ASSERT(!strcmp("Renamed", hap_char_get_val(name)->s));
+
+    /* The deletion frees all that was allocated after the setup (the address sanitizer
+     * catches any free of the static storage), and leaves the description as it was.
+     */
+    hap_acc_delete(ha);
+    test_alloc_count(&in_use_after);
+    TEST_ASSERT_EQUAL(in_use, in_use_after);
+    TEST_ASSERT(!strcmp("Esp-Light", desc->servs[0].chars[3].val.s));
+
+    /* The storage can be used again, and gives the same accessory as the first time */
+    ha = test_create();
+    test_static_graph(ha);
+    TEST_ASSERT(hap_acc_get_char_by_iid(ha, TEST_MAX_IID + 1) == NULL);
+    TEST_ASSERT(hap_acc_get_serv_by_iid(ha, TEST_MAX_IID + 2) == NULL);
+    hap_acc_delete(ha);
+}
+
+int main()
+{
+    hap_set_debug_level(HAP_DEBUG_LEVEL_WARN);
+    RUN_TEST(test_invalid_desc);
+    RUN_TEST(test_static_acc);
+    return 0;
+}
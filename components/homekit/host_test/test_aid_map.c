@@ -0,0 +1,239 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* Bridged accessory aid lookups, across simulated reboots. Each boot runs in a child process,
+ * like test_boot_keystore, in a shared keystore directory.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <esp_timer.h>
+#include <hap.h>
+#include <esp_hap_database.h>
+#include <esp_hap_keystore.h>
+#include "host_test.h"
+
+#define TEST_IDS        100
+
+/* Filled in by a boot, and passed back to the parent. The keystore counters cover just the
+ * boot function, and not the keystore and database init before it.
+ */
+typedef struct {
+    int aids[2 * TEST_IDS];
+    int64_t lookup_us;
+    hap_keystore_stats_t stats;
+} test_result_t;
+
+typedef int (*test_boot_fn_t)(test_result_t *res);
+
+static void test_id(char *buf, size_t len, const char *prefix, int i)
+{
+    snprintf(buf, len, "%s-%02x:%02x", prefix, i / 256, i % 256);
+}
+
+/* Looks up TEST_IDS ids with the given prefix, into res->aids[offset...] */
+static int test_lookup(const char *prefix, int offset, test_result_t *res)
+{
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < TEST_IDS; i++) {
+        char id[32];
+        test_id(id, sizeof(id), prefix, i);
+        res->aids[offset + i] = hap_get_unique_aid(id);
+        if (res->aids[offset + i] <= 1) {
+            return HAP_FAIL;
+        }
+    }
+    res->lookup_us += esp_timer_get_time() - start;
+    return HAP_SUCCESS;
+}
+
+static int test_boot(test_boot_fn_t fn, test_result_t *res)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return HAP_FAIL;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        return HAP_FAIL;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        hap_keystore_stats_t init_stats;
+        memset(res, 0, sizeof(*res));
+        if (hap_keystore_init() != HAP_SUCCESS || hap_database_init() != HAP_SUCCESS ||
+                hap_keystore_get_stats(&init_stats) != HAP_SUCCESS || fn(res) != HAP_SUCCESS ||
+                hap_keystore_get_stats(&res->stats) != HAP_SUCCESS) {
+            _exit(1);
+        }
+        res->stats.nvs_reads -= init_stats.nvs_reads;
+        res->stats.nvs_writes -= init_stats.nvs_writes;
+        res->stats.commits -= init_stats.commits;
+        if (write(fds[1], res, sizeof(*res)) != sizeof(*res)) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    ssize_t len = read(fds[0], res, sizeof(*res));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (len != sizeof(*res) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
+static void test_assert_unique(const int *aids, int count)
+{
+    for (int i = 0; i < count; i++) {
+        for (int j = i + 1; j < count; j++) {
+            TEST_ASSERT(aids[i] != aids[j]);
+        }
+    }
+}
+
+static int test_boot_first(test_result_t *res)
+{
+    return test_lookup("old", 0, res);
+}
+
+static int test_boot_first_bulk(test_result_t *res)
+{
+    char ids[TEST_IDS][32];
+    const char *id_ptrs[TEST_IDS];
+    for (int i = 0; i < TEST_IDS; i++) {
+        test_id(ids[i], sizeof(ids[i]), "old", i);
+        id_ptrs[i] = ids[i];
+    }
+    int64_t start = esp_timer_get_time();
+    int ret = hap_get_unique_aids(id_ptrs, TEST_IDS, res->aids);
+    res->lookup_us = esp_timer_get_time() - start;
+    return ret;
+}
+
+static int test_boot_legacy(test_result_t *res)
+{
+    /* Older firmware kept one key per id, next to the current aid */
+    for (int i = 0; i < TEST_IDS; i++) {
+        char id[32];
+        int aid = hap_get_next_aid(NULL);
+        test_id(id, sizeof(id), "old", i);
+        if (hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, id, (uint8_t *)&aid, sizeof(aid)) != HAP_SUCCESS) {
+            return HAP_FAIL;
+        }
+    }
+    return HAP_SUCCESS;
+}
+
+static int test_boot_again(test_result_t *res)
+{
+    return test_lookup("old", 0, res);
+}
+
+static int test_boot_reset(test_result_t *res)
+{
+    int ret = test_lookup("old", 0, res);
+    hap_erase_accessory_info();
+    /* Before the reboot which follows the reset */
+    ret |= test_lookup("new", TEST_IDS, res);
+    return ret;
+}
+
+static int test_boot_after_reset(test_result_t *res)
+{
+    int ret = test_lookup("new", 0, res);
+    ret |= test_lookup("old", TEST_IDS, res);
+    return ret;
+}
+
+static void test_print(const char *name, test_result_t *res)
+{
+    printf("  %-24s %3u reads from flash, %3u writes to flash, %3u commits, %5lld us for %d lookups\n",
+            name, (unsigned)res->stats.nvs_reads, (unsigned)res->stats.nvs_writes, (unsigned)res->stats.commits,
+            (long long)res->lookup_us, TEST_IDS);
+}
+
+static void test_lookup_cost(void)
+{
+    test_result_t first, again, migrated;
+    TEST_ASSERT_EQUAL(0, mkdir("lookup", 0755));
+    TEST_ASSERT_EQUAL(0, chdir("lookup"));
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(test_boot_first, &first));
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(test_boot_again, &again));
+    test_assert_unique(first.aids, TEST_IDS);
+    TEST_ASSERT(!memcmp(first.aids, again.aids, TEST_IDS * sizeof(int)));
+    /* The whole map is a single key, and nothing is written if no id is new */
+    TEST_ASSERT(again.stats.nvs_reads <= 2);
+    TEST_ASSERT_EQUAL(0, again.stats.commits);
+    TEST_ASSERT_EQUAL(0, chdir(".."));
+
+    test_result_t bulk;
+    TEST_ASSERT_EQUAL(0, mkdir("bulk", 0755));
+    TEST_ASSERT_EQUAL(0, chdir("bulk"));
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(test_boot_first_bulk, &bulk));
+    TEST_ASSERT(!memcmp(first.aids, bulk.aids, TEST_IDS * sizeof(int)));
+    TEST_ASSERT_EQUAL(1, bulk.stats.commits);
+    TEST_ASSERT_EQUAL(0, chdir(".."));
+
+    /* From the per id keys of older firmware */
+    test_result_t legacy;
+    TEST_ASSERT_EQUAL(0, mkdir("legacy", 0755));
+    TEST_ASSERT_EQUAL(0, chdir("legacy"));
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(test_boot_legacy, &legacy));
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(test_boot_again, &migrated));
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(test_boot_again, &again));
+    TEST_ASSERT(!memcmp(migrated.aids, again.aids, TEST_IDS * sizeof(int)));
+    TEST_ASSERT_EQUAL(0, chdir(".."));
+
+    printf("  %d bridged accessories:\n", TEST_IDS);
+    test_print("first boot", &first);
+    test_print("first boot, bulk", &bulk);
+    test_print("migration from id keys", &migrated);
+    test_print("later boots", &again);
+}
+
+/* The aids handed out after a reset must not clash with ones from before it */
+static void test_reset(void)
+{
+    test_result_t before, after;
+    TEST_ASSERT_EQUAL(0, mkdir("reset", 0755));
+    TEST_ASSERT_EQUAL(0, chdir("reset"));
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(test_boot_reset, &before));
+    test_assert_unique(before.aids, 2 * TEST_IDS);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(test_boot_after_reset, &after));
+    test_assert_unique(after.aids, 2 * TEST_IDS);
+    TEST_ASSERT_EQUAL(0, chdir(".."));
+}
+
+int main(void)
+{
+    hap_set_debug_level(HAP_DEBUG_LEVEL_ERR);
+    RUN_TEST(test_lookup_cost);
+    RUN_TEST(test_reset);
+    return 0;
+}
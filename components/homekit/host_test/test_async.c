@@ -0,0 +1,261 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+/* Deferred service writes (hap_req_defer()) against simulated downstream devices, each served
+ * by its own task and taking 200 ms to respond, like Zigbee or Modbus devices behind a bridge.
+ * A request is handled the way the PUT /characteristics handler does it, with one service
+ * (device) per characteristic.
+ */
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <esp_timer.h>
+#include <hap.h>
+#include <esp_hap_async.h>
+#include "host_test.h"
+
+#define TEST_MAX_DEVICES    20
+#define TEST_DEVICE_MS      200
+/* Margin for scheduling delays on the host */
+#define TEST_MARGIN_MS      100
+
+typedef enum {
+    /* Completes successfully after its delay */
+    TEST_DEV_OK,
+    /* Fails with a device specific status after its delay */
+    TEST_DEV_FAIL,
+    /* Defers, but then completes synchronously. Its task still reports a (stale) completion */
+    TEST_DEV_SYNC_AFTER_DEFER,
+    /* Returns HAP_PENDING without deferring */
+    TEST_DEV_PENDING_WITHOUT_DEFER,
+} test_dev_mode_t;
+
+typedef struct {
+    test_dev_mode_t mode;
+    int delay_ms;
+    QueueHandle_t jobs;
+    /* Result of the last hap_async_complete() from the device task */
+    volatile int complete_ret;
+    volatile int completions;
+} test_dev_t;
+
+static test_dev_t test_devs[TEST_MAX_DEVICES];
+
+static void test_dev_task(void *arg)
+{
+    test_dev_t *dev = (test_dev_t *)arg;
+    hap_async_token_t token;
+    while (xQueueReceive(dev->jobs, &token, portMAX_DELAY) == pdTRUE) {
+        if (!token) {
+            break;
+        }
+        vTaskDelay(pdMS_TO_TICKS(dev->delay_ms));
+        if (dev->mode == TEST_DEV_FAIL) {
+            hap_status_t status = HAP_STATUS_RES_BUSY;
+            dev->complete_ret = hap_async_complete(token, HAP_FAIL, &status, 1);
+        } else {
+            dev->complete_ret = hap_async_complete(token, HAP_SUCCESS, NULL, 0);
+        }
+        __sync_fetch_and_add(&dev->completions, 1);
+    }
+    vTaskDelete(NULL);
+}
+
+static int test_dev_write(hap_write_data_t write_data[], int count, void *serv_priv, void *write_priv)
+{
+    test_dev_t *dev = (test_dev_t *)serv_priv;
+    if (dev->mode == TEST_DEV_PENDING_WITHOUT_DEFER) {
+        return HAP_PENDING;
+    }
+    hap_async_token_t token = hap_req_defer();
+    if (!token) {
+        /* Too many pending. Talk to the device synchronously */
+        vTaskDelay(pdMS_TO_TICKS(dev->delay_ms));
+        *(write_data[0].status) = HAP_STATUS_SUCCESS;
+        return HAP_SUCCESS;
+    }
+    xQueueSend(dev->jobs, &token, portMAX_DELAY);
+    if (dev->mode == TEST_DEV_SYNC_AFTER_DEFER) {
+        *(write_data[0].status) = HAP_STATUS_SUCCESS;
+        return HAP_SUCCESS;
+    }
+    return HAP_PENDING;
+}
+
+static void test_devs_start(int num, int delay_ms)
+{
+    for (int i = 0; i < num; i++) {
+        test_devs[i].mode = TEST_DEV_OK;
+        test_devs[i].delay_ms = delay_ms;
+        test_devs[i].complete_ret = HAP_SUCCESS;
+        test_devs[i].completions = 0;
+        test_devs[i].jobs = xQueueCreate(4, sizeof(hap_async_token_t));
+        TEST_ASSERT(test_devs[i].jobs);
+        TEST_ASSERT(xTaskCreate(test_dev_task, "dev", 4096, &test_devs[i], 1, NULL) == pdPASS);
+    }
+}
+
+static void test_devs_stop(int num)
+{
+    hap_async_token_t stop = 0;
+    for (int i = 0; i < num; i++) {
+        xQueueSend(test_devs[i].jobs, &stop, portMAX_DELAY);
+    }
+    /* Let the tasks exit before their queues go */
+    vTaskDelay(pdMS_TO_TICKS(TEST_MARGIN_MS));
+    for (int i = 0; i < num; i++) {
+        vQueueDelete(test_devs[i].jobs);
+    }
+}
+
+/* Same as the PUT /characteristics handler. Returns HAP_FAIL if any write failed, and the time
+ * taken in *elapsed_ms
+ */
+static int test_write_request(int num, hap_status_t status[], int *elapsed_ms)
+{
+    hap_write_data_t write_data[TEST_MAX_DEVICES];
+    bool write_err = false;
+    memset(write_data, 0, sizeof(write_data));
+    int64_t start = esp_timer_get_time();
+    hap_async_req_begin();
+    for (int i = 0; i < num; i++) {
+        status[i] = HAP_STATUS_VAL_INVALID;
+        write_data[i].status = &status[i];
+        int cookie = hap_async_batch_begin(write_data[i].status, 1);
+        if (hap_async_batch_end(cookie, test_dev_write(&write_data[i], 1, &test_devs[i], NULL))
+                != HAP_SUCCESS) {
+            write_err = true;
+        }
+    }
+    if (hap_async_req_end() != HAP_SUCCESS) {
+        write_err = true;
+    }
+    *elapsed_ms = (esp_timer_get_time() - start) / 1000;
+    return write_err ? HAP_FAIL : HAP_SUCCESS;
+}
+
+/* The devices are waited for in parallel, so the request takes as long as the slowest one */
+static void test_parallel_devices()
+{
+    hap_status_t status[TEST_MAX_DEVICES];
+    int elapsed_ms;
+    const int num = 8;
+    test_devs_start(num, TEST_DEVICE_MS);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_write_request(num, status, &elapsed_ms));
+    printf("  %d devices x %d ms: request took %d ms\n", num, TEST_DEVICE_MS, elapsed_ms);
+    TEST_ASSERT(elapsed_ms >= TEST_DEVICE_MS);
+    TEST_ASSERT(elapsed_ms < TEST_DEVICE_MS + TEST_MARGIN_MS);
+    for (int i = 0; i < num; i++) {
+        TEST_ASSERT_EQUAL(HAP_STATUS_SUCCESS, status[i]);
+        TEST_ASSERT_EQUAL(HAP_SUCCESS, test_devs[i].complete_ret);
+    }
+    test_devs_stop(num);
+}
+
+static void test_mixed_results()
+{
+    hap_status_t status[TEST_MAX_DEVICES];
+    int elapsed_ms;
+    const int num = 4;
+    test_devs_start(num, TEST_DEVICE_MS);
+    test_devs[1].mode = TEST_DEV_FAIL;
+    test_devs[2].mode = TEST_DEV_SYNC_AFTER_DEFER;
+    test_devs[3].mode = TEST_DEV_PENDING_WITHOUT_DEFER;
+    TEST_ASSERT_EQUAL(HAP_FAIL, test_write_request(num, status, &elapsed_ms));
+    printf("  ok, failed, sync after defer, pending without defer: %d ms\n", elapsed_ms);
+    TEST_ASSERT_EQUAL(HAP_STATUS_SUCCESS, status[0]);
+    /* The status reported by the device is passed on as is */
+    TEST_ASSERT_EQUAL(HAP_STATUS_RES_BUSY, status[1]);
+    TEST_ASSERT_EQUAL(HAP_STATUS_SUCCESS, status[2]);
+    /* Nothing set the status of the one which returned HAP_PENDING without deferring */
+    TEST_ASSERT_EQUAL(HAP_STATUS_VAL_INVALID, status[3]);
+    /* The request does not wait for the one which completed synchronously */
+    TEST_ASSERT(elapsed_ms < TEST_DEVICE_MS + TEST_MARGIN_MS);
+    vTaskDelay(pdMS_TO_TICKS(TEST_DEVICE_MS + TEST_MARGIN_MS));
+    /* Its late completion is ignored */
+    TEST_ASSERT_EQUAL(1, test_devs[2].completions);
+    TEST_ASSERT_EQUAL(HAP_FAIL, test_devs[2].complete_ret);
+    test_devs_stop(num);
+}
+
+/* A device slower than CONFIG_HAP_ASYNC_REQ_TIMEOUT_MS times out, and its completion, which
+ * comes after the request is over, is rejected
+ */
+static void test_timeout()
+{
+    hap_status_t status[TEST_MAX_DEVICES];
+    int elapsed_ms;
+    const int num = 2;
+    test_devs_start(num, TEST_DEVICE_MS);
+    test_devs[1].delay_ms = CONFIG_HAP_ASYNC_REQ_TIMEOUT_MS + TEST_DEVICE_MS;
+    TEST_ASSERT_EQUAL(HAP_FAIL, test_write_request(num, status, &elapsed_ms));
+    printf("  timed out after %d ms\n", elapsed_ms);
+    TEST_ASSERT(elapsed_ms >= CONFIG_HAP_ASYNC_REQ_TIMEOUT_MS);
+    TEST_ASSERT(elapsed_ms < CONFIG_HAP_ASYNC_REQ_TIMEOUT_MS + TEST_MARGIN_MS);
+    TEST_ASSERT_EQUAL(HAP_STATUS_SUCCESS, status[0]);
+    TEST_ASSERT_EQUAL(HAP_STATUS_TIMEOUT, status[1]);
+
+    /* A new request, started while the late completion is still to come */
+    test_devs[1].delay_ms = TEST_DEVICE_MS;
+    vTaskDelay(pdMS_TO_TICKS(TEST_DEVICE_MS / 2));
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_write_request(num, status, &elapsed_ms));
+    vTaskDelay(pdMS_TO_TICKS(TEST_DEVICE_MS + TEST_MARGIN_MS));
+    TEST_ASSERT_EQUAL(2, test_devs[1].completions);
+    TEST_ASSERT_EQUAL(HAP_STATUS_SUCCESS, status[1]);
+    test_devs_stop(num);
+}
+
+/* Beyond CONFIG_HAP_ASYNC_MAX_PENDING callbacks, hap_req_defer() returns 0 and the callbacks
+ * complete synchronously
+ */
+static void test_too_many_pending()
+{
+    hap_status_t status[TEST_MAX_DEVICES];
+    int elapsed_ms;
+    const int num = TEST_MAX_DEVICES;
+    const int sync = num - CONFIG_HAP_ASYNC_MAX_PENDING;
+    test_devs_start(num, TEST_DEVICE_MS);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_write_request(num, status, &elapsed_ms));
+    printf("  %d devices, %d synchronous: request took %d ms\n", num, sync, elapsed_ms);
+    TEST_ASSERT(elapsed_ms >= sync * TEST_DEVICE_MS);
+    TEST_ASSERT(elapsed_ms < (sync + 1) * TEST_DEVICE_MS + TEST_MARGIN_MS);
+    for (int i = 0; i < num; i++) {
+        TEST_ASSERT_EQUAL(HAP_STATUS_SUCCESS, status[i]);
+    }
+    test_devs_stop(num);
+}
+
+int main()
+{
+    /* The failures are all expected ones */
+    hap_set_debug_level(HAP_DEBUG_LEVEL_ASSERT);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_async_init());
+    RUN_TEST(test_parallel_devices);
+    RUN_TEST(test_mixed_results);
+    RUN_TEST(test_timeout);
+    RUN_TEST(test_too_many_pending);
+    return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* Boot-time keystore cost of a first boot of a bridge, run the way hap_init() and hap_start()
+ * run it, once with every write committed on its own and once with the writes of the whole
+ * boot batched. Each boot runs in a child process, with its own keystore directory and a
+ * fresh keystore cache.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <hap.h>
+#include <esp_hap_main.h>
+#include <esp_hap_database.h>
+#include <esp_hap_keystore.h>
+#include "host_test.h"
+
+#define TEST_BRIDGED    20
+
+int hap_acc_setup_init(void);
+
+static int test_identify(hap_acc_t *ha)
+{
+    return HAP_SUCCESS;
+}
+
+static int test_boot(bool batch)
+{
+    if (hap_keystore_init() != HAP_SUCCESS) {
+        return HAP_FAIL;
+    }
+    if (batch) {
+        hap_keystore_begin_batch();
+    }
+    if (hap_database_init() != HAP_SUCCESS) {
+        return HAP_FAIL;
+    }
+    hap_acc_cfg_t cfg = {
+        .name = "Bridge",
+        .model = "Model",
+        .manufacturer = "Espressif",
+        .serial_num = "001122334455",
+        .fw_rev = "1.0.0",
+        .pv = "1.1.0",
+        .cid = HAP_CID_BRIDGE,
+        .identify_routine = test_identify,
+    };
+    hap_acc_t *ha = hap_acc_create(&cfg);
+    if (!ha) {
+        return HAP_FAIL;
+    }
+    hap_add_accessory(ha);
+    /* The bridged accessories, as the bridge example adds them */
+    for (int i = 0; i < TEST_BRIDGED; i++) {
+        char id[16];
+        snprintf(id, sizeof(id), "dev-%d", i);
+        cfg.name = id;
+        ha = hap_acc_create(&cfg);
+        if (!ha) {
+            return HAP_FAIL;
+        }
+        hap_add_bridged_accessory(ha, hap_get_unique_aid(id));
+    }
+    strcpy(hap_priv.setup_id, "ES32");
+    hap_priv.setup_code = "111-22-333";
+    int ret = hap_acc_setup_init();
+    if (batch) {
+        ret |= hap_keystore_end_batch();
+    }
+    return ret;
+}
+
+/* Boots in a child process, in the directory "dir", and returns its keystore counters */
+static int test_boot_stats(const char *dir, bool batch, hap_keystore_stats_t *stats)
+{
+    int fds[2];
+    if (mkdir(dir, 0755) != 0 || pipe(fds) != 0) {
+        return HAP_FAIL;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        return HAP_FAIL;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        if (chdir(dir) != 0 || test_boot(batch) != HAP_SUCCESS ||
+                hap_keystore_get_stats(stats) != HAP_SUCCESS ||
+                write(fds[1], stats, sizeof(*stats)) != sizeof(*stats)) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    ssize_t len = read(fds[0], stats, sizeof(*stats));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (len != sizeof(*stats) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
+static void test_print(const char *name, hap_keystore_stats_t *stats)
+{
+    printf("  %-10s %3u reads (%3u from flash), %3u writes (%3u to flash), %3u commits, %6lld us\n",
+            name, (unsigned)stats->reads, (unsigned)stats->nvs_reads, (unsigned)stats->writes,
+            (unsigned)stats->nvs_writes, (unsigned)stats->commits, (long long)stats->time_us);
+}
+
+static void test_boot_batched(void)
+{
+    hap_keystore_stats_t single, batched;
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot_stats("single", false, &single));
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot_stats("batched", true, &batched));
+    printf("  First boot of a bridge with %d bridged accessories:\n", TEST_BRIDGED);
+    test_print("unbatched", &single);
+    test_print("batched", &batched);
+    /* Same values written, but with one commit per namespace instead of one per write */
+    TEST_ASSERT_EQUAL(single.writes, batched.writes);
+    TEST_ASSERT(single.commits >= TEST_BRIDGED);
+    TEST_ASSERT(batched.commits <= 3);
+    TEST_ASSERT(batched.nvs_writes <= single.nvs_writes);
+}
+
+int main(void)
+{
+    hap_set_debug_level(HAP_DEBUG_LEVEL_ERR);
+    RUN_TEST(test_boot_batched);
+    return 0;
+}
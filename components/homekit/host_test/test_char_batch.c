@@ -0,0 +1,253 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* Benchmark of batched vs individual characteristic updates, with a notification task which
+ * runs passes concurrently, like the real one. Event posts go into an 8 entry queue, like the
+ * HAP main loop's, so that posts which do not fit show up as failures. Also, a batch which
+ * runs out of memory.
+ */
+#include <string.h>
+#include <pthread.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <esp_timer.h>
+#include <hap.h>
+#include <hap_platform_memory.h>
+#include <esp_hap_main.h>
+#include <esp_hap_char.h>
+#include "host_test.h"
+
+#define TEST_CHARS          64
+#define TEST_ROUNDS         200
+#define TEST_QUEUE_LEN      8
+
+static QueueHandle_t test_queue;
+static volatile int test_posts, test_post_failures, test_passes, test_notified;
+static volatile bool test_done;
+static hap_char_t *test_chars[TEST_CHARS];
+/* If limited, the number of allocations which still succeed */
+static volatile bool test_alloc_limit;
+static volatile int test_allocs_left;
+
+void *__real_hap_platform_memory_malloc_tagged(hap_mem_tag_t tag, size_t size);
+void *__real_hap_platform_memory_calloc_tagged(hap_mem_tag_t tag, size_t count, size_t size);
+
+static bool test_alloc_allowed()
+{
+    if (!test_alloc_limit) {
+        return true;
+    }
+    return __sync_fetch_and_sub(&test_allocs_left, 1) > 0;
+}
+
+void *__wrap_hap_platform_memory_malloc_tagged(hap_mem_tag_t tag, size_t size)
+{
+    return test_alloc_allowed() ? __real_hap_platform_memory_malloc_tagged(tag, size) : NULL;
+}
+
+void *__wrap_hap_platform_memory_calloc_tagged(hap_mem_tag_t tag, size_t count, size_t size)
+{
+    return test_alloc_allowed() ? __real_hap_platform_memory_calloc_tagged(tag, count, size) : NULL;
+}
+
+int hap_send_event(hap_internal_event_t event)
+{
+    __sync_fetch_and_add(&test_posts, 1);
+    if (xQueueSend(test_queue, &event, 0) != pdTRUE) {
+        __sync_fetch_and_add(&test_post_failures, 1);
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
+/* Same as the notification pass, except that nothing is sent */
+static void *test_notif_task(void *arg)
+{
+    hap_internal_event_t event;
+    while (!test_done) {
+        if (xQueueReceive(test_queue, &event, pdMS_TO_TICKS(10)) != pdTRUE) {
+            continue;
+        }
+        hap_take_pending_notif_chars(NULL);
+        int cnt = 0;
+        hap_notif_pass_lock();
+        while (hap_pop_pending_notif_char(NULL) != NULL) {
+            cnt++;
+        }
+        hap_notif_pass_unlock();
+        __sync_fetch_and_add(&test_notified, cnt);
+        __sync_fetch_and_add(&test_passes, 1);
+    }
+    return NULL;
+}
+
+/* Wait for the notification task to finish with all the posted passes. An empty queue is
+ * not enough, as the last pass may still be running.
+ */
+static void test_drain()
+{
+    while (test_passes != test_posts - test_post_failures) {
+        vTaskDelay(1);
+    }
+}
+
+static void test_reset()
+{
+    test_drain();
+    test_posts = test_post_failures = test_passes = test_notified = 0;
+}
+
+static void test_report(const char *name, int64_t usec)
+{
+    test_drain();
+    printf("  %-10s %d x %d updates: %lld us, %d posts (%d failed), %d passes, %d notified\n",
+            name, TEST_ROUNDS, TEST_CHARS, (long long)usec, test_posts, test_post_failures,
+            test_passes, test_notified);
+}
+
+static void test_individual_vs_batch()
+{
+    pthread_t task;
+    hap_char_update_t updates[TEST_CHARS];
+    test_queue = xQueueCreate(TEST_QUEUE_LEN, sizeof(hap_internal_event_t));
+    hap_event_queue_init();
+    for (int i = 0; i < TEST_CHARS; i++) {
+        test_chars[i] = hap_char_uint32_create("11", HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV, 0);
+        TEST_ASSERT(test_chars[i]);
+    }
+    pthread_create(&task, NULL, test_notif_task, NULL);
+
+    test_reset();
+    int64_t start = esp_timer_get_time();
+    for (int r = 1; r <= TEST_ROUNDS; r++) {
+        for (int i = 0; i < TEST_CHARS; i++) {
+            hap_val_t val = { .u = r };
+            TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_update_val(test_chars[i], &val));
+        }
+    }
+    test_report("individual", esp_timer_get_time() - start);
+    /* The pending set posts a pass only if none is already posted */
+    TEST_ASSERT(test_posts <= TEST_ROUNDS * TEST_CHARS);
+    TEST_ASSERT(test_notified <= TEST_ROUNDS * TEST_CHARS);
+
+    test_reset();
+    start = esp_timer_get_time();
+    for (int r = 1; r <= TEST_ROUNDS; r++) {
+        for (int i = 0; i < TEST_CHARS; i++) {
+            updates[i].hc = test_chars[i];
+            updates[i].val.u = TEST_ROUNDS + r;
+        }
+        TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_update_vals(updates, TEST_CHARS));
+    }
+    test_report("batch", esp_timer_get_time() - start);
+    /* At most one post per batch, none of which overflows the queue. A pass may take a
+     * batch which is still being applied, with the rest of it left for the next pass.
+     */
+    TEST_ASSERT(test_posts <= TEST_ROUNDS);
+    TEST_ASSERT_EQUAL(0, test_post_failures);
+    TEST_ASSERT(test_notified >= TEST_CHARS);
+    TEST_ASSERT(test_notified <= TEST_ROUNDS * TEST_CHARS);
+
+    test_done = true;
+    pthread_join(task, NULL);
+    for (int i = 0; i < TEST_CHARS; i++) {
+        hap_char_delete(test_chars[i]);
+    }
+    vQueueDelete(test_queue);
+}
+
+/* A string and a 200 byte TLV8, both larger than the values they replace, and an int */
+static void test_batch_fill(hap_char_update_t *updates, hap_char_t **hcs, char *str, uint8_t *tlv)
+{
+    memset(str, 's', HAP_CHAR_STRING_MAX_LEN);
+    str[HAP_CHAR_STRING_MAX_LEN] = '\0';
+    memset(tlv, 0xa5, 200);
+    updates[0] = (hap_char_update_t) { .hc = hcs[0], .val.s = str };
+    updates[1] = (hap_char_update_t) { .hc = hcs[1], .val.d = { .buf = tlv, .buflen = 200 } };
+    updates[2] = (hap_char_update_t) { .hc = hcs[2], .val.u = 100 };
+}
+
+/* The storage for the new values gets allocated before any of them is applied. If that
+ * fails, nothing is applied, and if the allocations after that fail, all of them are.
+ */
+static void test_batch_alloc_failure()
+{
+    char str[HAP_CHAR_STRING_MAX_LEN + 1];
+    uint8_t tlv[200];
+    uint8_t init = 0;
+    hap_data_val_t init_val = { .buf = &init, .buflen = 1 };
+    hap_char_update_t updates[3];
+    hap_char_t *hcs[3];
+    test_queue = xQueueCreate(TEST_QUEUE_LEN, sizeof(hap_internal_event_t));
+    hcs[0] = hap_char_string_create("23", HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV, "a");
+    hcs[1] = hap_char_tlv8_create("117", HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV, &init_val);
+    hcs[2] = hap_char_uint8_create("8", HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV, 0);
+    TEST_ASSERT(hcs[0] && hcs[1] && hcs[2]);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_data_set_ownership(hcs[1], HAP_DATA_OWN_COPY));
+    test_batch_fill(updates, hcs, str, tlv);
+
+    /* The TLV8 cannot be reserved */
+    test_alloc_limit = true;
+    test_allocs_left = 1;
+    TEST_ASSERT_EQUAL(HAP_FAIL, hap_char_update_vals(updates, 3));
+    test_alloc_limit = false;
+    TEST_ASSERT_EQUAL(0, strcmp("a", hap_char_get_val(hcs[0])->s));
+    TEST_ASSERT_EQUAL(1, hap_char_get_val(hcs[1])->d.buflen);
+    TEST_ASSERT_EQUAL(0, hap_char_get_val(hcs[2])->u);
+
+    /* Both get reserved, with a new buffer each and a node retiring the old string buffer
+     * (the TLV8 still refers to "init"). Any allocation after those, while applying the
+     * values, fails.
+     */
+    hap_char_delete(hcs[0]);
+    hap_char_delete(hcs[1]);
+    hcs[0] = hap_char_string_create("23", HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV, "a");
+    hcs[1] = hap_char_tlv8_create("117", HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV, &init_val);
+    TEST_ASSERT(hcs[0] && hcs[1]);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_data_set_ownership(hcs[1], HAP_DATA_OWN_COPY));
+    test_batch_fill(updates, hcs, str, tlv);
+    test_alloc_limit = true;
+    test_allocs_left = 3;
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_update_vals(updates, 3));
+    TEST_ASSERT_EQUAL(0, test_allocs_left);
+    test_alloc_limit = false;
+    TEST_ASSERT_EQUAL(0, strcmp(str, hap_char_get_val(hcs[0])->s));
+    TEST_ASSERT_EQUAL(200, hap_char_get_val(hcs[1])->d.buflen);
+    TEST_ASSERT_EQUAL(0, memcmp(tlv, hap_char_get_val(hcs[1])->d.buf, 200));
+    TEST_ASSERT_EQUAL(100, hap_char_get_val(hcs[2])->u);
+
+    for (int i = 0; i < 3; i++) {
+        hap_char_delete(hcs[i]);
+    }
+    vQueueDelete(test_queue);
+}
+
+int main()
+{
+    hap_set_debug_level(HAP_DEBUG_LEVEL_WARN);
+    RUN_TEST(test_individual_vs_batch);
+    RUN_TEST(test_batch_alloc_failure);
+    return 0;
+}
@@ -0,0 +1,228 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* String/Data values updated by some threads while others take snapshots of them, as the
+ * httpd task does. Every value is self describing, so that a torn or stale read is caught,
+ * and any read from a freed buffer is caught by the address sanitizer.
+ */
+#include <string.h>
+#include <pthread.h>
+#include <hap.h>
+#include <hap_platform_memory.h>
+#include <esp_hap_char.h>
+#include "host_test.h"
+
+#define TEST_WRITERS        2
+#define TEST_READERS        3
+#define TEST_UPDATES        100000
+
+static hap_char_t *test_hc;
+static volatile bool test_done;
+static volatile int test_snapshots;
+
+/* A value of "len" bytes, all of them derived from the length */
+static void test_fill(uint8_t *buf, size_t len)
+{
+    memset(buf, 'a' + len % 26, len);
+}
+
+static bool test_check(const uint8_t *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] != 'a' + len % 26) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void *test_string_writer(void *arg)
+{
+    char str[HAP_CHAR_STRING_MAX_LEN + 1];
+    unsigned int seed = (uintptr_t)arg;
+    for (int i = 0; i < TEST_UPDATES; i++) {
+        /* Lengths growing often enough to need a new buffer */
+        size_t len = 1 + rand_r(&seed) % HAP_CHAR_STRING_MAX_LEN;
+        test_fill((uint8_t *)str, len);
+        str[len] = '\0';
+        hap_val_t val = { .s = str };
+        TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_update_val(test_hc, &val));
+        if (i % 1000 == 0) {
+            hap_char_reserve_val(test_hc, rand_r(&seed) % HAP_CHAR_STRING_MAX_LEN);
+        }
+    }
+    return NULL;
+}
+
+static void *test_data_writer(void *arg)
+{
+    uint8_t data[512];
+    unsigned int seed = (uintptr_t)arg;
+    for (int i = 0; i < TEST_UPDATES; i++) {
+        size_t len = 1 + rand_r(&seed) % sizeof(data);
+        test_fill(data, len);
+        hap_val_t val = { .d = { .buf = data, .buflen = len } };
+        TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_update_val(test_hc, &val));
+        if (i % 1000 == 0) {
+            hap_char_reserve_val(test_hc, rand_r(&seed) % 1024);
+        }
+    }
+    return NULL;
+}
+
+static void *test_reader(void *arg)
+{
+    uint8_t buf[HAP_CHAR_STRING_MAX_LEN + 1];
+    uint8_t data[512];
+    __hap_char_t *_hc = (__hap_char_t *)test_hc;
+    while (!test_done) {
+        hap_val_t val;
+        if (_hc->format == HAP_CHAR_FORMAT_STRING) {
+            size_t size = sizeof(buf);
+            TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_get_val_snapshot(_hc, &val, buf, &size));
+            TEST_ASSERT(val.s == (char *)buf);
+            TEST_ASSERT(test_check(buf, strlen(val.s)));
+        } else {
+            size_t size = sizeof(data);
+            TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_get_val_snapshot(_hc, &val, data, &size));
+            TEST_ASSERT(test_check(val.d.buf, val.d.buflen));
+        }
+        __sync_fetch_and_add(&test_snapshots, 1);
+    }
+    return NULL;
+}
+
+static void test_run(void *(*writer)(void *))
+{
+    pthread_t writers[TEST_WRITERS], readers[TEST_READERS];
+    test_done = false;
+    test_snapshots = 0;
+    for (int i = 0; i < TEST_READERS; i++) {
+        pthread_create(&readers[i], NULL, test_reader, NULL);
+    }
+    for (int i = 0; i < TEST_WRITERS; i++) {
+        pthread_create(&writers[i], NULL, writer, (void *)(uintptr_t)(i + 1));
+    }
+    for (int i = 0; i < TEST_WRITERS; i++) {
+        pthread_join(writers[i], NULL);
+    }
+    test_done = true;
+    for (int i = 0; i < TEST_READERS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    printf("  %d updates, %d snapshots\n", TEST_WRITERS * TEST_UPDATES, test_snapshots);
+    TEST_ASSERT(test_snapshots > 0);
+}
+
+static uint32_t test_db_allocs()
+{
+    hap_mem_stats_t stats;
+    hap_platform_memory_get_stats(HAP_MEM_TAG_DATABASE, &stats);
+    return stats.cur_count;
+}
+
+static void test_string_snapshots()
+{
+    uint32_t allocs = test_db_allocs();
+    test_hc = hap_char_string_create("23", HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV, "b");
+    TEST_ASSERT(test_hc);
+    test_run(test_string_writer);
+    hap_char_delete(test_hc);
+    /* Nothing retired during the run is left behind */
+    TEST_ASSERT_EQUAL(allocs, test_db_allocs());
+}
+
+static void test_data_snapshots()
+{
+    uint32_t allocs = test_db_allocs();
+    uint8_t init = 'b';
+    hap_data_val_t val = { .buf = &init, .buflen = 1 };
+    test_hc = hap_char_data_create("A5", HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV, &val);
+    TEST_ASSERT(test_hc);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_data_set_ownership(test_hc, HAP_DATA_OWN_COPY));
+    test_run(test_data_writer);
+    hap_char_delete(test_hc);
+    TEST_ASSERT_EQUAL(allocs, test_db_allocs());
+}
+
+/* Allocations made so far, across all the tags */
+static uint32_t test_alloc_count()
+{
+    uint32_t count = 0;
+    for (int i = 0; i < HAP_MEM_TAG_MAX; i++) {
+        hap_mem_stats_t stats;
+        hap_platform_memory_get_stats(i, &stats);
+        count += stats.alloc_count;
+    }
+    return count;
+}
+
+/* Values which fit in the reserved buffer, however large, are copied into it */
+static void test_reserved_updates()
+{
+    uint8_t tlv[200];
+    uint8_t init = 0;
+    hap_data_val_t val = { .buf = &init, .buflen = 1 };
+    hap_char_t *hc = hap_char_tlv8_create("117", HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV, &val);
+    TEST_ASSERT(hc);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_data_set_ownership(hc, HAP_DATA_OWN_COPY));
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_reserve_val(hc, sizeof(tlv)));
+    uint32_t allocs = test_alloc_count();
+    for (int i = 0; i < 1000; i++) {
+        memset(tlv, i, sizeof(tlv));
+        hap_val_t new_val = { .d = { .buf = tlv, .buflen = sizeof(tlv) - i % 2 } };
+        TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_update_val(hc, &new_val));
+    }
+    printf("  1000 updates of a 200 byte TLV8: %u allocations\n", (unsigned)(test_alloc_count() - allocs));
+    TEST_ASSERT_EQUAL(allocs, test_alloc_count());
+    const hap_val_t *cur = hap_char_get_val(hc);
+    TEST_ASSERT_EQUAL(sizeof(tlv) - 1, cur->d.buflen);
+    TEST_ASSERT(cur->d.buf[0] == (uint8_t)999);
+    hap_char_delete(hc);
+
+    char str[HAP_CHAR_STRING_MAX_LEN + 1];
+    hc = hap_char_string_create("23", HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV, "b");
+    TEST_ASSERT(hc);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_reserve_val(hc, 150));
+    allocs = test_alloc_count();
+    for (int i = 0; i < 1000; i++) {
+        size_t len = 100 + i % 50;
+        test_fill((uint8_t *)str, len);
+        str[len] = '\0';
+        hap_val_t new_val = { .s = str };
+        TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_update_val(hc, &new_val));
+    }
+    TEST_ASSERT_EQUAL(allocs, test_alloc_count());
+    TEST_ASSERT(!strcmp(hap_char_get_val(hc)->s, str));
+    hap_char_delete(hc);
+}
+
+int main()
+{
+    hap_set_debug_level(HAP_DEBUG_LEVEL_WARN);
+    RUN_TEST(test_string_snapshots);
+    RUN_TEST(test_data_snapshots);
+    RUN_TEST(test_reserved_updates);
+    return 0;
+}
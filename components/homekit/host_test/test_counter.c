@@ -0,0 +1,216 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* Journaled keystore counters: the flash writes per update compared to a plain NVS key, and
+ * the value seen after a reboot. Each boot runs in a child process, like test_boot_keystore.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <hap.h>
+#include <esp_hap_keystore.h>
+#include "host_test.h"
+
+#define TEST_NS             "hap_main"
+#define TEST_KEY            "ctr"
+#define TEST_SECTOR         0
+#define TEST_UPDATES        2000
+/* An NVS entry takes 32 bytes of flash, and an NVS page of 4K holds 126 of them */
+#define TEST_NVS_ENTRY_SIZE 32
+#define TEST_NVS_PAGE_ENTRIES 126
+#define TEST_JOURNAL_REC_SIZE 8
+
+typedef struct {
+    int sector;         /* Journal sector for the counter, -1 for a plain key */
+    uint32_t from;      /* Values from..to get set, in that order. Nothing if to is 0 */
+    uint32_t to;
+    uint32_t wrap;      /* Value after which the counter wraps around to 1 */
+} test_boot_cfg_t;
+
+/* Filled in by a boot, and passed back to the parent. The keystore counters cover just the
+ * updates, and not the init.
+ */
+typedef struct {
+    int init_ret;
+    uint32_t init_val;
+    hap_keystore_stats_t stats;
+} test_result_t;
+
+static int test_boot(const test_boot_cfg_t *cfg, test_result_t *res)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return HAP_FAIL;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        return HAP_FAIL;
+    }
+    if (pid == 0) {
+        static hap_keystore_counter_t ctr;
+        hap_keystore_stats_t init_stats;
+        close(fds[0]);
+        memset(res, 0, sizeof(*res));
+        if (hap_keystore_init() != HAP_SUCCESS) {
+            _exit(1);
+        }
+        res->init_ret = hap_keystore_counter_init(&ctr, TEST_NS, TEST_KEY, sizeof(uint32_t), cfg->sector);
+        res->init_val = ctr.val;
+        hap_keystore_get_stats(&init_stats);
+        uint32_t val = cfg->from;
+        while (cfg->to) {
+            if (hap_keystore_counter_set(&ctr, val) != HAP_SUCCESS) {
+                _exit(1);
+            }
+            if (val == cfg->to) {
+                break;
+            }
+            val = (val == cfg->wrap) ? 1 : val + 1;
+        }
+        hap_keystore_get_stats(&res->stats);
+        res->stats.nvs_writes -= init_stats.nvs_writes;
+        res->stats.commits -= init_stats.commits;
+        res->stats.journal_writes -= init_stats.journal_writes;
+        res->stats.journal_erases -= init_stats.journal_erases;
+        if (write(fds[1], res, sizeof(*res)) != sizeof(*res)) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    ssize_t len = read(fds[0], res, sizeof(*res));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (len != sizeof(*res) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
+static void test_enter(const char *dir)
+{
+    TEST_ASSERT_EQUAL(0, mkdir(dir, 0755));
+    TEST_ASSERT_EQUAL(0, chdir(dir));
+}
+
+static void test_print(const char *name, const test_result_t *res)
+{
+    uint32_t bytes = res->stats.nvs_writes * TEST_NVS_ENTRY_SIZE + res->stats.journal_writes * TEST_JOURNAL_REC_SIZE;
+    double erases = (double)res->stats.nvs_writes / TEST_NVS_PAGE_ENTRIES + res->stats.journal_erases;
+    printf("  %-10s %4u NVS writes, %4u journal writes, %2u journal erases: %5.1f bytes programmed "
+            "and %.4f sector erases per update\n", name, (unsigned)res->stats.nvs_writes,
+            (unsigned)res->stats.journal_writes, (unsigned)res->stats.journal_erases,
+            (double)bytes / TEST_UPDATES, erases / TEST_UPDATES);
+}
+
+/* The same updates, to a plain NVS key and to a journaled counter. The journal sector of the
+ * host backend is 4K, i.e. 512 records.
+ */
+static void test_write_amplification(void)
+{
+    test_boot_cfg_t cfg = { .from = 1, .to = TEST_UPDATES };
+    test_result_t plain, journaled, again;
+
+    test_enter("plain");
+    cfg.sector = -1;
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(&cfg, &plain));
+    TEST_ASSERT_EQUAL(0, chdir(".."));
+
+    test_enter("journaled");
+    cfg.sector = TEST_SECTOR;
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(&cfg, &journaled));
+    cfg.to = 0;
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(&cfg, &again));
+    TEST_ASSERT_EQUAL(0, chdir(".."));
+
+    test_print("plain", &plain);
+    test_print("journaled", &journaled);
+    TEST_ASSERT_EQUAL(TEST_UPDATES, plain.stats.nvs_writes);
+    /* Just a checkpoint (instead of a record) and an erase for every full sector */
+    TEST_ASSERT_EQUAL(TEST_UPDATES / 512, journaled.stats.nvs_writes);
+    TEST_ASSERT_EQUAL(TEST_UPDATES - TEST_UPDATES / 512, journaled.stats.journal_writes);
+    TEST_ASSERT_EQUAL(TEST_UPDATES / 512, journaled.stats.journal_erases);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, again.init_ret);
+    TEST_ASSERT_EQUAL(TEST_UPDATES, again.init_val);
+}
+
+/* A firmware without the journal partition updates just the NVS key. Its value has to win
+ * over the older one still in the journal.
+ */
+static void test_newer_checkpoint(void)
+{
+    test_boot_cfg_t cfg = { .sector = TEST_SECTOR, .from = 1, .to = 100 };
+    test_result_t res;
+    test_enter("checkpoint");
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(&cfg, &res));
+    TEST_ASSERT_EQUAL(0, res.stats.nvs_writes);
+
+    cfg = (test_boot_cfg_t) { .sector = -1, .from = 200, .to = 200 };
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(&cfg, &res));
+
+    cfg = (test_boot_cfg_t) { .sector = TEST_SECTOR };
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(&cfg, &res));
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, res.init_ret);
+    TEST_ASSERT_EQUAL(200, res.init_val);
+    TEST_ASSERT_EQUAL(0, chdir(".."));
+}
+
+/* After a wrap around, the small value has to win over the larger checkpoint */
+static void test_wrap_around(void)
+{
+    test_boot_cfg_t cfg = { .sector = TEST_SECTOR, .from = 65000, .to = 65535 };
+    test_result_t res;
+    test_enter("wrap");
+    /* Enough updates for a checkpoint */
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(&cfg, &res));
+    TEST_ASSERT_EQUAL(1, res.stats.nvs_writes);
+
+    cfg = (test_boot_cfg_t) { .sector = TEST_SECTOR, .from = 65535, .to = 1, .wrap = 65535 };
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(&cfg, &res));
+    TEST_ASSERT_EQUAL(65535, res.init_val);
+    TEST_ASSERT_EQUAL(1, res.stats.nvs_writes);
+
+    cfg = (test_boot_cfg_t) { .sector = TEST_SECTOR, .from = 2, .to = 2 };
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(&cfg, &res));
+    TEST_ASSERT_EQUAL(1, res.init_val);
+    /* Back to the journal */
+    TEST_ASSERT_EQUAL(0, res.stats.nvs_writes);
+
+    cfg = (test_boot_cfg_t) { .sector = TEST_SECTOR };
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(&cfg, &res));
+    TEST_ASSERT_EQUAL(2, res.init_val);
+    TEST_ASSERT_EQUAL(0, chdir(".."));
+}
+
+int main(void)
+{
+    hap_set_debug_level(HAP_DEBUG_LEVEL_WARN);
+    RUN_TEST(test_write_amplification);
+    RUN_TEST(test_newer_checkpoint);
+    RUN_TEST(test_wrap_around);
+    return 0;
+}
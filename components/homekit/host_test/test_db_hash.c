@@ -0,0 +1,160 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* Walks of the whole database by the HAP main loop (the database hash and the flush of the
+ * persistent characteristic values), while the application keeps adding, removing and deleting
+ * bridged accessories. Any walk over a deleted accessory is caught by the address sanitizer.
+ */
+#include <stdio.h>
+#include <pthread.h>
+#include <hap.h>
+#include <hap_apple_servs.h>
+#include <hap_apple_chars.h>
+#include <esp_hap_acc.h>
+#include <esp_hap_keystore.h>
+#include "host_test.h"
+
+#define TEST_ROUNDS     5000
+#define TEST_BRIDGED    30
+
+static volatile bool test_done;
+static volatile int test_walks;
+static hap_acc_t *test_primary;
+
+static int test_identify(hap_acc_t *ha)
+{
+    return HAP_SUCCESS;
+}
+
+static hap_acc_t *test_acc_create(const char *name)
+{
+    hap_acc_cfg_t cfg = {
+        .name = (char *)name,
+        .model = "Model",
+        .manufacturer = "Espressif",
+        .serial_num = "001122334455",
+        .fw_rev = "1.0.0",
+        .pv = "1.1.0",
+        .cid = HAP_CID_BRIDGE,
+        .identify_routine = test_identify,
+    };
+    hap_acc_t *ha = hap_acc_create(&cfg);
+    /* Gives the flush something to save for every accessory */
+    if (ha) {
+        hap_serv_t *hs = hap_acc_get_serv_by_uuid(ha, HAP_SERV_UUID_ACCESSORY_INFORMATION);
+        hap_char_set_persist(hap_serv_get_char_by_uuid(hs, HAP_CHAR_UUID_NAME), true);
+    }
+    return ha;
+}
+
+static void *test_hash_task(void *arg)
+{
+    while (!test_done) {
+        hap_acc_db_hash();
+        test_walks++;
+    }
+    return NULL;
+}
+
+static void *test_flush_task(void *arg)
+{
+    hap_serv_t *hs = hap_acc_get_serv_by_uuid(test_primary, HAP_SERV_UUID_ACCESSORY_INFORMATION);
+    hap_char_t *hc = hap_serv_get_char_by_uuid(hs, HAP_CHAR_UUID_NAME);
+    /* Values just go to the keystore cache, so that the flushes mostly walk the database */
+    hap_keystore_begin_batch();
+    while (!test_done) {
+        /* Anything to flush at all */
+        hap_val_t val = {
+            .s = (test_walks % 2) ? "Bridge" : "Bridge 2",
+        };
+        hap_char_update_val(hc, &val);
+        hap_char_persist_flush();
+        test_walks++;
+    }
+    hap_keystore_end_batch();
+    return NULL;
+}
+
+/* Replaces bridged accessories while "walker" runs in another thread */
+static void test_replace_during(void *(*walker)(void *), const char *what)
+{
+    test_done = false;
+    test_walks = 0;
+    hap_acc_t *bridged[TEST_BRIDGED];
+    for (int i = 0; i < TEST_BRIDGED; i++) {
+        bridged[i] = test_acc_create("Bridged");
+        TEST_ASSERT(bridged[i]);
+        hap_add_bridged_accessory(bridged[i], 2 + i);
+    }
+    uint32_t hash = hap_acc_db_hash();
+
+    pthread_t thread;
+    TEST_ASSERT_EQUAL(0, pthread_create(&thread, NULL, walker, NULL));
+    /* Replace the accessories one by one, so that some walk is always past the one which
+     * gets deleted
+     */
+    unsigned int seed = 1;
+    for (int i = 0; i < TEST_ROUNDS; i++) {
+        int n = rand_r(&seed) % TEST_BRIDGED;
+        int aid = hap_acc_get_aid(bridged[n]);
+        hap_acc_t *ha = test_acc_create("Bridged");
+        TEST_ASSERT(ha);
+        hap_remove_bridged_accessory(bridged[n]);
+        hap_acc_delete(bridged[n]);
+        hap_add_bridged_accessory(ha, aid);
+        bridged[n] = ha;
+    }
+    test_done = true;
+    pthread_join(thread, NULL);
+    printf("  %d accessories replaced during %d %s\n", TEST_ROUNDS, test_walks, what);
+    TEST_ASSERT(test_walks > 0);
+    TEST_ASSERT_EQUAL(hash, hap_acc_db_hash());
+    for (int i = 0; i < TEST_BRIDGED; i++) {
+        hap_remove_bridged_accessory(bridged[i]);
+        hap_acc_delete(bridged[i]);
+    }
+}
+
+static void test_hash_during_removal(void)
+{
+    test_replace_during(test_hash_task, "hash computations");
+}
+
+static void test_flush_during_removal(void)
+{
+    test_replace_during(test_flush_task, "flushes");
+}
+
+int main(void)
+{
+    hap_set_debug_level(HAP_DEBUG_LEVEL_ERR);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_keystore_init());
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_db_lock_init());
+    test_primary = test_acc_create("Bridge");
+    TEST_ASSERT(test_primary);
+    hap_add_accessory(test_primary);
+    RUN_TEST(test_hash_during_removal);
+    RUN_TEST(test_flush_during_removal);
+    return 0;
+}
@@ -0,0 +1,279 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* The fast-start snapshot across reboots, when the keys it mirrors get changed behind its
+ * back, the way a firmware without the snapshot would change them. Each boot runs in a child
+ * process, like test_boot_keystore, in a shared keystore directory.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <hap.h>
+#include <esp_hap_main.h>
+#include <esp_hap_database.h>
+#include <esp_hap_controllers.h>
+#include <esp_hap_keystore.h>
+#include "host_test.h"
+
+int hap_acc_setup_init(void);
+
+typedef enum {
+    TEST_BOOT_PLAIN,
+    TEST_BOOT_PAIR,         /* Pair a controller, after the setup */
+    TEST_BOOT_OLD_AID,      /* Before the database init, the current aid gets changed */
+    TEST_BOOT_OLD_UNPAIR,   /* ...the controller table gets deleted */
+    TEST_BOOT_OLD_FW_REV,   /* ...the firmware revision gets changed */
+} test_boot_type_t;
+
+/* Filled in by a boot, and passed back to the parent */
+typedef struct {
+    bool fast_start;
+    uint32_t cur_aid;
+    uint32_t config_num;
+    int paired;
+    uint32_t nvs_reads;
+    bool ltska_found;       /* The private key in use is the one in the keystore */
+    bool ltska_in_snapshot;
+} test_result_t;
+
+static int test_identify(hap_acc_t *ha)
+{
+    return HAP_SUCCESS;
+}
+
+/* The writes of a firmware which does not know about the snapshot */
+static int test_old_firmware(test_boot_type_t type)
+{
+    uint32_t aid = 50;
+    switch (type) {
+        case TEST_BOOT_OLD_AID:
+            return hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, "cur_aid", (uint8_t *)&aid, sizeof(aid));
+        case TEST_BOOT_OLD_UNPAIR:
+            return hap_keystore_delete("hap_ctrl", "ctrl_tbl");
+        case TEST_BOOT_OLD_FW_REV:
+            return hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, "fw_rev", (uint8_t *)"0.9.0", 5);
+        default:
+            return HAP_SUCCESS;
+    }
+}
+
+static int test_pair()
+{
+    hap_ctrl_data_t *ctrl = hap_controller_get_empty_loc();
+    if (!ctrl) {
+        return HAP_FAIL;
+    }
+    strcpy(ctrl->info.id, "controller");
+    memset(ctrl->info.ltpk, 0x5a, sizeof(ctrl->info.ltpk));
+    ctrl->info.perms = 1;
+    return hap_controller_save(ctrl);
+}
+
+static void test_check_ltska(test_result_t *res)
+{
+    uint8_t ltska[sizeof(hap_priv.ltska)];
+    uint8_t snapshot[512];
+    size_t len = sizeof(ltska);
+    res->ltska_found = (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, "ltska", ltska, &len) == HAP_SUCCESS)
+        && !memcmp(ltska, hap_priv.ltska, sizeof(ltska));
+    len = sizeof(snapshot);
+    res->ltska_in_snapshot = false;
+    if (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, "fast_start", snapshot, &len) != HAP_SUCCESS) {
+        return;
+    }
+    for (size_t i = 0; i + sizeof(ltska) <= len; i++) {
+        if (!memcmp(snapshot + i, ltska, sizeof(ltska))) {
+            res->ltska_in_snapshot = true;
+        }
+    }
+}
+
+static int test_boot_run(test_boot_type_t type, test_result_t *res)
+{
+    if (hap_keystore_init() != HAP_SUCCESS || test_old_firmware(type) != HAP_SUCCESS) {
+        return HAP_FAIL;
+    }
+    hap_keystore_stats_t init_stats;
+    hap_keystore_get_stats(&init_stats);
+    if (hap_database_init() != HAP_SUCCESS) {
+        return HAP_FAIL;
+    }
+    hap_acc_cfg_t cfg = {
+        .name = "Light",
+        .model = "Model",
+        .manufacturer = "Espressif",
+        .serial_num = "001122334455",
+        .fw_rev = "1.0.0",
+        .pv = "1.1.0",
+        .cid = HAP_CID_LIGHTING,
+        .identify_routine = test_identify,
+    };
+    hap_acc_t *ha = hap_acc_create(&cfg);
+    if (!ha) {
+        return HAP_FAIL;
+    }
+    hap_add_accessory(ha);
+    strcpy(hap_priv.setup_id, "ES32");
+    hap_priv.setup_code = "111-22-333";
+    if (hap_acc_setup_init() != HAP_SUCCESS) {
+        return HAP_FAIL;
+    }
+    hap_keystore_stats_t stats;
+    hap_keystore_get_stats(&stats);
+    res->fast_start = hap_fast_start_used();
+    res->cur_aid = hap_priv.cur_aid;
+    res->config_num = hap_priv.config_num;
+    res->paired = hap_get_paired_controller_count();
+    res->nvs_reads = stats.nvs_reads - init_stats.nvs_reads;
+    test_check_ltska(res);
+    if (type == TEST_BOOT_PAIR) {
+        return test_pair();
+    }
+    return HAP_SUCCESS;
+}
+
+static int test_boot(test_boot_type_t type, test_result_t *res)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return HAP_FAIL;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        return HAP_FAIL;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        memset(res, 0, sizeof(*res));
+        if (test_boot_run(type, res) != HAP_SUCCESS || write(fds[1], res, sizeof(*res)) != sizeof(*res)) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    ssize_t len = read(fds[0], res, sizeof(*res));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (len != sizeof(*res) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
+/* Boots till the snapshot gets used, with a controller paired. The pairing does not touch
+ * the snapshot, since the controllers always come from their table.
+ */
+static void test_setup(const char *dir)
+{
+    test_result_t res;
+    TEST_ASSERT_EQUAL(0, mkdir(dir, 0755));
+    TEST_ASSERT_EQUAL(0, chdir(dir));
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(TEST_BOOT_PAIR, &res));
+    TEST_ASSERT(!res.fast_start);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(TEST_BOOT_PLAIN, &res));
+    TEST_ASSERT(res.fast_start);
+    TEST_ASSERT_EQUAL(1, res.paired);
+}
+
+static void test_warm_boot(void)
+{
+    test_result_t cold, warm;
+    TEST_ASSERT_EQUAL(0, mkdir("warm", 0755));
+    TEST_ASSERT_EQUAL(0, chdir("warm"));
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(TEST_BOOT_PLAIN, &cold));
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(TEST_BOOT_PLAIN, &warm));
+    printf("  %u reads from flash without the snapshot, %u with it\n",
+            (unsigned)cold.nvs_reads, (unsigned)warm.nvs_reads);
+    TEST_ASSERT(!cold.fast_start);
+    TEST_ASSERT(warm.fast_start);
+    TEST_ASSERT_EQUAL(cold.cur_aid, warm.cur_aid);
+    TEST_ASSERT_EQUAL(cold.config_num, warm.config_num);
+    TEST_ASSERT(warm.nvs_reads < cold.nvs_reads);
+    TEST_ASSERT_EQUAL(0, chdir(".."));
+}
+
+static void test_stale_aid(void)
+{
+    test_result_t res;
+    test_setup("aid");
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(TEST_BOOT_OLD_AID, &res));
+    TEST_ASSERT(!res.fast_start);
+    TEST_ASSERT_EQUAL(50, res.cur_aid);
+    /* Saved again, with the new aid */
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(TEST_BOOT_PLAIN, &res));
+    TEST_ASSERT(res.fast_start);
+    TEST_ASSERT_EQUAL(50, res.cur_aid);
+    TEST_ASSERT_EQUAL(0, chdir(".."));
+}
+
+/* The controllers are not in the snapshot, so it still gets used */
+static void test_old_unpair(void)
+{
+    test_result_t res;
+    test_setup("unpair");
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(TEST_BOOT_OLD_UNPAIR, &res));
+    TEST_ASSERT(res.fast_start);
+    TEST_ASSERT_EQUAL(0, res.paired);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(TEST_BOOT_PLAIN, &res));
+    TEST_ASSERT_EQUAL(0, res.paired);
+    TEST_ASSERT_EQUAL(0, chdir(".."));
+}
+
+/* Neither is the private key, which is still the one in its own key */
+static void test_private_key(void)
+{
+    test_result_t res;
+    test_setup("keys");
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(TEST_BOOT_PLAIN, &res));
+    TEST_ASSERT(res.fast_start);
+    TEST_ASSERT(res.ltska_found);
+    TEST_ASSERT(!res.ltska_in_snapshot);
+    TEST_ASSERT_EQUAL(0, chdir(".."));
+}
+
+/* After a downgrade and an upgrade back, the config number has to go up */
+static void test_stale_fw_rev(void)
+{
+    test_result_t before, res;
+    test_setup("fw_rev");
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(TEST_BOOT_PLAIN, &before));
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, test_boot(TEST_BOOT_OLD_FW_REV, &res));
+    TEST_ASSERT(!res.fast_start);
+    TEST_ASSERT_EQUAL(before.config_num + 1, res.config_num);
+    TEST_ASSERT_EQUAL(0, chdir(".."));
+}
+
+int main(void)
+{
+    hap_set_debug_level(HAP_DEBUG_LEVEL_WARN);
+    RUN_TEST(test_warm_boot);
+    RUN_TEST(test_stale_aid);
+    RUN_TEST(test_old_unpair);
+    RUN_TEST(test_private_key);
+    RUN_TEST(test_stale_fw_rev);
+    return 0;
+}
@@ -0,0 +1,414 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* Crash consistency of the host keystore backend. The partition file is damaged the way a
+ * crash in the middle of a write would leave it, or the writing process is killed outright,
+ * and then it is opened again in a new process, like after a reboot. Whatever was committed
+ * before the crash has to be there, and a value being written has to be either the old one
+ * or the new one, never a mix.
+ */
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <hap_platform_keystore.h>
+#include "host_test.h"
+
+#define TEST_PART       "crash"
+#define TEST_NS         "crash"
+#define TEST_PATH       TEST_PART ".kv"
+#define TEST_TMP_PATH   TEST_PATH ".tmp"
+#define TEST_KEYS       10
+/* The name space, key and value of a record add up to a multiple of 4, so a record has no
+ * padding and ends with the last (non zero) byte of its value.
+ */
+#define TEST_VAL_LEN    24
+#define TEST_REC_LEN    (16 + 32)
+#define TEST_KILLS      100
+#define TEST_CTR_LEN    1024
+
+static void test_key(char *buf, size_t len, int i)
+{
+    snprintf(buf, len, "k%02d", i);
+}
+
+static void test_val(uint8_t *val, int i, int version)
+{
+    memset(val, 0x10 + i * 4 + version, TEST_VAL_LEN);
+}
+
+/* The keystore logs every open, and there are a few hundred of them */
+static void test_quiet(void)
+{
+    int fd = open("/dev/null", O_WRONLY);
+    if (fd >= 0) {
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+    }
+}
+
+/* Runs fn in a child process, which starts with no partition open, like after a reboot */
+static int test_in_child(int (*fn)(void *arg), void *arg)
+{
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        test_quiet();
+        if (hap_platform_keystore_init_partition(TEST_PART, false) != 0) {
+            _exit(1);
+        }
+        _exit(fn(arg) ? 1 : 0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+static int test_write_keys(void *arg)
+{
+    int version = *(int *)arg;
+    for (int i = 0; i < TEST_KEYS; i++) {
+        char key[8];
+        uint8_t val[TEST_VAL_LEN];
+        test_key(key, sizeof(key), i);
+        test_val(val, i, version);
+        if (hap_platform_keystore_set(TEST_PART, TEST_NS, key, val, sizeof(val)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* The one update which gets torn */
+static int test_update_key(void *arg)
+{
+    uint8_t val[TEST_VAL_LEN];
+    test_val(val, 3, 1);
+    return hap_platform_keystore_set(TEST_PART, TEST_NS, "k03", val, sizeof(val));
+}
+
+/* All the keys have to hold their first values */
+static int test_check_keys(void *arg)
+{
+    for (int i = 0; i < TEST_KEYS; i++) {
+        char key[8];
+        uint8_t val[TEST_VAL_LEN], expected[TEST_VAL_LEN];
+        size_t val_len = sizeof(val);
+        test_key(key, sizeof(key), i);
+        test_val(expected, i, 0);
+        if (hap_platform_keystore_get(TEST_PART, TEST_NS, key, val, &val_len) != 0 ||
+                val_len != sizeof(val) || memcmp(val, expected, sizeof(val))) {
+            fprintf(stderr, "  %s is not intact\n", key);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* After the recovery, the log has to take new records again */
+static int test_check_add(void *arg)
+{
+    uint8_t val = 0x5a;
+    if (test_check_keys(arg) != 0) {
+        return -1;
+    }
+    return hap_platform_keystore_set(TEST_PART, TEST_NS, "new", &val, sizeof(val));
+}
+
+static int test_check_new(void *arg)
+{
+    uint8_t val = 0;
+    size_t val_len = sizeof(val);
+    if (hap_platform_keystore_get(TEST_PART, TEST_NS, "new", &val, &val_len) != 0 || val != 0x5a) {
+        return -1;
+    }
+    return test_check_keys(arg);
+}
+
+static void *test_read_file(const char *path, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    TEST_ASSERT(fp);
+    fseek(fp, 0, SEEK_END);
+    *len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    void *buf = malloc(*len);
+    TEST_ASSERT(buf);
+    TEST_ASSERT_EQUAL(*len, fread(buf, 1, *len, fp));
+    fclose(fp);
+    return buf;
+}
+
+static void test_write_file(const char *path, const void *buf, size_t len)
+{
+    FILE *fp = fopen(path, "wb");
+    TEST_ASSERT(fp);
+    TEST_ASSERT_EQUAL(len, fwrite(buf, 1, len, fp));
+    fclose(fp);
+}
+
+/* End of the log, i.e. just past the last non zero byte */
+static size_t test_log_end(const uint8_t *buf, size_t len)
+{
+    while (len && !buf[len - 1]) {
+        len--;
+    }
+    return len;
+}
+
+/* Reopens the damaged file, and checks it */
+static void test_reopen(void)
+{
+    TEST_ASSERT_EQUAL(0, test_in_child(test_check_add, NULL));
+    TEST_ASSERT_EQUAL(0, test_in_child(test_check_new, NULL));
+}
+
+/* The update of k03 is the last record. It gets cut short at every possible byte, with the
+ * rest either missing from the file (power lost while extending it), or holding whatever was
+ * in the flash sector before (a torn write), or with a single byte corrupted.
+ */
+static void test_torn_record(void)
+{
+    int version = 0;
+    TEST_ASSERT_EQUAL(0, mkdir("torn", 0755));
+    TEST_ASSERT_EQUAL(0, chdir("torn"));
+    TEST_ASSERT_EQUAL(0, test_in_child(test_write_keys, &version));
+    size_t len;
+    uint8_t *before = test_read_file(TEST_PATH, &len);
+    size_t start = test_log_end(before, len);
+    TEST_ASSERT_EQUAL(0, test_in_child(test_update_key, NULL));
+    uint8_t *after = test_read_file(TEST_PATH, &len);
+    size_t end = test_log_end(after, len);
+    TEST_ASSERT_EQUAL(start + TEST_REC_LEN, end);
+    uint8_t *buf = malloc(len);
+    TEST_ASSERT(buf);
+
+    for (size_t cut = start; cut < end; cut++) {
+        test_write_file(TEST_PATH, after, cut);
+        test_reopen();
+
+        memcpy(buf, after, len);
+        memset(buf + cut, 0xa5, end - cut);
+        test_write_file(TEST_PATH, buf, len);
+        test_reopen();
+
+        memcpy(buf, after, len);
+        buf[cut] ^= 0x01;
+        test_write_file(TEST_PATH, buf, len);
+        test_reopen();
+    }
+    printf("  %u cut points, all recovered\n", (unsigned)(end - start));
+    free(buf);
+    free(after);
+    free(before);
+    TEST_ASSERT_EQUAL(0, chdir(".."));
+}
+
+/* A counter value is its sequence number, repeated over the whole value, so that a mix of two
+ * values can be told apart
+ */
+static void test_ctr_val(uint32_t *val, uint32_t seq)
+{
+    for (int i = 0; i < TEST_CTR_LEN / sizeof(uint32_t); i++) {
+        val[i] = seq;
+    }
+}
+
+/* Returns the stored counter, 0 if there is none, or -1 if it is inconsistent */
+static int64_t test_ctr_get(void)
+{
+    uint32_t val[TEST_CTR_LEN / sizeof(uint32_t)], expected[TEST_CTR_LEN / sizeof(uint32_t)];
+    size_t val_len = sizeof(val);
+    int ret = hap_platform_keystore_get(TEST_PART, TEST_NS, "ctr", (uint8_t *)val, &val_len);
+    if (ret == -2) {
+        return 0;
+    }
+    if (ret != 0 || val_len != sizeof(val)) {
+        return -1;
+    }
+    test_ctr_val(expected, val[0]);
+    return memcmp(val, expected, sizeof(val)) ? -1 : val[0];
+}
+
+/* Keeps incrementing the counter, and reports every committed value to the parent, till it
+ * gets killed. With 1K values, the log gets compacted every few dozen commits.
+ */
+static int test_ctr_writer(void *arg)
+{
+    int fd = *(int *)arg;
+    int64_t seq = test_ctr_get();
+    if (seq < 0) {
+        return -1;
+    }
+    uint32_t val[TEST_CTR_LEN / sizeof(uint32_t)];
+    while (1) {
+        test_ctr_val(val, ++seq);
+        if (hap_platform_keystore_set(TEST_PART, TEST_NS, "ctr", (uint8_t *)val, sizeof(val)) != 0) {
+            return -1;
+        }
+        uint32_t acked = seq;
+        if (write(fd, &acked, sizeof(acked)) != sizeof(acked)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int test_ctr_check(void *arg)
+{
+    int64_t seq = test_ctr_get();
+    if (seq < 0) {
+        return -1;
+    }
+    uint32_t ctr = seq;
+    if (write(*(int *)arg, &ctr, sizeof(ctr)) != sizeof(ctr)) {
+        return -1;
+    }
+    /* The keys written before any of the kills have to survive all the compactions */
+    return test_check_keys(NULL);
+}
+
+static uint32_t test_ctr_read(void)
+{
+    int fds[2];
+    TEST_ASSERT_EQUAL(0, pipe(fds));
+    TEST_ASSERT_EQUAL(0, test_in_child(test_ctr_check, &fds[1]));
+    uint32_t ctr = 0;
+    TEST_ASSERT_EQUAL(sizeof(ctr), read(fds[0], &ctr, sizeof(ctr)));
+    close(fds[0]);
+    close(fds[1]);
+    return ctr;
+}
+
+/* The writer gets killed at random times, which lands in the middle of appending a record,
+ * of syncing it, or of compacting the log into a new file.
+ */
+static void test_kill_during_commit(void)
+{
+    int version = 0;
+    TEST_ASSERT_EQUAL(0, mkdir("kill", 0755));
+    TEST_ASSERT_EQUAL(0, chdir("kill"));
+    TEST_ASSERT_EQUAL(0, test_in_child(test_write_keys, &version));
+    srand(getpid());
+    uint32_t ctr = 0;
+    int tmp_left = 0;
+    for (int i = 0; i < TEST_KILLS; i++) {
+        int fds[2];
+        TEST_ASSERT_EQUAL(0, pipe(fds));
+        pid_t pid = fork();
+        TEST_ASSERT(pid >= 0);
+        if (pid == 0) {
+            close(fds[0]);
+            test_quiet();
+            if (hap_platform_keystore_init_partition(TEST_PART, false) != 0) {
+                _exit(1);
+            }
+            test_ctr_writer(&fds[1]);
+            _exit(1);
+        }
+        close(fds[1]);
+        usleep(1000 + rand() % 20000);
+        kill(pid, SIGKILL);
+        int status;
+        waitpid(pid, &status, 0);
+        TEST_ASSERT(WIFSIGNALED(status));
+        /* The last value which the writer saw committed */
+        uint32_t acked, last_acked = ctr;
+        while (read(fds[0], &acked, sizeof(acked)) == sizeof(acked)) {
+            last_acked = acked;
+        }
+        close(fds[0]);
+        tmp_left += (access(TEST_TMP_PATH, F_OK) == 0);
+
+        uint32_t stored = test_ctr_read();
+        /* The value being written when killed may or may not have made it */
+        if (stored != last_acked && stored != last_acked + 1) {
+            fprintf(stderr, "  kill %d: counter is %u, last committed %u\n", i, stored, last_acked);
+            TEST_ASSERT(0);
+        }
+        ctr = stored;
+    }
+    printf("  %d kills, %u commits, %d kills during compaction\n", TEST_KILLS, ctr, tmp_left);
+    TEST_ASSERT(ctr > TEST_KILLS);
+    TEST_ASSERT_EQUAL(0, chdir(".."));
+}
+
+/* A compaction killed halfway leaves its new file behind, which must neither be picked up
+ * when opening nor get in the way of the next compaction
+ */
+static void test_stale_compaction(void)
+{
+    int version = 0;
+    TEST_ASSERT_EQUAL(0, mkdir("stale", 0755));
+    TEST_ASSERT_EQUAL(0, chdir("stale"));
+    TEST_ASSERT_EQUAL(0, test_in_child(test_write_keys, &version));
+    uint8_t junk[4096];
+    memset(junk, 0xa5, sizeof(junk));
+    test_write_file(TEST_TMP_PATH, junk, sizeof(junk));
+    test_reopen();
+    /* Enough updates to compact the log a few times */
+    for (int i = 0; i < 4; i++) {
+        int fds[2];
+        TEST_ASSERT_EQUAL(0, pipe(fds));
+        pid_t pid = fork();
+        TEST_ASSERT(pid >= 0);
+        if (pid == 0) {
+            close(fds[0]);
+            test_quiet();
+            if (hap_platform_keystore_init_partition(TEST_PART, false) != 0) {
+                _exit(1);
+            }
+            for (int j = 0; j < 50; j++) {
+                uint32_t val[TEST_CTR_LEN / sizeof(uint32_t)];
+                test_ctr_val(val, i * 50 + j + 1);
+                if (hap_platform_keystore_set(TEST_PART, TEST_NS, "ctr", (uint8_t *)val, sizeof(val)) != 0) {
+                    _exit(1);
+                }
+            }
+            _exit(0);
+        }
+        close(fds[0]);
+        close(fds[1]);
+        int status;
+        waitpid(pid, &status, 0);
+        TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        TEST_ASSERT_EQUAL((i + 1) * 50, test_ctr_read());
+    }
+    TEST_ASSERT(access(TEST_TMP_PATH, F_OK) != 0);
+    TEST_ASSERT_EQUAL(0, chdir(".."));
+}
+
+int main(void)
+{
+    RUN_TEST(test_torn_record);
+    RUN_TEST(test_kill_during_commit);
+    RUN_TEST(test_stale_compaction);
+    return 0;
+}
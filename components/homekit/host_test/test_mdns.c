@@ -0,0 +1,219 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* mDNS announcements by the HAP main loop, with the real hap_start() and the loop running.
+ * The mDNS responder is a stub which just counts the calls, and hap_mdns_announce() publishes
+ * just the items which change at runtime.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <mdns.h>
+#include <hap.h>
+#include <esp_hap_main.h>
+#include <esp_hap_database.h>
+#include <esp_hap_ip_services.h>
+#include "host_test.h"
+
+static volatile int test_service_adds, test_service_removes, test_txt_sets, test_txt_item_sets;
+static volatile bool test_restarted;
+static bool test_announced;
+
+esp_err_t mdns_init(void)
+{
+    return ESP_OK;
+}
+
+void mdns_free(void)
+{
+}
+
+esp_err_t mdns_hostname_set(const char *hostname)
+{
+    return ESP_OK;
+}
+
+esp_err_t mdns_service_add(const char *instance_name, const char *service_type, const char *proto,
+        uint16_t port, mdns_txt_item_t txt[], size_t num_items)
+{
+    test_service_adds++;
+    return ESP_OK;
+}
+
+esp_err_t mdns_service_remove(const char *service_type, const char *proto)
+{
+    test_service_removes++;
+    return ESP_OK;
+}
+
+esp_err_t mdns_service_instance_name_set(const char *service_type, const char *proto,
+        const char *instance_name)
+{
+    return ESP_OK;
+}
+
+esp_err_t mdns_service_txt_set(const char *service_type, const char *proto, mdns_txt_item_t txt[],
+        uint8_t num_items)
+{
+    test_txt_sets++;
+    return ESP_OK;
+}
+
+esp_err_t mdns_service_txt_item_set(const char *service_type, const char *proto, const char *key,
+        const char *value)
+{
+    test_txt_item_sets++;
+    return ESP_OK;
+}
+
+/* Same flow as the real one, in esp_hap_ip_services.c */
+int hap_mdns_announce(bool first)
+{
+    static char config_num[6];
+    static char state_num[6];
+    mdns_txt_item_t txt[3];
+    snprintf(config_num, sizeof(config_num), "%d", hap_priv.config_num);
+    snprintf(state_num, sizeof(state_num), "%u", hap_priv.state_num);
+    txt[0].key = "c#";
+    txt[0].value = config_num;
+    txt[1].key = "id";
+    txt[1].value = hap_priv.acc_id;
+    txt[2].key = "s#";
+    txt[2].value = state_num;
+    if (first || !test_announced) {
+        test_announced = true;
+        return hap_mdns_serv_start(&hap_priv.hap_mdns_handle, "Test", "_hap", "_tcp", 80, txt, 3);
+    }
+    return hap_mdns_serv_update_txt(&hap_priv.hap_mdns_handle, txt, 3);
+}
+
+int hap_mdns_deannounce(void)
+{
+    test_announced = false;
+    return hap_mdns_serv_stop(&hap_priv.hap_mdns_handle);
+}
+
+void esp_restart(void)
+{
+    test_restarted = true;
+}
+
+static int test_identify(hap_acc_t *ha)
+{
+    return HAP_SUCCESS;
+}
+
+static void test_sleep_ms(uint32_t ms)
+{
+    vTaskDelay(pdMS_TO_TICKS(ms));
+}
+
+/* Waits up to "ms" for a counter to reach "val" */
+static bool test_wait_for(volatile int *counter, int val, uint32_t ms)
+{
+    for (uint32_t waited = 0; *counter < val; waited += 10) {
+        if (waited >= ms) {
+            return false;
+        }
+        test_sleep_ms(10);
+    }
+    return true;
+}
+
+static int test_txt_updates(void)
+{
+    return test_txt_sets + test_txt_item_sets;
+}
+
+static void test_start(void)
+{
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_init(HAP_TRANSPORT_WIFI));
+    hap_acc_cfg_t cfg = {
+        .name = "Test",
+        .model = "Model",
+        .manufacturer = "Espressif",
+        .serial_num = "001122334455",
+        .fw_rev = "1.0.0",
+        .pv = "1.1.0",
+        .cid = HAP_CID_LIGHTING,
+        .identify_routine = test_identify,
+    };
+    hap_acc_t *ha = hap_acc_create(&cfg);
+    TEST_ASSERT(ha);
+    hap_add_accessory(ha);
+    strcpy(hap_priv.setup_id, "ES32");
+    hap_priv.setup_code = "111-22-333";
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_start());
+    TEST_ASSERT_EQUAL(1, test_service_adds);
+}
+
+/* A burst of config number updates goes out as one announcement right away, and one more
+ * with the final values at the end of the minimum interval.
+ */
+static void test_rate_limit(void)
+{
+    /* Past the minimum interval since the announcement by hap_start() */
+    test_sleep_ms(CONFIG_HAP_MDNS_MIN_INTERVAL_MS + 200);
+    int updates = test_txt_updates();
+    for (int i = 0; i < 5; i++) {
+        TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_update_config_number());
+        test_sleep_ms(50);
+    }
+    TEST_ASSERT_EQUAL(updates + 1, test_txt_updates());
+    test_sleep_ms(CONFIG_HAP_MDNS_MIN_INTERVAL_MS + 200);
+    printf("  5 config number updates, %d TXT updates\n", test_txt_updates() - updates);
+    TEST_ASSERT_EQUAL(updates + 2, test_txt_updates());
+    /* Only c# changes for an unpaired accessory, so just that item is sent */
+    TEST_ASSERT_EQUAL(0, test_txt_sets);
+    TEST_ASSERT_EQUAL(1, test_service_adds);
+}
+
+/* Once the service has been de-announced for a reboot, nothing may bring it back */
+static void test_no_announce_after_reboot(void)
+{
+    test_sleep_ms(CONFIG_HAP_MDNS_MIN_INTERVAL_MS + 200);
+    int updates = test_txt_updates();
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_reboot_accessory());
+    TEST_ASSERT(test_wait_for(&test_service_removes, 1, 3000));
+    /* An announcement now would not be rate limited, as the interval is long past */
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_update_config_number());
+    test_sleep_ms(300);
+    TEST_ASSERT_EQUAL(1, test_service_adds);
+    TEST_ASSERT_EQUAL(updates, test_txt_updates());
+    for (int waited = 0; !test_restarted && waited < 5000; waited += 10) {
+        test_sleep_ms(10);
+    }
+    TEST_ASSERT(test_restarted);
+    TEST_ASSERT_EQUAL(1, test_service_adds);
+}
+
+int main(void)
+{
+    hap_set_debug_level(HAP_DEBUG_LEVEL_ERR);
+    test_start();
+    RUN_TEST(test_rate_limit);
+    RUN_TEST(test_no_announce_after_reboot);
+    return 0;
+}
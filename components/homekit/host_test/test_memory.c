@@ -0,0 +1,66 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* Tagged allocations and their accounting */
+#include <stdint.h>
+#include <string.h>
+#include <hap_platform_memory.h>
+#include "host_test.h"
+
+static void test_alloc_free(void)
+{
+    hap_mem_stats_t before, after;
+    TEST_ASSERT_EQUAL(0, hap_platform_memory_get_stats(HAP_MEM_TAG_OTHER, &before));
+    uint8_t *buf = hap_platform_memory_malloc_tagged(HAP_MEM_TAG_OTHER, 100);
+    TEST_ASSERT(buf);
+    memset(buf, 0, 100);
+    TEST_ASSERT_EQUAL(0, hap_platform_memory_get_stats(HAP_MEM_TAG_OTHER, &after));
+    TEST_ASSERT_EQUAL(before.cur_bytes + 100, after.cur_bytes);
+    TEST_ASSERT_EQUAL(before.alloc_count + 1, after.alloc_count);
+    hap_platform_memory_free_tagged(buf);
+    TEST_ASSERT_EQUAL(0, hap_platform_memory_get_stats(HAP_MEM_TAG_OTHER, &after));
+    TEST_ASSERT_EQUAL(before.cur_bytes, after.cur_bytes);
+    TEST_ASSERT_EQUAL(before.cur_count, after.cur_count);
+}
+
+/* A size which wraps around once the header is added must fail, and not return a tiny buffer */
+static void test_size_overflow(void)
+{
+    hap_mem_stats_t before, after;
+    TEST_ASSERT_EQUAL(0, hap_platform_memory_get_stats(HAP_MEM_TAG_OTHER, &before));
+    TEST_ASSERT(!hap_platform_memory_malloc_tagged(HAP_MEM_TAG_OTHER, SIZE_MAX));
+    TEST_ASSERT(!hap_platform_memory_malloc_tagged(HAP_MEM_TAG_OTHER, SIZE_MAX - 4));
+    TEST_ASSERT(!hap_platform_memory_calloc_tagged(HAP_MEM_TAG_OTHER, 2, SIZE_MAX / 2));
+    TEST_ASSERT_EQUAL(0, hap_platform_memory_get_stats(HAP_MEM_TAG_OTHER, &after));
+    TEST_ASSERT_EQUAL(before.fail_count + 3, after.fail_count);
+    TEST_ASSERT_EQUAL(before.cur_bytes, after.cur_bytes);
+    TEST_ASSERT_EQUAL(before.alloc_count, after.alloc_count);
+}
+
+int main(void)
+{
+    RUN_TEST(test_alloc_free);
+    RUN_TEST(test_size_overflow);
+    return 0;
+}
@@ -0,0 +1,273 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+/* Replay of a random sequence of characteristic updates, deletions and creations at 10 kHz,
+ * against a notification task which drains the ISR updates and walks the pending
+ * characteristics in chunks, like the real pass. Any characteristic freed under the pass
+ * or the drain shows up as a use after free, and any which got dropped from the pass without
+ * clearing its pending state, as never getting notified again.
+ */
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
+#include <hap.h>
+#include <esp_hap_main.h>
+#include <esp_hap_char.h>
+#include "host_test.h"
+
+#define TEST_SLOTS          32
+#define TEST_OPS            10000
+#define TEST_OP_PERIOD_US   100
+#define TEST_CHUNK          4
+#define TEST_SEED           0x2545F491
+
+static hap_char_t *test_chars[TEST_SLOTS];
+static volatile bool test_done;
+static volatile uint8_t test_seen[TEST_OPS + TEST_SLOTS + 1];
+static volatile int test_passes, test_notified;
+static uint32_t test_rand_state = TEST_SEED;
+static int32_t test_next_iid = 1;
+
+static SemaphoreHandle_t test_apply_sem;
+static volatile bool test_hold_apply;
+
+/* Called while a value is being applied, when a persistent characteristic changes. Used to hold
+ * the drain in the middle of applying an update.
+ */
+int hap_send_event(hap_internal_event_t event)
+{
+    if (event == HAP_INTERNAL_EVENT_CHAR_PERSIST && test_hold_apply) {
+        xSemaphoreGive(test_apply_sem);
+        usleep(50 * 1000);
+    }
+    return HAP_SUCCESS;
+}
+
+static uint32_t test_rand()
+{
+    /* xorshift32, so that every run replays the same sequence */
+    uint32_t x = test_rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return test_rand_state = x;
+}
+
+static hap_char_t *test_char_create(bool uint32_only)
+{
+    hap_char_t *hc;
+    if (uint32_only || (test_rand() & 1)) {
+        hc = hap_char_uint32_create("11", HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV, 0);
+    } else {
+        hc = hap_char_string_create("23", HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV, "x");
+    }
+    TEST_ASSERT(hc);
+    hap_char_set_iid(hc, test_next_iid++);
+    return hc;
+}
+
+static void test_char_update(hap_char_t *hc, uint32_t n, bool from_isr)
+{
+    hap_val_t val;
+    char str[16];
+    if (hap_char_get_format(hc) == HAP_CHAR_FORMAT_UINT32) {
+        val.u = n;
+    } else {
+        snprintf(str, sizeof(str), "v%u", (unsigned)n);
+        val.s = str;
+    }
+    if (from_isr) {
+        host_test_isr_enter();
+        /* Fails only if the ring is full */
+        hap_char_update_val(hc, &val);
+        host_test_isr_exit();
+    } else {
+        TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_update_val(hc, &val));
+    }
+}
+
+/* Same as the notification pass, except that nothing is encoded or sent. The pass lock is
+ * released between chunks, so that deletions get in while characteristics are still taken.
+ */
+static void *test_notif_task(void *arg)
+{
+    while (!test_done) {
+        hap_char_drain_isr_updates();
+        if (hap_take_pending_notif_chars(NULL) == 0) {
+            usleep(50);
+            continue;
+        }
+        hap_char_t *chunk[TEST_CHUNK];
+        int i, j;
+        do {
+            i = 0;
+            hap_notif_pass_lock();
+            while ((i < TEST_CHUNK) && (chunk[i] = hap_pop_pending_notif_char(NULL)) != NULL) {
+                i++;
+            }
+            /* Access the characteristics a while after popping them, like encoding does */
+            usleep(20);
+            for (j = 0; j < i; j++) {
+                int32_t iid = hap_char_get_iid(chunk[j]);
+                TEST_ASSERT(iid > 0 && iid < (int32_t)sizeof(test_seen));
+                if (hap_char_get_format(chunk[j]) == HAP_CHAR_FORMAT_UINT32) {
+                    (void)hap_char_get_val(chunk[j])->u;
+                }
+                test_seen[iid] = 1;
+            }
+            hap_notif_pass_unlock();
+            __sync_fetch_and_add(&test_notified, i);
+            usleep(20);
+        } while (i);
+        __sync_fetch_and_add(&test_passes, 1);
+    }
+    return NULL;
+}
+
+/* Replay, with the updates made from a simulated ISR if from_isr is set. These are then applied
+ * by the drain, which can be in progress when the characteristic gets deleted.
+ */
+static void test_replay(bool from_isr)
+{
+    pthread_t task;
+    int i, deletes = 0;
+    test_done = false;
+    test_passes = test_notified = 0;
+    test_rand_state = TEST_SEED;
+    test_next_iid = 1;
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_event_queue_init());
+    for (i = 0; i < TEST_SLOTS; i++) {
+        test_chars[i] = test_char_create(from_isr);
+    }
+    pthread_create(&task, NULL, test_notif_task, NULL);
+
+    int64_t start = esp_timer_get_time();
+    int64_t next = start;
+    for (i = 0; i < TEST_OPS; i++) {
+        uint32_t r = test_rand();
+        int slot = r % TEST_SLOTS;
+        if ((r >> 8) % 8 == 0) {
+            /* Delete and create one afresh. Half of these get queued for a notification */
+            hap_char_delete(test_chars[slot]);
+            test_chars[slot] = test_char_create(from_isr);
+            if (r & (1 << 16)) {
+                test_char_update(test_chars[slot], i + 1, from_isr);
+            }
+            deletes++;
+        } else {
+            test_char_update(test_chars[slot], i + 1, from_isr);
+        }
+        next += TEST_OP_PERIOD_US;
+        while (esp_timer_get_time() < next) {
+        }
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+
+    /* Every characteristic still present should get notified for a fresh update */
+    for (i = 0; i < TEST_SLOTS; i++) {
+        test_seen[hap_char_get_iid(test_chars[i])] = 0;
+    }
+    for (i = 0; i < TEST_SLOTS; i++) {
+        test_char_update(test_chars[i], TEST_OPS + 1, false);
+    }
+    int missing = TEST_SLOTS;
+    for (int wait = 0; wait < 200 && missing; wait++) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+        missing = 0;
+        for (i = 0; i < TEST_SLOTS; i++) {
+            missing += !test_seen[hap_char_get_iid(test_chars[i])];
+        }
+    }
+    printf("  %d ops (%d deletes) in %lld us, %d passes, %d notified\n", TEST_OPS, deletes,
+            (long long)elapsed, test_passes, test_notified);
+    TEST_ASSERT_EQUAL(0, missing);
+
+    test_done = true;
+    pthread_join(task, NULL);
+    for (i = 0; i < TEST_SLOTS; i++) {
+        hap_char_delete(test_chars[i]);
+    }
+}
+
+static void test_update_delete_replay()
+{
+    test_replay(false);
+}
+
+static void test_isr_update_delete_replay()
+{
+    hap_isr_update_stats_t stats;
+    test_replay(true);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_get_isr_update_stats(&stats));
+    printf("  %u pushed, %u dropped, %u applied\n", (unsigned)stats.pushed,
+            (unsigned)stats.dropped, (unsigned)stats.applied);
+    TEST_ASSERT(stats.applied > 0);
+}
+
+static void *test_drain_task(void *arg)
+{
+    hap_char_drain_isr_updates();
+    return NULL;
+}
+
+/* Delete a characteristic while the drain is applying an update taken from the ring for it */
+static void test_delete_during_drain()
+{
+    pthread_t task;
+    hap_val_t val = { .u = 1 };
+    test_apply_sem = xSemaphoreCreateBinary();
+    hap_char_t *hc = hap_char_uint32_create("11", HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV, 0);
+    TEST_ASSERT(hc);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_set_persist(hc, true));
+    host_test_isr_enter();
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_update_val_from_isr(hc, &val));
+    host_test_isr_exit();
+
+    test_hold_apply = true;
+    pthread_create(&task, NULL, test_drain_task, NULL);
+    TEST_ASSERT(xSemaphoreTake(test_apply_sem, pdMS_TO_TICKS(1000)) == pdTRUE);
+    /* The update is out of the ring by now. The deletion has to wait for it to be applied */
+    int64_t start = esp_timer_get_time();
+    hap_char_delete(hc);
+    int64_t waited = esp_timer_get_time() - start;
+    pthread_join(task, NULL);
+    test_hold_apply = false;
+    printf("  deletion waited %lld us\n", (long long)waited);
+    TEST_ASSERT(waited > 10 * 1000);
+    vSemaphoreDelete(test_apply_sem);
+}
+
+int main()
+{
+    hap_set_debug_level(HAP_DEBUG_LEVEL_WARN);
+    RUN_TEST(test_update_delete_replay);
+    RUN_TEST(test_isr_update_delete_replay);
+    RUN_TEST(test_delete_during_drain);
+    return 0;
+}
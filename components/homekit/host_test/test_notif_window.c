@@ -0,0 +1,210 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* A dimmer ramped over 100 steps with 2 controllers subscribed, with the notification
+ * coalescing window on the service, overridden on the characteristic, and next to a
+ * stateless event which must never wait for the window. The notification task is the same as
+ * the real pass, except that it just counts the EVENT messages, one per controller which
+ * has subscribed to any of the characteristics taken.
+ */
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <esp_timer.h>
+#include <hap.h>
+#include <hap_apple_servs.h>
+#include <hap_apple_chars.h>
+#include <esp_hap_main.h>
+#include <esp_hap_char.h>
+#include "host_test.h"
+
+#define TEST_STEPS          100
+#define TEST_STEP_MS        10
+#define TEST_WINDOW_MS      100
+#define TEST_CTRLS          2
+#define TEST_QUEUE_LEN      8
+/* Switch presses during the ramp, one every TEST_PRESS_STEPS steps */
+#define TEST_PRESS_STEPS    10
+
+static QueueHandle_t test_queue;
+static volatile int test_posts, test_post_failures, test_passes;
+static volatile bool test_done;
+static hap_char_t *test_switch;
+static volatile int test_switch_events;
+static volatile int64_t test_press_ts, test_switch_max_us;
+
+int hap_send_event(hap_internal_event_t event)
+{
+    __sync_fetch_and_add(&test_posts, 1);
+    if (xQueueSend(test_queue, &event, 0) != pdTRUE) {
+        __sync_fetch_and_add(&test_post_failures, 1);
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
+static void *test_notif_task(void *arg)
+{
+    hap_internal_event_t event;
+    while (!test_done) {
+        if (xQueueReceive(test_queue, &event, pdMS_TO_TICKS(10)) != pdTRUE) {
+            continue;
+        }
+        hap_take_pending_notif_chars(NULL);
+        hap_char_t *hc;
+        uint16_t ctrls = 0;
+        hap_notif_pass_lock();
+        while ((hc = hap_pop_pending_notif_char(NULL)) != NULL) {
+            ctrls |= hap_char_take_notif_ctrls(hc);
+            if (hc == test_switch) {
+                int64_t delay = esp_timer_get_time() - test_press_ts;
+                if (delay > test_switch_max_us) {
+                    test_switch_max_us = delay;
+                }
+                test_switch_events++;
+            }
+        }
+        hap_notif_pass_unlock();
+        hap_notif_count_pass(__builtin_popcount(ctrls), ctrls ? 1 : 0);
+        __sync_fetch_and_add(&test_passes, 1);
+    }
+    return NULL;
+}
+
+/* Wait for the last window to end, and the passes posted to be done */
+static void test_drain()
+{
+    vTaskDelay(pdMS_TO_TICKS(2 * TEST_WINDOW_MS));
+    while (test_passes != test_posts - test_post_failures) {
+        vTaskDelay(1);
+    }
+}
+
+static hap_char_t *test_char_add(hap_serv_t *hs, hap_char_t *hc)
+{
+    TEST_ASSERT(hc);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_serv_add_char(hs, hc));
+    for (int i = 0; i < TEST_CTRLS; i++) {
+        TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_manage_notification(hc, i, true));
+    }
+    return hc;
+}
+
+/* Ramps the brightness from 1 to TEST_STEPS, with a switch press every TEST_PRESS_STEPS
+ * steps if "presses" is set, and gets the statistics for the ramp.
+ */
+static void test_ramp(hap_char_t *brightness, bool presses, hap_notif_stats_t *stats)
+{
+    test_drain();
+    hap_reset_notif_stats();
+    test_switch_events = 0;
+    test_switch_max_us = 0;
+    for (int i = 1; i <= TEST_STEPS; i++) {
+        hap_val_t val = { .i = i };
+        TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_update_val(brightness, &val));
+        if (presses && (i % TEST_PRESS_STEPS == 0)) {
+            /* A single press every time. The event is sent even if the value is the same */
+            val.u = 0;
+            test_press_ts = esp_timer_get_time();
+            TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_update_val(test_switch, &val));
+        }
+        vTaskDelay(pdMS_TO_TICKS(TEST_STEP_MS));
+    }
+    test_drain();
+    hap_get_notif_stats(stats);
+    printf("  %3u updates, %3u coalesced, %3u immediate, %3u passes, %3u EVENT messages\n",
+            (unsigned)stats->updates, (unsigned)stats->coalesced, (unsigned)stats->immediate,
+            (unsigned)stats->passes, (unsigned)stats->messages);
+    TEST_ASSERT_EQUAL(0, test_post_failures);
+    /* Every pass sent the changes to both the controllers */
+    TEST_ASSERT_EQUAL(TEST_CTRLS * stats->passes, stats->messages);
+}
+
+static void test_dimmer_ramp()
+{
+    pthread_t task;
+    hap_notif_stats_t no_window, serv_window, char_override, with_switch;
+    test_queue = xQueueCreate(TEST_QUEUE_LEN, sizeof(hap_internal_event_t));
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_event_queue_init());
+    pthread_create(&task, NULL, test_notif_task, NULL);
+
+    hap_serv_t *hs = hap_serv_create(HAP_SERV_UUID_LIGHTBULB);
+    TEST_ASSERT(hs);
+    hap_char_t *brightness = test_char_add(hs, hap_char_brightness_create(0));
+    test_switch = test_char_add(hs, hap_char_programmable_switch_event_create(0));
+
+    /* No window (the default): an EVENT for every step, to every controller */
+    test_ramp(brightness, false, &no_window);
+    TEST_ASSERT_EQUAL(TEST_STEPS, no_window.updates);
+    TEST_ASSERT(no_window.immediate > 0);
+    TEST_ASSERT(no_window.messages > TEST_CTRLS * TEST_STEPS / 2);
+
+    /* The service window, inherited by the brightness. A pass every window, with all the
+     * other steps merged into the pending notification.
+     */
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_serv_set_notif_window(hs, TEST_WINDOW_MS));
+    test_ramp(brightness, false, &serv_window);
+    int windows = TEST_STEPS * TEST_STEP_MS / TEST_WINDOW_MS;
+    TEST_ASSERT_EQUAL(0, serv_window.immediate);
+    TEST_ASSERT(serv_window.passes >= windows / 2 && serv_window.passes <= windows + 2);
+    TEST_ASSERT_EQUAL(TEST_STEPS - serv_window.passes, serv_window.coalesced);
+
+    /* The brightness' own window of 0 wins over the service's */
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_set_notif_window(brightness, 0));
+    test_ramp(brightness, false, &char_override);
+    TEST_ASSERT(char_override.immediate > 0);
+    TEST_ASSERT(char_override.messages > TEST_CTRLS * TEST_STEPS / 2);
+
+    /* Back to the service window, with switch presses in between. The presses go out right
+     * away, each one taking the brightness pending at that point along with it.
+     */
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_char_set_notif_window(brightness, HAP_NOTIF_WINDOW_INHERIT));
+    test_ramp(brightness, true, &with_switch);
+    int presses = TEST_STEPS / TEST_PRESS_STEPS;
+    printf("  %d switch events, longest delay %lld us\n", test_switch_events,
+            (long long)test_switch_max_us);
+    TEST_ASSERT_EQUAL(TEST_STEPS + presses, with_switch.updates);
+    TEST_ASSERT_EQUAL(presses, test_switch_events);
+    TEST_ASSERT(with_switch.immediate > 0 && with_switch.immediate <= presses);
+    TEST_ASSERT(test_switch_max_us < TEST_WINDOW_MS * 1000 / 2);
+
+    printf("  EVENT messages: %u without a window, %u with a %d ms window\n",
+            (unsigned)no_window.messages, (unsigned)serv_window.messages, TEST_WINDOW_MS);
+    TEST_ASSERT(serv_window.messages < no_window.messages / 4);
+
+    test_done = true;
+    pthread_join(task, NULL);
+    hap_serv_delete(hs);
+    vQueueDelete(test_queue);
+}
+
+int main()
+{
+    hap_set_debug_level(HAP_DEBUG_LEVEL_WARN);
+    RUN_TEST(test_dimmer_ramp);
+    return 0;
+}
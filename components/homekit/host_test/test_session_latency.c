@@ -0,0 +1,291 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+/* Benchmark of the HTTP server's request latency under a sustained notification load, with
+ * one controller reading its socket slowly. The notification load is sent the way the
+ * notification pass does (sessions referenced with hap_sessions_get_all() and sent to without
+ * any table lock held), using the real session locking and send path over socket pairs.
+ * The HTTP server side sends responses on the other sessions and keeps connecting and
+ * disconnecting controllers, neither of which should have to wait for the slow socket.
+ * Also, a request stuck in a deferred read, which should not hold up the notifications.
+ */
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
+#include <hap.h>
+#include <hap_platform_memory.h>
+#include <esp_hap_database.h>
+#include <esp_hap_pair_verify.h>
+#include <esp_hap_network_io.h>
+#include "host_test.h"
+
+#define TEST_SESSIONS           4
+#define TEST_DURATION_US        (1000 * 1000)
+#define TEST_REQ_PERIOD_US      1000
+#define TEST_EVENT_SIZE         2048
+#define TEST_RESP_SIZE          256
+/* The slow controller reads this much every TEST_SLOW_READ_MS */
+#define TEST_SLOW_READ_SIZE     256
+#define TEST_SLOW_READ_MS       2
+/* A request is not expected to wait anywhere near as long as a send to the slow socket */
+#define TEST_REQ_MAX_US         (10 * 1000)
+#define TEST_MAX_SAMPLES        4096
+/* How long a deferred read keeps its request waiting */
+#define TEST_DEFER_MS           200
+
+static volatile bool test_done;
+static int test_peer_fds[TEST_SESSIONS];
+static int64_t test_req_lat[TEST_MAX_SAMPLES], test_conn_lat[TEST_MAX_SAMPLES];
+static int test_req_cnt, test_conn_cnt;
+static volatile bool test_slow_reader;
+static volatile int test_events_sent;
+static volatile int test_session_events[HAP_MAX_SESSIONS];
+static volatile int64_t test_event_max_us;
+
+/* Same as what Pair Verify does on success, except for the keys */
+static hap_secure_session_t *test_session_add(int fd)
+{
+    hap_secure_session_t *session = hap_platform_memory_calloc_tagged(HAP_MEM_TAG_SESSION,
+            sizeof(hap_secure_session_t), 1);
+    TEST_ASSERT(session);
+    session->refcnt = 1;
+    session->lock = xSemaphoreCreateRecursiveMutex();
+    TEST_ASSERT(session->lock);
+    session->state = STATE_VERIFIED;
+    session->conn_identifier = fd;
+    hap_sessions_lock();
+    for (int i = 0; i < HAP_MAX_SESSIONS; i++) {
+        if (!hap_priv.sessions[i]) {
+            hap_priv.sessions[i] = session;
+            break;
+        }
+    }
+    hap_sessions_unlock();
+    return session;
+}
+
+static void *test_peer_reader(void *arg)
+{
+    int idx = (int)(intptr_t)arg;
+    char buf[TEST_EVENT_SIZE];
+    while (!test_done) {
+        if (idx == 0 && test_slow_reader) {
+            if (read(test_peer_fds[idx], buf, TEST_SLOW_READ_SIZE) <= 0) {
+                break;
+            }
+            usleep(TEST_SLOW_READ_MS * 1000);
+        } else if (read(test_peer_fds[idx], buf, sizeof(buf)) <= 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Same as the notification pass, with every controller subscribed to everything */
+static void *test_event_task(void *arg)
+{
+    static char event[TEST_EVENT_SIZE];
+    hap_secure_session_t *sessions[HAP_MAX_SESSIONS];
+    memset(event, 'e', sizeof(event));
+    while (!test_done) {
+        uint16_t active = hap_sessions_get_all(sessions);
+        for (int k = 0; k < HAP_MAX_SESSIONS; k++) {
+            if (!(active & (1 << k))) {
+                continue;
+            }
+            int64_t start = esp_timer_get_time();
+            if (hap_session_send(sessions[k], event, sizeof(event), 0) > 0) {
+                __sync_fetch_and_add(&test_events_sent, 1);
+                __sync_fetch_and_add(&test_session_events[k], 1);
+            }
+            int64_t elapsed = esp_timer_get_time() - start;
+            if (elapsed > test_event_max_us) {
+                test_event_max_us = elapsed;
+            }
+        }
+        for (int k = 0; k < HAP_MAX_SESSIONS; k++) {
+            hap_session_put(sessions[k]);
+        }
+    }
+    return NULL;
+}
+
+static int test_cmp(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void test_print_lat(const char *name, int64_t *lat, int cnt)
+{
+    qsort(lat, cnt, sizeof(int64_t), test_cmp);
+    printf("  %-18s %4d samples: p50 %lld us, p99 %lld us, max %lld us\n", name, cnt,
+            (long long)lat[cnt / 2], (long long)lat[cnt * 99 / 100], (long long)lat[cnt - 1]);
+}
+
+/* Sessions over socket pairs, each with a reader at the controller's end, and the
+ * notification task. Session 0 gets a small socket buffer, for the slow reader.
+ */
+static void test_start(hap_secure_session_t *sessions[], pthread_t readers[], pthread_t *events)
+{
+    int fds[2];
+    test_done = false;
+    test_events_sent = 0;
+    test_event_max_us = 0;
+    memset((void *)test_session_events, 0, sizeof(test_session_events));
+    for (int i = 0; i < TEST_SESSIONS; i++) {
+        TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+        if (i == 0) {
+            int size = 4096;
+            setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+            setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        }
+        sessions[i] = test_session_add(fds[0]);
+        test_peer_fds[i] = fds[1];
+        pthread_create(&readers[i], NULL, test_peer_reader, (void *)(intptr_t)i);
+    }
+    pthread_create(events, NULL, test_event_task, NULL);
+}
+
+/* Unblock everything and clean up */
+static void test_stop(hap_secure_session_t *sessions[], pthread_t readers[], pthread_t events)
+{
+    test_done = true;
+    for (int i = 0; i < TEST_SESSIONS; i++) {
+        shutdown(test_peer_fds[i], SHUT_RDWR);
+        shutdown(sessions[i]->conn_identifier, SHUT_RDWR);
+    }
+    pthread_join(events, NULL);
+    for (int i = 0; i < TEST_SESSIONS; i++) {
+        pthread_join(readers[i], NULL);
+        int fd = sessions[i]->conn_identifier;
+        hap_free_session(sessions[i]);
+        close(fd);
+        close(test_peer_fds[i]);
+    }
+    for (int i = 0; i < HAP_MAX_SESSIONS; i++) {
+        TEST_ASSERT(hap_priv.sessions[i] == NULL);
+    }
+}
+
+static void test_request_latency_under_events()
+{
+    pthread_t readers[TEST_SESSIONS], events;
+    hap_secure_session_t *sessions[TEST_SESSIONS];
+    int fds[2];
+    test_slow_reader = true;
+    test_start(sessions, readers, &events);
+
+    char resp[TEST_RESP_SIZE];
+    memset(resp, 'r', sizeof(resp));
+    int64_t end = esp_timer_get_time() + TEST_DURATION_US;
+    for (int n = 0; esp_timer_get_time() < end && test_req_cnt < TEST_MAX_SAMPLES; n++) {
+        /* A response on one of the fast controllers' sessions */
+        hap_secure_session_t *session = sessions[1 + n % (TEST_SESSIONS - 1)];
+        int64_t start = esp_timer_get_time();
+        hap_session_req_begin(session);
+        TEST_ASSERT(hap_session_resp_send(session, resp, sizeof(resp), 0) > 0);
+        hap_session_req_end(session);
+        test_req_lat[test_req_cnt++] = esp_timer_get_time() - start;
+        if (n % 10 == 0) {
+            /* A controller connecting and then disconnecting, while possibly being notified */
+            TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+            start = esp_timer_get_time();
+            hap_free_session(test_session_add(fds[0]));
+            test_conn_lat[test_conn_cnt++] = esp_timer_get_time() - start;
+            close(fds[0]);
+            close(fds[1]);
+        }
+        usleep(TEST_REQ_PERIOD_US);
+    }
+
+    printf("  %d events sent, longest send %lld us\n", test_events_sent,
+            (long long)test_event_max_us);
+    test_print_lat("response", test_req_lat, test_req_cnt);
+    test_print_lat("connect+disconnect", test_conn_lat, test_conn_cnt);
+    /* The slow controller did hold up the notifications */
+    TEST_ASSERT(test_event_max_us > TEST_REQ_MAX_US);
+    TEST_ASSERT(test_req_lat[test_req_cnt - 1] < TEST_REQ_MAX_US);
+    TEST_ASSERT(test_conn_lat[test_conn_cnt - 1] < TEST_REQ_MAX_US);
+    test_stop(sessions, readers, events);
+}
+
+/* A request on session 0 waits for a deferred read before it responds, the way
+ * hap_http_session_handler() runs the handler. EVENT messages keep going out meanwhile, to
+ * the other sessions as well as to session 0.
+ */
+static void test_events_during_deferred_read()
+{
+    pthread_t readers[TEST_SESSIONS], events;
+    hap_secure_session_t *sessions[TEST_SESSIONS];
+    int waiting[TEST_SESSIONS];
+    char resp[TEST_RESP_SIZE];
+    memset(resp, 'r', sizeof(resp));
+    test_slow_reader = false;
+    test_start(sessions, readers, &events);
+
+    hap_session_req_begin(sessions[0]);
+    /* Session k of the test is at index k in the sessions table */
+    for (int i = 0; i < TEST_SESSIONS; i++) {
+        waiting[i] = test_session_events[i];
+    }
+    usleep(TEST_DEFER_MS * 1000);
+    for (int i = 0; i < TEST_SESSIONS; i++) {
+        waiting[i] = test_session_events[i] - waiting[i];
+    }
+    TEST_ASSERT(hap_session_resp_send(sessions[0], resp, sizeof(resp), 0) > 0);
+    TEST_ASSERT(hap_session_resp_send(sessions[0], resp, sizeof(resp), 0) > 0);
+    hap_session_req_end(sessions[0]);
+    /* And after the response */
+    int after = test_session_events[0];
+    while (test_session_events[0] == after) {
+        usleep(1000);
+    }
+
+    printf("  %d events to the waiting session and %d to the next one in %d ms, "
+            "longest send %lld us\n", waiting[0], waiting[1], TEST_DEFER_MS,
+            (long long)test_event_max_us);
+    for (int i = 0; i < TEST_SESSIONS; i++) {
+        TEST_ASSERT(waiting[i] > 0);
+    }
+    TEST_ASSERT(test_event_max_us < TEST_DEFER_MS * 1000);
+    test_stop(sessions, readers, events);
+}
+
+int main()
+{
+    hap_set_debug_level(HAP_DEBUG_LEVEL_WARN);
+    /* Sends on sockets shut down at the end should just fail */
+    signal(SIGPIPE, SIG_IGN);
+    TEST_ASSERT_EQUAL(HAP_SUCCESS, hap_sessions_init());
+    RUN_TEST(test_request_latency_under_events);
+    RUN_TEST(test_events_during_deferred_read);
+    return 0;
+}
@@ -15,6 +15,7 @@
 #include "esp_system.h"
 #include "argtable3/argtable3.h"
 #include "emulator.h"
+#include <hap_platform_memory.h>
 
 static void register_read();
 static void register_write();
@@ -25,6 +26,8 @@ static void register_reset_pairings();
 static void register_auth();
 static void register_reset_wifi_credentials();
 static void register_reboot_accessory();
+static void register_mem_stats();
+static void register_notif_latency();
 
 void register_system()
 {
@@ -37,6 +40,8 @@ void register_system()
     register_reset();
     register_read();
     register_write();
+    register_mem_stats();
+    register_notif_latency();
 }
 
 /* Reading from characteristic sequence */
@@ -258,3 +263,59 @@ static void register_auth()
     };
     ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
 }
+
+/* Display the HomeKit memory accounting statistics */
+static int mem_stats(int argc, char** argv)
+{
+#ifdef CONFIG_HAP_PLATFORM_MEMORY_TRACKING
+    if(argc == 1) {
+        hap_platform_memory_dump_stats();
+    } else if((argc == 2) && !strcmp(argv[1], "reset")) {
+        hap_platform_memory_reset_peak();
+    } else {
+        printf("Invalid Usage.");
+        return ESP_ERR_INVALID_ARG;
+    }
+#else
+    printf("Memory tracking not enabled. Enable CONFIG_HAP_PLATFORM_MEMORY_TRACKING.\n");
+#endif
+    return ESP_OK;
+}
+
+static void register_mem_stats()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "mem-stats",
+        .help = "Show HomeKit memory usage per subsystem.\n Usage: mem-stats [reset]",
+        .hint = NULL,
+        .func = &mem_stats,
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+/* Display the event notification latency histograms */
+static int notif_latency(int argc, char** argv)
+{
+    if(argc == 1) {
+        hap_dump_notif_latency(false);
+    } else if((argc == 2) && !strcmp(argv[1], "hist")) {
+        hap_dump_notif_latency(true);
+    } else if((argc == 2) && !strcmp(argv[1], "reset")) {
+        hap_reset_notif_latency();
+    } else {
+        printf("Invalid Usage.");
+        return ESP_ERR_INVALID_ARG;
+    }
+    return ESP_OK;
+}
+
+static void register_notif_latency()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "notif-latency",
+        .help = "Show event notification latency per stage.\n Usage: notif-latency [hist|reset]",
+        .hint = NULL,
+        .func = &notif_latency,
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
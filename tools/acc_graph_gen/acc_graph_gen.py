@@ -0,0 +1,377 @@
+#!/usr/bin/env python
+#
+# Copyright 2020 Espressif Systems (Shanghai) PTE LTD
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Generates the static tables for hap_acc_create_static() from a JSON
+# description of the accessories. See README.md for the description format.
+#
+from __future__ import print_function
+import argparse
+import json
+import os
+import re
+import sys
+
+SDK_PATH = os.path.abspath(os.path.join(os.path.dirname(__file__), '..', '..'))
+PROFILES_PATH = os.path.join(SDK_PATH, 'components', 'homekit', 'esp_hap_apple_profiles')
+
+FORMATS = {
+    'bool': ('HAP_CHAR_FORMAT_BOOL', 'b'),
+    'uint8': ('HAP_CHAR_FORMAT_UINT8', 'u'),
+    'uint16': ('HAP_CHAR_FORMAT_UINT16', 'u'),
+    'uint32': ('HAP_CHAR_FORMAT_UINT32', 'u'),
+    'uint64': ('HAP_CHAR_FORMAT_UINT64', 'i64'),
+    'int': ('HAP_CHAR_FORMAT_INT', 'i'),
+    'float': ('HAP_CHAR_FORMAT_FLOAT', 'f'),
+    'string': ('HAP_CHAR_FORMAT_STRING', 's'),
+    'tlv8': ('HAP_CHAR_FORMAT_TLV8', 't'),
+    'data': ('HAP_CHAR_FORMAT_DATA', 'd'),
+}
+
+PERMS = ['PR', 'PW', 'EV', 'AA', 'TW', 'HD', 'SPECIAL_READ']
+
+
+class GenError(Exception):
+    pass
+
+
+def load_profiles():
+    """ Read the characteristic and service definitions from the Apple profiles component,
+    so that the same formats, permissions and constraints get used as the hap_char_*_create()
+    and hap_serv_*_create() APIs.
+    """
+    chars = {}
+    servs = {}
+    with open(os.path.join(PROFILES_PATH, 'src', 'hap_apple_chars.c')) as f:
+        src = f.read()
+    for m in re.finditer(r'hap_char_t \*hap_char_(\w+)_create\([^)]*\)\n\{(.*?)\n\}', src, re.S):
+        name, body = m.group(1), m.group(2)
+        c = re.search(r'hap_char_(\w+)_create\((\w+|"[^"]*"),\s*([^,;]+?),', body, re.S)
+        if not c:
+            continue
+        ch = {
+            'format': c.group(1),
+            'uuid': c.group(2),
+            'perms': ' '.join(c.group(3).split()),
+        }
+        c = re.search(r'hap_char_(?:int|float)_set_constraints\(hc,\s*([^,]+),\s*([^,]+),\s*([^)]+)\)', body)
+        if c:
+            ch['min'], ch['max'], ch['step'] = [x.strip() for x in c.groups()]
+        c = re.search(r'hap_char_add_unit\(hc,\s*(\w+)\)', body)
+        if c:
+            ch['unit'] = c.group(1)
+        chars[name] = ch
+    with open(os.path.join(PROFILES_PATH, 'src', 'hap_apple_servs.c')) as f:
+        src = f.read()
+    for m in re.finditer(r'hap_serv_t \*hap_serv_(\w+)_create\([^)]*\)\n\{(.*?)\n\}', src, re.S):
+        name, body = m.group(1), m.group(2)
+        c = re.search(r'hap_serv_create\((\w+)\)', body)
+        if not c:
+            continue
+        servs[name] = {
+            'uuid': c.group(1),
+            'chars': re.findall(r'hap_serv_add_char\(hs,\s*hap_char_(\w+)_create\(', body),
+        }
+    return chars, servs
+
+
+def c_ident(s):
+    return re.sub(r'[^A-Za-z0-9_]', '_', s)
+
+
+def c_string(s):
+    return '"' + s.replace('\\', '\\\\').replace('"', '\\"') + '"'
+
+
+def c_uuid(t, prefix):
+    if t.startswith(prefix):
+        return t
+    return c_string(t)
+
+
+class Generator(object):
+    def __init__(self, desc, prefix):
+        self.desc = desc
+        self.prefix = c_ident(prefix)
+        self.chars, self.servs = load_profiles()
+        self.src = []
+        self.hdr = []
+
+    def char_info(self, cdesc):
+        """ Merge the profile defaults for a characteristic with the description """
+        t = cdesc['type']
+        ch = dict(self.chars.get(t, {}))
+        if not ch:
+            if 'format' not in cdesc or 'perms' not in cdesc:
+                raise GenError('Characteristic "%s" is not a known profile. Specify "format" and "perms"' % t)
+            ch['uuid'] = c_uuid(t, 'HAP_CHAR_UUID_')
+        for k in ('format', 'min', 'max', 'step', 'maxlen', 'unit', 'description',
+                  'valid_vals', 'valid_vals_range', 'value', 'iid'):
+            if k in cdesc:
+                ch[k] = cdesc[k]
+        if 'perms' in cdesc:
+            for p in cdesc['perms']:
+                if p not in PERMS:
+                    raise GenError('Invalid permission "%s" for "%s"' % (p, t))
+            ch['perms'] = ' | '.join('HAP_CHAR_PERM_' + p for p in cdesc['perms'])
+        if ch['format'] not in FORMATS:
+            raise GenError('Invalid format "%s" for "%s"' % (ch['format'], t))
+        if 'unit' in cdesc and not cdesc['unit'].startswith('HAP_CHAR_UNIT_'):
+            ch['unit'] = c_string(cdesc['unit'])
+        ch['name'] = c_ident(cdesc.get('name', t))
+        return ch
+
+    def serv_chars(self, sdesc):
+        """ Mandatory characteristics of a profile service, followed by the ones from the description """
+        chars = []
+        listed = sdesc.get('chars', [])
+        profile = self.servs.get(sdesc['type'])
+        if profile:
+            for t in profile['chars']:
+                if not any(c['type'] == t for c in listed):
+                    chars.append({'type': t})
+        return chars + listed
+
+    def acc_info_serv(self, acc, first):
+        info = acc.get('info', {})
+        for k in ('name', 'manufacturer', 'model', 'serial_num', 'fw_rev'):
+            if k not in info:
+                raise GenError('Accessory "%s" missing "info.%s"' % (acc['name'], k))
+        chars = [
+            {'type': 'identify', 'value': False},
+            {'type': 'manufacturer', 'value': info['manufacturer']},
+            {'type': 'model', 'value': info['model']},
+            {'type': 'name', 'value': info['name']},
+            {'type': 'serial_number', 'value': info['serial_num']},
+            {'type': 'firmware_revision', 'value': info['fw_rev']},
+        ]
+        if info.get('hw_rev'):
+            chars.append({'type': 'hardware_revision', 'value': info['hw_rev']})
+        servs = [{'name': 'accessory_information', 'type': 'accessory_information', 'chars': chars, 'no_profile': True}]
+        if first:
+            # Same as the Protocol Information Service added by hap_acc_create()
+            servs.append({'name': 'protocol_information', 'type': 'protocol_information', 'no_profile': True,
+                          'chars': [{'type': 'version', 'value': '1.1.0'}]})
+        return servs
+
+    def assign_iids(self, servs):
+        """ Assign instance IDs in the same order as hap_acc_add_serv(), skipping the ones fixed
+        in the description, so that the database looks the same as one built using the dynamic APIs.
+        """
+        used = set()
+        for s in servs:
+            for o in [s] + s['chars_info']:
+                if 'iid' in o:
+                    if o['iid'] in used or o['iid'] <= 0:
+                        raise GenError('Invalid or duplicate iid %d' % o['iid'])
+                    used.add(o['iid'])
+        nxt = 1
+        for s in servs:
+            for o in [s] + s['chars_info']:
+                if 'iid' not in o:
+                    while nxt in used:
+                        nxt += 1
+                    o['iid'] = nxt
+                    used.add(nxt)
+
+    def val_init(self, member, fmt, v, sym):
+        if fmt in ('tlv8', 'data'):
+            data = bytearray.fromhex(v)
+            self.src.append('static const uint8_t %s[] = {%s};' % (sym, ', '.join('0x%02x' % b for b in data)))
+            return '.val.%s = {.buf = (uint8_t *)%s, .buflen = sizeof(%s)}' % (member, sym, sym)
+        if fmt == 'string':
+            return '.val.s = %s' % c_string(v)
+        if fmt == 'bool':
+            return '.val.b = %s' % ('true' if v else 'false')
+        return '.val.%s = %s' % (member, v)
+
+    def gen_char(self, ch, sym):
+        fmt_enum, member = FORMATS[ch['format']]
+        fields = [
+            '.type_uuid = %s' % ch['uuid'],
+            '.iid = %d' % ch['iid'],
+            '.perms = %s' % ch['perms'],
+            '.format = %s' % fmt_enum,
+        ]
+        if 'value' in ch:
+            fields.append(self.val_init(member, ch['format'], ch['value'], sym + '_val'))
+        cmember = 'f' if ch['format'] == 'float' else 'i'
+        flags = []
+        if 'min' in ch and 'max' in ch:
+            flags += ['HAP_CHAR_DESC_MIN', 'HAP_CHAR_DESC_MAX']
+            fields += ['.min.%s = %s' % (cmember, ch['min']), '.max.%s = %s' % (cmember, ch['max'])]
+            if 'step' in ch and float(str(ch['step']).rstrip('f')) != 0:
+                flags.append('HAP_CHAR_DESC_STEP')
+                fields.append('.step.%s = %s' % (cmember, ch['step']))
+        if 'maxlen' in ch:
+            flags.append('HAP_CHAR_DESC_MAXLEN' if ch['format'] == 'string' else 'HAP_CHAR_DESC_MAXDATALEN')
+            fields.append('.max.i = %d' % ch['maxlen'])
+        if flags:
+            fields.append('.constraints = ' + ' | '.join(flags))
+        if 'unit' in ch:
+            fields.append('.unit = %s' % ch['unit'])
+        if 'description' in ch:
+            fields.append('.description = %s' % c_string(ch['description']))
+        if 'valid_vals' in ch:
+            self.src.append('static const uint8_t %s_valid_vals[] = {%s};' %
+                            (sym, ', '.join(str(v) for v in ch['valid_vals'])))
+            fields += ['.valid_vals = %s_valid_vals' % sym, '.valid_vals_cnt = %d' % len(ch['valid_vals'])]
+        if 'valid_vals_range' in ch:
+            self.src.append('static const uint8_t %s_valid_vals_range[] = {%d, %d};' %
+                            (sym, ch['valid_vals_range'][0], ch['valid_vals_range'][1]))
+            fields.append('.valid_vals_range = %s_valid_vals_range' % sym)
+        return '    {\n' + ''.join('        %s,\n' % f for f in fields) + '    },'
+
+    def gen_acc(self, acc, first):
+        aname = c_ident(acc['name'])
+        asym = '%s_%s' % (self.prefix, aname)
+        servs = self.acc_info_serv(acc, first) + acc.get('services', [])
+        names = set()
+        for s in servs:
+            s['name'] = c_ident(s.get('name', s['type']))
+            if s['name'] in names:
+                raise GenError('Duplicate service name "%s" in accessory "%s"' % (s['name'], aname))
+            names.add(s['name'])
+            if s['type'] in self.servs:
+                s['uuid'] = self.servs[s['type']]['uuid']
+            elif s['type'] in ('accessory_information', 'protocol_information'):
+                s['uuid'] = 'HAP_SERV_UUID_' + s['type'].upper()
+            else:
+                s['uuid'] = c_uuid(s['type'], 'HAP_SERV_UUID_')
+            chars = s['chars'] if s.get('no_profile') else self.serv_chars(s)
+            s['chars_info'] = [self.char_info(c) for c in chars]
+        self.assign_iids(servs)
+
+        num_chars = 0
+        num_links = 0
+        self.hdr.append('/* Instance IDs for accessory "%s" */' % aname)
+        for s in servs:
+            ssym = '%s_%s' % (asym, s['name'])
+            self.hdr.append('#define %s_IID %d' % (ssym.upper(), s['iid']))
+            self.src.append('')
+            cnames = set()
+            entries = []
+            for ch in s['chars_info']:
+                if ch['name'] in cnames:
+                    raise GenError('Duplicate characteristic "%s" in service "%s"' % (ch['name'], s['name']))
+                cnames.add(ch['name'])
+                csym = '%s_%s' % (ssym, ch['name'])
+                self.hdr.append('#define %s_IID %d' % (csym.upper(), ch['iid']))
+                entries.append(self.gen_char(ch, csym))
+            self.src.append('static const hap_char_desc_t %s_chars[] = {' % ssym)
+            self.src += entries
+            self.src.append('};')
+            links = []
+            for l in s.get('linked', []):
+                ls = [o for o in servs if o['name'] == l]
+                if not ls:
+                    raise GenError('Linked service "%s" not found in accessory "%s"' % (l, aname))
+                links.append(str(ls[0]['iid']))
+            if links:
+                self.src.append('static const uint32_t %s_links[] = {%s};' % (ssym, ', '.join(links)))
+            s['links'] = len(links)
+            num_chars += len(s['chars_info'])
+            num_links += len(links)
+        self.hdr.append('')
+
+        self.src.append('')
+        self.src.append('static const hap_serv_desc_t %s_servs[] = {' % asym)
+        for s in servs:
+            ssym = '%s_%s' % (asym, s['name'])
+            fields = ['.type_uuid = %s' % s['uuid'], '.iid = %d' % s['iid']]
+            if s.get('primary'):
+                fields.append('.primary = true')
+            if s.get('hidden'):
+                fields.append('.hidden = true')
+            fields += ['.chars = %s_chars' % ssym, '.num_chars = %d' % len(s['chars_info'])]
+            if s['links']:
+                fields += ['.linked_iids = %s_links' % ssym, '.num_linked = %d' % s['links']]
+            self.src.append('    {\n' + ''.join('        %s,\n' % f for f in fields) + '    },')
+        self.src.append('};')
+        self.src.append('')
+        self.src.append('static hap_acc_static_t %s_acc_storage;' % asym)
+        self.src.append('static hap_serv_static_t %s_serv_storage[%d];' % (asym, len(servs)))
+        self.src.append('static hap_char_static_t %s_char_storage[%d];' % (asym, num_chars))
+        if num_links:
+            self.src.append('static hap_linked_serv_static_t %s_link_storage[%d];' % (asym, num_links))
+        self.src.append('')
+        fields = [
+            '.servs = %s_servs' % asym,
+            '.num_servs = %d' % len(servs),
+            '.cid = %s' % acc.get('cid', 'HAP_CID_NONE'),
+            '.acc_storage = &%s_acc_storage' % asym,
+            '.serv_storage = %s_serv_storage' % asym,
+            '.char_storage = %s_char_storage' % asym,
+        ]
+        if num_links:
+            fields.append('.link_storage = %s_link_storage' % asym)
+        if acc.get('identify_routine'):
+            fields.append('.identify_routine = %s' % acc['identify_routine'])
+        self.src.append('const hap_acc_desc_t %s_desc = {' % asym)
+        self.src += ['    %s,' % f for f in fields]
+        self.src.append('};')
+        self.hdr_decls.append('extern const hap_acc_desc_t %s_desc;' % asym)
+
+    def generate(self, out_dir):
+        self.hdr_decls = []
+        accs = self.desc.get('accessories', [])
+        if not accs:
+            raise GenError('No accessories in the description')
+        for i, acc in enumerate(accs):
+            if 'name' not in acc:
+                raise GenError('Accessory %d has no "name"' % i)
+            self.gen_acc(acc, i == 0 and not self.desc.get('bridged_only', False))
+
+        guard = '_%s_H_' % self.prefix.upper()
+        identify = sorted(set(a['identify_routine'] for a in accs if a.get('identify_routine')))
+        hdr = ['/* Generated by acc_graph_gen.py. Do not edit */',
+               '#ifndef %s' % guard, '#define %s' % guard, '',
+               '#include <hap.h>', '#include <hap_static.h>', '',
+               '#ifdef __cplusplus', 'extern "C" {', '#endif', '']
+        hdr += self.hdr + self.hdr_decls + ['']
+        hdr += ['/* Identify routines, to be defined by the application */']
+        hdr += ['int %s(hap_acc_t *ha);' % r for r in identify]
+        hdr += ['', '#ifdef __cplusplus', '}', '#endif', '', '#endif /* %s */' % guard, '']
+        src = ['/* Generated by acc_graph_gen.py. Do not edit */',
+               '#include <hap.h>', '#include <hap_static.h>',
+               '#include <hap_apple_servs.h>', '#include <hap_apple_chars.h>',
+               '#include "%s.h"' % self.prefix] + self.src + ['']
+        with open(os.path.join(out_dir, self.prefix + '.h'), 'w') as f:
+            f.write('\n'.join(hdr))
+        with open(os.path.join(out_dir, self.prefix + '.c'), 'w') as f:
+            f.write('\n'.join(src))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate static accessory tables for hap_acc_create_static()')
+    parser.add_argument('input', help='JSON description of the accessories')
+    parser.add_argument('--prefix', help='Name of the generated files and prefix for the symbols '
+                        '(default: input file name)')
+    parser.add_argument('--outdir', default='.', help='Output directory (default: current directory)')
+    args = parser.parse_args()
+
+    prefix = args.prefix or os.path.splitext(os.path.basename(args.input))[0]
+    with open(args.input) as f:
+        desc = json.load(f)
+    try:
+        Generator(desc, prefix).generate(args.outdir)
+    except GenError as e:
+        print('Error: ' + str(e))
+        sys.exit(1)
+    print('Generated %s.c and %s.h in %s' % (prefix, prefix, args.outdir))
+
+
+if __name__ == '__main__':
+    main()